@@ -0,0 +1,187 @@
+#include "batch.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static char *read_all(const char *path) {
+  FILE *in_file = stdin;
+  if (strcmp(path, "-") != 0 && !(in_file = fopen(path, "rb"))) {
+    fprintf(stderr, "Could not open batch list: %s\n", path);
+    return NULL;
+  }
+  size_t capacity = 4096, size = 0;
+  char *text = (char *)malloc(capacity);
+  size_t n;
+  while (text && (n = fread(text + size, 1, capacity - size - 1, in_file)) >
+                     0) {
+    size += n;
+    if (size + 1 == capacity) {
+      char *grown = (char *)realloc(text, capacity * 2);
+      if (!grown) {
+        free(text);
+        text = NULL;
+        break;
+      }
+      text = grown;
+      capacity *= 2;
+    }
+  }
+  if (in_file != stdin) {
+    fclose(in_file);
+  }
+  if (!text) {
+    fprintf(stderr, "Memory allocation failed for batch list.\n");
+    return NULL;
+  }
+  text[size] = '\0';
+  return text;
+}
+
+/**
+ * @brief 行を区切り文字で二つに分ける
+ * @return 二つに分けられた場合は二つ目の先頭、分けられない場合はNULL
+ */
+static char *split_fields(char *line) {
+  char *sep = strchr(line, '\t');
+  if (!sep) {
+    sep = line + strcspn(line, " ");
+    if (*sep == '\0') {
+      return NULL;
+    }
+  }
+  *sep++ = '\0';
+  while (*sep == ' ' || *sep == '\t') {
+    sep++;
+  }
+  /* 末尾の空白とCRは取り除く */
+  size_t len = strlen(sep);
+  while (len > 0 && (sep[len - 1] == ' ' || sep[len - 1] == '\t' ||
+                     sep[len - 1] == '\r')) {
+    sep[--len] = '\0';
+  }
+  return len > 0 ? sep : NULL;
+}
+
+BatchManifest *batch_manifest_read(const char *path) {
+  char *text = read_all(path);
+  if (!text) {
+    return NULL;
+  }
+  int lines = 1;
+  for (const char *p = text; *p; p++) {
+    lines += *p == '\n';
+  }
+  BatchManifest *manifest = (BatchManifest *)malloc(sizeof(BatchManifest));
+  BatchEntry *entries = (BatchEntry *)malloc(sizeof(BatchEntry) * lines);
+  if (!manifest || !entries) {
+    fprintf(stderr, "Memory allocation failed for batch list.\n");
+    free(manifest);
+    free(entries);
+    free(text);
+    return NULL;
+  }
+  manifest->entries = entries;
+  manifest->count = 0;
+  manifest->text = text;
+
+  int line_no = 0;
+  for (char *line = text; line;) {
+    char *next = strchr(line, '\n');
+    if (next) {
+      *next++ = '\0';
+    }
+    line_no++;
+    line += strspn(line, " \t\r");
+    if (*line != '\0' && *line != '#') {
+      char *output = split_fields(line);
+      if (!output) {
+        fprintf(stderr, "%s:%d: expected an input and an output file.\n",
+                path, line_no);
+        batch_manifest_free(manifest);
+        return NULL;
+      }
+      entries[manifest->count].input = line;
+      entries[manifest->count].output = output;
+      manifest->count++;
+    }
+    line = next;
+  }
+  return manifest;
+}
+
+void batch_manifest_free(BatchManifest *manifest) {
+  if (manifest) {
+    free(manifest->entries);
+    free(manifest->text);
+    free(manifest);
+  }
+}
+
+struct BatchPool {
+  pthread_mutex_t lock;
+  void **buffers;
+  int count, capacity;
+  void (*free_fn)(void *);
+};
+
+BatchPool *batch_pool_new(void (*free_fn)(void *)) {
+  BatchPool *pool = (BatchPool *)calloc(1, sizeof(BatchPool));
+  if (!pool) {
+    fprintf(stderr, "Memory allocation failed for BatchPool.\n");
+    return NULL;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pool->free_fn = free_fn;
+  return pool;
+}
+
+void *batch_pool_take(BatchPool *pool) {
+  void *buffer = NULL;
+  pthread_mutex_lock(&pool->lock);
+  if (pool->count > 0) {
+    buffer = pool->buffers[--pool->count];
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return buffer;
+}
+
+void batch_pool_give(BatchPool *pool, void *buffer) {
+  if (!buffer) {
+    return;
+  }
+  pthread_mutex_lock(&pool->lock);
+  if (pool->count == pool->capacity) {
+    int capacity = pool->capacity ? pool->capacity * 2 : 8;
+    void **grown =
+        (void **)realloc(pool->buffers, sizeof(void *) * capacity);
+    if (!grown) {
+      /* 返せない場合は手放すだけで、次に借りる側が確保し直す */
+      pthread_mutex_unlock(&pool->lock);
+      pool->free_fn(buffer);
+      return;
+    }
+    pool->buffers = grown;
+    pool->capacity = capacity;
+  }
+  pool->buffers[pool->count++] = buffer;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void batch_pool_free(BatchPool *pool) {
+  if (pool) {
+    for (int i = 0; i < pool->count; i++) {
+      pool->free_fn(pool->buffers[i]);
+    }
+    free(pool->buffers);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+  }
+}
+
+double batch_now(void) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,65 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+/*
+ * 一つのプロセスで多数のファイルを変換するための共通部分。
+ * 入出力の組を並べたリストを読み、ファイル単位でparallel_for_rowsに渡す。
+ * 作業用のバッファはプールから借りて返すので、ファイルごとに確保し直さない。
+ */
+
+typedef struct {
+  const char *input;
+  const char *output;
+} BatchEntry;
+
+typedef struct {
+  BatchEntry *entries;
+  int count;
+  char *text; /* entriesが指す文字列の領域 */
+} BatchManifest;
+
+/**
+ * @brief 1行に入力と出力を1組ずつ書いたリストを読む
+ * @param path リストのファイル名。"-"の場合は標準入力から読む
+ * @return 読んだリスト、失敗した場合はNULL。batch_manifest_freeで解放する
+ * @note 入力と出力はタブで区切る。タブがない行は空白で区切る。
+ *       空行と#で始まる行は読み飛ばす
+ */
+BatchManifest *batch_manifest_read(const char *path);
+
+/**
+ * @brief batch_manifest_readで読んだリストを解放する
+ */
+void batch_manifest_free(BatchManifest *manifest);
+
+typedef struct BatchPool BatchPool;
+
+/**
+ * @brief 作業用のバッファを使い回すためのプールを作る
+ * @param free_fn プールを解放するときに残っているバッファに対して呼ぶ関数
+ * @return プール、失敗した場合はNULL
+ */
+BatchPool *batch_pool_new(void (*free_fn)(void *));
+
+/**
+ * @brief プールからバッファを借りる
+ * @return 返却されたバッファ、空の場合はNULL。NULLの場合は呼び出し元が確保する
+ */
+void *batch_pool_take(BatchPool *pool);
+
+/**
+ * @brief 借りたバッファ (または新しく確保したバッファ) をプールに返す
+ */
+void batch_pool_give(BatchPool *pool, void *buffer);
+
+/**
+ * @brief プールと残っているバッファを解放する
+ */
+void batch_pool_free(BatchPool *pool);
+
+/**
+ * @brief 経過時間を測るための時刻を秒で返す
+ */
+double batch_now(void);
+
+#endif
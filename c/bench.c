@@ -0,0 +1,578 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vips/vips.h>
+
+#include "batch.h"
+#include "binfmt.h"
+#include "deckernel.h"
+#include "enckernel.h"
+#include "parallel.h"
+
+/*
+ * 符号化と復元を段階ごとに計測し、結果をJSONで出力するベンチマーク。
+ * 各段階は指定した回数だけ繰り返し、最も速かった回の時間を使う。
+ *
+ * 符号化の段階
+ *   load:          PNGを展開してRGBの画素にする
+ *   convert_stats: 色変換とブロックごとの最小・最大、四隅の符号化
+ *                  (全ブロックを補間する圧縮レベルでカーネルを動かした時間)
+ *   quantize:      量子化と差分符号化 (カーネル全体からconvert_statsを引いた時間)
+ *   serialize:     planes_to_bufでバイナリ形式を組み立てる
+ *   output:        ファイルに書き出す
+ * 復元の段階
+ *   load:          ファイルを読み込む
+ *   parse:         img_view_open_memでビューを作る
+ *   decode:        逆量子化と色変換 (カーネル)
+ *   output:        PNGに符号化する
+ */
+
+#define MAX_SWEEP 16
+
+typedef struct {
+  const char *name;
+  int width, height;
+  void *png;
+  size_t png_size;
+} BenchImage;
+
+typedef struct {
+  const uint8_t *pixels;
+  int width;
+  int compress_level;
+  encode_block_fn encode_block;
+  ImgPlanes *planes;
+} EncodeJob;
+
+static void encode_block_row(void *ctx, int row) {
+  EncodeJob *job = (EncodeJob *)ctx;
+  int blocks_per_row = job->width / 8;
+  size_t stride = (size_t)job->width * 3;
+  const uint8_t *src = job->pixels + (size_t)row * 8 * stride;
+  int32_t first = row * blocks_per_row;
+  for (int bx = 0; bx < blocks_per_row; bx++) {
+    job->encode_block(src + bx * 8 * 3, stride, job->compress_level,
+                      planes_header(job->planes, first + bx),
+                      planes_corners(job->planes, first + bx),
+                      planes_codes(job->planes, first + bx));
+  }
+}
+
+typedef struct {
+  const ImgView *view;
+  decode_block_fn decode_block;
+  uint8_t *pixels;
+} DecodeJob;
+
+static void decode_block_row(void *ctx, int row) {
+  DecodeJob *job = (DecodeJob *)ctx;
+  int blocks_per_row = job->view->width / 8;
+  size_t stride = (size_t)job->view->width * 3;
+  uint8_t *dst = job->pixels + (size_t)row * 8 * stride;
+  int32_t first = row * blocks_per_row;
+  for (int bx = 0; bx < blocks_per_row; bx++) {
+    job->decode_block(img_view_header(job->view, first + bx),
+                      img_view_corners(job->view, first + bx),
+                      img_view_codes(job->view, first + bx), dst + bx * 8 * 3,
+                      stride);
+  }
+}
+
+/* 乱数列は実行ごとに同じにする */
+static uint32_t xorshift32(uint32_t *state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+static uint8_t clamp_u8(int v) { return v < 0 ? 0 : v > 255 ? 255 : v; }
+
+/**
+ * @brief 合成画像の1画素を作る
+ * @param kind "flat" / "gradient" / "noise" / "photo"
+ */
+static void synth_pixel(const char *kind, int x, int y, int width, int height,
+                        uint32_t *rng, uint8_t *dst) {
+  if (strcmp(kind, "flat") == 0) {
+    /* 大きな単色の領域が並ぶ、文書やスクリーンショットに近い画像 */
+    int cell = ((x / 128) + (y / 96) * 3) % 5;
+    static const uint8_t colors[5][3] = {{255, 255, 255}, {240, 240, 240},
+                                         {32, 32, 32},    {200, 60, 40},
+                                         {40, 90, 200}};
+    memcpy(dst, colors[cell], 3);
+  } else if (strcmp(kind, "gradient") == 0) {
+    dst[0] = (uint8_t)(x * 255 / (width - 1));
+    dst[1] = (uint8_t)(y * 255 / (height - 1));
+    dst[2] = (uint8_t)((x + y) * 255 / (width + height - 2));
+  } else if (strcmp(kind, "noise") == 0) {
+    uint32_t r = xorshift32(rng);
+    dst[0] = (uint8_t)r;
+    dst[1] = (uint8_t)(r >> 8);
+    dst[2] = (uint8_t)(r >> 16);
+  } else {
+    /* 滑らかな明暗にエッジと弱いノイズを重ねた、写真に近い画像 */
+    int base = (x * 7 + y * 5) % 512;
+    base = base < 256 ? base : 511 - base;
+    int edge = ((x / 37 + y / 53) % 2) * 48;
+    int noise = (int)(xorshift32(rng) % 17) - 8;
+    dst[0] = clamp_u8(base / 2 + 60 + edge + noise);
+    dst[1] = clamp_u8(base / 3 + 80 + noise);
+    dst[2] = clamp_u8(200 - base / 2 + edge / 2 + noise);
+  }
+}
+
+/**
+ * @brief RGBの画素からPNGを作り、loadの段階の入力にする
+ * @return 成功時0、失敗時-1
+ */
+static int bench_image_set(BenchImage *image, const char *name,
+                           const uint8_t *pixels, int width, int height) {
+  image->name = name;
+  image->width = width;
+  image->height = height;
+  VipsImage *vimage = vips_image_new_from_memory(
+      pixels, (size_t)width * height * 3, width, height, 3, VIPS_FORMAT_UCHAR);
+  if (!vimage || vips_image_write_to_buffer(vimage, ".png", &image->png,
+                                            &image->png_size, NULL) != 0) {
+    fprintf(stderr, "Could not create %s: %s\n", name, vips_error_buffer());
+    vips_error_clear();
+    if (vimage) {
+      g_object_unref(vimage);
+    }
+    return -1;
+  }
+  g_object_unref(vimage);
+  return 0;
+}
+
+static int bench_image_synth(BenchImage *image, const char *kind, int width,
+                             int height) {
+  uint8_t *pixels = (uint8_t *)malloc((size_t)width * height * 3);
+  if (!pixels) {
+    fprintf(stderr, "Memory allocation failed for %s.\n", kind);
+    return -1;
+  }
+  uint32_t rng = 2463534242u;
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      synth_pixel(kind, x, y, width, height, &rng,
+                  pixels + ((size_t)y * width + x) * 3);
+    }
+  }
+  int result = bench_image_set(image, kind, pixels, width, height);
+  free(pixels);
+  return result;
+}
+
+/**
+ * @brief 画像ファイルを読み、RGBで幅と高さが8の倍数になるように切り詰める
+ */
+static int bench_image_file(BenchImage *image, const char *name,
+                            const char *path) {
+  VipsImage *vimage = vips_image_new_from_file(path, NULL);
+  if (!vimage) {
+    fprintf(stderr, "Skipping %s: %s\n", path, vips_error_buffer());
+    vips_error_clear();
+    return -1;
+  }
+  VipsImage *temp;
+  if (vips_image_get_bands(vimage) == 4) {
+    if (vips_extract_band(vimage, &temp, 0, "n", 3, NULL) != 0) {
+      g_object_unref(vimage);
+      return -1;
+    }
+    g_object_unref(vimage);
+    vimage = temp;
+  }
+  if (vips_image_get_bands(vimage) != 3 ||
+      vips_cast(vimage, &temp, VIPS_FORMAT_UCHAR, NULL) != 0) {
+    fprintf(stderr, "Skipping %s: not an RGB image.\n", path);
+    g_object_unref(vimage);
+    return -1;
+  }
+  g_object_unref(vimage);
+  vimage = temp;
+
+  int width = vips_image_get_width(vimage);
+  int height = vips_image_get_height(vimage);
+  size_t size;
+  uint8_t *pixels = (uint8_t *)vips_image_write_to_memory(vimage, &size);
+  g_object_unref(vimage);
+  if (!pixels || width < 8 || height < 8) {
+    fprintf(stderr, "Skipping %s: could not read pixels.\n", path);
+    g_free(pixels);
+    return -1;
+  }
+  /* 行の先頭から切り詰めた幅だけ詰め直す */
+  int cropped_width = width / 8 * 8;
+  for (int y = 0; y < height / 8 * 8; y++) {
+    memmove(pixels + (size_t)y * cropped_width * 3,
+            pixels + (size_t)y * width * 3, (size_t)cropped_width * 3);
+  }
+  int result =
+      bench_image_set(image, name, pixels, cropped_width, height / 8 * 8);
+  g_free(pixels);
+  return result;
+}
+
+enum {
+  ENC_STAGE_LOAD,
+  ENC_STAGE_CONVERT,
+  ENC_STAGE_QUANTIZE,
+  ENC_STAGE_SERIALIZE,
+  ENC_STAGE_OUTPUT,
+  ENC_STAGE_COUNT
+};
+static const char *encode_stage_names[] = {"load", "convert_stats", "quantize",
+                                           "serialize", "output"};
+
+enum {
+  DEC_STAGE_LOAD,
+  DEC_STAGE_PARSE,
+  DEC_STAGE_DECODE,
+  DEC_STAGE_OUTPUT,
+  DEC_STAGE_COUNT
+};
+static const char *decode_stage_names[] = {"load", "parse", "decode",
+                                           "output"};
+
+/**
+ * @brief 段階ごとの最短時間を記録する
+ */
+static void keep_min(double *best, int stage, double seconds) {
+  if (best[stage] < 0 || seconds < best[stage]) {
+    best[stage] = seconds;
+  }
+}
+
+/**
+ * @brief 1つの画像・圧縮レベル・スレッド数で符号化を計測する
+ * @param out_file 符号化した結果を書き出す一時ファイル。復元の計測で読む
+ * @return 成功時0、失敗時-1
+ */
+static int bench_encode(const BenchImage *image, int level, int nthreads,
+                        encode_block_fn encode_block, int repeats,
+                        FILE *out_file, double *best, size_t *bin_size) {
+  int width = image->width, height = image->height;
+  ImgPlanes *planes =
+      alloc_imgplanes(width, height, (width / 8) * (height / 8));
+  if (!planes) {
+    return -1;
+  }
+  for (int stage = 0; stage < ENC_STAGE_COUNT; stage++) {
+    best[stage] = -1;
+  }
+
+  int result = 0;
+  for (int rep = 0; rep < repeats && result == 0; rep++) {
+    double t0 = batch_now();
+    VipsImage *vimage =
+        vips_image_new_from_buffer(image->png, image->png_size, "", NULL);
+    size_t size = 0;
+    uint8_t *pixels =
+        vimage ? (uint8_t *)vips_image_write_to_memory(vimage, &size) : NULL;
+    if (vimage) {
+      g_object_unref(vimage);
+    }
+    if (!pixels || size != (size_t)width * height * 3) {
+      fprintf(stderr, "Could not load %s.\n", image->name);
+      g_free(pixels);
+      result = -1;
+      break;
+    }
+    double t1 = batch_now();
+
+    /* 全チャンネルを補間するレベルでは量子化と差分符号化を行わない */
+    EncodeJob job = {pixels, width, INT_MAX, encode_block, planes};
+    parallel_for_rows(height / 8, nthreads, encode_block_row, &job);
+    double t2 = batch_now();
+    job.compress_level = level;
+    parallel_for_rows(height / 8, nthreads, encode_block_row, &job);
+    double t3 = batch_now();
+
+    char *buf;
+    planes_to_buf(planes, &buf, &size);
+    double t4 = batch_now();
+    if (!buf) {
+      g_free(pixels);
+      result = -1;
+      break;
+    }
+
+    rewind(out_file);
+    if (fwrite(buf, 1, size, out_file) != size || fflush(out_file) != 0) {
+      fprintf(stderr, "Could not write benchmark output.\n");
+      result = -1;
+    }
+    double t5 = batch_now();
+
+    double convert = t2 - t1, kernel = t3 - t2;
+    keep_min(best, ENC_STAGE_LOAD, t1 - t0);
+    keep_min(best, ENC_STAGE_CONVERT, convert);
+    keep_min(best, ENC_STAGE_QUANTIZE, kernel > convert ? kernel - convert : 0);
+    keep_min(best, ENC_STAGE_SERIALIZE, t4 - t3);
+    keep_min(best, ENC_STAGE_OUTPUT, t5 - t4);
+    *bin_size = size;
+    free(buf);
+    g_free(pixels);
+  }
+  free_imgplanes(planes);
+  return result;
+}
+
+/**
+ * @brief bench_encodeが書き出したファイルの復元を計測する
+ * @return 成功時0、失敗時-1
+ */
+static int bench_decode(const BenchImage *image, int nthreads,
+                        decode_block_fn decode_block, int repeats,
+                        FILE *in_file, size_t bin_size, double *best) {
+  char *buf = (char *)malloc(bin_size);
+  uint8_t *pixels =
+      (uint8_t *)malloc((size_t)image->width * image->height * 3);
+  if (!buf || !pixels) {
+    fprintf(stderr, "Memory allocation failed for benchmark.\n");
+    free(buf);
+    free(pixels);
+    return -1;
+  }
+  for (int stage = 0; stage < DEC_STAGE_COUNT; stage++) {
+    best[stage] = -1;
+  }
+
+  int result = 0;
+  for (int rep = 0; rep < repeats && result == 0; rep++) {
+    double t0 = batch_now();
+    rewind(in_file);
+    if (fread(buf, 1, bin_size, in_file) != bin_size) {
+      fprintf(stderr, "Could not read benchmark output.\n");
+      result = -1;
+      break;
+    }
+    double t1 = batch_now();
+    ImgView *view = img_view_open_mem(buf, bin_size, 1);
+    if (!view) {
+      result = -1;
+      break;
+    }
+    double t2 = batch_now();
+    DecodeJob job = {view, decode_block, pixels};
+    parallel_for_rows(view->height / 8, nthreads, decode_block_row, &job);
+    double t3 = batch_now();
+
+    VipsImage *vimage = vips_image_new_from_memory(
+        pixels, (size_t)view->width * view->height * 3, view->width,
+        view->height, 3, VIPS_FORMAT_UCHAR);
+    void *png = NULL;
+    size_t png_size;
+    if (!vimage ||
+        vips_image_write_to_buffer(vimage, ".png", &png, &png_size, NULL) !=
+            0) {
+      fprintf(stderr, "Could not encode PNG: %s\n", vips_error_buffer());
+      vips_error_clear();
+      result = -1;
+    }
+    double t4 = batch_now();
+    if (vimage) {
+      g_object_unref(vimage);
+    }
+    g_free(png);
+    img_view_close(view);
+
+    keep_min(best, DEC_STAGE_LOAD, t1 - t0);
+    keep_min(best, DEC_STAGE_PARSE, t2 - t1);
+    keep_min(best, DEC_STAGE_DECODE, t3 - t2);
+    keep_min(best, DEC_STAGE_OUTPUT, t4 - t3);
+  }
+  free(buf);
+  free(pixels);
+  return result;
+}
+
+static void print_stages(FILE *out, const char *const *names, int count,
+                         const double *best, double megapixels,
+                         int32_t blocks) {
+  double total = 0;
+  fprintf(out, "\"stages\": {");
+  for (int i = 0; i < count; i++) {
+    double seconds = best[i] > 0 ? best[i] : 0;
+    total += seconds;
+    fprintf(out,
+            "%s\"%s\": {\"seconds\": %.9f, \"mp_per_s\": %.3f, "
+            "\"ns_per_block\": %.3f}",
+            i ? ", " : "", names[i], seconds,
+            seconds > 0 ? megapixels / seconds : 0.0,
+            seconds * 1e9 / blocks);
+  }
+  fprintf(out,
+          "}, \"total\": {\"seconds\": %.9f, \"mp_per_s\": %.3f, "
+          "\"ns_per_block\": %.3f}",
+          total, total > 0 ? megapixels / total : 0.0, total * 1e9 / blocks);
+}
+
+/**
+ * @brief "1,16,64" のようなカンマ区切りの整数を読む
+ * @return 読んだ個数、不正な場合は0
+ */
+static int parse_list(const char *text, int *values) {
+  int count = 0;
+  const char *p = text;
+  while (*p && count < MAX_SWEEP) {
+    char *end;
+    long value = strtol(p, &end, 10);
+    if (end == p || value < 0 || value > INT_MAX) {
+      return 0;
+    }
+    values[count++] = (int)value;
+    p = *end == ',' ? end + 1 : end;
+    if (*end != ',' && *end != '\0') {
+      return 0;
+    }
+  }
+  return *p ? 0 : count;
+}
+
+int main(int argc, char *argv[]) {
+  if (VIPS_INIT(argv[0])) {
+    vips_error_exit(NULL);
+  }
+
+  const char *output_file = NULL;
+  const char *colorbar = "../colorbar.png";
+  int width = 1024, height = 768, repeats = 3;
+  int levels[MAX_SWEEP] = {1, 16, 64};
+  int nlevels = 3;
+  int threads[MAX_SWEEP];
+  int nthreads_list = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      output_file = argv[++i];
+    } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      if (sscanf(argv[++i], "%dx%d", &width, &height) != 2 || width < 8 ||
+          height < 8 || width > INT16_MAX || height > INT16_MAX) {
+        fprintf(stderr, "Invalid size: %s\n", argv[i]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      repeats = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+      if (!(nlevels = parse_list(argv[++i], levels))) {
+        fprintf(stderr, "Invalid level list: %s\n", argv[i]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      if (!(nthreads_list = parse_list(argv[++i], threads))) {
+        fprintf(stderr, "Invalid thread list: %s\n", argv[i]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--colorbar") == 0 && i + 1 < argc) {
+      colorbar = argv[++i];
+    } else {
+      fprintf(stderr,
+              "Usage: %s [-o result.json] [-s WxH] [-r repeats] "
+              "[-l levels] [-j threads] [--colorbar file]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  if (repeats < 1) {
+    repeats = 1;
+  }
+  int cpu_count = parallel_cpu_count();
+  if (nthreads_list == 0) {
+    /* 1スレッドから倍々にCPU数まで */
+    for (int n = 1; n < cpu_count && nthreads_list < MAX_SWEEP - 1; n *= 2) {
+      threads[nthreads_list++] = n;
+    }
+    threads[nthreads_list++] = cpu_count;
+  }
+  for (int i = 0; i < nthreads_list; i++) {
+    if (threads[i] == 0) {
+      threads[i] = cpu_count;
+    }
+  }
+
+  BenchImage images[5];
+  int nimages = 0;
+  static const char *kinds[] = {"flat", "gradient", "noise", "photo"};
+  width = width / 8 * 8;
+  height = height / 8 * 8;
+  for (int i = 0; i < 4; i++) {
+    if (bench_image_synth(&images[nimages], kinds[i], width, height) == 0) {
+      nimages++;
+    }
+  }
+  if (bench_image_file(&images[nimages], "colorbar", colorbar) == 0) {
+    nimages++;
+  }
+
+  encode_block_fn encode_block = encode_kernel_select(ENC_KERNEL_AUTO, false);
+  decode_block_fn decode_block = decode_kernel_select(DEC_KERNEL_AUTO);
+  FILE *bin_file = tmpfile();
+  FILE *out = stdout;
+  if (!bin_file || (output_file && !(out = fopen(output_file, "w")))) {
+    fprintf(stderr, "Could not open output file.\n");
+    return 1;
+  }
+
+  fprintf(out, "{\"cpu_count\": %d, \"repeats\": %d, \"results\": [",
+          cpu_count, repeats);
+  int result = 0;
+  bool first = true;
+  for (int i = 0; i < nimages && result == 0; i++) {
+    const BenchImage *image = &images[i];
+    double megapixels = (double)image->width * image->height / 1e6;
+    int32_t blocks = (image->width / 8) * (image->height / 8);
+    for (int l = 0; l < nlevels && result == 0; l++) {
+      for (int t = 0; t < nthreads_list && result == 0; t++) {
+        double enc_best[ENC_STAGE_COUNT], dec_best[DEC_STAGE_COUNT];
+        size_t bin_size = 0;
+        if (bench_encode(image, levels[l], threads[t], encode_block, repeats,
+                         bin_file, enc_best, &bin_size) != 0 ||
+            bench_decode(image, threads[t], decode_block, repeats, bin_file,
+                         bin_size, dec_best) != 0) {
+          result = 1;
+          break;
+        }
+        fprintf(out,
+                "%s\n  {\"image\": \"%s\", \"width\": %d, \"height\": %d, "
+                "\"level\": %d, \"threads\": %d, \"bytes\": %zu,\n"
+                "   \"encode\": {",
+                first ? "" : ",", image->name, image->width, image->height,
+                levels[l], threads[t], bin_size);
+        print_stages(out, encode_stage_names, ENC_STAGE_COUNT, enc_best,
+                     megapixels, blocks);
+        fprintf(out, "},\n   \"decode\": {");
+        print_stages(out, decode_stage_names, DEC_STAGE_COUNT, dec_best,
+                     megapixels, blocks);
+        fprintf(out, "}}");
+        first = false;
+        /* 進み具合として、カーネルだけの速度を表示する */
+        double enc_kernel = enc_best[ENC_STAGE_CONVERT] +
+                            enc_best[ENC_STAGE_QUANTIZE];
+        fprintf(stderr,
+                "%-8s level %3d, %2d threads: encode %.1f MP/s, "
+                "decode %.1f MP/s\n",
+                image->name, levels[l], threads[t],
+                enc_kernel > 0 ? megapixels / enc_kernel : 0.0,
+                dec_best[DEC_STAGE_DECODE] > 0
+                    ? megapixels / dec_best[DEC_STAGE_DECODE]
+                    : 0.0);
+      }
+    }
+  }
+  fprintf(out, "\n]}\n");
+
+  for (int i = 0; i < nimages; i++) {
+    g_free(images[i].png);
+  }
+  fclose(bin_file);
+  if (out != stdout) {
+    fclose(out);
+  }
+  vips_shutdown();
+  return result;
+}
@@ -1,4 +1,6 @@
 #include "binfmt.h"
+#include "entropy.h"
+#include "xzio.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,19 +9,118 @@
 #include <winsock2.h>
 #else
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 #endif
 
+#ifdef _WIN32
+struct iovec {
+  void *iov_base;
+  size_t iov_len;
+};
+#endif
+
+#if !defined(IOV_MAX) || IOV_MAX > 1024
+#define WRITE_BATCH_IOV 1024
+#else
+#define WRITE_BATCH_IOV IOV_MAX
+#endif
+#define WRITE_STAGING_SIZE 65536
+
 static const char *binfmt_msg =
     "this is binary image of https://github.com/bsahd/image-compress "
     "format.\nversion:"
     "230606ee9a6d0b45b71167f8faa01ed169cd96bb\n\n\n\n\n\n\n\n\n";
+static const char *binfmt_msg_entropy =
+    "this is binary image of https://github.com/bsahd/image-compress "
+    "format.\nversion:entropy-coded-1\n\n\n\n\n\n\n\n\n";
+static const char *binfmt_msg_sparse =
+    "this is binary image of https://github.com/bsahd/image-compress "
+    "format.\nversion:sparse-codes-1\n\n\n\n\n\n\n\n\n";
+static const char *binfmt_msg_chroma420 =
+    "this is binary image of https://github.com/bsahd/image-compress "
+    "format.\nversion:chroma-420-1\n\n\n\n\n\n\n\n\n";
 static const char *binfmt_endmsg = "\n\n\nthis is binary format. read head "
                                    "using head command for more information.\n";
 
+static size_t header_size_with(const char *msg) {
+  return strlen(msg) + sizeof(int16_t) * 2 + sizeof(int32_t);
+}
+
+static size_t file_header_size(void) { return header_size_with(binfmt_msg); }
+
+static void fill_header_with(char *ptr, const char *msg, int16_t width,
+                             int16_t height, int32_t block_count) {
+  memcpy(ptr, msg, strlen(msg));
+  ptr += strlen(msg);
+
+  int16_t width_be = htons(width);
+  int16_t height_be = htons(height);
+  memcpy(ptr, &width_be, sizeof(int16_t));
+  ptr += sizeof(int16_t);
+  memcpy(ptr, &height_be, sizeof(int16_t));
+  ptr += sizeof(int16_t);
+
+  int32_t block_count_be = htonl(block_count);
+  memcpy(ptr, &block_count_be, sizeof(int32_t));
+}
+
+static void fill_file_header(char *ptr, int16_t width, int16_t height,
+                             int32_t block_count) {
+  fill_header_with(ptr, binfmt_msg, width, height, block_count);
+}
+
+static bool has_version(const char *buffer, size_t size, const char *msg) {
+  return size >= strlen(msg) && memcmp(buffer, msg, strlen(msg)) == 0;
+}
+
+/**
+ * @brief 先頭のメッセージと寸法を読む
+ * @return ヘッダの直後へのポインタ、msgと一致しない場合はNULL
+ */
+static const char *parse_header_with(const char *buffer, size_t size,
+                                     const char *msg, int16_t *width,
+                                     int16_t *height, int32_t *block_count) {
+  if (size < header_size_with(msg) ||
+      memcmp(buffer, msg, strlen(msg)) != 0) {
+    return NULL;
+  }
+  const char *ptr = buffer + strlen(msg);
+
+  int16_t width_be, height_be;
+  memcpy(&width_be, ptr, sizeof(int16_t));
+  ptr += sizeof(int16_t);
+  memcpy(&height_be, ptr, sizeof(int16_t));
+  ptr += sizeof(int16_t);
+  int32_t block_count_be;
+  memcpy(&block_count_be, ptr, sizeof(int32_t));
+  ptr += sizeof(int32_t);
+
+  *width = ntohs(width_be);
+  *height = ntohs(height_be);
+  *block_count = ntohl(block_count_be);
+  return ptr;
+}
+
+static void fill_block_header(const BlockData *block, uint8_t *ptr) {
+  ptr[BLOCK_MAXY] = block->blockmaxy;
+  ptr[BLOCK_MINY] = block->blockminy;
+  ptr[BLOCK_MAXU] = block->blockmaxu;
+  ptr[BLOCK_MINU] = block->blockminu;
+  ptr[BLOCK_MAXV] = block->blockmaxv;
+  ptr[BLOCK_MINV] = block->blockminv;
+  ptr[BLOCK_FLAGS] = block_flags(block->interpolatey, block->interpolateu,
+                                 block->interpolatev);
+}
+
 void img_to_buf(const ImgData *imgdata, char **buffer, size_t *size) {
 
-  size_t total_size = strlen(binfmt_msg) + strlen(binfmt_endmsg) +
-                      sizeof(int16_t) * 2 + sizeof(int32_t) +
+  size_t total_size = file_header_size() + strlen(binfmt_endmsg) +
                       imgdata->block_count * (sizeof(uint8_t) * 7);
   total_size += imgdata->block_count * (sizeof(uint8_t) * 4);
   total_size += imgdata->block_count * (sizeof(uint8_t) * 64);
@@ -33,40 +134,13 @@ void img_to_buf(const ImgData *imgdata, char **buffer, size_t *size) {
   }
   char *ptr = buf;
 
-  memcpy(ptr, binfmt_msg, strlen(binfmt_msg));
-  ptr += strlen(binfmt_msg);
-
-  int16_t width_be = htons(imgdata->width);
-  int16_t height_be = htons(imgdata->height);
-  memcpy(ptr, &width_be, sizeof(int16_t));
-  ptr += sizeof(int16_t);
-  memcpy(ptr, &height_be, sizeof(int16_t));
-  ptr += sizeof(int16_t);
-
-  int32_t block_count_be = htonl(imgdata->block_count);
-  memcpy(ptr, &block_count_be, sizeof(int32_t));
-  ptr += sizeof(int32_t);
+  fill_file_header(ptr, imgdata->width, imgdata->height,
+                   imgdata->block_count);
+  ptr += file_header_size();
 
   for (int i = 0; i < imgdata->block_count; ++i) {
-
-    memcpy(ptr, &imgdata->blocks[i].blockmaxy, sizeof(uint8_t));
-    ptr += 1;
-    memcpy(ptr, &imgdata->blocks[i].blockminy, sizeof(uint8_t));
-    ptr += 1;
-    memcpy(ptr, &imgdata->blocks[i].blockmaxu, sizeof(uint8_t));
-    ptr += 1;
-    memcpy(ptr, &imgdata->blocks[i].blockminu, sizeof(uint8_t));
-    ptr += 1;
-    memcpy(ptr, &imgdata->blocks[i].blockmaxv, sizeof(uint8_t));
-    ptr += 1;
-    memcpy(ptr, &imgdata->blocks[i].blockminv, sizeof(uint8_t));
-    ptr += 1;
-
-    uint8_t interpolaten = (imgdata->blocks[i].interpolatey << 2) |
-                           (imgdata->blocks[i].interpolateu << 1) |
-                           imgdata->blocks[i].interpolatev;
-    memcpy(ptr, &interpolaten, sizeof(uint8_t));
-    ptr += sizeof(uint8_t);
+    fill_block_header(&imgdata->blocks[i], (uint8_t *)ptr);
+    ptr += sizeof(uint8_t) * 7;
   }
 
   for (int i = 0; i < imgdata->block_count; ++i) {
@@ -86,34 +160,691 @@ void img_to_buf(const ImgData *imgdata, char **buffer, size_t *size) {
   *size = total_size;
 }
 
-ImgData *buf_to_img(const char *buffer, size_t size) {
-  const char *ptr = buffer;
+/*
+ * img_write_fileで使う書き込みバッチ。
+ * 詰め直しが必要なヘッダ面と四隅の面は小さなステージング領域に、
+ * 画素の面はBlockDataのnblock4bnを直接iovecで指して、まとめてwritevする。
+ */
+typedef struct {
+  FILE *out;
+  struct iovec iov[WRITE_BATCH_IOV];
+  int niov;
+  size_t staged;
+  uint8_t staging[WRITE_STAGING_SIZE];
+} WriteBatch;
+
+static int batch_flush(WriteBatch *batch) {
+  int result = 0;
+#ifdef _WIN32
+  for (int i = 0; i < batch->niov && result == 0; i++) {
+    if (fwrite(batch->iov[i].iov_base, 1, batch->iov[i].iov_len, batch->out) !=
+        batch->iov[i].iov_len) {
+      result = -1;
+    }
+  }
+#else
+  int fd = fileno(batch->out);
+  struct iovec *iov = batch->iov;
+  int niov = batch->niov;
+  while (niov > 0) {
+    ssize_t n = writev(fd, iov, niov);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      result = -1;
+      break;
+    }
+    /* 途中までしか書けなかった場合は残りから続ける */
+    while (niov > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      niov--;
+    }
+    if (niov > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+#endif
+  batch->niov = 0;
+  batch->staged = 0;
+  return result;
+}
+
+static int batch_add(WriteBatch *batch, const void *data, size_t len) {
+  if (batch->niov == WRITE_BATCH_IOV && batch_flush(batch) != 0) {
+    return -1;
+  }
+  batch->iov[batch->niov].iov_base = (void *)data;
+  batch->iov[batch->niov].iov_len = len;
+  batch->niov++;
+  return 0;
+}
+
+/**
+ * @brief ステージング領域にlenバイト確保する。直前の領域と連続なら一つのiovecにまとめる
+ */
+static uint8_t *batch_stage(WriteBatch *batch, size_t len) {
+  if ((batch->staged + len > WRITE_STAGING_SIZE ||
+       batch->niov == WRITE_BATCH_IOV) &&
+      batch_flush(batch) != 0) {
+    return NULL;
+  }
+  uint8_t *ptr = batch->staging + batch->staged;
+  batch->staged += len;
+  struct iovec *last = batch->niov ? &batch->iov[batch->niov - 1] : NULL;
+  if (last && (uint8_t *)last->iov_base + last->iov_len == ptr) {
+    last->iov_len += len;
+  } else if (batch_add(batch, ptr, len) != 0) {
+    return NULL;
+  }
+  return ptr;
+}
+
+int img_write_file(const ImgData *imgdata, FILE *out) {
+  WriteBatch *batch = (WriteBatch *)malloc(sizeof(WriteBatch));
+  if (!batch) {
+    fprintf(stderr, "Memory allocation failed for write batch.\n");
+    return -1;
+  }
+  batch->out = out;
+  batch->niov = 0;
+  batch->staged = 0;
+
+#ifndef _WIN32
+  /* writevはFILEのバッファを経由しないので、先に溜まっている分を出す */
+  if (fflush(out) != 0) {
+    free(batch);
+    return -1;
+  }
+#endif
+
+  int result = 0;
+  uint8_t *ptr = batch_stage(batch, file_header_size());
+  if (ptr) {
+    fill_file_header((char *)ptr, imgdata->width, imgdata->height,
+                     imgdata->block_count);
+  } else {
+    result = -1;
+  }
+
+  for (int i = 0; i < imgdata->block_count && result == 0; ++i) {
+    if ((ptr = batch_stage(batch, 7))) {
+      fill_block_header(&imgdata->blocks[i], ptr);
+    } else {
+      result = -1;
+    }
+  }
+
+  for (int i = 0; i < imgdata->block_count && result == 0; ++i) {
+    if ((ptr = batch_stage(batch, 4))) {
+      memcpy(ptr, imgdata->blocks[i].corners, sizeof(uint8_t) * 4);
+    } else {
+      result = -1;
+    }
+  }
+
+  for (int i = 0; i < imgdata->block_count && result == 0; ++i) {
+    result = batch_add(batch, imgdata->blocks[i].nblock4bn,
+                       sizeof(uint8_t) * 64);
+  }
+
+  if (result == 0) {
+    result = batch_add(batch, binfmt_endmsg, strlen(binfmt_endmsg));
+  }
+  if (result == 0) {
+    result = batch_flush(batch);
+  }
+  if (result != 0) {
+    fprintf(stderr, "Failed to write binfmt output.\n");
+  }
+  free(batch);
+  return result;
+}
+
+ImgPlanes *alloc_imgplanes(int16_t width, int16_t height,
+                           int32_t block_count) {
+  size_t plane_size = (size_t)block_count * (BLOCK_HEADER_SIZE +
+                                             BLOCK_CORNERS_SIZE +
+                                             BLOCK_CODES_SIZE);
+  ImgPlanes *planes = (ImgPlanes *)malloc(sizeof(ImgPlanes) + plane_size);
+  if (!planes) {
+    fprintf(stderr, "Memory allocation failed for ImgPlanes.\n");
+    return NULL;
+  }
+  planes->capacity = block_count;
+  planes->headers = (uint8_t *)(planes + 1);
+  return reuse_imgplanes(planes, width, height, block_count);
+}
+
+ImgPlanes *reuse_imgplanes(ImgPlanes *planes, int16_t width, int16_t height,
+                           int32_t block_count) {
+  if (!planes || planes->capacity < block_count) {
+    free_imgplanes(planes);
+    return alloc_imgplanes(width, height, block_count);
+  }
+  /* 面の境目はブロック数で決まるので、先頭から詰め直す */
+  planes->width = width;
+  planes->height = height;
+  planes->block_count = block_count;
+  planes->corners = planes->headers + (size_t)block_count * BLOCK_HEADER_SIZE;
+  planes->codes = planes->corners + (size_t)block_count * BLOCK_CORNERS_SIZE;
+  return planes;
+}
+
+void free_imgplanes(ImgPlanes *planes) { free(planes); }
+
+void planes_to_buf(const ImgPlanes *planes, char **buffer, size_t *size) {
+  size_t count = (size_t)planes->block_count;
+  size_t total_size =
+      file_header_size() + strlen(binfmt_endmsg) +
+      count * (BLOCK_HEADER_SIZE + BLOCK_CORNERS_SIZE + BLOCK_CODES_SIZE);
+
+  char *buf = (char *)malloc(total_size);
+  if (!buf) {
+    fprintf(stderr, "Memory allocation failed for binfmt buffer.\n");
+    *buffer = NULL;
+    *size = 0;
+    return;
+  }
+  char *ptr = buf;
+
+  fill_file_header(ptr, planes->width, planes->height, planes->block_count);
+  ptr += file_header_size();
+  memcpy(ptr, planes->headers, count * BLOCK_HEADER_SIZE);
+  ptr += count * BLOCK_HEADER_SIZE;
+  memcpy(ptr, planes->corners, count * BLOCK_CORNERS_SIZE);
+  ptr += count * BLOCK_CORNERS_SIZE;
+  memcpy(ptr, planes->codes, count * BLOCK_CODES_SIZE);
+  ptr += count * BLOCK_CODES_SIZE;
+  memcpy(ptr, binfmt_endmsg, strlen(binfmt_endmsg));
+
+  *buffer = buf;
+  *size = total_size;
+}
+
+int planes_write_file(const ImgPlanes *planes, FILE *out) {
+  WriteBatch *batch = (WriteBatch *)malloc(sizeof(WriteBatch));
+  if (!batch) {
+    fprintf(stderr, "Memory allocation failed for write batch.\n");
+    return -1;
+  }
+  batch->out = out;
+  batch->niov = 0;
+  batch->staged = 0;
+
+#ifndef _WIN32
+  if (fflush(out) != 0) {
+    free(batch);
+    return -1;
+  }
+#endif
+
+  /* 面はそれぞれ連続しているので、ヘッダとフッタを含めて5つのiovecで済む */
+  size_t count = (size_t)planes->block_count;
+  int result = 0;
+  uint8_t *ptr = batch_stage(batch, file_header_size());
+  if (ptr) {
+    fill_file_header((char *)ptr, planes->width, planes->height,
+                     planes->block_count);
+  } else {
+    result = -1;
+  }
+  if (result == 0) {
+    result = batch_add(batch, planes->headers, count * BLOCK_HEADER_SIZE);
+  }
+  if (result == 0) {
+    result = batch_add(batch, planes->corners, count * BLOCK_CORNERS_SIZE);
+  }
+  if (result == 0) {
+    result = batch_add(batch, planes->codes, count * BLOCK_CODES_SIZE);
+  }
+  if (result == 0) {
+    result = batch_add(batch, binfmt_endmsg, strlen(binfmt_endmsg));
+  }
+  if (result == 0) {
+    result = batch_flush(batch);
+  }
+  if (result != 0) {
+    fprintf(stderr, "Failed to write binfmt output.\n");
+  }
+  free(batch);
+  return result;
+}
+
+int planes_write_sink(const ImgPlanes *planes, binfmt_sink_fn sink,
+                      void *ctx) {
+  size_t count = (size_t)planes->block_count;
+  char header[256];
+  fill_file_header(header, planes->width, planes->height,
+                   planes->block_count);
+
+  int result = sink(ctx, header, file_header_size());
+  if (result == 0) {
+    result = sink(ctx, planes->headers, count * BLOCK_HEADER_SIZE);
+  }
+  if (result == 0) {
+    result = sink(ctx, planes->corners, count * BLOCK_CORNERS_SIZE);
+  }
+  if (result == 0) {
+    result = sink(ctx, planes->codes, count * BLOCK_CODES_SIZE);
+  }
+  if (result == 0) {
+    result = sink(ctx, binfmt_endmsg, strlen(binfmt_endmsg));
+  }
+  return result;
+}
+
+size_t binfmt_file_size(int32_t block_count) {
+  return file_header_size() + strlen(binfmt_endmsg) +
+         (size_t)block_count *
+             (BLOCK_HEADER_SIZE + BLOCK_CORNERS_SIZE + BLOCK_CODES_SIZE);
+}
+
+size_t binfmt_header_size(void) { return file_header_size(); }
+
+int binfmt_parse_header(const char *buffer, size_t size, int16_t *width,
+                        int16_t *height, int32_t *block_count) {
+  if (!parse_header_with(buffer, size, binfmt_msg, width, height,
+                         block_count) ||
+      *width < 0 || *height < 0 || *block_count < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+size_t binfmt_footer_size(void) { return strlen(binfmt_endmsg); }
+
+bool binfmt_is_footer(const char *buffer) {
+  return memcmp(buffer, binfmt_endmsg, strlen(binfmt_endmsg)) == 0;
+}
+
+const char *binfmt_footer(void) { return binfmt_endmsg; }
+
+void binfmt_put_be32(uint8_t *ptr, uint32_t value) {
+  uint32_t be = htonl(value);
+  memcpy(ptr, &be, sizeof(uint32_t));
+}
+
+uint32_t binfmt_get_be32(const uint8_t *ptr) {
+  uint32_t be;
+  memcpy(&be, ptr, sizeof(uint32_t));
+  return ntohl(be);
+}
+
+void binfmt_put_be64(uint8_t *ptr, uint64_t value) {
+  binfmt_put_be32(ptr, (uint32_t)(value >> 32));
+  binfmt_put_be32(ptr + 4, (uint32_t)value);
+}
+
+uint64_t binfmt_get_be64(const uint8_t *ptr) {
+  return ((uint64_t)binfmt_get_be32(ptr) << 32) | binfmt_get_be32(ptr + 4);
+}
+
+bool binfmt_file_has_version(const char *path, const char *msg) {
+  FILE *in_file = fopen(path, "rb");
+  if (!in_file) {
+    return false;
+  }
+  char head[128];
+  size_t n = strlen(msg) <= sizeof(head)
+                 ? fread(head, 1, strlen(msg), in_file)
+                 : 0;
+  fclose(in_file);
+  return has_version(head, n, msg);
+}
+
+int binfmt_check_index(const uint8_t *data, size_t size, const uint8_t *index,
+                       uint32_t count, size_t entry_size, size_t offset_pos,
+                       const char *what) {
+  if (size < strlen(binfmt_endmsg) ||
+      !binfmt_is_footer((const char *)data + size - strlen(binfmt_endmsg))) {
+    fprintf(stderr, "Invalid footer.\n");
+    return -1;
+  }
+  size_t body_end = size - strlen(binfmt_endmsg);
+  for (uint32_t i = 0; i < count; i++) {
+    const uint8_t *entry = index + (size_t)i * entry_size + offset_pos;
+    uint64_t offset = binfmt_get_be64(entry);
+    uint64_t len = binfmt_get_be64(entry + 8);
+    if (offset > body_end || len > body_end - offset) {
+      fprintf(stderr, "%s %u is out of range.\n", what, i);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+ImgPlanes *img_to_planes(const ImgData *imgdata) {
+  ImgPlanes *planes =
+      alloc_imgplanes(imgdata->width, imgdata->height, imgdata->block_count);
+  if (!planes) {
+    return NULL;
+  }
+  for (int i = 0; i < imgdata->block_count; ++i) {
+    fill_block_header(&imgdata->blocks[i], planes_header(planes, i));
+    memcpy(planes_corners(planes, i), imgdata->blocks[i].corners,
+           BLOCK_CORNERS_SIZE);
+    memcpy(planes_codes(planes, i), imgdata->blocks[i].nblock4bn,
+           BLOCK_CODES_SIZE);
+  }
+  return planes;
+}
+
+struct BinfmtWriter {
+  /* 先頭から順に書く分はすべてsinkに渡す */
+  binfmt_sink_fn sink;
+  void *sink_ctx;
+  int32_t block_count;
+  int32_t written;
+  size_t header_size;
+  /* 画素の面に書いたバイト数。BINFMT_SPARSEでは省いた分だけ少ない */
+  size_t codes_written;
+  bool sparse;
+  bool chroma420;
+  /* 出力がシークできる場合は各面の位置に直接書く */
+  FILE *out;
+  bool seekable;
+  long base;
+  /* シークできない場合は四隅と画素の面を一時ファイルに退避する */
+  FILE *corners_spill;
+  FILE *codes_spill;
+  FILE *chroma_spill; /* BINFMT_CHROMA420の色差の面 */
+  /* BINFMT_ENTROPYの場合はブロックを符号化しながらsinkに渡す */
+  EntropyEncoder *entropy;
+};
+
+int binfmt_file_sink(void *ctx, const void *data, size_t len) {
+  return fwrite(data, 1, len, (FILE *)ctx) == len ? 0 : -1;
+}
+
+/**
+ * @brief block_is_flatなブロックを除いて画素の面をemitに渡す
+ * @param written 渡したバイト数を加える
+ * @note 省かないブロックが続く間はまとめて一度に渡す
+ */
+static int emit_sparse_codes(const ImgPlanes *planes, binfmt_sink_fn emit,
+                             void *ctx, size_t *written) {
+  int32_t run_start = 0;
+  for (int32_t i = 0; i <= planes->block_count; i++) {
+    if (i < planes->block_count && !block_is_flat(planes_header(planes, i))) {
+      continue;
+    }
+    if (i > run_start) {
+      size_t len = (size_t)(i - run_start) * BLOCK_CODES_SIZE;
+      if (emit(ctx, planes_codes(planes, run_start), len) != 0) {
+        return -1;
+      }
+      *written += len;
+    }
+    run_start = i + 1;
+  }
+  return 0;
+}
+
+static BinfmtWriter *writer_start(BinfmtWriter *writer, BinfmtFormat format,
+                                  int16_t width, int16_t height) {
+  const char *msg = format == BINFMT_SPARSE      ? binfmt_msg_sparse
+                    : format == BINFMT_CHROMA420 ? binfmt_msg_chroma420
+                                                 : binfmt_msg;
+  writer->sparse = format == BINFMT_SPARSE;
+  writer->chroma420 = format == BINFMT_CHROMA420;
+  if (format == BINFMT_ENTROPY) {
+    msg = binfmt_msg_entropy;
+    writer->seekable = false;
+    writer->entropy =
+        entropy_encoder_new(writer->sink, writer->sink_ctx, width / 8);
+    if (!writer->entropy) {
+      binfmt_writer_abort(writer);
+      return NULL;
+    }
+  } else if (!writer->seekable) {
+    writer->corners_spill = tmpfile();
+    writer->codes_spill = tmpfile();
+    writer->chroma_spill = writer->chroma420 ? tmpfile() : NULL;
+    if (!writer->corners_spill || !writer->codes_spill ||
+        (writer->chroma420 && !writer->chroma_spill)) {
+      fprintf(stderr, "Could not create spill files.\n");
+      binfmt_writer_abort(writer);
+      return NULL;
+    }
+  }
+
+  char header[256];
+  writer->header_size = header_size_with(msg);
+  fill_header_with(header, msg, width, height, writer->block_count);
+  if (writer->sink(writer->sink_ctx, header, writer->header_size) != 0) {
+    fprintf(stderr, "Failed to write binfmt header.\n");
+    binfmt_writer_abort(writer);
+    return NULL;
+  }
+  return writer;
+}
+
+BinfmtWriter *binfmt_writer_open(FILE *out, BinfmtFormat format, int16_t width,
+                                 int16_t height, int32_t block_count) {
+  BinfmtWriter *writer = (BinfmtWriter *)calloc(1, sizeof(BinfmtWriter));
+  if (!writer) {
+    fprintf(stderr, "Memory allocation failed for BinfmtWriter.\n");
+    return NULL;
+  }
+  writer->sink = binfmt_file_sink;
+  writer->sink_ctx = out;
+  writer->block_count = block_count;
+  writer->out = out;
+  writer->base = ftell(out);
+  writer->seekable =
+      writer->base >= 0 && fseek(out, writer->base, SEEK_SET) == 0;
+  return writer_start(writer, format, width, height);
+}
+
+BinfmtWriter *binfmt_writer_open_sink(binfmt_sink_fn sink, void *ctx,
+                                      BinfmtFormat format, int16_t width,
+                                      int16_t height, int32_t block_count) {
+  BinfmtWriter *writer = (BinfmtWriter *)calloc(1, sizeof(BinfmtWriter));
+  if (!writer) {
+    fprintf(stderr, "Memory allocation failed for BinfmtWriter.\n");
+    return NULL;
+  }
+  writer->sink = sink;
+  writer->sink_ctx = ctx;
+  writer->block_count = block_count;
+  return writer_start(writer, format, width, height);
+}
+
+static int write_plane(BinfmtWriter *writer, FILE *spill, long plane_offset,
+                       size_t record_size, const uint8_t *data,
+                       size_t count) {
+  FILE *dst = spill;
+  if (writer->seekable) {
+    dst = writer->out;
+    long offset = writer->base + (long)writer->header_size + plane_offset +
+                  (long)(writer->written * record_size);
+    if (fseek(dst, offset, SEEK_SET) != 0) {
+      return -1;
+    }
+  } else if (!spill) {
+    return writer->sink(writer->sink_ctx, data, record_size * count);
+  }
+  return fwrite(data, record_size, count, dst) == count ? 0 : -1;
+}
+
+/**
+ * @brief ブロックを輝度と色差の面に分けて書く
+ * @return 成功時0、失敗時-1
+ * @note 画素の面はencode_kernel_selectのchroma-420用のカーネルで符号化したもので、
+ *       各ブロックの先頭に輝度と色差が続けて入っている
+ */
+static int write_chroma420(BinfmtWriter *writer, const ImgPlanes *strip,
+                           long codes_offset) {
+  size_t count = (size_t)strip->block_count;
+  uint8_t *y_plane =
+      (uint8_t *)malloc(count * (CHROMA420_Y_SIZE + CHROMA420_UV_SIZE) + 1);
+  if (!y_plane) {
+    fprintf(stderr, "Memory allocation failed for chroma planes.\n");
+    return -1;
+  }
+  uint8_t *uv_plane = y_plane + count * CHROMA420_Y_SIZE;
+  for (size_t i = 0; i < count; i++) {
+    const uint8_t *codes = planes_codes(strip, i);
+    memcpy(y_plane + i * CHROMA420_Y_SIZE, codes, CHROMA420_Y_SIZE);
+    memcpy(uv_plane + i * CHROMA420_UV_SIZE, codes + CHROMA420_Y_SIZE,
+           CHROMA420_UV_SIZE);
+  }
+  long uv_offset =
+      codes_offset + (long)writer->block_count * CHROMA420_Y_SIZE;
+  int result = write_plane(writer, writer->codes_spill, codes_offset,
+                           CHROMA420_Y_SIZE, y_plane, count);
+  result |= write_plane(writer, writer->chroma_spill, uv_offset,
+                        CHROMA420_UV_SIZE, uv_plane, count);
+  writer->codes_written += count * (CHROMA420_Y_SIZE + CHROMA420_UV_SIZE);
+  free(y_plane);
+  return result;
+}
+
+int binfmt_writer_write_planes(BinfmtWriter *writer, const ImgPlanes *strip) {
+  size_t count = (size_t)strip->block_count;
+  if (strip->block_count > writer->block_count - writer->written) {
+    fprintf(stderr, "Too many blocks written to binfmt.\n");
+    return -1;
+  }
+
+  if (writer->entropy) {
+    if (entropy_encode_planes(writer->entropy, strip) != 0) {
+      fprintf(stderr, "Failed to write binfmt blocks.\n");
+      return -1;
+    }
+    writer->written += strip->block_count;
+    return 0;
+  }
+
+  long corners_offset = (long)writer->block_count * BLOCK_HEADER_SIZE;
+  long codes_offset =
+      (long)writer->block_count * (BLOCK_HEADER_SIZE + BLOCK_CORNERS_SIZE);
+  int result = 0;
+
+  /* ヘッダ面はシークできなくても先頭から順に書ける */
+  result |= write_plane(writer, NULL, 0, BLOCK_HEADER_SIZE,
+                        strip->headers, count);
+  result |= write_plane(writer, writer->corners_spill, corners_offset,
+                        BLOCK_CORNERS_SIZE, strip->corners, count);
+  if (writer->sparse) {
+    FILE *dst = writer->codes_spill;
+    if (writer->seekable) {
+      dst = writer->out;
+      long offset = writer->base + (long)writer->header_size + codes_offset +
+                    (long)writer->codes_written;
+      result |= fseek(dst, offset, SEEK_SET);
+    }
+    if (result == 0) {
+      result = emit_sparse_codes(strip, binfmt_file_sink, dst,
+                                 &writer->codes_written);
+    }
+  } else if (writer->chroma420) {
+    result |= write_chroma420(writer, strip, codes_offset);
+  } else {
+    result |= write_plane(writer, writer->codes_spill, codes_offset,
+                          BLOCK_CODES_SIZE, strip->codes, count);
+    writer->codes_written += count * BLOCK_CODES_SIZE;
+  }
+
+  if (result != 0) {
+    fprintf(stderr, "Failed to write binfmt blocks.\n");
+    return -1;
+  }
+  writer->written += strip->block_count;
+  return 0;
+}
+
+static int copy_spill(FILE *spill, BinfmtWriter *writer) {
+  char buf[65536];
+  size_t n;
+  rewind(spill);
+  while ((n = fread(buf, 1, sizeof(buf), spill)) > 0) {
+    if (writer->sink(writer->sink_ctx, buf, n) != 0) {
+      return -1;
+    }
+  }
+  return ferror(spill) ? -1 : 0;
+}
+
+int binfmt_writer_close(BinfmtWriter *writer) {
+  int result = 0;
+  if (writer->written != writer->block_count) {
+    fprintf(stderr, "Expected %d blocks but %d were written.\n",
+            writer->block_count, writer->written);
+    result = -1;
+  } else if (writer->entropy) {
+    result = entropy_encoder_finish(writer->entropy);
+    writer->entropy = NULL;
+  } else if (writer->seekable) {
+    long end = writer->base + (long)writer->header_size +
+               (long)writer->block_count *
+                   (BLOCK_HEADER_SIZE + BLOCK_CORNERS_SIZE) +
+               (long)writer->codes_written;
+    if (fseek(writer->out, end, SEEK_SET) != 0) {
+      result = -1;
+    }
+  } else {
+    if (copy_spill(writer->corners_spill, writer) != 0 ||
+        copy_spill(writer->codes_spill, writer) != 0 ||
+        (writer->chroma_spill &&
+         copy_spill(writer->chroma_spill, writer) != 0)) {
+      result = -1;
+    }
+  }
+  if (result == 0) {
+    result = writer->sink(writer->sink_ctx, binfmt_endmsg,
+                          strlen(binfmt_endmsg));
+  }
+  if (result != 0) {
+    fprintf(stderr, "Failed to finish binfmt output.\n");
+  }
+  binfmt_writer_abort(writer);
+  return result;
+}
+
+void binfmt_writer_abort(BinfmtWriter *writer) {
+  if (writer) {
+    if (writer->corners_spill) {
+      fclose(writer->corners_spill);
+    }
+    if (writer->codes_spill) {
+      fclose(writer->codes_spill);
+    }
+    if (writer->chroma_spill) {
+      fclose(writer->chroma_spill);
+    }
+    entropy_encoder_free(writer->entropy);
+    free(writer);
+  }
+}
 
-  if (size < strlen(binfmt_msg) ||
-      memcmp(ptr, binfmt_msg, strlen(binfmt_msg)) != 0) {
-    fprintf(stderr, "Invalid header. %s\n", ptr);
+ImgData *buf_to_img(const char *buffer, size_t size) {
+  if (!has_version(buffer, size, binfmt_msg)) {
+    /* 面をそのまま並べていない形式は一度ImgPlanesに展開する */
+    ImgPlanes *planes = buf_to_planes(buffer, size);
+    if (!planes) {
+      return NULL;
+    }
+    ImgData *img = planes_to_img(planes);
+    free_imgplanes(planes);
+    return img;
+  }
+  ImgView view;
+  if (img_view_from_buf(buffer, size, &view) != 0) {
     return NULL;
   }
-  ptr += strlen(binfmt_msg);
 
   ImgData *img = (ImgData *)malloc(sizeof(ImgData));
   if (!img) {
     fprintf(stderr, "Memory allocation failed for ImgData.\n");
     return NULL;
   }
-
-  int16_t width_be, height_be;
-  memcpy(&width_be, ptr, sizeof(int16_t));
-  ptr += sizeof(int16_t);
-  memcpy(&height_be, ptr, sizeof(int16_t));
-  ptr += sizeof(int16_t);
-  img->width = ntohs(width_be);
-  img->height = ntohs(height_be);
-
-  int32_t block_count_be;
-  memcpy(&block_count_be, ptr, sizeof(int32_t));
-  ptr += sizeof(int32_t);
-  img->block_count = ntohl(block_count_be);
+  img->width = view.width;
+  img->height = view.height;
+  img->block_count = view.block_count;
 
   img->blocks = (BlockData *)malloc(sizeof(BlockData) * img->block_count);
   if (!img->blocks) {
@@ -123,34 +854,246 @@ ImgData *buf_to_img(const char *buffer, size_t size) {
   }
 
   for (int i = 0; i < img->block_count; ++i) {
-    memcpy(&img->blocks[i].blockmaxy, ptr, sizeof(uint8_t) * 6);
-    ptr += sizeof(uint8_t) * 6;
-    uint8_t interpolaten;
-    memcpy(&interpolaten, ptr, sizeof(uint8_t));
-    ptr += sizeof(uint8_t);
+    img_view_get_block(&view, i, &img->blocks[i]);
+  }
+
+  return img;
+}
+
+static bool is_entropy_coded(const char *buffer, size_t size) {
+  return has_version(buffer, size, binfmt_msg_entropy);
+}
+
+static bool is_sparse(const char *buffer, size_t size) {
+  return has_version(buffer, size, binfmt_msg_sparse);
+}
+
+static bool is_chroma420(const char *buffer, size_t size) {
+  return has_version(buffer, size, binfmt_msg_chroma420);
+}
 
-    img->blocks[i].interpolatey = (interpolaten >> 2) & 1;
-    img->blocks[i].interpolateu = (interpolaten >> 1) & 1;
-    img->blocks[i].interpolatev = interpolaten & 1;
+/**
+ * @brief 色差を間引いた形式を*planesに展開する
+ * @return 成功時0、失敗時-1
+ */
+static int unpack_chroma420(const char *buffer, size_t size,
+                            ImgPlanes **planes_ptr) {
+  int16_t width, height;
+  int32_t block_count;
+  const char *ptr = parse_header_with(buffer, size, binfmt_msg_chroma420,
+                                      &width, &height, &block_count);
+  if (!ptr) {
+    fprintf(stderr, "Invalid header.\n");
+    return -1;
+  }
+  if (block_count < 0) {
+    fprintf(stderr, "Invalid block count.\n");
+    return -1;
+  }
+  size_t count = (size_t)block_count;
+  size_t planes_size =
+      count * (BLOCK_HEADER_SIZE + BLOCK_CORNERS_SIZE + CHROMA420_Y_SIZE +
+               CHROMA420_UV_SIZE);
+  if (size - header_size_with(binfmt_msg_chroma420) <
+          planes_size + strlen(binfmt_endmsg) ||
+      memcmp(ptr + planes_size, binfmt_endmsg, strlen(binfmt_endmsg)) != 0) {
+    fprintf(stderr, "Invalid footer.\n");
+    return -1;
   }
 
-  for (int i = 0; i < img->block_count; ++i) {
-    memcpy(img->blocks[i].corners, ptr, sizeof(uint8_t) * 4);
-    ptr += sizeof(uint8_t) * 4;
+  ImgPlanes *planes = *planes_ptr =
+      reuse_imgplanes(*planes_ptr, width, height, block_count);
+  if (!planes) {
+    return -1;
   }
+  const uint8_t *headers = (const uint8_t *)ptr;
+  const uint8_t *y_plane =
+      headers + count * (BLOCK_HEADER_SIZE + BLOCK_CORNERS_SIZE);
+  const uint8_t *uv_plane = y_plane + count * CHROMA420_Y_SIZE;
+  memcpy(planes->headers, headers, count * BLOCK_HEADER_SIZE);
+  memcpy(planes->corners, headers + count * BLOCK_HEADER_SIZE,
+         count * BLOCK_CORNERS_SIZE);
+  /* 復元カーネルはフラグを見て、詰めたままの輝度と色差を4x4の区画で読む */
+  for (size_t i = 0; i < count; i++) {
+    uint8_t *codes = planes_codes(planes, i);
+    memcpy(codes, y_plane + i * CHROMA420_Y_SIZE, CHROMA420_Y_SIZE);
+    memcpy(codes + CHROMA420_Y_SIZE, uv_plane + i * CHROMA420_UV_SIZE,
+           CHROMA420_UV_SIZE);
+    planes->headers[i * BLOCK_HEADER_SIZE + BLOCK_FLAGS] |=
+        BLOCK_FLAG_CHROMA420;
+  }
+  return 0;
+}
 
-  for (int i = 0; i < img->block_count; ++i) {
-    memcpy(img->blocks[i].nblock4bn, ptr, sizeof(uint8_t) * 64);
-    ptr += sizeof(uint8_t) * 64;
+/**
+ * @brief 画素を省いた形式を*planesに展開する。省かれたブロックの画素は0にする
+ * @return 成功時0、失敗時-1
+ */
+static int unpack_sparse(const char *buffer, size_t size,
+                         ImgPlanes **planes_ptr) {
+  int16_t width, height;
+  int32_t block_count;
+  const char *ptr = parse_header_with(buffer, size, binfmt_msg_sparse,
+                                      &width, &height, &block_count);
+  if (!ptr) {
+    fprintf(stderr, "Invalid header.\n");
+    return -1;
+  }
+  if (block_count < 0) {
+    fprintf(stderr, "Invalid block count.\n");
+    return -1;
+  }
+  size_t count = (size_t)block_count;
+  size_t rest = size - header_size_with(binfmt_msg_sparse);
+  if (rest < count * (BLOCK_HEADER_SIZE + BLOCK_CORNERS_SIZE)) {
+    fprintf(stderr, "Invalid footer.\n");
+    return -1;
+  }
+  /* 画素の面の長さはヘッダ面のフラグから決まる */
+  const uint8_t *headers = (const uint8_t *)ptr;
+  size_t coded = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (!block_is_flat(headers + i * BLOCK_HEADER_SIZE)) {
+      coded++;
+    }
+  }
+  size_t planes_size = count * (BLOCK_HEADER_SIZE + BLOCK_CORNERS_SIZE) +
+                       coded * BLOCK_CODES_SIZE;
+  if (rest < planes_size + strlen(binfmt_endmsg) ||
+      memcmp(ptr + planes_size, binfmt_endmsg, strlen(binfmt_endmsg)) != 0) {
+    fprintf(stderr, "Invalid footer.\n");
+    return -1;
   }
 
-  if (size < (ptr - buffer) + strlen(binfmt_endmsg) ||
-      memcmp(ptr, binfmt_endmsg, strlen(binfmt_endmsg)) != 0) {
+  ImgPlanes *planes = *planes_ptr =
+      reuse_imgplanes(*planes_ptr, width, height, block_count);
+  if (!planes) {
+    return -1;
+  }
+  memcpy(planes->headers, headers, count * BLOCK_HEADER_SIZE);
+  memcpy(planes->corners, headers + count * BLOCK_HEADER_SIZE,
+         count * BLOCK_CORNERS_SIZE);
+  const uint8_t *src =
+      headers + count * (BLOCK_HEADER_SIZE + BLOCK_CORNERS_SIZE);
+  for (int32_t i = 0; i < block_count; i++) {
+    if (block_is_flat(planes_header(planes, i))) {
+      memset(planes_codes(planes, i), 0, BLOCK_CODES_SIZE);
+    } else {
+      memcpy(planes_codes(planes, i), src, BLOCK_CODES_SIZE);
+      src += BLOCK_CODES_SIZE;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief 算術符号で詰めた形式を*planesに展開する
+ * @return 成功時0、失敗時-1
+ */
+static int unpack_entropy(const char *buffer, size_t size,
+                          ImgPlanes **planes_ptr, EntropyDecoder *decoder) {
+  int16_t width, height;
+  int32_t block_count;
+  const char *ptr = parse_header_with(buffer, size, binfmt_msg_entropy,
+                                      &width, &height, &block_count);
+  if (!ptr) {
+    fprintf(stderr, "Invalid header.\n");
+    return -1;
+  }
+  if (block_count < 0) {
+    fprintf(stderr, "Invalid block count.\n");
+    return -1;
+  }
+  /* 符号の長さは持たないので、フッタを末尾から探す */
+  size_t coded = size - header_size_with(binfmt_msg_entropy);
+  if (coded < strlen(binfmt_endmsg) ||
+      memcmp(buffer + size - strlen(binfmt_endmsg), binfmt_endmsg,
+             strlen(binfmt_endmsg)) != 0) {
     fprintf(stderr, "Invalid footer.\n");
-    free_imgdata(img);
+    return -1;
+  }
+  coded -= strlen(binfmt_endmsg);
+
+  ImgPlanes *planes = *planes_ptr =
+      reuse_imgplanes(*planes_ptr, width, height, block_count);
+  if (!planes) {
+    return -1;
+  }
+  return entropy_decode_planes(decoder, (const uint8_t *)ptr, coded, planes);
+}
+
+bool binfmt_is_planar(const char *buffer, size_t size) {
+  return has_version(buffer, size, binfmt_msg);
+}
+
+int buf_unpack_planes(const char *buffer, size_t size, ImgPlanes **planes) {
+  return buf_unpack_planes_with(buffer, size, planes, NULL);
+}
+
+int buf_unpack_planes_with(const char *buffer, size_t size, ImgPlanes **planes,
+                           EntropyDecoder *entropy) {
+  if (is_entropy_coded(buffer, size)) {
+    return unpack_entropy(buffer, size, planes, entropy);
+  }
+  if (is_sparse(buffer, size)) {
+    return unpack_sparse(buffer, size, planes);
+  }
+  if (is_chroma420(buffer, size)) {
+    return unpack_chroma420(buffer, size, planes);
+  }
+  ImgView view;
+  if (img_view_from_buf(buffer, size, &view) != 0) {
+    return -1;
+  }
+
+  *planes = reuse_imgplanes(*planes, view.width, view.height,
+                            view.block_count);
+  if (!*planes) {
+    return -1;
+  }
+  size_t count = (size_t)view.block_count;
+  memcpy((*planes)->headers, view.headers, count * BLOCK_HEADER_SIZE);
+  memcpy((*planes)->corners, view.corners, count * BLOCK_CORNERS_SIZE);
+  memcpy((*planes)->codes, view.codes, count * BLOCK_CODES_SIZE);
+  return 0;
+}
+
+ImgPlanes *buf_to_planes(const char *buffer, size_t size) {
+  ImgPlanes *planes = NULL;
+  if (buf_unpack_planes(buffer, size, &planes) != 0) {
+    free_imgplanes(planes);
+    return NULL;
+  }
+  return planes;
+}
+
+ImgData *planes_to_img(const ImgPlanes *planes) {
+  ImgData *img = (ImgData *)malloc(sizeof(ImgData));
+  if (!img) {
+    fprintf(stderr, "Memory allocation failed for ImgData.\n");
+    return NULL;
+  }
+  img->width = planes->width;
+  img->height = planes->height;
+  img->block_count = planes->block_count;
+
+  img->blocks = (BlockData *)malloc(sizeof(BlockData) * img->block_count);
+  if (!img->blocks) {
+    fprintf(stderr, "Memory allocation failed for BlockData.\n");
+    free(img);
     return NULL;
   }
 
+  /* ImgViewと同じ並びなので、ビューとして読めば展開処理を共有できる */
+  ImgView view;
+  memset(&view, 0, sizeof(ImgView));
+  view.block_count = planes->block_count;
+  view.headers = planes->headers;
+  view.corners = planes->corners;
+  view.codes = planes->codes;
+  for (int i = 0; i < img->block_count; ++i) {
+    img_view_get_block(&view, i, &img->blocks[i]);
+  }
   return img;
 }
 
@@ -161,4 +1104,192 @@ void free_imgdata(ImgData *imgdata) {
     }
     free(imgdata);
   }
-}
\ No newline at end of file
+}
+int img_view_from_buf(const char *buffer, size_t size, ImgView *view) {
+  memset(view, 0, sizeof(ImgView));
+  const char *ptr = parse_header_with(buffer, size, binfmt_msg, &view->width,
+                                      &view->height, &view->block_count);
+  if (!ptr) {
+    fprintf(stderr, "Invalid header.\n");
+    return -1;
+  }
+  if (view->block_count < 0) {
+    fprintf(stderr, "Invalid block count.\n");
+    return -1;
+  }
+
+  size_t planes = (size_t)view->block_count * (7 + 4 + 64);
+  if (size - file_header_size() < planes + strlen(binfmt_endmsg) ||
+      memcmp(ptr + planes, binfmt_endmsg, strlen(binfmt_endmsg)) != 0) {
+    fprintf(stderr, "Invalid footer.\n");
+    return -1;
+  }
+
+  view->headers = (const uint8_t *)ptr;
+  view->corners = view->headers + (size_t)view->block_count * 7;
+  view->codes = view->corners + (size_t)view->block_count * 4;
+  return 0;
+}
+
+void *binfmt_map_file(const char *path, size_t *size) {
+  void *map = NULL;
+  size_t map_size = 0;
+#ifdef _WIN32
+  FILE *in_file = fopen(path, "rb");
+  if (!in_file) {
+    fprintf(stderr, "Could not open input file: %s\n", path);
+    return NULL;
+  }
+  fseek(in_file, 0, SEEK_END);
+  map_size = ftell(in_file);
+  fseek(in_file, 0, SEEK_SET);
+  map = malloc(map_size);
+  if (!map || fread(map, 1, map_size, in_file) != map_size) {
+    fprintf(stderr, "Could not read input file: %s\n", path);
+    fclose(in_file);
+    free(map);
+    return NULL;
+  }
+  fclose(in_file);
+#else
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Could not open input file: %s\n", path);
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    fprintf(stderr, "Could not read input file: %s\n", path);
+    close(fd);
+    return NULL;
+  }
+  map_size = st.st_size;
+  map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "Could not map input file: %s\n", path);
+    return NULL;
+  }
+#endif
+  *size = map_size;
+  return map;
+}
+
+void binfmt_unmap_file(void *map, size_t size) {
+  if (map) {
+#ifdef _WIN32
+    (void)size;
+    free(map);
+#else
+    munmap(map, size);
+#endif
+  }
+}
+
+/**
+ * @brief dataに対するビューを作る。xz形式や面を並べていない形式は展開する
+ * @return 成功時0、失敗時-1
+ * @note 展開しなかった場合、ビューはdataを直接指す
+ */
+static int view_unpack(ImgView *view, const char *data, size_t size,
+                       int nthreads) {
+  uint8_t *unpacked = NULL;
+  if (xz_is_stream(data, size)) {
+    size_t unpacked_size;
+    if (xz_decode_buffer((const uint8_t *)data, size, nthreads, &unpacked,
+                         &unpacked_size) != 0) {
+      return -1;
+    }
+    data = (const char *)unpacked;
+    size = unpacked_size;
+  }
+
+  if (is_entropy_coded(data, size) || is_sparse(data, size) ||
+      is_chroma420(data, size)) {
+    /* 面をそのまま並べていない形式は面に展開し、ビューはその面を指す */
+    ImgPlanes *planes = NULL;
+    int result = buf_unpack_planes(data, size, &planes);
+    free(unpacked);
+    if (result != 0) {
+      free_imgplanes(planes);
+      return -1;
+    }
+    memset(view, 0, sizeof(ImgView));
+    view->width = planes->width;
+    view->height = planes->height;
+    view->block_count = planes->block_count;
+    view->headers = planes->headers;
+    view->corners = planes->corners;
+    view->codes = planes->codes;
+    view->planes = planes;
+    return 0;
+  }
+  if (img_view_from_buf(data, size, view) != 0) {
+    free(unpacked);
+    return -1;
+  }
+  view->unpacked = unpacked;
+  return 0;
+}
+
+ImgView *img_view_open(const char *path, int nthreads) {
+  ImgView *view = (ImgView *)malloc(sizeof(ImgView));
+  if (!view) {
+    fprintf(stderr, "Memory allocation failed for ImgView.\n");
+    return NULL;
+  }
+  size_t map_size;
+  void *map = binfmt_map_file(path, &map_size);
+  if (!map) {
+    free(view);
+    return NULL;
+  }
+
+  if (view_unpack(view, (const char *)map, map_size, nthreads) != 0) {
+    fprintf(stderr, "Could not read image data: %s\n", path);
+    binfmt_unmap_file(map, map_size);
+    free(view);
+    return NULL;
+  }
+  /* 展開した場合は元の領域を参照しないので、すぐに手放す */
+  if (view->unpacked || view->planes) {
+    binfmt_unmap_file(map, map_size);
+  } else {
+    view->map = map;
+    view->map_size = map_size;
+  }
+  return view;
+}
+
+ImgView *img_view_open_mem(const void *data, size_t size, int nthreads) {
+  ImgView *view = (ImgView *)malloc(sizeof(ImgView));
+  if (!view) {
+    fprintf(stderr, "Memory allocation failed for ImgView.\n");
+    return NULL;
+  }
+  if (view_unpack(view, (const char *)data, size, nthreads) != 0) {
+    free(view);
+    return NULL;
+  }
+  return view;
+}
+
+void img_view_close(ImgView *view) {
+  if (view) {
+    binfmt_unmap_file(view->map, view->map_size);
+    free(view->unpacked);
+    free_imgplanes(view->planes);
+    free(view);
+  }
+}
+
+void img_view_get_block(const ImgView *view, int32_t index,
+                        BlockData *block) {
+  const uint8_t *header = img_view_header(view, index);
+  memcpy(&block->blockmaxy, header, sizeof(uint8_t) * 6);
+  block->interpolatey = (header[6] >> 2) & 1;
+  block->interpolateu = (header[6] >> 1) & 1;
+  block->interpolatev = header[6] & 1;
+  memcpy(block->corners, img_view_corners(view, index), sizeof(uint8_t) * 4);
+  memcpy(block->nblock4bn, img_view_codes(view, index), sizeof(uint8_t) * 64);
+}
@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 typedef struct {
   uint8_t blockmaxy, blockminy;
@@ -20,19 +21,391 @@ typedef struct {
   BlockData *blocks;
 } ImgData;
 
+/* ヘッダ面の1ブロック分 (7バイト) の並び */
+enum {
+  BLOCK_MAXY,
+  BLOCK_MINY,
+  BLOCK_MAXU,
+  BLOCK_MINU,
+  BLOCK_MAXV,
+  BLOCK_MINV,
+  BLOCK_FLAGS,
+  BLOCK_HEADER_SIZE
+};
+
+#define BLOCK_FLAG_Y 4
+#define BLOCK_FLAG_U 2
+#define BLOCK_FLAG_V 1
+#define BLOCK_FLAGS_ALL (BLOCK_FLAG_Y | BLOCK_FLAG_U | BLOCK_FLAG_V)
+/* 画素の面がCHROMA420_Y_SIZEバイトの輝度とCHROMA420_UV_SIZEバイトの色差を
+ * 続けて持つブロック。色差の範囲と四隅は2x2画素の平均から求めてある */
+#define BLOCK_FLAG_CHROMA420 8
+#define BLOCK_CORNERS_SIZE 4
+#define BLOCK_CODES_SIZE 64
+/* BINFMT_CHROMA420形式で1ブロックが輝度と色差の面に占めるバイト数 */
+#define CHROMA420_Y_SIZE 32
+#define CHROMA420_UV_SIZE 8
+/* 画素i (0..63) の色差が属する、4x4に並べた区画の番号 */
+#define CHROMA420_CELL(i) (((i) / 16) * 4 + ((i) % 8) / 2)
+
+/* BLOCK_FLAGSが取りうる8通りの値についてX(..., flags)を展開し、
+ * 補間の組み合わせごとに特殊化したname_0からname_7の関数を作る。
+ * BLOCK_FLAGS_TABLEはそれらをflagsで引く表の初期化子になる */
+#define BLOCK_FLAGS_EACH(X, ...)                                               \
+  X(__VA_ARGS__, 0)                                                            \
+  X(__VA_ARGS__, 1)                                                            \
+  X(__VA_ARGS__, 2)                                                            \
+  X(__VA_ARGS__, 3)                                                            \
+  X(__VA_ARGS__, 4)                                                            \
+  X(__VA_ARGS__, 5)                                                            \
+  X(__VA_ARGS__, 6)                                                            \
+  X(__VA_ARGS__, 7)
+#define BLOCK_FLAGS_TABLE(name)                                                \
+  {name##_0, name##_1, name##_2, name##_3,                                     \
+   name##_4, name##_5, name##_6, name##_7}
+
+static inline uint8_t block_flags(bool interpolatey, bool interpolateu,
+                                  bool interpolatev) {
+  return (interpolatey ? BLOCK_FLAG_Y : 0) | (interpolateu ? BLOCK_FLAG_U : 0) |
+         (interpolatev ? BLOCK_FLAG_V : 0);
+}
+
+/**
+ * @brief 三つのチャンネルをすべて補間するブロックかどうか
+ * @note このようなブロックの画素の差分は常に0で、四隅だけで復元できる
+ */
+static inline bool block_is_flat(const uint8_t *header) {
+  return (header[BLOCK_FLAGS] & BLOCK_FLAGS_ALL) == BLOCK_FLAGS_ALL;
+}
+
+/**
+ * @brief ファイルと同じ面構成でブロックを持つImgData
+ * @note 各面は連続した配列なので、読み書きは面ごとの一括コピーで済む
+ */
+typedef struct {
+  int16_t width, height;
+  int32_t block_count;
+  uint8_t *headers; /* BLOCK_HEADER_SIZEバイト x block_count */
+  uint8_t *corners; /* BLOCK_CORNERS_SIZEバイト x block_count */
+  uint8_t *codes;   /* BLOCK_CODES_SIZEバイト x block_count */
+  int32_t capacity; /* 確保した領域に収まるブロック数 */
+} ImgPlanes;
+
+static inline uint8_t *planes_header(const ImgPlanes *planes, int32_t index) {
+  return planes->headers + (size_t)index * BLOCK_HEADER_SIZE;
+}
+
+static inline uint8_t *planes_corners(const ImgPlanes *planes, int32_t index) {
+  return planes->corners + (size_t)index * BLOCK_CORNERS_SIZE;
+}
+
+static inline uint8_t *planes_codes(const ImgPlanes *planes, int32_t index) {
+  return planes->codes + (size_t)index * BLOCK_CODES_SIZE;
+}
+
+/**
+ * @brief ImgPlanes構造体を確保する。三つの面は一つの領域にまとめて確保される
+ * @return 確保された構造体へのポインタ、失敗した場合はNULL
+ */
+ImgPlanes *alloc_imgplanes(int16_t width, int16_t height, int32_t block_count);
+
+/**
+ * @brief 確保済みのImgPlanesを別の寸法で使い回す
+ * @param planes 使い回す構造体。NULLでもよい
+ * @return 領域が足りればplanesそのもの、足りなければ確保し直した構造体。
+ *         失敗した場合はNULLで、planesは解放される
+ */
+ImgPlanes *reuse_imgplanes(ImgPlanes *planes, int16_t width, int16_t height,
+                           int32_t block_count);
+
+/**
+ * @brief ImgPlanes構造体のメモリを解放する
+ */
+void free_imgplanes(ImgPlanes *planes);
+
+/**
+ * @brief ImgPlanes構造体からバイナリバッファを生成する
+ */
+void planes_to_buf(const ImgPlanes *planes, char **buffer, size_t *size);
+
+/**
+ * @brief バイナリバッファからImgPlanes構造体を復元する
+ * @note BINFMT_ENTROPY形式、BINFMT_SPARSE形式とBINFMT_CHROMA420形式も読める
+ * @return 復元された構造体へのポインタ、失敗した場合はNULL
+ */
+ImgPlanes *buf_to_planes(const char *buffer, size_t size);
+
+/**
+ * @brief バイナリバッファを確保済みのImgPlanesに展開する
+ * @param planes 使い回す構造体。領域が足りない場合は確保し直して書き換える。
+ *               NULLを指してもよい。失敗した場合も呼び出し元が解放する
+ * @return 成功時0、失敗時-1
+ * @note 同じ寸法の画像を繰り返し展開する場合、2回目以降はメモリを確保しない。
+ *       ただしBINFMT_ENTROPY形式は呼び出しごとに復元器を確保する
+ */
+int buf_unpack_planes(const char *buffer, size_t size, ImgPlanes **planes);
+
+struct EntropyDecoder;
+
+/**
+ * @brief buf_unpack_planesと同じだが、BINFMT_ENTROPY形式をentropyで復元する
+ * @param entropy 使い回す復元器 (entropy_decoder_new)。NULLの場合は
+ *                buf_unpack_planesと同じく呼び出しごとに確保する
+ */
+int buf_unpack_planes_with(const char *buffer, size_t size, ImgPlanes **planes,
+                           struct EntropyDecoder *entropy);
+
+/**
+ * @brief 三つの面をそのまま並べた形式 (BINFMT_PLANAR) かどうかを判定する
+ * @note この形式はimg_view_from_bufでコピーせずに読める
+ */
+bool binfmt_is_planar(const char *buffer, size_t size);
+
+/**
+ * @brief ImgPlanes構造体をバイナリ形式で直接ファイルに書き出す
+ * @return 成功時0、失敗時-1
+ */
+int planes_write_file(const ImgPlanes *planes, FILE *out);
+
+/**
+ * @brief 出力先に順にバイト列を渡す関数の型
+ * @return 成功時0、失敗時-1
+ */
+typedef int (*binfmt_sink_fn)(void *ctx, const void *data, size_t len);
+
+/**
+ * @brief ctxをFILE *として書き出すbinfmt_sink_fn
+ */
+int binfmt_file_sink(void *ctx, const void *data, size_t len);
+
+/**
+ * @brief ImgPlanes構造体のバイナリ形式をsinkに順に渡す
+ * @note 面ごとに一度ずつ呼ぶので、xzなどの圧縮ストリームにそのまま流せる
+ * @return 成功時0、失敗時-1
+ */
+int planes_write_sink(const ImgPlanes *planes, binfmt_sink_fn sink,
+                      void *ctx);
+
+/**
+ * @brief block_count個のブロックを持つバイナリ形式全体のバイト数を返す
+ */
+size_t binfmt_file_size(int32_t block_count);
+
+/**
+ * @brief BINFMT_PLANAR形式の先頭のメッセージと寸法のバイト数を返す
+ */
+size_t binfmt_header_size(void);
+
+/**
+ * @brief BINFMT_PLANAR形式の先頭のメッセージと寸法を読む
+ * @param size binfmt_header_size()バイト以上であること
+ * @return 成功時0、形式が違う場合や寸法が不正な場合-1
+ * @note 面を読まずに寸法だけを知りたい場合に使う
+ */
+int binfmt_parse_header(const char *buffer, size_t size, int16_t *width,
+                        int16_t *height, int32_t *block_count);
+
+/**
+ * @brief 三つの面の直後に続くフッタのバイト数を返す
+ */
+size_t binfmt_footer_size(void);
+
+/**
+ * @brief bufferがフッタと一致するかどうか
+ * @param buffer binfmt_footer_size()バイトを指すこと
+ */
+bool binfmt_is_footer(const char *buffer);
+
+/**
+ * @brief フッタの文字列を返す。長さはbinfmt_footer_size()バイト
+ * @note tiled-1、pyramid-1、temporal-1の入れ物も同じフッタで終える
+ */
+const char *binfmt_footer(void);
+
+/**
+ * @brief 入れ物の形式が寸法や位置を書く、ビッグエンディアンの整数を読み書きする
+ */
+void binfmt_put_be32(uint8_t *ptr, uint32_t value);
+uint32_t binfmt_get_be32(const uint8_t *ptr);
+void binfmt_put_be64(uint8_t *ptr, uint64_t value);
+uint64_t binfmt_get_be64(const uint8_t *ptr);
+
+/**
+ * @brief pathのファイルがmsgの版の行で始まるかどうか
+ * @return 開けない場合や短い場合はfalse
+ */
+bool binfmt_file_has_version(const char *path, const char *msg);
+
+/**
+ * @brief 入れ物の位置と長さの表が指す範囲が、すべてフッタより前に収まって
+ *        いることを確かめる
+ * @param data,size ファイル全体。フッタで終わっていること
+ * @param index count個の項目をentry_sizeバイトずつ並べた表
+ * @param offset_pos 項目の中で位置を置くバイト位置。長さは直後の8バイト
+ * @param what 範囲外の項目を知らせるときの名前 ("Tile"、"Level")
+ * @return 成功時0、失敗時-1
+ */
+int binfmt_check_index(const uint8_t *data, size_t size, const uint8_t *index,
+                       uint32_t count, size_t entry_size, size_t offset_pos,
+                       const char *what);
+
+/**
+ * @brief 互換用。ImgDataをImgPlanesに変換する
+ */
+ImgPlanes *img_to_planes(const ImgData *imgdata);
+
+/**
+ * @brief 互換用。ImgPlanesをImgDataに変換する
+ */
+ImgData *planes_to_img(const ImgPlanes *planes);
+
 /**
  * @brief ImgData構造体からバイナリバッファを生成する
  */
 void img_to_buf(const ImgData *imgdata, char **buffer, size_t *size);
 
+/**
+ * @brief ImgData構造体をバイナリ形式で直接ファイルに書き出す
+ * @param out 出力先
+ * @return 成功時0、失敗時-1
+ * @note img_to_bufと同じバイト列を、全体のバッファを作らずにwritevで出力する
+ */
+int img_write_file(const ImgData *imgdata, FILE *out);
+
+/* 出力する形式 */
+typedef enum {
+  BINFMT_PLANAR,  /* 三つの面をそのまま並べる形式 */
+  BINFMT_ENTROPY, /* ブロックごとに算術符号で詰めた形式 (entropy.h) */
+  BINFMT_SPARSE,  /* block_is_flatなブロックの画素を省いた形式 */
+  /* 画素の面を輝度と、2x2画素で平均した色差の面に分けた形式 */
+  BINFMT_CHROMA420,
+} BinfmtFormat;
+
+typedef struct BinfmtWriter BinfmtWriter;
+
+/**
+ * @brief ブロックを少しずつ書き出すライタを開く
+ * @param out 出力先。シークできない場合は四隅と画素の面を一時ファイルに退避する
+ * @param format 出力する形式。BINFMT_ENTROPYの場合は先頭から順に書くだけになる
+ * @param block_count 書き出すブロックの総数
+ * @return ライタ、失敗した場合はNULL
+ * @note ImgData全体を持たずにimg_to_bufと同じバイト列を出力できる
+ */
+BinfmtWriter *binfmt_writer_open(FILE *out, BinfmtFormat format, int16_t width,
+                                 int16_t height, int32_t block_count);
+
+/**
+ * @brief シークできない出力先としてsinkに書き出すライタを開く
+ * @note 四隅と画素の面は一時ファイルに退避し、閉じるときにsinkに渡す
+ */
+BinfmtWriter *binfmt_writer_open_sink(binfmt_sink_fn sink, void *ctx,
+                                      BinfmtFormat format, int16_t width,
+                                      int16_t height, int32_t block_count);
+
+/**
+ * @brief ブロックを先頭から順に追加する
+ * @param strip 追加するブロックを持つImgPlanes。block_count個すべてを書く
+ * @return 成功時0、失敗時-1
+ */
+int binfmt_writer_write_planes(BinfmtWriter *writer, const ImgPlanes *strip);
+
+/**
+ * @brief 残りの面とフッタを書き出してライタを解放する
+ * @return 成功時0、ブロック数が足りない場合や書き込みに失敗した場合-1
+ */
+int binfmt_writer_close(BinfmtWriter *writer);
+
+/**
+ * @brief 出力を完了せずにライタを解放する
+ */
+void binfmt_writer_abort(BinfmtWriter *writer);
+
 /**
  * @brief バイナリバッファからImgData構造体を復元する
  * @param buffer 入力バイナリバッファ
  * @param size 入力バイナリバッファのサイズ
  * @return 復元されたImgData構造体へのポインタ、失敗した場合はNULL
+ * @note BINFMT_ENTROPY形式、BINFMT_SPARSE形式とBINFMT_CHROMA420形式も読める
  */
 ImgData *buf_to_img(const char *buffer, size_t size);
 
+/**
+ * @brief ファイルの三つの面を直接参照する読み取り専用のビュー
+ * @note 各ブロックの位置はblock_countから計算するので、コピーは発生しない
+ */
+typedef struct {
+  int16_t width, height;
+  int32_t block_count;
+  const uint8_t *headers; /* 7バイト x block_count */
+  const uint8_t *corners; /* 4バイト x block_count */
+  const uint8_t *codes;   /* 64バイト x block_count */
+  void *map;
+  size_t map_size;
+  uint8_t *unpacked; /* xzを展開した場合の領域 */
+  ImgPlanes *planes; /* 算術符号や省いた画素を展開した場合の面 */
+} ImgView;
+
+/**
+ * @brief メモリ上のバイナリバッファに対するビューを作る
+ * @param buffer 入力バイナリバッファ。ビューを使い終わるまで解放しないこと
+ * @return 成功時0、ヘッダやフッタが不正な場合-1
+ */
+int img_view_from_buf(const char *buffer, size_t size, ImgView *view);
+
+/**
+ * @brief ファイルをメモリマップしてビューを作る
+ * @param nthreads xz形式の場合の展開スレッド数
+ * @return ビュー、失敗した場合はNULL。img_view_closeで解放する
+ * @note xz形式やBINFMT_ENTROPY形式、BINFMT_SPARSE形式、
+ *       BINFMT_CHROMA420形式のファイルは
+ *       メモリ上に展開してからビューを作る
+ */
+ImgView *img_view_open(const char *path, int nthreads);
+
+/**
+ * @brief ファイル全体を読み取り専用でメモリマップする
+ * @param size ファイルのバイト数を返す
+ * @return 先頭へのポインタ、失敗した場合はNULL。binfmt_unmap_fileで解放する
+ */
+void *binfmt_map_file(const char *path, size_t *size);
+
+/**
+ * @brief binfmt_map_fileでマップした領域を解放する
+ */
+void binfmt_unmap_file(void *map, size_t size);
+
+/**
+ * @brief メモリ上のデータに対してimg_view_openと同じようにビューを作る
+ * @param data ファイルの内容。ビューを使い終わるまで解放しないこと
+ * @return ビュー、失敗した場合はNULL。img_view_closeで解放する
+ */
+ImgView *img_view_open_mem(const void *data, size_t size, int nthreads);
+
+/**
+ * @brief img_view_openで作ったビューを解放する
+ */
+void img_view_close(ImgView *view);
+
+static inline const uint8_t *img_view_header(const ImgView *view,
+                                             int32_t index) {
+  return view->headers + (size_t)index * BLOCK_HEADER_SIZE;
+}
+
+static inline const uint8_t *img_view_corners(const ImgView *view,
+                                              int32_t index) {
+  return view->corners + (size_t)index * BLOCK_CORNERS_SIZE;
+}
+
+static inline const uint8_t *img_view_codes(const ImgView *view,
+                                            int32_t index) {
+  return view->codes + (size_t)index * BLOCK_CODES_SIZE;
+}
+
+/**
+ * @brief ビューから1ブロック分をBlockDataに展開する
+ */
+void img_view_get_block(const ImgView *view, int32_t index, BlockData *block);
+
 /**
  * @brief ImgData構造体のメモリを解放する
  * @param imgdata 解放する構造体へのポインタ
@@ -1,4 +1,3 @@
-#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,270 +9,1738 @@
 #include <arpa/inet.h>
 #endif
 
+#include "batch.h"
 #include "binfmt.h"
+#include "enckernel.h"
+#include "parallel.h"
+#include "pyramid.h"
+#include "ratectl.h"
+#include "rawio.h"
+#include "stats.h"
+#include "temporal.h"
+#include "tiled.h"
+#include "xzio.h"
 
 #define COMPRESS_LEVEL 16
+/* --target-sizeで書き出してみる最大の回数と、目標を下回ってよい割合 */
+#define RATECTL_PASSES 4
+#define RATECTL_TOLERANCE 0.03
 
 typedef struct {
-  double y, u, v;
-} YUV_Pixel;
+  const uint8_t *pixels;
+  size_t stride;
+  int width; /* 8の倍数に広げた幅 */
+  /* pixelsから読める範囲。外側のブロックは黒で埋めて符号化する */
+  int valid_width, valid_height;
+  bool repeat_edges; /* 黒ではなく端の画素を繰り返して埋める */
+  int compress_level;
+  encode_block_fn encode_block;
+  ImgPlanes *planes;
+  const int *levels; /* ブロックごとの圧縮レベル。NULLの場合はcompress_level */
+  RateControl *analyze; /* NULLでない場合は符号化せずに候補を調べる */
+} EncodeJob;
 
-void rgb_to_yuv_norm(uint8_t r, uint8_t g, uint8_t b, YUV_Pixel *yuv) {
-  yuv->y = 0.299 * r + 0.587 * g + 0.114 * b;
-  yuv->u = -0.169 * r - 0.331 * g + 0.5 * b + 128;
-  yuv->v = 0.5 * r - 0.419 * g - 0.081 * b + 128;
+/**
+ * @brief w x hの画素の右と下を、端の画素を繰り返してpadded_w x padded_hに広げる
+ * @note BINFMT_CHROMA420は2x2画素の色差を平均するので、黒で埋めると端の区画の
+ *       色が変わる。端の画素を繰り返せば、平均は画像の内側の画素だけのものになる
+ */
+static void extend_edges(uint8_t *pixels, size_t stride, int w, int h,
+                         int padded_w, int padded_h) {
+  for (int y = 0; y < h; y++) {
+    uint8_t *row = pixels + (size_t)y * stride;
+    for (int x = w; x < padded_w; x++) {
+      memcpy(row + x * 3, row + (w - 1) * 3, 3);
+    }
+  }
+  for (int y = h; y < padded_h; y++) {
+    memcpy(pixels + (size_t)y * stride, pixels + (size_t)(h - 1) * stride,
+           (size_t)padded_w * 3);
+  }
 }
 
-int pix_delta(int prev, int now, int max) {
-  if (now >= prev) {
-    return now - prev;
-  } else {
-    return max + now - prev;
+static void encode_block_row(void *ctx, int row) {
+  EncodeJob *job = (EncodeJob *)ctx;
+  int blocks_per_row = job->width / 8;
+  const uint8_t *src = job->pixels + (size_t)row * 8 * job->stride;
+  int32_t first = row * blocks_per_row;
+  int h = job->valid_height - row * 8;
+  for (int bx = 0; bx < blocks_per_row; bx++) {
+    const uint8_t *block = src + bx * 8 * 3;
+    size_t stride = job->stride;
+    int w = job->valid_width - bx * 8;
+    uint8_t edge[8 * 8 * 3];
+    if (w < 8 || h < 8) {
+      /* 埋めた画像を作らず、端のブロックだけをその場で広げる */
+      memset(edge, 0, sizeof(edge));
+      for (int y = 0; y < h && y < 8; y++) {
+        memcpy(edge + y * 8 * 3, block + (size_t)y * stride,
+               (size_t)(w < 8 ? w : 8) * 3);
+      }
+      if (job->repeat_edges) {
+        extend_edges(edge, 8 * 3, w < 8 ? w : 8, h < 8 ? h : 8, 8, 8);
+      }
+      block = edge;
+      stride = 8 * 3;
+    }
+    if (job->analyze) {
+      ratectl_analyze_block(job->analyze, first + bx, block, stride,
+                            w < 8 ? w : 8, h < 8 ? h : 8);
+      continue;
+    }
+    int level = job->levels ? job->levels[first + bx] : job->compress_level;
+    job->encode_block(block, stride, level,
+                      planes_header(job->planes, first + bx),
+                      planes_corners(job->planes, first + bx),
+                      planes_codes(job->planes, first + bx));
   }
 }
 
-void get_channel_stats(YUV_Pixel block[8][8], float channel, uint8_t *min_val,
-                       uint8_t *max_val, int *drange) {
-  double min_d = 256.0, max_d = -1.0;
-  for (int by = 0; by < 8; by++) {
-    for (int bx = 0; bx < 8; bx++) {
-      double val;
-      if (channel == 0)
-        val = block[by][bx].y;
-      else if (channel == 1)
-        val = block[by][bx].u;
-      else
-        val = block[by][bx].v;
-      min_d = fmin(min_d, val);
-      max_d = fmax(max_d, val);
+/**
+ * @brief ストリップの画素を上から順に用意する関数
+ * @param top 用意する最初の行
+ * @param rows 用意する行数。画像の下端を越える行は含まない
+ * @param pixels,stride 用意した画素の先頭と1行あたりのバイト数を返す
+ * @return 成功時0、失敗時-1
+ */
+typedef int (*strip_read_fn)(void *ctx, int top, int rows,
+                             const uint8_t **pixels, size_t *stride);
+
+/**
+ * @brief 一度に読むブロック行の数。スレッドごとに数行ずつ渡せる分だけまとめる
+ */
+static int strip_block_rows(int nthreads) {
+  return (nthreads > 1) ? nthreads * 4 : 1;
+}
+
+/**
+ * @brief 8行ずつreadで読み込みながら符号化し、writerに書き出す
+ * @param width,height 画素の寸法。8の倍数でない場合は端のブロックを黒で埋める
+ * @param repeat_edges 黒ではなく端の画素を繰り返して埋める
+ * @note 画像全体も全ブロックの面も持たないので、メモリ使用量は幅に比例する
+ */
+static int encode_strips(strip_read_fn read, void *src, int width, int height,
+                         bool repeat_edges, int compress_level,
+                         encode_block_fn encode_block, int nthreads,
+                         BinfmtWriter *writer, Stats *stats) {
+  int padded_width = (width + 7) / 8 * 8;
+  int blocks_per_row = padded_width / 8;
+  int block_rows = (height + 7) / 8;
+  int rows_per_batch = strip_block_rows(nthreads);
+
+  ImgPlanes *strip = alloc_imgplanes(padded_width, block_rows * 8,
+                                     blocks_per_row * rows_per_batch);
+  if (!strip) {
+    fprintf(stderr, "Memory allocation failed for strip buffers.\n");
+    return 1;
+  }
+
+  int result = 0;
+  for (int row = 0; row < block_rows; row += rows_per_batch) {
+    int nrows = block_rows - row;
+    if (nrows > rows_per_batch) {
+      nrows = rows_per_batch;
     }
+    int top = row * 8;
+    int rows = height - top < nrows * 8 ? height - top : nrows * 8;
+    const uint8_t *pixels;
+    size_t stride;
+    StatsTimer timer = stats_timer_start(stats);
+    if (read(src, top, rows, &pixels, &stride) != 0) {
+      result = 1;
+      break;
+    }
+    stats_timer_stop(stats, "load", &timer);
+    timer = stats_timer_start(stats);
+    EncodeJob job = {pixels,
+                     stride,
+                     padded_width,
+                     width,
+                     rows,
+                     repeat_edges,
+                     compress_level,
+                     encode_block,
+                     strip,
+                     NULL,
+                     NULL};
+    parallel_for_rows(nrows, nthreads, encode_block_row, &job);
+    stats_timer_stop(stats, "encode", &timer);
+    /* 最後のストリップは行数が少ないので、書き出すブロック数だけを合わせる */
+    strip->block_count = nrows * blocks_per_row;
+    stats_add_blocks(stats, strip->headers, strip->block_count);
+    timer = stats_timer_start(stats);
+    if (binfmt_writer_write_planes(writer, strip) != 0) {
+      result = 1;
+      break;
+    }
+    stats_timer_stop(stats, "write", &timer);
   }
-  *max_val = ceil(max_d);
-  *min_val = floor(min_d);
-  *drange = *max_val - *min_val;
+
+  free_imgplanes(strip);
+  return result;
 }
 
-int main(int argc, char *argv[]) {
-  if (VIPS_INIT(argv[0])) {
-    vips_error_exit(NULL);
+static int read_region_strip(void *ctx, int top, int rows,
+                             const uint8_t **pixels, size_t *stride) {
+  VipsRegion *region = (VipsRegion *)ctx;
+  VipsRect rect = {0, top, vips_image_get_width(region->im), rows};
+  if (vips_region_prepare(region, &rect) != 0) {
+    fprintf(stderr, "Failed to read rows %d-%d: %s\n", rect.top,
+            rect.top + rect.height - 1, vips_error_buffer());
+    return -1;
   }
+  *pixels = VIPS_REGION_ADDR(region, 0, top);
+  *stride = VIPS_REGION_LSKIP(region);
+  return 0;
+}
 
-#ifdef _WIN32
-  WSADATA wsaData;
-  if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
-    fprintf(stderr, "WSAStartup failed.\n");
+typedef struct {
+  RawStream *stream;
+  uint8_t *pixels; /* strip_block_rows分の行を置く領域 */
+} RawStrip;
+
+static int read_raw_strip(void *ctx, int top, int rows,
+                          const uint8_t **pixels, size_t *stride) {
+  RawStrip *strip = (RawStrip *)ctx;
+  (void)top;
+  *pixels = strip->pixels;
+  *stride = (size_t)strip->stream->width * 3;
+  return rawio_stream_read(strip->stream, strip->pixels, rows);
+}
+
+/**
+ * @brief 出力先のライタを開く。xzの場合は圧縮しながら書き出す
+ * @param xz_writer xzの場合に開いたライタを返す。それ以外はNULL
+ */
+static BinfmtWriter *open_output(FILE *out, BinfmtFormat format, bool xz,
+                                 int nthreads, int width, int height,
+                                 XzWriter **xz_writer) {
+  int32_t block_count = (width / 8) * (height / 8);
+  *xz_writer = NULL;
+  if (!xz) {
+    return binfmt_writer_open(out, format, width, height, block_count);
+  }
+  *xz_writer = xz_writer_open(out, nthreads, binfmt_file_size(block_count));
+  if (!*xz_writer) {
+    return NULL;
+  }
+  BinfmtWriter *writer = binfmt_writer_open_sink(
+      xz_writer_write, *xz_writer, format, width, height, block_count);
+  if (!writer) {
+    xz_writer_abort(*xz_writer);
+    *xz_writer = NULL;
+  }
+  return writer;
+}
+
+/**
+ * @brief open_outputで開いたライタを閉じる
+ * @param result それまでの処理の結果。0以外なら出力を完了せずに解放する
+ * @return 成功時0、失敗時1
+ */
+static int close_output(BinfmtWriter *writer, XzWriter *xz_writer,
+                        int result) {
+  if (result != 0) {
+    binfmt_writer_abort(writer);
+    xz_writer_abort(xz_writer);
     return 1;
   }
-#endif
+  if (binfmt_writer_close(writer) != 0) {
+    xz_writer_abort(xz_writer);
+    return 1;
+  }
+  if (xz_writer && xz_writer_close(xz_writer) != 0) {
+    return 1;
+  }
+  return 0;
+}
+
+static int encode_stream(VipsImage *image, int compress_level,
+                         encode_block_fn encode_block, int nthreads,
+                         FILE *out, BinfmtFormat format, bool xz,
+                         Stats *stats) {
+  int width = vips_image_get_width(image);
+  int height = vips_image_get_height(image);
+  VipsRegion *region = vips_region_new(image);
+  if (!region) {
+    fprintf(stderr, "Memory allocation failed for strip buffers.\n");
+    return 1;
+  }
+  XzWriter *xz_writer;
+  BinfmtWriter *writer =
+      open_output(out, format, xz, nthreads, width, height, &xz_writer);
+  if (!writer) {
+    g_object_unref(region);
+    return 1;
+  }
+  int result = encode_strips(read_region_strip, region, width, height,
+                             format == BINFMT_CHROMA420, compress_level,
+                             encode_block, nthreads, writer, stats);
+  StatsTimer timer = stats_timer_start(stats);
+  result = close_output(writer, xz_writer, result);
+  stats_timer_stop(stats, "write", &timer);
+  g_object_unref(region);
+  return result;
+}
 
-  if (argc < 3) {
-    fprintf(stderr, "Usage: %s [compress_level] <input_file> <output_file>\n",
-            argv[0]);
+/**
+ * @brief 直接読む画素を上から順に読みながら符号化する
+ * @note 標準入力でも全体を読まないので、メモリ使用量は幅に比例する
+ */
+static int encode_raw_stream(RawStream *stream, int compress_level,
+                             encode_block_fn encode_block, int nthreads,
+                             FILE *out, BinfmtFormat format, bool xz,
+                             Stats *stats) {
+  RawStrip strip = {stream,
+                    (uint8_t *)malloc((size_t)stream->width * 3 * 8 *
+                                      strip_block_rows(nthreads))};
+  if (!strip.pixels) {
+    fprintf(stderr, "Memory allocation failed for strip buffers.\n");
+    return 1;
+  }
+  XzWriter *xz_writer;
+  BinfmtWriter *writer = open_output(
+      out, format, xz, nthreads, (stream->width + 7) / 8 * 8,
+      (stream->height + 7) / 8 * 8, &xz_writer);
+  if (!writer) {
+    free(strip.pixels);
     return 1;
   }
+  int result = encode_strips(read_raw_strip, &strip, stream->width,
+                             stream->height, format == BINFMT_CHROMA420,
+                             compress_level, encode_block, nthreads, writer,
+                             stats);
+  StatsTimer timer = stats_timer_start(stats);
+  result = close_output(writer, xz_writer, result);
+  stats_timer_stop(stats, "write", &timer);
+  free(strip.pixels);
+  return result;
+}
+
+/**
+ * @brief 全ブロックの面を書き出す
+ * @return 成功時0、失敗時-1
+ * @note 面をそのまま並べる形式は面ごとに一度で書く。xzの場合は面ごとに
+ *       圧縮器へ流し込む
+ */
+static int write_planes(const ImgPlanes *planes, FILE *out,
+                        BinfmtFormat format, bool xz, int nthreads) {
+  if (format == BINFMT_PLANAR && !xz) {
+    return planes_write_file(planes, out);
+  }
+  if (format == BINFMT_PLANAR) {
+    XzWriter *xz_writer =
+        xz_writer_open(out, nthreads, binfmt_file_size(planes->block_count));
+    if (!xz_writer) {
+      return -1;
+    }
+    if (planes_write_sink(planes, xz_writer_write, xz_writer) != 0) {
+      xz_writer_abort(xz_writer);
+      return -1;
+    }
+    return xz_writer_close(xz_writer);
+  }
+
+  XzWriter *xz_writer;
+  BinfmtWriter *writer = open_output(out, format, xz, nthreads, planes->width,
+                                     planes->height, &xz_writer);
+  if (!writer) {
+    return -1;
+  }
+  int result = binfmt_writer_write_planes(writer, planes);
+  return close_output(writer, xz_writer, result) == 0 ? 0 : -1;
+}
+
+/**
+ * @brief 1タイル分の出力をメモリに溜めるFILEを開く
+ */
+static FILE *tile_buffer_open(char **buf, size_t *size) {
+#ifdef _WIN32
+  (void)buf;
+  (void)size;
+  return tmpfile();
+#else
+  return open_memstream(buf, size);
+#endif
+}
+
+/**
+ * @brief tile_buffer_openで開いたFILEを閉じ、溜めた内容を*bufに返す
+ * @return 成功時0、失敗時-1
+ */
+static int tile_buffer_close(FILE *file, char **buf, size_t *size) {
+#ifdef _WIN32
+  long len = ftell(file);
+  *buf = len >= 0 ? (char *)malloc(len ? len : 1) : NULL;
+  *size = len >= 0 ? (size_t)len : 0;
+  int result = (*buf && fseek(file, 0, SEEK_SET) == 0 &&
+                fread(*buf, 1, *size, file) == *size)
+                   ? 0
+                   : -1;
+  fclose(file);
+  return result;
+#else
+  /* open_memstreamは閉じたときに*bufと*sizeを確定させる */
+  (void)buf;
+  (void)size;
+  return fclose(file) == 0 ? 0 : -1;
+#endif
+}
 
-  int compress_level = (argc > 3) ? atoi(argv[1]) : COMPRESS_LEVEL;
-  const char *input_file = (argc > 3) ? argv[2] : argv[1];
-  const char *output_file = (argc > 3) ? argv[3] : argv[2];
+/**
+ * @brief write_planesで書き出すバイト列をメモリ上に作る
+ * @param buf 作ったバイト列を返す。freeで解放する
+ * @return 成功時0、失敗時-1
+ */
+static int write_planes_mem(const ImgPlanes *planes, BinfmtFormat format,
+                            bool xz, int nthreads, char **buf, size_t *size) {
+  *buf = NULL;
+  /* 面をそのまま並べる形式はバッファに直接書ける。writevはFILEのメモリ
+   * ストリームには使えないので、それ以外はwrite_planesに任せる */
+  if (format == BINFMT_PLANAR && !xz) {
+    planes_to_buf(planes, buf, size);
+    return *buf ? 0 : -1;
+  }
+  FILE *mem = tile_buffer_open(buf, size);
+  if (!mem) {
+    return -1;
+  }
+  int result = write_planes(planes, mem, format, xz, nthreads);
+  if (tile_buffer_close(mem, buf, size) != 0) {
+    result = -1;
+  }
+  return result;
+}
 
+typedef struct {
   VipsImage *image;
-  if (strcmp(input_file, "-") == 0) {
-    fprintf(stderr, "Reading from stdin is not supported in this C version.\n");
-    return 1;
+  int compress_level;
+  encode_block_fn encode_block;
+  BinfmtFormat format;
+  bool xz;
+  uint32_t tile_size;
+  uint32_t tiles_x;
+  uint32_t first;
+  Stats *stats;
+  /* first番目から順に、各タイルを符号化した結果 */
+  char **bufs;
+  size_t *sizes;
+  int *results;
+} TileJob;
+
+/**
+ * @brief first+k番目のタイルを読み込んで符号化し、メモリ上の形式にする
+ */
+static void encode_tile(void *ctx, int k) {
+  TileJob *job = (TileJob *)ctx;
+  uint32_t index = job->first + k;
+  int x = index % job->tiles_x * job->tile_size;
+  int y = index / job->tiles_x * job->tile_size;
+  int w = vips_image_get_width(job->image) - x;
+  int h = vips_image_get_height(job->image) - y;
+  w = w < (int)job->tile_size ? w : (int)job->tile_size;
+  h = h < (int)job->tile_size ? h : (int)job->tile_size;
+
+  job->bufs[k] = NULL;
+  job->results[k] = -1;
+  VipsRegion *region = vips_region_new(job->image);
+  ImgPlanes *planes = alloc_imgplanes(w, h, (w / 8) * (h / 8));
+  VipsRect rect = {x, y, w, h};
+  if (!region || !planes) {
+    fprintf(stderr, "Memory allocation failed for tile %u.\n", index);
+  } else if (vips_region_prepare(region, &rect) != 0) {
+    fprintf(stderr, "Failed to read tile %u: %s\n", index,
+            vips_error_buffer());
   } else {
-    if (!(image = vips_image_new_from_file(input_file, NULL))) {
-      vips_error_exit(NULL);
+    EncodeJob encode_job = {VIPS_REGION_ADDR(region, x, y),
+                            VIPS_REGION_LSKIP(region),
+                            w,
+                            w,
+                            h,
+                            job->format == BINFMT_CHROMA420,
+                            job->compress_level,
+                            job->encode_block,
+                            planes,
+                            NULL,
+                            NULL};
+    for (int row = 0; row < h / 8; row++) {
+      encode_block_row(&encode_job, row);
     }
+    stats_add_blocks(job->stats, planes->headers, planes->block_count);
+    /* タイル同士を並列に処理するので、xzはタイルごとに1スレッドで圧縮する */
+    job->results[k] = write_planes_mem(planes, job->format, job->xz, 1,
+                                       &job->bufs[k], &job->sizes[k]);
   }
+  free_imgplanes(planes);
+  if (region) {
+    g_object_unref(region);
+  }
+}
+
+/**
+ * @brief 画像をタイルに分けて符号化し、タイル形式で書き出す
+ * @note nthreads個ずつのタイルを並列に符号化し、順に書き出す
+ * @return 成功時0、失敗時1
+ */
+static int encode_tiles(VipsImage *image, int compress_level,
+                        encode_block_fn encode_block, int nthreads,
+                        FILE *out, BinfmtFormat format, bool xz,
+                        uint32_t tile_size, Stats *stats) {
+  uint32_t width = vips_image_get_width(image);
+  uint32_t height = vips_image_get_height(image);
+  TiledWriter *writer = tiled_writer_open(out, width, height, tile_size);
+  if (!writer) {
+    return 1;
+  }
+  uint32_t tiles_x = tiled_tiles_across(width, tile_size);
+  uint32_t tile_count = tiles_x * tiled_tiles_across(height, tile_size);
+  int batch = nthreads > 1 ? nthreads : 1;
+  char **bufs = (char **)calloc(batch, sizeof(char *));
+  size_t *sizes = (size_t *)calloc(batch, sizeof(size_t));
+  int *results = (int *)calloc(batch, sizeof(int));
+  if (!bufs || !sizes || !results) {
+    fprintf(stderr, "Memory allocation failed for tile buffers.\n");
+    free(bufs);
+    free(sizes);
+    free(results);
+    tiled_writer_abort(writer);
+    return 1;
+  }
+
+  int result = 0;
+  for (uint32_t first = 0; first < tile_count && result == 0;
+       first += batch) {
+    int n = tile_count - first < (uint32_t)batch ? (int)(tile_count - first)
+                                                 : batch;
+    TileJob job = {image, compress_level, encode_block, format, xz, tile_size,
+                   tiles_x, first, stats, bufs, sizes, results};
+    /* タイルごとの読み込みと符号化は並列に重なるので、まとめて計る */
+    StatsTimer timer = stats_timer_start(stats);
+    parallel_for_rows(n, nthreads, encode_tile, &job);
+    stats_timer_stop(stats, "encode", &timer);
+    timer = stats_timer_start(stats);
+    for (int k = 0; k < n; k++) {
+      if (result == 0 &&
+          (results[k] != 0 ||
+           tiled_writer_add(writer, bufs[k], sizes[k]) != 0)) {
+        result = 1;
+      }
+      free(bufs[k]);
+      bufs[k] = NULL;
+    }
+    stats_timer_stop(stats, "write", &timer);
+  }
+  free(bufs);
+  free(sizes);
+  free(results);
+  if (result != 0) {
+    tiled_writer_abort(writer);
+    return 1;
+  }
+  return tiled_writer_close(writer) == 0 ? 0 : 1;
+}
+
+typedef struct {
+  int compress_level;
+  encode_block_fn encode_block;
+  int nthreads;
+  bool stream;
+  bool xz;
+  int tile_size;
+  BinfmtFormat format;
+  Stats *stats; /* --statsの計測値。NULLの場合は計測しない */
+  int raw_width, raw_height; /* --raw WxH。0の場合はヘッダから読む */
+  /* --target-sizeと--target-psnr。0の場合はcompress_levelをそのまま使う */
+  double target_size, target_psnr;
+  bool pyramid; /* --pyramid。縮小した全ての段を一つのファイルに書き出す */
+} EncodeOptions;
+
+/* 幅と高さを8の倍数に広げる方法 */
+typedef enum {
+  PAD_BLACK,  /* 黒で埋める */
+  PAD_REPEAT, /* 端の画素を繰り返す */
+  PAD_NONE,   /* 広げずに、端のブロックを符号化するときに埋める */
+} PadMode;
+
+/**
+ * @brief 出力の形式に合わせて広げ方を選ぶ
+ * @note --pyramidは元の寸法から縮小するので広げない。BINFMT_CHROMA420は
+ *       2x2画素の色差を平均するので、端の画素を繰り返す
+ */
+static PadMode pad_mode(const EncodeOptions *opts) {
+  if (opts->pyramid) {
+    return PAD_NONE;
+  }
+  return opts->format == BINFMT_CHROMA420 ? PAD_REPEAT : PAD_BLACK;
+}
 
+/**
+ * @brief 画像をRGBの8ビットで幅と高さが8の倍数になるように整える
+ * @param image 整える画像。参照は引き取る
+ * @param pad 8の倍数に広げる方法
+ * @return 整えた画像、失敗した場合はNULL
+ */
+static VipsImage *prepare_image(VipsImage *image, const char *input_file,
+                                PadMode pad) {
   int width = vips_image_get_width(image);
   int height = vips_image_get_height(image);
-  int bands = vips_image_get_bands(image);
+  VipsImage *temp = NULL;
+  int result = 0;
 
-  if (bands == 4) {
+  if (vips_image_get_bands(image) == 4) {
     fprintf(stderr, "Alpha channel detected, extracting RGB bands.\n");
-    VipsImage *temp;
-    if (vips_extract_band(image, &temp, 0, "n", 3, NULL) != 0) {
-      vips_error_exit(NULL);
-    }
+    result = vips_extract_band(image, &temp, 0, "n", 3, NULL);
     g_object_unref(image);
     image = temp;
-    bands = vips_image_get_bands(image);
   }
 
   int pad_right = (8 - (width % 8)) % 8;
   int pad_bottom = (8 - (height % 8)) % 8;
 
-  if (pad_right > 0 || pad_bottom > 0) {
-    VipsImage *temp;
-    if (vips_embed(image, &temp, 0, 0, width + pad_right, height + pad_bottom,
-                   "extend", VIPS_EXTEND_BLACK, NULL) != 0) {
-      vips_error_exit(NULL);
+  if (result == 0 && pad != PAD_NONE && (pad_right > 0 || pad_bottom > 0)) {
+    result = vips_embed(image, &temp, 0, 0, width + pad_right,
+                        height + pad_bottom, "extend",
+                        pad == PAD_REPEAT ? VIPS_EXTEND_COPY
+                                          : VIPS_EXTEND_BLACK,
+                        NULL);
+    g_object_unref(image);
+    image = temp;
+    if (result == 0) {
+      fprintf(stderr, "Extended to %dx%d\n", vips_image_get_width(image),
+              vips_image_get_height(image));
     }
+  }
+
+  if (result == 0) {
+    result = vips_cast(image, &temp, VIPS_FORMAT_UCHAR, NULL);
     g_object_unref(image);
     image = temp;
+  }
+  if (result != 0) {
+    fprintf(stderr, "Could not convert %s: %s\n", input_file,
+            vips_error_buffer());
+    vips_error_clear();
+    return NULL;
+  }
+  return image;
+}
+
+/**
+ * @brief 画像を読み込み、prepare_imageで整える
+ * @return 整えた画像、失敗した場合はNULL
+ */
+static VipsImage *load_image(const char *input_file, bool stream,
+                             PadMode pad) {
+  VipsImage *image = vips_image_new_from_file(
+      input_file, "access",
+      stream ? VIPS_ACCESS_SEQUENTIAL : VIPS_ACCESS_RANDOM, NULL);
+  if (!image) {
+    fprintf(stderr, "Could not load %s: %s\n", input_file,
+            vips_error_buffer());
+    vips_error_clear();
+    return NULL;
+  }
+  return prepare_image(image, input_file, pad);
+}
+
+/**
+ * @brief PPM/PAMやヘッダなしのRGBをlibvipsを通さずに読む
+ * @param raw 読んだ画像を返す。libvipsで読むべき場合はNULLのまま
+ * @param stream NULLでなく--streamの場合は、全体を読まずにヘッダだけを読んだ
+ *               リーダを返し、rawはNULLのまま
+ * @return 成功時またはlibvipsで読むべき場合0、失敗時1
+ */
+static int open_native(const char *input_file, const EncodeOptions *opts,
+                       RawImage **raw, RawStream **stream) {
+  *raw = NULL;
+  if (stream) {
+    *stream = NULL;
+  }
+  RawFormat format = RAWIO_PPM;
+  bool is_stdin = strcmp(input_file, "-") == 0;
+  if (opts->raw_width <= 0 && !is_stdin &&
+      !rawio_format_from_name(input_file, &format)) {
+    return 0;
+  }
+  if (opts->raw_width <= 0 && format == RAWIO_RAW) {
+    fprintf(stderr, "--raw WxH is required to read %s.\n", input_file);
+    return 1;
+  }
+  bool unsupported;
+  if (stream && opts->stream) {
+    *stream = rawio_stream_open(input_file, opts->raw_width,
+                                opts->raw_height, &unsupported);
+    if (*stream) {
+      return 0;
+    }
+  } else {
+    *raw = rawio_open(input_file, opts->raw_width, opts->raw_height,
+                      &unsupported);
+    if (*raw) {
+      return 0;
+    }
+  }
+  /* 扱えない種類のPNMファイルはlibvipsに任せる */
+  if (unsupported && !is_stdin) {
+    fprintf(stderr, "Reading %s with libvips instead.\n", input_file);
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * @brief 目標に合わせてブロックごとにレベルを選んで符号化し、書き出す
+ * @param job 符号化する画素と面。levelsとanalyzeはここで設定する
+ * @note 候補を調べるのは一度だけ。バイト数が目標の場合は、選んだレベルで
+ *       メモリ上に書き出した実際のバイト数で見積もりを補正しながら、
+ *       最大RATECTL_PASSES回まで選び直す
+ * @return 成功時0、失敗時1
+ */
+static int encode_rate_controlled(EncodeJob *job, int block_rows,
+                                  const EncodeOptions *opts, FILE *out_file,
+                                  bool xz) {
+  int32_t count = job->planes->block_count;
+  RateControl *rc = ratectl_new(count, job->encode_block,
+                                opts->format == BINFMT_SPARSE && !xz);
+  int *levels = (int *)malloc(sizeof(int) * (count ? count : 1) * 2);
+  if (!rc || !levels) {
+    fprintf(stderr, "Memory allocation failed for rate control.\n");
+    ratectl_free(rc);
+    free(levels);
+    return 1;
+  }
+  int *best_levels = levels + count;
+
+  StatsTimer timer = stats_timer_start(opts->stats);
+  job->analyze = rc;
+  parallel_for_rows(block_rows, opts->nthreads, encode_block_row, job);
+  job->analyze = NULL;
+  job->levels = levels;
+  stats_timer_stop(opts->stats, "analyze", &timer);
+
+  int result = 0;
+  RateEstimate est;
+  if (opts->target_size <= 0) {
+    est = ratectl_choose_psnr(rc, opts->target_psnr, levels);
+    if (est.psnr < opts->target_psnr) {
+      fprintf(stderr, "Target PSNR is out of reach, using the best levels.\n");
+    }
+    timer = stats_timer_start(opts->stats);
+    parallel_for_rows(block_rows, opts->nthreads, encode_block_row, job);
+    stats_timer_stop(opts->stats, "encode", &timer);
+    timer = stats_timer_start(opts->stats);
+    result = write_planes(job->planes, out_file, opts->format, xz,
+                          opts->nthreads) == 0
+                 ? 0
+                 : 1;
+    stats_timer_stop(opts->stats, "write", &timer);
+    fprintf(stderr, "Rate control: estimated PSNR %.2f dB.\n", est.psnr);
+  } else {
+    /* 見積もりは実際のバイト数とずれるので、比で目標を補正して選び直す */
+    double budget = opts->target_size;
+    char *best = NULL;
+    size_t best_size = 0;
+    RateEstimate best_est = {0, 0};
+    int pass;
+    for (pass = 0; pass < RATECTL_PASSES && result == 0; pass++) {
+      est = ratectl_choose_bytes(rc, budget, levels);
+      if (best && memcmp(best_levels, levels, sizeof(int) * count) == 0) {
+        /* 補正しても選び方が変わらなければ、書き出したものと同じになる */
+        break;
+      }
+      timer = stats_timer_start(opts->stats);
+      parallel_for_rows(block_rows, opts->nthreads, encode_block_row, job);
+      stats_timer_stop(opts->stats, "encode", &timer);
+      timer = stats_timer_start(opts->stats);
+      char *buf;
+      size_t size = 0;
+      result = write_planes_mem(job->planes, opts->format, xz,
+                                opts->nthreads, &buf, &size);
+      stats_timer_stop(opts->stats, "write", &timer);
+      if (result != 0) {
+        free(buf);
+        break;
+      }
+      /* 目標以下で最大のもの、目標以下がなければ最小のものを残す */
+      bool fits = size <= opts->target_size;
+      bool best_fits = best && best_size <= opts->target_size;
+      if (!best || (fits && (!best_fits || size > best_size)) ||
+          (!fits && !best_fits && size < best_size)) {
+        free(best);
+        best = buf;
+        best_size = size;
+        best_est = est;
+        memcpy(best_levels, levels, sizeof(int) * count);
+      } else {
+        free(buf);
+      }
+      if (fits && size >= opts->target_size * (1 - RATECTL_TOLERANCE)) {
+        pass++;
+        break;
+      }
+      budget = est.bytes * opts->target_size / (size ? size : 1);
+    }
+    if (result == 0) {
+      if (best_size > opts->target_size) {
+        fprintf(stderr, "Target size is out of reach, using the smallest "
+                        "levels.\n");
+      }
+      fprintf(stderr,
+              "Rate control: %d passes, %zu bytes, estimated PSNR %.2f "
+              "dB.\n",
+              pass, best_size, best_est.psnr);
+      timer = stats_timer_start(opts->stats);
+      result = fwrite(best, 1, best_size, out_file) == best_size ? 0 : 1;
+      stats_timer_stop(opts->stats, "write", &timer);
+      if (memcmp(best_levels, levels, sizeof(int) * count) != 0) {
+        /* --statsで数えるヘッダ面を書き出したものに合わせる */
+        memcpy(levels, best_levels, sizeof(int) * count);
+        parallel_for_rows(block_rows, opts->nthreads, encode_block_row, job);
+      }
+    }
+    free(best);
+  }
+  stats_add_blocks(opts->stats, job->planes->headers, count);
+
+  job->levels = NULL;
+  free(levels);
+  ratectl_free(rc);
+  return result == 0 ? 0 : 1;
+}
+
+/**
+ * @brief メモリ上の画素を全ブロックの面に符号化して書き出す
+ * @param width,height pixelsの寸法。8の倍数でない場合は端のブロックを黒で埋める
+ * @param planes_cache 使い回すImgPlanes。NULLの場合は毎回確保して解放する
+ * @return 成功時0、失敗時1
+ */
+static int encode_pixels(const uint8_t *pixels, size_t stride, int width,
+                         int height, const EncodeOptions *opts,
+                         FILE *out_file, bool xz, ImgPlanes **planes_cache) {
+  int padded_width = (width + 7) / 8 * 8;
+  int padded_height = (height + 7) / 8 * 8;
+  ImgPlanes *planes = reuse_imgplanes(
+      planes_cache ? *planes_cache : NULL, padded_width, padded_height,
+      (padded_width / 8) * (padded_height / 8));
+  if (!planes) {
+    if (planes_cache) {
+      *planes_cache = NULL;
+    }
+    return 1;
+  }
+
+  EncodeJob job = {pixels,
+                   stride,
+                   padded_width,
+                   width,
+                   height,
+                   opts->format == BINFMT_CHROMA420,
+                   opts->compress_level,
+                   opts->encode_block,
+                   planes,
+                   NULL,
+                   NULL};
+  int result;
+  if (opts->target_size > 0 || opts->target_psnr > 0) {
+    result = encode_rate_controlled(&job, padded_height / 8, opts, out_file,
+                                    xz);
+  } else {
+    StatsTimer timer = stats_timer_start(opts->stats);
+    parallel_for_rows(padded_height / 8, opts->nthreads, encode_block_row,
+                      &job);
+    stats_timer_stop(opts->stats, "encode", &timer);
+    stats_add_blocks(opts->stats, planes->headers, planes->block_count);
+
+    timer = stats_timer_start(opts->stats);
+    result =
+        write_planes(planes, out_file, opts->format, xz, opts->nthreads) == 0
+            ? 0
+            : 1;
+    stats_timer_stop(opts->stats, "write", &timer);
+  }
+
+  if (planes_cache) {
+    *planes_cache = planes;
+  } else {
+    free_imgplanes(planes);
+  }
+  return result;
+}
+
+typedef struct {
+  const uint8_t *src;
+  size_t stride;
+  int src_width, src_height;
+  uint8_t *dst; /* 詰めて並べた(src_width + 1) / 2幅の画素 */
+  int dst_width;
+} HalveJob;
+
+/**
+ * @brief 2x2の平均で1行縮小する。奇数の寸法では端の画素を繰り返す
+ */
+static void halve_row(void *ctx, int y) {
+  HalveJob *job = (HalveJob *)ctx;
+  const uint8_t *row0 = job->src + (size_t)y * 2 * job->stride;
+  const uint8_t *row1 = y * 2 + 1 < job->src_height ? row0 + job->stride : row0;
+  uint8_t *out = job->dst + (size_t)y * job->dst_width * 3;
+  for (int x = 0; x < job->dst_width; x++) {
+    int x0 = x * 2 * 3;
+    int x1 = x * 2 + 1 < job->src_width ? x0 + 3 : x0;
+    for (int c = 0; c < 3; c++) {
+      out[x * 3 + c] = (uint8_t)((row0[x0 + c] + row0[x1 + c] +
+                                  row1[x0 + c] + row1[x1 + c] + 2) >>
+                                 2);
+    }
+  }
+}
+
+/**
+ * @brief 段を一つ符号化し、メモリ上の.binにする
+ * @param planes 使い回すImgPlanes。寸法に合わせて確保し直す
+ * @param buf,len 書き出したバイト列を返す。freeで解放する
+ * @return 成功時0、失敗時1
+ */
+static int encode_pyramid_level(const uint8_t *src, size_t stride, int w, int h,
+                                const EncodeOptions *opts, bool xz,
+                                ImgPlanes **planes, char **buf, size_t *len) {
+  int padded_width = (w + 7) / 8 * 8;
+  int padded_height = (h + 7) / 8 * 8;
+  *planes = reuse_imgplanes(*planes, padded_width, padded_height,
+                            (padded_width / 8) * (padded_height / 8));
+  if (!*planes) {
+    return 1;
+  }
+  EncodeJob job = {src,
+                   stride,
+                   padded_width,
+                   w,
+                   h,
+                   opts->format == BINFMT_CHROMA420,
+                   opts->compress_level,
+                   opts->encode_block,
+                   *planes,
+                   NULL,
+                   NULL};
+  StatsTimer timer = stats_timer_start(opts->stats);
+  parallel_for_rows(padded_height / 8, opts->nthreads, encode_block_row, &job);
+  stats_timer_stop(opts->stats, "encode", &timer);
+  stats_add_blocks(opts->stats, (*planes)->headers, (*planes)->block_count);
+
+  timer = stats_timer_start(opts->stats);
+  if (write_planes_mem(*planes, opts->format, xz, opts->nthreads, buf, len) !=
+      0) {
+    free(*buf);
+    return 1;
+  }
+  stats_timer_stop(opts->stats, "write", &timer);
+  return 0;
+}
+
+/**
+ * @brief 1/2ずつ縮小した全ての段を符号化し、段の形式で書き出す
+ * @param width,height pixelsの寸法。8の倍数でない場合は端のブロックを埋める
+ * @note 読み込んだ画素から順に縮小するので、画像を読むのは一度だけ。
+ *       幅と高さがどちらも8以下になった段で終える。8の倍数に広げた寸法が
+ *       INT16_MAXを超える段は一つの.binに収まらないので書かず、収まる段から
+ *       書き始める
+ * @return 成功時0、失敗時1
+ */
+static int encode_pyramid(const uint8_t *pixels, size_t stride, int width,
+                          int height, const EncodeOptions *opts,
+                          FILE *out_file, bool xz) {
+  /* 書く段の寸法はINT16_MAX以下なので、16段を超えることはない */
+  PyramidLevel levels[16];
+  char *bufs[16];
+  uint32_t count = 0;
+  /* 縮小した画素は二つの領域に交互に書く */
+  size_t scaled_size = (size_t)((width + 1) / 2) * ((height + 1) / 2) * 3;
+  uint8_t *scaled[2] = {(uint8_t *)malloc(scaled_size ? scaled_size : 1),
+                        (uint8_t *)malloc(scaled_size ? scaled_size : 1)};
+  ImgPlanes *planes = NULL;
+  int result = 0;
+  if (!scaled[0] || !scaled[1]) {
+    fprintf(stderr, "Memory allocation failed for pyramid levels.\n");
+    result = 1;
+  }
+
+  const uint8_t *src = pixels;
+  int w = width, h = height;
+  int halvings = 0, skipped = 0;
+  while (result == 0) {
+    if ((w + 7) / 8 * 8 > INT16_MAX || (h + 7) / 8 * 8 > INT16_MAX) {
+      skipped++;
+    } else {
+      size_t len = 0;
+      if (encode_pyramid_level(src, stride, w, h, opts, xz, &planes,
+                               &bufs[count], &len) != 0) {
+        result = 1;
+        break;
+      }
+      levels[count].width = (uint32_t)w;
+      levels[count].height = (uint32_t)h;
+      levels[count].data = bufs[count];
+      levels[count].len = len;
+      count++;
+    }
+    if (w <= 8 && h <= 8) {
+      break;
+    }
+
+    StatsTimer timer = stats_timer_start(opts->stats);
+    HalveJob halve = {src, stride, w, h, scaled[halvings++ % 2], (w + 1) / 2};
+    parallel_for_rows((h + 1) / 2, opts->nthreads, halve_row, &halve);
+    stats_timer_stop(opts->stats, "scale", &timer);
+    src = halve.dst;
+    w = halve.dst_width;
+    h = (h + 1) / 2;
+    stride = (size_t)w * 3;
+  }
+
+  if (result == 0) {
+    if (skipped > 0) {
+      fprintf(stderr, "Skipped %d levels larger than %d px, starting at "
+                      "%ux%u.\n",
+              skipped, INT16_MAX, levels[0].width, levels[0].height);
+    }
+    StatsTimer timer = stats_timer_start(opts->stats);
+    result = pyramid_write(out_file, count, levels) == 0 ? 0 : 1;
+    stats_timer_stop(opts->stats, "write", &timer);
+    fprintf(stderr, "Wrote %u levels down to %dx%d.\n", count, w, h);
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    free(bufs[i]);
+  }
+  free_imgplanes(planes);
+  free(scaled[0]);
+  free(scaled[1]);
+  return result;
+}
+
+/**
+ * @brief 1つのファイルを符号化して書き出す
+ * @param planes_cache 使い回すImgPlanes。NULLの場合は毎回確保して解放する
+ * @return 成功時0、失敗時1
+ */
+static int encode_file(const char *input_file, const char *output_file,
+                       const EncodeOptions *opts, ImgPlanes **planes_cache) {
+  size_t output_len = strlen(output_file);
+  bool xz = opts->xz ||
+            (output_len > 3 && strcmp(output_file + output_len - 3, ".xz") == 0);
+  int tile_size = opts->tile_size;
+  Stats *stats = opts->stats;
+
+  StatsTimer timer = stats_timer_start(stats);
+  RawImage *raw;
+  RawStream *raw_stream;
+  if (open_native(input_file, opts, &raw, &raw_stream) != 0) {
+    return 1;
+  }
+  /* 直接読んだ画素は端のブロックを符号化するときに埋める */
+  int width = 0, height = 0;
+  if (raw) {
+    width = (raw->width + 7) / 8 * 8;
+    height = (raw->height + 7) / 8 * 8;
+  } else if (raw_stream) {
+    width = (raw_stream->width + 7) / 8 * 8;
+    height = (raw_stream->height + 7) / 8 * 8;
+  }
+  /* 一つの面にまとめた形式は寸法をint16_tで持つので、超える場合はタイルに分ける。
+   * --pyramidは収まらない段を書かずに縮小するので分けない */
+  bool too_large = width > INT16_MAX || height > INT16_MAX;
+  if (tile_size == 0 && too_large && !opts->pyramid) {
+    tile_size = 1024;
+  }
+
+  /* タイルはregionで切り出すので、直接読んだ画素もlibvipsの画像にする */
+  bool via_vips = raw ? tile_size > 0 : !raw_stream;
+  VipsImage *image = NULL;
+  if (!raw && !raw_stream) {
+    image = load_image(input_file, opts->stream, pad_mode(opts));
+  } else if (via_vips) {
+    image = vips_image_new_from_memory(
+        raw->pixels, (size_t)raw->width * raw->height * 3, raw->width,
+        raw->height, 3, VIPS_FORMAT_UCHAR);
+    image = image ? prepare_image(image, input_file, pad_mode(opts)) : NULL;
+  }
+  if (via_vips) {
+    if (!image) {
+      rawio_close(raw);
+      rawio_stream_close(raw_stream);
+      return 1;
+    }
     width = vips_image_get_width(image);
     height = vips_image_get_height(image);
-    fprintf(stderr, "Extended to %dx%d\n", width, height);
   }
+  stats_timer_stop(stats, "load", &timer);
 
-  VipsImage *image_uchar;
-  if (vips_cast(image, &image_uchar, VIPS_FORMAT_UCHAR, NULL) != 0) {
-    vips_error_exit(NULL);
+  if (tile_size == 0 && (width > INT16_MAX || height > INT16_MAX) &&
+      !opts->pyramid) {
+    tile_size = 1024;
+    too_large = true;
+  }
+  if (too_large && opts->tile_size == 0 && !opts->pyramid) {
+    fprintf(stderr, "Image is larger than %d px, writing %d px tiles.\n",
+            INT16_MAX, tile_size);
+  }
+  const char *conflict = NULL;
+  if (tile_size > 0 && opts->stream) {
+    conflict = "--stream cannot be combined with tiled output.";
+  } else if (tile_size > 0 &&
+             (opts->target_size > 0 || opts->target_psnr > 0)) {
+    conflict = "Rate control cannot be combined with tiled output.";
+  } else if (tile_size > 0 && opts->pyramid) {
+    conflict = "--pyramid cannot be combined with tiled output.";
+  } else if (opts->target_size > 0 && !xz &&
+             (opts->format == BINFMT_PLANAR ||
+              opts->format == BINFMT_CHROMA420)) {
+    /* 面をそのまま並べる形式はレベルによらず同じ大きさになる */
+    conflict = "--target-size needs --xz, --entropy or --sparse.";
+  }
+  if (conflict) {
+    fprintf(stderr, "%s\n", conflict);
+    if (image) {
+      g_object_unref(image);
+    }
+    rawio_close(raw);
+    rawio_stream_close(raw_stream);
+    return 1;
   }
-  g_object_unref(image);
-  image = image_uchar;
 
-  size_t image_size;
-  void *pixels_void;
-  pixels_void = vips_image_write_to_memory(image, &image_size);
-  if (!pixels_void) {
-    vips_error_exit(NULL);
+  FILE *out_file = stdout;
+  if (strcmp(output_file, "-") != 0 &&
+      !(out_file = fopen(output_file, "wb"))) {
+    fprintf(stderr, "Could not open output file: %s\n", output_file);
+    if (image) {
+      g_object_unref(image);
+    }
+    rawio_close(raw);
+    rawio_stream_close(raw_stream);
+    return 1;
   }
-  uint8_t *pixels = (uint8_t *)pixels_void;
-
-  ImgData imgdata;
-  imgdata.width = width;
-  imgdata.height = height;
-  imgdata.block_count = (width / 8) * (height / 8);
-  imgdata.blocks =
-      (BlockData *)g_malloc(sizeof(BlockData) * imgdata.block_count);
-  if (!imgdata.blocks) {
-    fprintf(stderr, "Memory allocation failed for imgdata.blocks.\n");
-    g_free(pixels);
-    return 1;
-  }
-  size_t block_index = 0;
-
-  fprintf(stderr, "Encoding...\n");
-  for (int y = 0; y < height; y += 8) {
-    for (int x = 0; x < width; x += 8) {
-      YUV_Pixel block_yuv[8][8];
-      for (int by = 0; by < 8; by++) {
-        for (int bx = 0; bx < 8; bx++) {
-          size_t offset = ((y + by) * width + (x + bx)) * 3;
-          uint8_t r = pixels[offset];
-          uint8_t g = pixels[offset + 1];
-          uint8_t b = pixels[offset + 2];
-          rgb_to_yuv_norm(r, g, b, &block_yuv[by][bx]);
-        }
+
+  int result = 0;
+  if (tile_size > 0) {
+    result = encode_tiles(image, opts->compress_level, opts->encode_block,
+                          opts->nthreads, out_file, opts->format, xz,
+                          tile_size, stats);
+  } else if (raw) {
+    /* 段の形式は広げる前の画素から縮小するので、広げたことを知らせない */
+    if (!opts->pyramid && (width != raw->width || height != raw->height)) {
+      fprintf(stderr, "Extended to %dx%d\n", width, height);
+    }
+    if (opts->pyramid) {
+      result = encode_pyramid(raw->pixels, (size_t)raw->width * 3,
+                              raw->width, raw->height, opts, out_file, xz);
+    } else {
+      result = encode_pixels(raw->pixels, (size_t)raw->width * 3, raw->width,
+                             raw->height, opts, out_file, xz, planes_cache);
+    }
+  } else if (raw_stream) {
+    if (width != raw_stream->width || height != raw_stream->height) {
+      fprintf(stderr, "Extended to %dx%d\n", width, height);
+    }
+    result = encode_raw_stream(raw_stream, opts->compress_level,
+                               opts->encode_block, opts->nthreads, out_file,
+                               opts->format, xz, stats);
+  } else if (opts->stream) {
+    result = encode_stream(image, opts->compress_level, opts->encode_block,
+                           opts->nthreads, out_file, opts->format, xz, stats);
+  } else {
+    /* 画素はregionの領域を直接読み、面だけを使い回す */
+    VipsRegion *region = vips_region_new(image);
+    VipsRect rect = {0, 0, width, height};
+    timer = stats_timer_start(stats);
+    if (!region) {
+      fprintf(stderr, "Memory allocation failed for %s.\n", input_file);
+      result = 1;
+    } else if (vips_region_prepare(region, &rect) != 0) {
+      fprintf(stderr, "Could not read %s: %s\n", input_file,
+              vips_error_buffer());
+      vips_error_clear();
+      result = 1;
+    } else {
+      /* libvipsは画素を遅延して読むので、ここまでを読み込みとする */
+      stats_timer_stop(stats, "load", &timer);
+      if (opts->pyramid) {
+        result = encode_pyramid(VIPS_REGION_ADDR(region, 0, 0),
+                                VIPS_REGION_LSKIP(region), width, height,
+                                opts, out_file, xz);
+      } else {
+        result = encode_pixels(VIPS_REGION_ADDR(region, 0, 0),
+                               VIPS_REGION_LSKIP(region), width, height, opts,
+                               out_file, xz, planes_cache);
       }
+    }
+    if (region) {
+      g_object_unref(region);
+    }
+  }
+
+  if (out_file != stdout && fclose(out_file) != 0) {
+    result = 1;
+  }
+  if (image) {
+    g_object_unref(image);
+  }
+  rawio_close(raw);
+  rawio_stream_close(raw_stream);
+  stats_add_bytes(stats, stats_file_size(input_file),
+                  stats_file_size(output_file));
+  return result;
+}
+
+typedef struct {
+  const BatchManifest *manifest;
+  const EncodeOptions *opts;
+  BatchPool *planes_pool;
+  int *results;
+} BatchJob;
+
+static void free_planes_buffer(void *planes) {
+  free_imgplanes((ImgPlanes *)planes);
+}
+
+static void encode_batch_entry(void *ctx, int index) {
+  BatchJob *job = (BatchJob *)ctx;
+  const BatchEntry *entry = &job->manifest->entries[index];
+  ImgPlanes *planes = (ImgPlanes *)batch_pool_take(job->planes_pool);
+  job->results[index] =
+      encode_file(entry->input, entry->output, job->opts, &planes);
+  batch_pool_give(job->planes_pool, planes);
+  if (job->results[index] != 0) {
+    fprintf(stderr, "Failed to encode %s\n", entry->input);
+  }
+}
+
+/**
+ * @brief リストにあるファイルをまとめて符号化する
+ * @note ファイル単位でnthreads個を並列に処理し、各ファイルは1スレッドで符号化する
+ * @return すべて成功した場合0、一つでも失敗した場合1
+ */
+static int encode_batch(const char *list_file, const EncodeOptions *opts) {
+  BatchManifest *manifest = batch_manifest_read(list_file);
+  if (!manifest) {
+    return 1;
+  }
+  BatchPool *pool = batch_pool_new(free_planes_buffer);
+  int *results = (int *)calloc(manifest->count ? manifest->count : 1,
+                               sizeof(int));
+  if (!pool || !results) {
+    fprintf(stderr, "Memory allocation failed for batch.\n");
+    batch_pool_free(pool);
+    free(results);
+    batch_manifest_free(manifest);
+    return 1;
+  }
+
+  EncodeOptions file_opts = *opts;
+  file_opts.nthreads = 1;
+  BatchJob job = {manifest, &file_opts, pool, results};
+  double start = batch_now();
+  parallel_for_rows(manifest->count, opts->nthreads, encode_batch_entry, &job);
+  double elapsed = batch_now() - start;
+
+  int failed = 0;
+  for (int i = 0; i < manifest->count; i++) {
+    failed += results[i] != 0;
+  }
+  fprintf(stderr, "Encoded %d of %d images in %.2f s (%.1f images/s).\n",
+          manifest->count - failed, manifest->count, elapsed,
+          elapsed > 0 ? (manifest->count - failed) / elapsed : 0.0);
+  free(results);
+  batch_pool_free(pool);
+  batch_manifest_free(manifest);
+  return failed ? 1 : 0;
+}
+
+/**
+ * @brief 画像を読み、幅と高さを8の倍数に広げたRGBとして*pixelsに置く
+ * @param pixels 読んだ画素を置く領域。足りない場合は確保し直す
+ * @param width,height 広げた寸法を返す
+ * @return 成功時0、失敗時1
+ */
+static int load_frame(const char *input_file, const EncodeOptions *opts,
+                      uint8_t **pixels, size_t *capacity, int *width,
+                      int *height) {
+  RawImage *raw;
+  if (open_native(input_file, opts, &raw, NULL) != 0) {
+    return 1;
+  }
+  VipsImage *image = NULL;
+  VipsRegion *region = NULL;
+  const uint8_t *src = NULL;
+  size_t stride = 0;
+  int w = 0, h = 0;
+  if (raw) {
+    src = raw->pixels;
+    stride = (size_t)raw->width * 3;
+    w = raw->width;
+    h = raw->height;
+  } else if ((image = load_image(input_file, false, pad_mode(opts)))) {
+    w = vips_image_get_width(image);
+    h = vips_image_get_height(image);
+    VipsRect rect = {0, 0, w, h};
+    region = vips_region_new(image);
+    if (region && vips_region_prepare(region, &rect) == 0) {
+      src = VIPS_REGION_ADDR(region, 0, 0);
+      stride = VIPS_REGION_LSKIP(region);
+    } else {
+      fprintf(stderr, "Could not read %s: %s\n", input_file,
+              vips_error_buffer());
+      vips_error_clear();
+    }
+  }
+
+  *width = (w + 7) / 8 * 8;
+  *height = (h + 7) / 8 * 8;
+  size_t row_size = (size_t)*width * 3;
+  int result = src ? 0 : 1;
+  if (result == 0 && (*width > INT16_MAX || *height > INT16_MAX)) {
+    fprintf(stderr, "Frames larger than %d px are not supported.\n",
+            INT16_MAX);
+    result = 1;
+  }
+  if (result == 0 && *capacity < row_size * *height) {
+    free(*pixels);
+    *pixels = (uint8_t *)malloc(row_size * *height);
+    *capacity = *pixels ? row_size * *height : 0;
+    if (!*pixels) {
+      fprintf(stderr, "Memory allocation failed for frame pixels.\n");
+      result = 1;
+    }
+  }
+  if (result == 0) {
+    /* 端のブロックはencode_block_rowと同じく埋める */
+    memset(*pixels, 0, row_size * *height);
+    for (int y = 0; y < h; y++) {
+      memcpy(*pixels + y * row_size, src + y * stride, (size_t)w * 3);
+    }
+    if (opts->format == BINFMT_CHROMA420) {
+      extend_edges(*pixels, row_size, w, h, *width, *height);
+    }
+  }
+  if (region) {
+    g_object_unref(region);
+  }
+  if (image) {
+    g_object_unref(image);
+  }
+  rawio_close(raw);
+  return result;
+}
 
-      BlockData *current_block = &imgdata.blocks[block_index++];
-      int drangey, drangeu, drangev;
-
-      get_channel_stats(block_yuv, 0, &current_block->blockminy,
-                        &current_block->blockmaxy, &drangey);
-      get_channel_stats(block_yuv, 1, &current_block->blockminu,
-                        &current_block->blockmaxu, &drangeu);
-      get_channel_stats(block_yuv, 2, &current_block->blockminv,
-                        &current_block->blockmaxv, &drangev);
-
-      current_block->interpolatey = (drangey < compress_level / 2);
-      current_block->interpolateu = (drangeu < compress_level);
-      current_block->interpolatev = (drangev < compress_level);
-
-      YUV_Pixel prevpix = {0, 0, 0};
-
-      for (int yi = 0; yi < 8; yi++) {
-        for (int xi = 0; xi < 8; xi++) {
-          double cy = block_yuv[yi][xi].y;
-          double cu = block_yuv[yi][xi].u;
-          double cv = block_yuv[yi][xi].v;
-
-          int qy, qu, qv;
-          if (current_block->interpolatey) {
-            qy = 0;
-          } else {
-            qy = floor((cy - current_block->blockminy) / drangey * 15.9);
-          }
-          if (current_block->interpolateu) {
-            qu = 0;
-          } else {
-            qu = floor((cu - current_block->blockminu) / drangeu * 3.9);
-          }
-          if (current_block->interpolatev) {
-            qv = 0;
-          } else {
-            qv = floor((cv - current_block->blockminv) / drangev * 3.9);
-          }
-
-          int r_delta = pix_delta((int)prevpix.y, qy, 16);
-          int g_delta = pix_delta((int)prevpix.u, qu, 4);
-          int b_delta = pix_delta((int)prevpix.v, qv, 4);
-          current_block->nblock4bn[yi][xi] =
-              (r_delta * 4 + g_delta) * 4 + b_delta;
-
-          prevpix.y = qy;
-          prevpix.u = qu;
-          prevpix.v = qv;
-        }
+typedef struct {
+  const uint8_t *pixels;
+  /* 前の画像の画素。NULLの場合はすべてのブロックを符号化する */
+  const uint8_t *prev;
+  int width;
+  int compress_level;
+  encode_block_fn encode_block;
+  /* これまでに書き出した各ブロック。変わったブロックだけを上書きする */
+  ImgPlanes *planes;
+  uint8_t *same; /* ブロックごとに、前の画像と同じなら1 */
+} SequenceJob;
+
+/**
+ * @brief row番目のブロック行のうち、前の画像から変わったブロックを符号化する
+ * @note 画素が同じブロックは符号化せずに同じとみなす。画素が違っても
+ *       符号化した結果が同じなら、そのブロックも同じとする
+ */
+static void encode_sequence_row(void *ctx, int row) {
+  SequenceJob *job = (SequenceJob *)ctx;
+  int blocks_per_row = job->width / 8;
+  size_t stride = (size_t)job->width * 3;
+  for (int bx = 0; bx < blocks_per_row; bx++) {
+    int32_t i = row * blocks_per_row + bx;
+    size_t offset = (size_t)row * 8 * stride + (size_t)bx * 8 * 3;
+    const uint8_t *src = job->pixels + offset;
+    bool same = job->prev != NULL;
+    for (int y = 0; y < 8 && same; y++) {
+      same = memcmp(src + y * stride, job->prev + offset + y * stride,
+                    8 * 3) == 0;
+    }
+    if (!same) {
+      uint8_t header[BLOCK_HEADER_SIZE], corners[BLOCK_CORNERS_SIZE];
+      uint8_t codes[BLOCK_CODES_SIZE];
+      job->encode_block(src, stride, job->compress_level, header, corners,
+                        codes);
+      uint8_t *old_header = planes_header(job->planes, i);
+      uint8_t *old_corners = planes_corners(job->planes, i);
+      uint8_t *old_codes = planes_codes(job->planes, i);
+      same = job->prev &&
+             memcmp(header, old_header, BLOCK_HEADER_SIZE) == 0 &&
+             memcmp(corners, old_corners, BLOCK_CORNERS_SIZE) == 0 &&
+             memcmp(codes, old_codes, BLOCK_CODES_SIZE) == 0;
+      if (!same) {
+        memcpy(old_header, header, BLOCK_HEADER_SIZE);
+        memcpy(old_corners, corners, BLOCK_CORNERS_SIZE);
+        memcpy(old_codes, codes, BLOCK_CODES_SIZE);
       }
+    }
+    job->same[i] = same;
+  }
+}
+
+/**
+ * @brief 変わったブロックだけをchangedに詰め、skipにビット列を作る
+ * @return changed、失敗した場合はNULL
+ */
+static ImgPlanes *pack_changed(const ImgPlanes *planes, const uint8_t *same,
+                               ImgPlanes *changed, uint8_t *skip) {
+  int32_t count = planes->block_count;
+  int32_t nchanged = 0;
+  memset(skip, 0, temporal_bitmap_size(count));
+  for (int32_t i = 0; i < count; i++) {
+    if (same[i]) {
+      skip[i / 8] |= 0x80 >> (i % 8);
+    } else {
+      nchanged++;
+    }
+  }
+  changed =
+      reuse_imgplanes(changed, planes->width, planes->height, nchanged);
+  if (!changed) {
+    return NULL;
+  }
+  int32_t k = 0;
+  for (int32_t i = 0; i < count; i++) {
+    if (!same[i]) {
+      memcpy(planes_header(changed, k), planes_header(planes, i),
+             BLOCK_HEADER_SIZE);
+      memcpy(planes_corners(changed, k), planes_corners(planes, i),
+             BLOCK_CORNERS_SIZE);
+      memcpy(planes_codes(changed, k), planes_codes(planes, i),
+             BLOCK_CODES_SIZE);
+      k++;
+    }
+  }
+  return changed;
+}
+
+/**
+ * @brief 前の画像との差分をtemporal.hの形式で書き出す
+ * @return 成功時0、失敗時-1
+ */
+static int write_frame(const ImgPlanes *changed, const uint8_t *skip,
+                       int32_t block_count, FILE *out, bool xz,
+                       int nthreads) {
+  if (!xz) {
+    return temporal_write(binfmt_file_sink, out, block_count, skip, changed);
+  }
+  XzWriter *xz_writer = xz_writer_open(
+      out, nthreads,
+      temporal_bitmap_size(block_count) +
+          binfmt_file_size(changed->block_count));
+  if (!xz_writer) {
+    return -1;
+  }
+  if (temporal_write(xz_writer_write, xz_writer, block_count, skip,
+                     changed) != 0) {
+    xz_writer_abort(xz_writer);
+    return -1;
+  }
+  return xz_writer_close(xz_writer);
+}
+
+/**
+ * @brief リストにある画像を順に1枚の連続した画像として符号化する
+ * @note 先頭と寸法が変わった画像は通常の形式で、それ以外は前の画像から
+ *       変わったブロックだけをtemporal.hの形式で書き出す
+ * @return すべて成功した場合0、失敗した場合1
+ */
+static int encode_sequence(const char *list_file, const EncodeOptions *opts) {
+  BatchManifest *manifest = batch_manifest_read(list_file);
+  if (!manifest) {
+    return 1;
+  }
+  Stats *stats = opts->stats;
+  uint8_t *frames[2] = {NULL, NULL};
+  size_t capacity[2] = {0, 0};
+  ImgPlanes *planes = NULL, *changed = NULL;
+  uint8_t *same = NULL, *skip = NULL;
+  int prev_width = 0, prev_height = 0;
+  int64_t total_blocks = 0, changed_blocks = 0;
+  int encoded = 0;
+  int result = 0;
+  double start = batch_now();
+
+  for (int f = 0; f < manifest->count && result == 0; f++) {
+    const BatchEntry *entry = &manifest->entries[f];
+    int cur = f % 2;
+    int width, height;
+    StatsTimer timer = stats_timer_start(stats);
+    if (load_frame(entry->input, opts, &frames[cur], &capacity[cur], &width,
+                   &height) != 0) {
+      result = 1;
+      break;
+    }
+    stats_timer_stop(stats, "load", &timer);
 
-      int corners_indices[4][2] = {{0, 0}, {0, 7}, {7, 0}, {7, 7}};
-      for (int i = 0; i < 4; i++) {
-        int yi = corners_indices[i][0];
-        int xi = corners_indices[i][1];
-        double cy = block_yuv[yi][xi].y;
-        double cu = block_yuv[yi][xi].u;
-        double cv = block_yuv[yi][xi].v;
-
-        int qy, qu, qv;
-        if (current_block->interpolatey) {
-          qy = floor(cy / 255.0 * 15.9);
-        } else {
-          qy = (drangey > 0)
-                   ? floor((cy - current_block->blockminy) / drangey * 15.9)
-                   : 0;
-        }
-        if (current_block->interpolateu) {
-          qu = floor(cu / 255.0 * 3.9);
-        } else {
-          qu = (drangeu > 0)
-                   ? floor((cu - current_block->blockminu) / drangeu * 3.9)
-                   : 0;
-        }
-        if (current_block->interpolatev) {
-          qv = floor(cv / 255.0 * 3.9);
-        } else {
-          qv = (drangev > 0)
-                   ? floor((cv - current_block->blockminv) / drangev * 3.9)
-                   : 0;
-        }
-        current_block->corners[i] = (qy * 4 + qu) * 4 + qv;
+    int32_t count = (width / 8) * (height / 8);
+    bool key = f == 0 || width != prev_width || height != prev_height;
+    if (key) {
+      planes = reuse_imgplanes(planes, width, height, count);
+      free(same);
+      free(skip);
+      same = (uint8_t *)malloc(count ? count : 1);
+      skip = (uint8_t *)malloc(temporal_bitmap_size(count) + 1);
+      if (!planes || !same || !skip) {
+        fprintf(stderr, "Memory allocation failed for frame planes.\n");
+        result = 1;
+        break;
       }
     }
+    timer = stats_timer_start(stats);
+    SequenceJob job = {frames[cur],
+                       key ? NULL : frames[1 - cur],
+                       width,
+                       opts->compress_level,
+                       opts->encode_block,
+                       planes,
+                       same};
+    parallel_for_rows(height / 8, opts->nthreads, encode_sequence_row, &job);
+    if (!key && !(changed = pack_changed(planes, same, changed, skip))) {
+      result = 1;
+      break;
+    }
+    stats_timer_stop(stats, "encode", &timer);
+    const ImgPlanes *written = key ? planes : changed;
+    stats_add_blocks(stats, written->headers, written->block_count);
+    total_blocks += count;
+    changed_blocks += written->block_count;
+
+    size_t output_len = strlen(entry->output);
+    bool xz = opts->xz || (output_len > 3 &&
+                           strcmp(entry->output + output_len - 3, ".xz") == 0);
+    FILE *out_file = stdout;
+    if (strcmp(entry->output, "-") != 0 &&
+        !(out_file = fopen(entry->output, "wb"))) {
+      fprintf(stderr, "Could not open output file: %s\n", entry->output);
+      result = 1;
+      break;
+    }
+    timer = stats_timer_start(stats);
+    if (key) {
+      result = write_planes(planes, out_file, opts->format, xz,
+                            opts->nthreads) == 0
+                   ? 0
+                   : 1;
+    } else {
+      result = write_frame(changed, skip, count, out_file, xz,
+                           opts->nthreads) == 0
+                   ? 0
+                   : 1;
+    }
+    if (out_file != stdout && fclose(out_file) != 0) {
+      result = 1;
+    }
+    stats_timer_stop(stats, "write", &timer);
+    stats_add_bytes(stats, stats_file_size(entry->input),
+                    stats_file_size(entry->output));
+    if (result != 0) {
+      fprintf(stderr, "Failed to encode %s\n", entry->input);
+    } else {
+      encoded++;
+    }
+    prev_width = width;
+    prev_height = height;
   }
-  g_free(pixels);
 
-  char *compressed_data = NULL;
-  size_t compressed_size = 0;
-  img_to_buf(&imgdata, &compressed_data, &compressed_size);
+  double elapsed = batch_now() - start;
+  fprintf(stderr,
+          "Encoded %d of %d frames in %.2f s, %lld of %lld blocks changed "
+          "(%.1f%%).\n",
+          encoded, manifest->count, elapsed, (long long)changed_blocks,
+          (long long)total_blocks,
+          total_blocks ? 100.0 * changed_blocks / total_blocks : 0.0);
+  free(frames[0]);
+  free(frames[1]);
+  free_imgplanes(planes);
+  free_imgplanes(changed);
+  free(same);
+  free(skip);
+  batch_manifest_free(manifest);
+  return result;
+}
+
+int main(int argc, char *argv[]) {
+  if (VIPS_INIT(argv[0])) {
+    vips_error_exit(NULL);
+  }
 
-  if (strcmp(output_file, "-") == 0) {
-    fwrite(compressed_data, 1, compressed_size, stdout);
-  } else {
-    FILE *out_file = fopen(output_file, "wb");
-    if (!out_file) {
-      fprintf(stderr, "Could not open output file: %s\n", output_file);
-      g_free(compressed_data);
-      g_free(imgdata.blocks);
 #ifdef _WIN32
-      WSACleanup();
+  WSADATA wsaData;
+  if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+    fprintf(stderr, "WSAStartup failed.\n");
+    return 1;
+  }
 #endif
-      return 1;
+
+  const char *positional[3];
+  int npositional = 0;
+  EncKernel kernel = ENC_KERNEL_AUTO;
+  const char *kernel_name = "auto";
+  const char *batch_list = NULL;
+  const char *sequence_list = NULL;
+  bool stats = false, stats_json = false;
+  int formats = 0; /* --entropy、--sparse、--chroma420で選んだ形式の数 */
+  EncodeOptions opts = {COMPRESS_LEVEL, NULL, 1, false, false, 0,
+                        BINFMT_PLANAR, NULL, 0, 0, 0, 0, false};
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      opts.nthreads = atoi(argv[++i]);
+    } else if (strncmp(argv[i], "-j", 2) == 0 && argv[i][2] != '\0') {
+      opts.nthreads = atoi(argv[i] + 2);
+    } else if (strcmp(argv[i], "--stream") == 0) {
+      opts.stream = true;
+    } else if (strcmp(argv[i], "--xz") == 0) {
+      opts.xz = true;
+    } else if (strcmp(argv[i], "--entropy") == 0) {
+      formats += opts.format != BINFMT_ENTROPY;
+      opts.format = BINFMT_ENTROPY;
+    } else if (strcmp(argv[i], "--sparse") == 0) {
+      formats += opts.format != BINFMT_SPARSE;
+      opts.format = BINFMT_SPARSE;
+    } else if (strcmp(argv[i], "--chroma420") == 0) {
+      formats += opts.format != BINFMT_CHROMA420;
+      opts.format = BINFMT_CHROMA420;
+    } else if (strcmp(argv[i], "--tile") == 0 && i + 1 < argc) {
+      opts.tile_size = atoi(argv[++i]);
+      if (opts.tile_size <= 0 || opts.tile_size % 8 != 0 ||
+          opts.tile_size > TILED_MAX_TILE_SIZE) {
+        fprintf(stderr, "Tile size must be a multiple of 8 up to %d.\n",
+                TILED_MAX_TILE_SIZE);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--target-size") == 0 && i + 1 < argc) {
+      opts.target_size = atof(argv[++i]);
+      if (opts.target_size <= 0) {
+        fprintf(stderr, "--target-size expects a positive byte count.\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--target-psnr") == 0 && i + 1 < argc) {
+      opts.target_psnr = atof(argv[++i]);
+      if (opts.target_psnr <= 0) {
+        fprintf(stderr, "--target-psnr expects a positive value in dB.\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--pyramid") == 0) {
+      opts.pyramid = true;
+    } else if (strcmp(argv[i], "--raw") == 0 && i + 1 < argc) {
+      if (sscanf(argv[++i], "%dx%d", &opts.raw_width, &opts.raw_height) != 2 ||
+          opts.raw_width <= 0 || opts.raw_height <= 0) {
+        fprintf(stderr, "--raw expects WIDTHxHEIGHT.\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+      batch_list = argv[++i];
+    } else if (strcmp(argv[i], "--sequence") == 0 && i + 1 < argc) {
+      sequence_list = argv[++i];
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      stats = true;
+    } else if (strcmp(argv[i], "--stats=json") == 0) {
+      stats = stats_json = true;
+    } else if (strncmp(argv[i], "--kernel=", 9) == 0) {
+      if (encode_kernel_parse(argv[i] + 9, &kernel) != 0) {
+        fprintf(stderr, "Unknown kernel: %s\n", argv[i] + 9);
+        return 1;
+      }
+      kernel_name = argv[i] + 9;
+    } else if (npositional < 3) {
+      positional[npositional++] = argv[i];
+    } else {
+      npositional = 0;
+      break;
     }
-    fwrite(compressed_data, 1, compressed_size, out_file);
-    fclose(out_file);
   }
 
-  g_free(compressed_data);
-  g_free(imgdata.blocks);
+  const char *list = batch_list ? batch_list : sequence_list;
+  if (list ? npositional > 1 : npositional < 2) {
+    fprintf(stderr,
+            "Usage: %s [-j threads] [--stream] [--xz] [--entropy] "
+            "[--sparse] [--chroma420] [--tile size] "
+            "[--kernel=scalar|sse2|avx2|neon] [--stats[=json]] [--raw WxH] "
+            "[--target-size bytes | --target-psnr dB] [--pyramid] "
+            "[compress_level] <input_file> <output_file>\n"
+            "       %s [options] --batch <list_file> [compress_level]\n"
+            "       %s [options] --sequence <list_file> [compress_level]\n",
+            argv[0], argv[0], argv[0]);
+    return 1;
+  }
+
+  if (list ? npositional == 1 : npositional > 2) {
+    opts.compress_level = atoi(positional[0]);
+  }
+  if (formats > 1) {
+    /* 形式はファイルに一つしか書けないので、後の指定で黙って上書きしない */
+    fprintf(stderr, "--entropy, --sparse and --chroma420 are exclusive.\n");
+    return 1;
+  }
+  if (sequence_list &&
+      (batch_list || opts.stream || opts.tile_size > 0 ||
+       opts.target_size > 0 || opts.target_psnr > 0)) {
+    fprintf(stderr, "--sequence cannot be combined with --batch, --stream, "
+                    "--tile or rate control.\n");
+    return 1;
+  }
+  if (opts.pyramid &&
+      (sequence_list || opts.stream || opts.tile_size > 0 ||
+       opts.target_size > 0 || opts.target_psnr > 0)) {
+    fprintf(stderr, "--pyramid cannot be combined with --sequence, --stream, "
+                    "--tile or rate control.\n");
+    return 1;
+  }
+  if (opts.target_size > 0 && opts.target_psnr > 0) {
+    fprintf(stderr, "--target-size and --target-psnr are exclusive.\n");
+    return 1;
+  }
+  if ((opts.target_size > 0 || opts.target_psnr > 0) &&
+      (opts.stream || opts.tile_size > 0)) {
+    /* 候補を調べてから選び直すので、全ブロックを一度に持つ必要がある */
+    fprintf(stderr, "Rate control cannot be combined with --stream or "
+                    "--tile.\n");
+    return 1;
+  }
+
+  opts.encode_block =
+      encode_kernel_select(kernel, opts.format == BINFMT_CHROMA420);
+  if (!opts.encode_block) {
+    fprintf(stderr, "Kernel %s is not supported on this CPU.\n",
+            kernel_name);
+    return 1;
+  }
+  if (opts.nthreads <= 0) {
+    opts.nthreads = parallel_cpu_count();
+  }
+  /* バッチでは各ファイルを1スレッドで処理するので、CPU時間はスレッドごとに計る */
+  if (stats && !(opts.stats = stats_new(batch_list != NULL))) {
+    return 1;
+  }
+
+  int result;
+  if (batch_list) {
+    result = encode_batch(batch_list, &opts);
+  } else if (sequence_list) {
+    result = encode_sequence(sequence_list, &opts);
+  } else {
+    const char *input_file =
+        (npositional > 2) ? positional[1] : positional[0];
+    const char *output_file =
+        (npositional > 2) ? positional[2] : positional[1];
+    fprintf(stderr, "Encoding...\n");
+    result = encode_file(input_file, output_file, &opts, NULL);
+  }
+  if (opts.stats) {
+    stats_print(opts.stats, stderr, stats_json);
+    stats_free(opts.stats);
+  }
   vips_shutdown();
 
 #ifdef _WIN32
   WSACleanup();
 #endif
-  fprintf(stderr, "Done.\n");
-  return 0;
+  if (result == 0 && !list) {
+    fprintf(stderr, "Done.\n");
+  }
+  return result;
 }
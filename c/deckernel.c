@@ -0,0 +1,845 @@
+#include "deckernel.h"
+#include <math.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DECKERNEL_X86 1
+#endif
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#define DECKERNEL_NEON 1
+#endif
+
+typedef struct {
+  double r, g, b;
+} RGB_Pixel;
+
+static RGB_Pixel yuv_to_rgb_norm(double Y, double U, double V) {
+  RGB_Pixel rgb;
+  rgb.r = Y + 1.402 * (V - 128);
+  rgb.g = Y - 0.344 * (U - 128) - 0.714 * (V - 128);
+  rgb.b = Y + 1.772 * (U - 128);
+  return rgb;
+}
+
+static int pix_delta_rev(int prev, int delta, int max) {
+  return (prev + delta) % max;
+}
+
+static double interpolate(double tl, double tr, double bl, double br, double u,
+                          double v) {
+  double top = tl * (1 - u) + tr * u;
+  double bottom = bl * (1 - u) + br * u;
+  return top * (1 - v) + bottom * v;
+}
+
+/**
+ * @brief 四隅の段を基準実装のYUVの値に戻す
+ */
+static void strict_corners(const uint8_t *header, const uint8_t *corners,
+                           double corners_orig[4][3]) {
+  for (int j = 0; j < 4; ++j) {
+    uint8_t corner = corners[j];
+    double oy =
+        (floor(corner / 16.0) / 15.0) * (header[BLOCK_MAXY] - header[BLOCK_MINY]) +
+        header[BLOCK_MINY];
+    double ou = (floor((corner % 16) / 4.0) / 3.0) *
+                    (header[BLOCK_MAXU] - header[BLOCK_MINU]) +
+                header[BLOCK_MINU];
+    double ov =
+        (floor(corner % 4) / 3.0) * (header[BLOCK_MAXV] - header[BLOCK_MINV]) +
+        header[BLOCK_MINV];
+    corners_orig[j][0] = oy;
+    corners_orig[j][1] = ou;
+    corners_orig[j][2] = ov;
+  }
+}
+
+/**
+ * @brief 基準実装の本体。flagsを定数として展開し、組み合わせごとに特殊化する
+ * @note 補間するチャンネルでは画素の差分を読まない。差分は各チャンネルで
+ *       独立に積み上げるので、読まなくても他のチャンネルの結果は変わらない
+ */
+__attribute__((always_inline)) static inline void
+decode_block_strict_with(const uint8_t *header, const uint8_t *corners,
+                         const uint8_t *codes, uint8_t *dst, size_t stride,
+                         int flags) {
+  const bool interpolatey = flags & BLOCK_FLAG_Y;
+  const bool interpolateu = flags & BLOCK_FLAG_U;
+  const bool interpolatev = flags & BLOCK_FLAG_V;
+  double corners_orig[4][3];
+  strict_corners(header, corners, corners_orig);
+
+  double prevpix[3] = {0, 0, 0};
+  for (int blockY = 0; blockY < 8; ++blockY) {
+    for (int blockX = 0; blockX < 8; ++blockX) {
+      uint8_t nblock_val = codes[blockY * 8 + blockX];
+      if (!interpolatey) {
+        prevpix[0] = pix_delta_rev((int)prevpix[0], floor(nblock_val / 16.0),
+                                   16);
+      }
+      if (!interpolateu) {
+        prevpix[1] =
+            pix_delta_rev((int)prevpix[1], floor((nblock_val % 16) / 4.0), 4);
+      }
+      if (!interpolatev) {
+        prevpix[2] = pix_delta_rev((int)prevpix[2], floor(nblock_val % 4), 4);
+      }
+      double dy = prevpix[0];
+      double du = prevpix[1];
+      double dv = prevpix[2];
+
+      double u_interp = (double)blockX / 7.0;
+      double v_interp = (double)blockY / 7.0;
+
+      double cy, cu, cv;
+      if (interpolatey) {
+        cy = interpolate(corners_orig[0][0], corners_orig[1][0],
+                         corners_orig[2][0], corners_orig[3][0], u_interp,
+                         v_interp);
+      } else {
+        cy = (dy / 15.0) * (header[BLOCK_MAXY] - header[BLOCK_MINY]) +
+             header[BLOCK_MINY];
+      }
+
+      if (interpolateu) {
+        cu = interpolate(corners_orig[0][1], corners_orig[1][1],
+                         corners_orig[2][1], corners_orig[3][1], u_interp,
+                         v_interp);
+      } else {
+        cu = (du / 3.0) * (header[BLOCK_MAXU] - header[BLOCK_MINU]) +
+             header[BLOCK_MINU];
+      }
+
+      if (interpolatev) {
+        cv = interpolate(corners_orig[0][2], corners_orig[1][2],
+                         corners_orig[2][2], corners_orig[3][2], u_interp,
+                         v_interp);
+      } else {
+        cv = (dv / 3.0) * (header[BLOCK_MAXV] - header[BLOCK_MINV]) +
+             header[BLOCK_MINV];
+      }
+
+      RGB_Pixel rgb = yuv_to_rgb_norm(cy, cu, cv);
+
+      uint8_t *pixel = dst + blockY * stride + blockX * 3;
+      pixel[0] = (uint8_t)fmax(0, fmin(255, round(rgb.r)));
+      pixel[1] = (uint8_t)fmax(0, fmin(255, round(rgb.g)));
+      pixel[2] = (uint8_t)fmax(0, fmin(255, round(rgb.b)));
+    }
+  }
+}
+
+#define DECODE_STRICT_FLAGS(name, flags)                                       \
+  static void name##_##flags(const uint8_t *header, const uint8_t *corners,    \
+                             const uint8_t *codes, uint8_t *dst,               \
+                             size_t stride) {                                  \
+    decode_block_strict_with(header, corners, codes, dst, stride, flags);      \
+  }
+BLOCK_FLAGS_EACH(DECODE_STRICT_FLAGS, decode_block_strict)
+
+/**
+ * @brief BLOCK_FLAG_CHROMA420のブロックの基準実装
+ * @note 色差は4x4の区画ごとに求め、補間する場合は四隅の区画の間を補間する
+ */
+__attribute__((always_inline)) static inline void
+decode_chroma420_strict_with(const uint8_t *header, const uint8_t *corners,
+                             const uint8_t *codes, uint8_t *dst,
+                             size_t stride, int flags) {
+  const bool interp[3] = {flags & BLOCK_FLAG_Y, flags & BLOCK_FLAG_U,
+                          flags & BLOCK_FLAG_V};
+  double corners_orig[4][3];
+  strict_corners(header, corners, corners_orig);
+
+  double cells[2][16];
+  for (int c = 1; c < 3; c++) {
+    double drange = header[BLOCK_MAXY + c * 2] - header[BLOCK_MINY + c * 2];
+    int q = 0;
+    for (int k = 0; k < 16; k++) {
+      if (interp[c]) {
+        cells[c - 1][k] =
+            interpolate(corners_orig[0][c], corners_orig[1][c],
+                        corners_orig[2][c], corners_orig[3][c],
+                        (double)(k % 4) / 3.0, (double)(k / 4) / 3.0);
+      } else {
+        int nibble = codes[CHROMA420_Y_SIZE + k / 2] >> (k % 2 ? 0 : 4);
+        q = pix_delta_rev(q, (nibble >> (c == 1 ? 2 : 0)) & 3, 4);
+        cells[c - 1][k] = (q / 3.0) * drange + header[BLOCK_MINY + c * 2];
+      }
+    }
+  }
+
+  int qy = 0;
+  for (int i = 0; i < 64; i++) {
+    double cy;
+    if (interp[0]) {
+      cy = interpolate(corners_orig[0][0], corners_orig[1][0],
+                       corners_orig[2][0], corners_orig[3][0],
+                       (double)(i % 8) / 7.0, (double)(i / 8) / 7.0);
+    } else {
+      qy = pix_delta_rev(qy, (codes[i / 2] >> (i % 2 ? 0 : 4)) & 15, 16);
+      cy = (qy / 15.0) * (header[BLOCK_MAXY] - header[BLOCK_MINY]) +
+           header[BLOCK_MINY];
+    }
+    int cell = CHROMA420_CELL(i);
+    RGB_Pixel rgb = yuv_to_rgb_norm(cy, cells[0][cell], cells[1][cell]);
+
+    uint8_t *pixel = dst + (i / 8) * stride + (i % 8) * 3;
+    pixel[0] = (uint8_t)fmax(0, fmin(255, round(rgb.r)));
+    pixel[1] = (uint8_t)fmax(0, fmin(255, round(rgb.g)));
+    pixel[2] = (uint8_t)fmax(0, fmin(255, round(rgb.b)));
+  }
+}
+
+#define DECODE_STRICT_CHROMA420_FLAGS(name, flags)                             \
+  static void name##_##flags(const uint8_t *header, const uint8_t *corners,    \
+                             const uint8_t *codes, uint8_t *dst,               \
+                             size_t stride) {                                  \
+    decode_chroma420_strict_with(header, corners, codes, dst, stride, flags);  \
+  }
+BLOCK_FLAGS_EACH(DECODE_STRICT_CHROMA420_FLAGS, decode_chroma420_strict)
+
+void decode_block_strict(const uint8_t *header, const uint8_t *corners,
+                         const uint8_t *codes, uint8_t *dst, size_t stride) {
+  static const decode_block_fn by_flags[8] =
+      BLOCK_FLAGS_TABLE(decode_block_strict);
+  static const decode_block_fn chroma420_by_flags[8] =
+      BLOCK_FLAGS_TABLE(decode_chroma420_strict);
+  (header[BLOCK_FLAGS] & BLOCK_FLAG_CHROMA420
+       ? chroma420_by_flags
+       : by_flags)[header[BLOCK_FLAGS] & BLOCK_FLAGS_ALL](header, corners,
+                                                          codes, dst, stride);
+}
+
+/*
+ * 固定小数点カーネル
+ * YUVは64倍した int16 で持つ (値は常に min と max の間なので 0..255 に収まる)。
+ * 補間チャンネルは四隅の値に下の重みテーブルを掛けて足し、12bit右シフトする。
+ * YUV->RGB は係数を 8192 倍した int16 で行い、最後に飽和パックで 0..255 にする。
+ */
+
+#define FIX_SHIFT 6
+#define WEIGHT_SHIFT 12
+#define COEF_SHIFT 13
+
+#define BW(a, b) (((a) * (b) * (1 << WEIGHT_SHIFT) + 24) / 49)
+#define BW01(x, y) BW(7 - (x), 7 - (y)), BW(x, 7 - (y))
+#define BW23(x, y) BW(7 - (x), y), BW(x, y)
+#define BW_ROW(P, y)                                                           \
+  P(0, y), P(1, y), P(2, y), P(3, y), P(4, y), P(5, y), P(6, y), P(7, y)
+#define BW_TABLE(P)                                                            \
+  BW_ROW(P, 0), BW_ROW(P, 1), BW_ROW(P, 2), BW_ROW(P, 3), BW_ROW(P, 4),        \
+      BW_ROW(P, 5), BW_ROW(P, 6), BW_ROW(P, 7)
+
+/* 各画素の (左上, 右上) と (左下, 右下) の重みを交互に並べたもの。合計は約4096 */
+static const int16_t bilinear_w01[128]
+    __attribute__((aligned(32))) = {BW_TABLE(BW01)};
+static const int16_t bilinear_w23[128]
+    __attribute__((aligned(32))) = {BW_TABLE(BW23)};
+
+/* chroma-420の4x4の区画を四隅の区画から補間する重み。四隅の順に並べる */
+#define CW(a, b) (((a) * (b) * (1 << WEIGHT_SHIFT) + 4) / 9)
+#define CW_DEC(wy) CW(3, wy), CW(2, wy), CW(1, wy), CW(0, wy)
+#define CW_INC(wy) CW(0, wy), CW(1, wy), CW(2, wy), CW(3, wy)
+static const int32_t cell_weights[4][16] __attribute__((aligned(32))) = {
+    {CW_DEC(3), CW_DEC(2), CW_DEC(1), CW_DEC(0)},
+    {CW_INC(3), CW_INC(2), CW_INC(1), CW_INC(0)},
+    {CW_DEC(0), CW_DEC(1), CW_DEC(2), CW_DEC(3)},
+    {CW_INC(0), CW_INC(1), CW_INC(2), CW_INC(3)},
+};
+
+static const int16_t coef_rv = 11485;  /* 1.402 */
+static const int16_t coef_gu = -2818;  /* -0.344 */
+static const int16_t coef_gv = -5849;  /* -0.714 */
+static const int16_t coef_bu = 14516;  /* 1.772 */
+
+typedef void (*interp_fn)(const int16_t corners[4], int16_t *out);
+typedef void (*convert_fn)(const int16_t *y, const int16_t *u,
+                           const int16_t *v, uint8_t rgb[3][64]);
+/* chromaは区画ごとに求めたR, G, Bの色差の項で、丸めの分を足してある */
+typedef void (*convert420_fn)(const int16_t *y, const int32_t chroma[3][16],
+                              uint8_t rgb[3][64]);
+
+static const int quant_levels[3] = {15, 3, 3};
+
+static int16_t fixed_level(int k, int levels, int drange, int min_val) {
+  int num = k * drange * (1 << FIX_SHIFT);
+  int half = levels / 2;
+  int rounded = (num >= 0) ? (num + half) / levels : -((-num + half) / levels);
+  return (int16_t)(min_val * (1 << FIX_SHIFT) + rounded);
+}
+
+static void interp_fixed(const int16_t corners[4], int16_t *out) {
+  for (int i = 0; i < 64; i++) {
+    int32_t acc = bilinear_w01[i * 2] * corners[0] +
+                  bilinear_w01[i * 2 + 1] * corners[1] +
+                  bilinear_w23[i * 2] * corners[2] +
+                  bilinear_w23[i * 2 + 1] * corners[3];
+    out[i] = (int16_t)((acc + (1 << (WEIGHT_SHIFT - 1))) >> WEIGHT_SHIFT);
+  }
+}
+
+static uint8_t saturate_u8(int32_t v) {
+  return v < 0 ? 0 : v > 255 ? 255 : (uint8_t)v;
+}
+
+static void convert_pixel_fixed(int16_t y, int16_t u, int16_t v, uint8_t *r,
+                                uint8_t *g, uint8_t *b) {
+  const int32_t round = 1 << (FIX_SHIFT + COEF_SHIFT - 1);
+  int32_t ys = (int32_t)y << COEF_SHIFT;
+  int32_t uc = u - (128 << FIX_SHIFT);
+  int32_t vc = v - (128 << FIX_SHIFT);
+  *r = saturate_u8((ys + coef_rv * vc + round) >> (FIX_SHIFT + COEF_SHIFT));
+  *g = saturate_u8((ys + coef_gu * uc + coef_gv * vc + round) >>
+                   (FIX_SHIFT + COEF_SHIFT));
+  *b = saturate_u8((ys + coef_bu * uc + round) >> (FIX_SHIFT + COEF_SHIFT));
+}
+
+static void convert_fixed(const int16_t *y, const int16_t *u, const int16_t *v,
+                          uint8_t rgb[3][64]) {
+  for (int i = 0; i < 64; i++) {
+    convert_pixel_fixed(y[i], u[i], v[i], &rgb[0][i], &rgb[1][i], &rgb[2][i]);
+  }
+}
+
+static void convert420_fixed(const int16_t *y, const int32_t chroma[3][16],
+                             uint8_t rgb[3][64]) {
+  for (int i = 0; i < 64; i++) {
+    int32_t ys = (int32_t)y[i] << COEF_SHIFT;
+    for (int c = 0; c < 3; c++) {
+      rgb[c][i] = saturate_u8((ys + chroma[c][CHROMA420_CELL(i)]) >>
+                              (FIX_SHIFT + COEF_SHIFT));
+    }
+  }
+}
+
+static void store_rgb(const uint8_t rgb[3][64], uint8_t *dst, size_t stride) {
+  for (int by = 0; by < 8; by++) {
+    uint8_t *row = dst + by * stride;
+    for (int bx = 0; bx < 8; bx++) {
+      row[bx * 3] = rgb[0][by * 8 + bx];
+      row[bx * 3 + 1] = rgb[1][by * 8 + bx];
+      row[bx * 3 + 2] = rgb[2][by * 8 + bx];
+    }
+  }
+}
+
+/**
+ * @brief 固定小数点カーネル共通部分。チャンネル値を求めてから変換関数に渡す
+ * @param flags ヘッダのBLOCK_FLAGS。DECODE_KERNELが定数を渡して展開するので、
+ *              チャンネルごとの分岐はコンパイル時に消える
+ */
+__attribute__((always_inline)) static inline void
+decode_block_fixed_with(const uint8_t *header, const uint8_t *corners,
+                        const uint8_t *codes, uint8_t *dst, size_t stride,
+                        int flags, interp_fn interp, convert_fn convert) {
+  const uint8_t mins[3] = {header[BLOCK_MINY], header[BLOCK_MINU],
+                           header[BLOCK_MINV]};
+  const int dranges[3] = {header[BLOCK_MAXY] - header[BLOCK_MINY],
+                          header[BLOCK_MAXU] - header[BLOCK_MINU],
+                          header[BLOCK_MAXV] - header[BLOCK_MINV]};
+  const bool interp_flags[3] = {flags & BLOCK_FLAG_Y, flags & BLOCK_FLAG_U,
+                                flags & BLOCK_FLAG_V};
+  static const int shifts[3] = {4, 2, 0};
+  static const int masks[3] = {15, 3, 3};
+
+  int16_t val[3][64] __attribute__((aligned(32)));
+
+  for (int c = 0; c < 3; c++) {
+    if (interp_flags[c]) {
+      /* 四隅の4段だけを求めればよい */
+      int16_t corner_vals[4];
+      for (int j = 0; j < 4; j++) {
+        corner_vals[j] = fixed_level((corners[j] >> shifts[c]) & masks[c],
+                                     quant_levels[c], dranges[c], mins[c]);
+      }
+      interp(corner_vals, val[c]);
+    } else {
+      int16_t levels[16];
+      for (int k = 0; k <= quant_levels[c]; k++) {
+        levels[k] = fixed_level(k, quant_levels[c], dranges[c], mins[c]);
+      }
+      int q = 0;
+      for (int i = 0; i < 64; i++) {
+        q = (q + (codes[i] >> shifts[c])) & masks[c];
+        val[c][i] = levels[q];
+      }
+    }
+  }
+
+  uint8_t rgb[3][64] __attribute__((aligned(32)));
+  convert(val[0], val[1], val[2], rgb);
+  store_rgb(rgb, dst, stride);
+}
+
+#define DECODE_FIXED_FLAGS(name, attr, interp, convert, flags)                 \
+  attr static void name##_##flags(const uint8_t *header,                      \
+                                  const uint8_t *corners,                     \
+                                  const uint8_t *codes, uint8_t *dst,         \
+                                  size_t stride) {                            \
+    decode_block_fixed_with(header, corners, codes, dst, stride, flags,       \
+                            interp, convert);                                 \
+  }
+
+/**
+ * @brief BLOCK_FLAG_CHROMA420のブロックの固定小数点カーネル共通部分
+ * @note 色差は16区画だけを求め、RGBへの変換でも色差の項は区画ごとに一度だけ
+ *       計算する。画素ごとに残るのは輝度を足して飽和させる処理だけになる
+ */
+__attribute__((always_inline)) static inline void
+decode_chroma420_fixed_with(const uint8_t *header, const uint8_t *corners,
+                            const uint8_t *codes, uint8_t *dst,
+                            size_t stride, int flags, interp_fn interp,
+                            convert420_fn convert) {
+  int drangey = header[BLOCK_MAXY] - header[BLOCK_MINY];
+  int16_t y[64] __attribute__((aligned(32)));
+  if (flags & BLOCK_FLAG_Y) {
+    int16_t corner_vals[4];
+    for (int j = 0; j < 4; j++) {
+      corner_vals[j] =
+          fixed_level(corners[j] >> 4, 15, drangey, header[BLOCK_MINY]);
+    }
+    interp(corner_vals, y);
+  } else {
+    int16_t levels[16];
+    for (int k = 0; k <= 15; k++) {
+      levels[k] = fixed_level(k, 15, drangey, header[BLOCK_MINY]);
+    }
+    int q = 0;
+    for (int i = 0; i < 64; i++) {
+      q = (q + (codes[i / 2] >> (i % 2 ? 0 : 4))) & 15;
+      y[i] = levels[q];
+    }
+  }
+
+  static const int shifts[2] = {2, 0};
+  const bool interp_uv[2] = {flags & BLOCK_FLAG_U, flags & BLOCK_FLAG_V};
+  int16_t uv[2][16];
+  for (int c = 0; c < 2; c++) {
+    int min_val = header[BLOCK_MINU + c * 2];
+    int drange = header[BLOCK_MAXU + c * 2] - min_val;
+    if (interp_uv[c]) {
+      int32_t cv[4];
+      for (int j = 0; j < 4; j++) {
+        cv[j] = fixed_level((corners[j] >> shifts[c]) & 3, 3, drange,
+                            min_val);
+      }
+      for (int k = 0; k < 16; k++) {
+        int32_t acc = cell_weights[0][k] * cv[0] + cell_weights[1][k] * cv[1] +
+                      cell_weights[2][k] * cv[2] + cell_weights[3][k] * cv[3];
+        uv[c][k] = (int16_t)((acc + (1 << (WEIGHT_SHIFT - 1))) >> WEIGHT_SHIFT);
+      }
+    } else {
+      int16_t levels[4];
+      for (int k = 0; k <= 3; k++) {
+        levels[k] = fixed_level(k, 3, drange, min_val);
+      }
+      int q = 0;
+      for (int k = 0; k < 16; k++) {
+        int nibble = codes[CHROMA420_Y_SIZE + k / 2] >> (k % 2 ? 0 : 4);
+        q = (q + (nibble >> shifts[c])) & 3;
+        uv[c][k] = levels[q];
+      }
+    }
+  }
+
+  const int32_t round = 1 << (FIX_SHIFT + COEF_SHIFT - 1);
+  int32_t chroma[3][16] __attribute__((aligned(32)));
+  for (int k = 0; k < 16; k++) {
+    int32_t uc = uv[0][k] - (128 << FIX_SHIFT);
+    int32_t vc = uv[1][k] - (128 << FIX_SHIFT);
+    chroma[0][k] = coef_rv * vc + round;
+    chroma[1][k] = coef_gu * uc + coef_gv * vc + round;
+    chroma[2][k] = coef_bu * uc + round;
+  }
+
+  uint8_t rgb[3][64] __attribute__((aligned(32)));
+  convert(y, chroma, rgb);
+  store_rgb(rgb, dst, stride);
+}
+
+#define DECODE_CHROMA420_FLAGS(name, attr, interp, convert, flags)             \
+  attr static void name##_##flags(const uint8_t *header,                      \
+                                  const uint8_t *corners,                     \
+                                  const uint8_t *codes, uint8_t *dst,         \
+                                  size_t stride) {                            \
+    decode_chroma420_fixed_with(header, corners, codes, dst, stride, flags,   \
+                                interp, convert);                             \
+  }
+
+/*
+ * 補間の組み合わせごとに特殊化したname_0からname_7と、BLOCK_FLAG_CHROMA420の
+ * ブロック用のname_chroma420_0からname_chroma420_7、
+ * ヘッダのflagsで表を引いてそれらを呼ぶnameを定義する
+ */
+#define DECODE_KERNEL(name, attr, interp, convert, convert420)                 \
+  BLOCK_FLAGS_EACH(DECODE_FIXED_FLAGS, name, attr, interp, convert)            \
+  BLOCK_FLAGS_EACH(DECODE_CHROMA420_FLAGS, name##_chroma420, attr, interp,     \
+                   convert420)                                                 \
+  static const decode_block_fn name##_by_flags[8] = BLOCK_FLAGS_TABLE(name);   \
+  static const decode_block_fn name##_chroma420_by_flags[8] =                  \
+      BLOCK_FLAGS_TABLE(name##_chroma420);                                     \
+  static void name(const uint8_t *header, const uint8_t *corners,             \
+                   const uint8_t *codes, uint8_t *dst, size_t stride) {       \
+    (header[BLOCK_FLAGS] & BLOCK_FLAG_CHROMA420                               \
+         ? name##_chroma420_by_flags                                           \
+         : name##_by_flags)[header[BLOCK_FLAGS] & BLOCK_FLAGS_ALL](            \
+        header, corners, codes, dst, stride);                                  \
+  }
+
+DECODE_KERNEL(decode_block_fixed, , interp_fixed, convert_fixed,
+              convert420_fixed)
+
+#ifdef DECKERNEL_X86
+
+__attribute__((target("sse2"))) static __m128i pair_epi16(int16_t lo,
+                                                          int16_t hi) {
+  return _mm_set1_epi32(
+      (int32_t)((uint16_t)lo | ((uint32_t)(uint16_t)hi << 16)));
+}
+
+__attribute__((target("sse2"))) static void
+interp_sse2(const int16_t corners[4], int16_t *out) {
+  const __m128i c01 = pair_epi16(corners[0], corners[1]);
+  const __m128i c23 = pair_epi16(corners[2], corners[3]);
+  const __m128i round = _mm_set1_epi32(1 << (WEIGHT_SHIFT - 1));
+  for (int i = 0; i < 64; i += 8) {
+    __m128i acc[2];
+    for (int h = 0; h < 2; h++) {
+      __m128i w01 = _mm_load_si128((const __m128i *)(bilinear_w01 + (i + h * 4) * 2));
+      __m128i w23 = _mm_load_si128((const __m128i *)(bilinear_w23 + (i + h * 4) * 2));
+      acc[h] = _mm_add_epi32(_mm_madd_epi16(w01, c01), _mm_madd_epi16(w23, c23));
+      acc[h] = _mm_srai_epi32(_mm_add_epi32(acc[h], round), WEIGHT_SHIFT);
+    }
+    _mm_store_si128((__m128i *)(out + i), _mm_packs_epi32(acc[0], acc[1]));
+  }
+}
+
+__attribute__((target("sse2"))) static void
+convert_sse2(const int16_t *y, const int16_t *u, const int16_t *v,
+             uint8_t rgb[3][64]) {
+  const __m128i bias = _mm_set1_epi16(128 << FIX_SHIFT);
+  const __m128i round = _mm_set1_epi32(1 << (FIX_SHIFT + COEF_SHIFT - 1));
+  const __m128i k_r = pair_epi16(0, coef_rv);
+  const __m128i k_g = pair_epi16(coef_gu, coef_gv);
+  const __m128i k_b = pair_epi16(coef_bu, 0);
+  const __m128i zero = _mm_setzero_si128();
+  for (int i = 0; i < 64; i += 16) {
+    __m128i out[3][2];
+    for (int h = 0; h < 2; h++) {
+      __m128i yv = _mm_load_si128((const __m128i *)(y + i + h * 8));
+      __m128i uc = _mm_sub_epi16(_mm_load_si128((const __m128i *)(u + i + h * 8)), bias);
+      __m128i vc = _mm_sub_epi16(_mm_load_si128((const __m128i *)(v + i + h * 8)), bias);
+      __m128i uv[2] = {_mm_unpacklo_epi16(uc, vc), _mm_unpackhi_epi16(uc, vc)};
+      /* y << 13 を (0, y) と (8192, 0) の madd で作る */
+      __m128i y0[2] = {_mm_unpacklo_epi16(zero, yv), _mm_unpackhi_epi16(zero, yv)};
+      __m128i rgb32[3][2];
+      for (int q = 0; q < 2; q++) {
+        __m128i ys = _mm_add_epi32(_mm_srai_epi32(y0[q], 16 - COEF_SHIFT), round);
+        rgb32[0][q] = _mm_add_epi32(ys, _mm_madd_epi16(uv[q], k_r));
+        rgb32[1][q] = _mm_add_epi32(ys, _mm_madd_epi16(uv[q], k_g));
+        rgb32[2][q] = _mm_add_epi32(ys, _mm_madd_epi16(uv[q], k_b));
+      }
+      for (int c = 0; c < 3; c++) {
+        out[c][h] = _mm_packs_epi32(
+            _mm_srai_epi32(rgb32[c][0], FIX_SHIFT + COEF_SHIFT),
+            _mm_srai_epi32(rgb32[c][1], FIX_SHIFT + COEF_SHIFT));
+      }
+    }
+    for (int c = 0; c < 3; c++) {
+      _mm_store_si128((__m128i *)(rgb[c] + i),
+                      _mm_packus_epi16(out[c][0], out[c][1]));
+    }
+  }
+}
+
+/*
+ * 8画素の行ごとに4区画の項を2画素ずつ複製して足す。AVX2のカーネルでも使うので、
+ * SSEとAVXの命令が混ざらないように呼び出し元に展開する
+ */
+__attribute__((target("sse2"), always_inline)) static inline void
+convert420_sse2(const int16_t *y, const int32_t chroma[3][16],
+                uint8_t rgb[3][64]) {
+  const __m128i zero = _mm_setzero_si128();
+  for (int i = 0; i < 64; i += 16) {
+    __m128i out[3][2];
+    for (int h = 0; h < 2; h++) {
+      int row = i + h * 8;
+      __m128i yv = _mm_load_si128((const __m128i *)(y + row));
+      __m128i ys[2] = {
+          _mm_srai_epi32(_mm_unpacklo_epi16(zero, yv), 16 - COEF_SHIFT),
+          _mm_srai_epi32(_mm_unpackhi_epi16(zero, yv), 16 - COEF_SHIFT)};
+      for (int c = 0; c < 3; c++) {
+        __m128i cells = _mm_load_si128(
+            (const __m128i *)(chroma[c] + CHROMA420_CELL(row)));
+        __m128i lo = _mm_add_epi32(ys[0], _mm_unpacklo_epi32(cells, cells));
+        __m128i hi = _mm_add_epi32(ys[1], _mm_unpackhi_epi32(cells, cells));
+        out[c][h] =
+            _mm_packs_epi32(_mm_srai_epi32(lo, FIX_SHIFT + COEF_SHIFT),
+                            _mm_srai_epi32(hi, FIX_SHIFT + COEF_SHIFT));
+      }
+    }
+    for (int c = 0; c < 3; c++) {
+      _mm_store_si128((__m128i *)(rgb[c] + i),
+                      _mm_packus_epi16(out[c][0], out[c][1]));
+    }
+  }
+}
+
+DECODE_KERNEL(decode_block_sse2, __attribute__((target("sse2"))), interp_sse2,
+              convert_sse2, convert420_sse2)
+
+__attribute__((target("avx2"))) static void
+interp_avx2(const int16_t corners[4], int16_t *out) {
+  const __m256i c01 = _mm256_set1_epi32(
+      (int32_t)((uint16_t)corners[0] | ((uint32_t)(uint16_t)corners[1] << 16)));
+  const __m256i c23 = _mm256_set1_epi32(
+      (int32_t)((uint16_t)corners[2] | ((uint32_t)(uint16_t)corners[3] << 16)));
+  const __m256i round = _mm256_set1_epi32(1 << (WEIGHT_SHIFT - 1));
+  for (int i = 0; i < 64; i += 16) {
+    __m256i acc[2];
+    for (int h = 0; h < 2; h++) {
+      __m256i w01 = _mm256_load_si256((const __m256i *)(bilinear_w01 + (i + h * 8) * 2));
+      __m256i w23 = _mm256_load_si256((const __m256i *)(bilinear_w23 + (i + h * 8) * 2));
+      acc[h] = _mm256_add_epi32(_mm256_madd_epi16(w01, c01),
+                                _mm256_madd_epi16(w23, c23));
+      acc[h] = _mm256_srai_epi32(_mm256_add_epi32(acc[h], round), WEIGHT_SHIFT);
+    }
+    /* packsはレーン内で詰めるので64bit単位で並べ直す */
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(acc[0], acc[1]),
+                                              _MM_SHUFFLE(3, 1, 2, 0));
+    _mm256_store_si256((__m256i *)(out + i), packed);
+  }
+}
+
+__attribute__((target("avx2"))) static void
+convert_avx2(const int16_t *y, const int16_t *u, const int16_t *v,
+             uint8_t rgb[3][64]) {
+  const __m256i bias = _mm256_set1_epi16(128 << FIX_SHIFT);
+  const __m256i round = _mm256_set1_epi32(1 << (FIX_SHIFT + COEF_SHIFT - 1));
+  const __m256i k_r = _mm256_set1_epi32((int32_t)((uint32_t)(uint16_t)coef_rv << 16));
+  const __m256i k_g = _mm256_set1_epi32(
+      (int32_t)((uint16_t)coef_gu | ((uint32_t)(uint16_t)coef_gv << 16)));
+  const __m256i k_b = _mm256_set1_epi32((uint16_t)coef_bu);
+  for (int i = 0; i < 64; i += 32) {
+    __m256i out[3][2];
+    for (int h = 0; h < 2; h++) {
+      __m256i yv = _mm256_load_si256((const __m256i *)(y + i + h * 16));
+      __m256i uc = _mm256_sub_epi16(_mm256_load_si256((const __m256i *)(u + i + h * 16)), bias);
+      __m256i vc = _mm256_sub_epi16(_mm256_load_si256((const __m256i *)(v + i + h * 16)), bias);
+      /* unpackはレーン内で動くが、y と u/v を同じ並びにすれば結果は揃う */
+      __m256i uv[2] = {_mm256_unpacklo_epi16(uc, vc), _mm256_unpackhi_epi16(uc, vc)};
+      __m256i ys[2] = {_mm256_slli_epi32(_mm256_cvtepi16_epi32(_mm256_castsi256_si128(yv)), COEF_SHIFT),
+                       _mm256_slli_epi32(_mm256_cvtepi16_epi32(_mm256_extracti128_si256(yv, 1)), COEF_SHIFT)};
+      /* cvtepi16_epi32 の並びを unpack の並びに合わせる */
+      __m256i ysl[2] = {_mm256_permute2x128_si256(ys[0], ys[1], 0x20),
+                        _mm256_permute2x128_si256(ys[0], ys[1], 0x31)};
+      __m256i rgb32[3][2];
+      for (int q = 0; q < 2; q++) {
+        __m256i yr = _mm256_add_epi32(ysl[q], round);
+        rgb32[0][q] = _mm256_add_epi32(yr, _mm256_madd_epi16(uv[q], k_r));
+        rgb32[1][q] = _mm256_add_epi32(yr, _mm256_madd_epi16(uv[q], k_g));
+        rgb32[2][q] = _mm256_add_epi32(yr, _mm256_madd_epi16(uv[q], k_b));
+      }
+      for (int c = 0; c < 3; c++) {
+        out[c][h] = _mm256_packs_epi32(
+            _mm256_srai_epi32(rgb32[c][0], FIX_SHIFT + COEF_SHIFT),
+            _mm256_srai_epi32(rgb32[c][1], FIX_SHIFT + COEF_SHIFT));
+      }
+    }
+    for (int c = 0; c < 3; c++) {
+      __m256i packed = _mm256_packus_epi16(out[c][0], out[c][1]);
+      _mm256_store_si256((__m256i *)(rgb[c] + i),
+                         _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0)));
+    }
+  }
+}
+
+DECODE_KERNEL(decode_block_avx2, __attribute__((target("avx2"))), interp_avx2,
+              convert_avx2, convert420_sse2)
+
+#endif
+
+#ifdef DECKERNEL_NEON
+
+static void interp_neon(const int16_t corners[4], int16_t *out) {
+  for (int i = 0; i < 64; i += 8) {
+    int16x8x2_t w01 = vld2q_s16(bilinear_w01 + i * 2);
+    int16x8x2_t w23 = vld2q_s16(bilinear_w23 + i * 2);
+    int32x4_t lo = vmull_n_s16(vget_low_s16(w01.val[0]), corners[0]);
+    lo = vmlal_n_s16(lo, vget_low_s16(w01.val[1]), corners[1]);
+    lo = vmlal_n_s16(lo, vget_low_s16(w23.val[0]), corners[2]);
+    lo = vmlal_n_s16(lo, vget_low_s16(w23.val[1]), corners[3]);
+    int32x4_t hi = vmull_n_s16(vget_high_s16(w01.val[0]), corners[0]);
+    hi = vmlal_n_s16(hi, vget_high_s16(w01.val[1]), corners[1]);
+    hi = vmlal_n_s16(hi, vget_high_s16(w23.val[0]), corners[2]);
+    hi = vmlal_n_s16(hi, vget_high_s16(w23.val[1]), corners[3]);
+    vst1q_s16(out + i, vcombine_s16(vrshrn_n_s32(lo, WEIGHT_SHIFT),
+                                    vrshrn_n_s32(hi, WEIGHT_SHIFT)));
+  }
+}
+
+static void convert_neon(const int16_t *y, const int16_t *u, const int16_t *v,
+                         uint8_t rgb[3][64]) {
+  const int16x8_t bias = vdupq_n_s16(128 << FIX_SHIFT);
+  for (int i = 0; i < 64; i += 8) {
+    int16x8_t yv = vld1q_s16(y + i);
+    int16x8_t uc = vsubq_s16(vld1q_s16(u + i), bias);
+    int16x8_t vc = vsubq_s16(vld1q_s16(v + i), bias);
+    int16x4_t out[3][2];
+    for (int h = 0; h < 2; h++) {
+      int16x4_t yh = h ? vget_high_s16(yv) : vget_low_s16(yv);
+      int16x4_t uh = h ? vget_high_s16(uc) : vget_low_s16(uc);
+      int16x4_t vh = h ? vget_high_s16(vc) : vget_low_s16(vc);
+      int32x4_t ys = vshll_n_s16(yh, COEF_SHIFT);
+      int32x4_t r = vmlal_n_s16(ys, vh, coef_rv);
+      int32x4_t g = vmlal_n_s16(vmlal_n_s16(ys, uh, coef_gu), vh, coef_gv);
+      int32x4_t b = vmlal_n_s16(ys, uh, coef_bu);
+      out[0][h] = vqrshrn_n_s32(r, FIX_SHIFT + COEF_SHIFT);
+      out[1][h] = vqrshrn_n_s32(g, FIX_SHIFT + COEF_SHIFT);
+      out[2][h] = vqrshrn_n_s32(b, FIX_SHIFT + COEF_SHIFT);
+    }
+    for (int c = 0; c < 3; c++) {
+      vst1_u8(rgb[c] + i, vqmovun_s16(vcombine_s16(out[c][0], out[c][1])));
+    }
+  }
+}
+
+static void convert420_neon(const int16_t *y, const int32_t chroma[3][16],
+                            uint8_t rgb[3][64]) {
+  for (int i = 0; i < 64; i += 8) {
+    int16x8_t yv = vld1q_s16(y + i);
+    int32x4_t ys[2] = {vshll_n_s16(vget_low_s16(yv), COEF_SHIFT),
+                       vshll_n_s16(vget_high_s16(yv), COEF_SHIFT)};
+    for (int c = 0; c < 3; c++) {
+      int32x4_t cells = vld1q_s32(chroma[c] + CHROMA420_CELL(i));
+      int32x4x2_t pairs = vzipq_s32(cells, cells);
+      int32x4_t lo = vshrq_n_s32(vaddq_s32(ys[0], pairs.val[0]),
+                                 FIX_SHIFT + COEF_SHIFT);
+      int32x4_t hi = vshrq_n_s32(vaddq_s32(ys[1], pairs.val[1]),
+                                 FIX_SHIFT + COEF_SHIFT);
+      vst1_u8(rgb[c] + i,
+              vqmovun_s16(vcombine_s16(vqmovn_s32(lo), vqmovn_s32(hi))));
+    }
+  }
+}
+
+DECODE_KERNEL(decode_block_neon, , interp_neon, convert_neon, convert420_neon)
+
+#endif
+
+void decode_block_thumbnail(const uint8_t *header, const uint8_t *corners,
+                            uint8_t *dst) {
+  static const int shifts[3] = {4, 2, 0};
+  static const int masks[3] = {15, 3, 3};
+  int16_t val[3];
+  for (int c = 0; c < 3; c++) {
+    int min_val = header[BLOCK_MINY + c * 2];
+    int drange = header[BLOCK_MAXY + c * 2] - min_val;
+    /* 補間するチャンネルでは四隅の平均がブロック全体の平均と一致する */
+    int32_t sum = 0;
+    for (int j = 0; j < 4; j++) {
+      sum += fixed_level((corners[j] >> shifts[c]) & masks[c],
+                         quant_levels[c], drange, min_val);
+    }
+    val[c] = (int16_t)((sum + 2) >> 2);
+  }
+  convert_pixel_fixed(val[0], val[1], val[2], &dst[0], &dst[1], &dst[2]);
+}
+
+void decode_view_thumbnail(const ImgView *view, uint8_t *dst, size_t stride) {
+  int blocks_per_row = view->width / 8;
+  int rows = view->height / 8;
+  for (int row = 0; row < rows; row++) {
+    uint8_t *line = dst + (size_t)row * stride;
+    for (int bx = 0; bx < blocks_per_row; bx++) {
+      size_t i = (size_t)row * blocks_per_row + bx;
+      if (i >= (size_t)view->block_count) {
+        return;
+      }
+      decode_block_thumbnail(img_view_header(view, i),
+                             img_view_corners(view, i), line + bx * 3);
+    }
+  }
+}
+
+int decode_view_region(const ImgView *view, decode_block_fn decode_block,
+                       int x, int y, int w, int h, uint8_t *dst,
+                       size_t stride) {
+  int blocks_per_row = view->width / 8;
+  if (x < 0 || y < 0 || w <= 0 || h <= 0 || x + w > view->width ||
+      y + h > view->height ||
+      (size_t)((y + h + 7) / 8) * blocks_per_row > (size_t)view->block_count) {
+    return -1;
+  }
+
+  uint8_t block[8 * 8 * 3];
+  for (int by = y / 8; by <= (y + h - 1) / 8; by++) {
+    int top = by * 8 < y ? y - by * 8 : 0;
+    int bottom = y + h - by * 8 < 8 ? y + h - by * 8 : 8;
+    for (int bx = x / 8; bx <= (x + w - 1) / 8; bx++) {
+      int left = bx * 8 < x ? x - bx * 8 : 0;
+      int right = x + w - bx * 8 < 8 ? x + w - bx * 8 : 8;
+      size_t i = (size_t)by * blocks_per_row + bx;
+      uint8_t *out = dst + (size_t)(by * 8 + top - y) * stride +
+                     (size_t)(bx * 8 + left - x) * 3;
+      /* 矩形に収まるブロックは出力先に直接復元する */
+      if (top == 0 && bottom == 8 && left == 0 && right == 8) {
+        decode_block(img_view_header(view, i), img_view_corners(view, i),
+                     img_view_codes(view, i), out, stride);
+        continue;
+      }
+      decode_block(img_view_header(view, i), img_view_corners(view, i),
+                   img_view_codes(view, i), block, 8 * 3);
+      for (int r = top; r < bottom; r++) {
+        memcpy(out + (size_t)(r - top) * stride, block + r * 8 * 3 + left * 3,
+               (size_t)(right - left) * 3);
+      }
+    }
+  }
+  return 0;
+}
+
+decode_block_fn decode_kernel_select(DecKernel kernel) {
+  switch (kernel) {
+  case DEC_KERNEL_STRICT:
+    return decode_block_strict;
+  case DEC_KERNEL_FIXED:
+    return decode_block_fixed;
+  case DEC_KERNEL_SSE2:
+#ifdef DECKERNEL_X86
+    if (__builtin_cpu_supports("sse2")) {
+      return decode_block_sse2;
+    }
+#endif
+    return NULL;
+  case DEC_KERNEL_AVX2:
+#ifdef DECKERNEL_X86
+    if (__builtin_cpu_supports("avx2")) {
+      return decode_block_avx2;
+    }
+#endif
+    return NULL;
+  case DEC_KERNEL_NEON:
+#ifdef DECKERNEL_NEON
+    return decode_block_neon;
+#else
+    return NULL;
+#endif
+  case DEC_KERNEL_AUTO:
+  default:
+    break;
+  }
+
+  static const DecKernel preferred[] = {DEC_KERNEL_AVX2, DEC_KERNEL_SSE2,
+                                        DEC_KERNEL_NEON};
+  for (size_t i = 0; i < sizeof(preferred) / sizeof(preferred[0]); i++) {
+    decode_block_fn fn = decode_kernel_select(preferred[i]);
+    if (fn) {
+      return fn;
+    }
+  }
+  return decode_block_fixed;
+}
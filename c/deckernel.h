@@ -0,0 +1,72 @@
+#ifndef DECKERNEL_H
+#define DECKERNEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "binfmt.h"
+
+typedef enum {
+  DEC_KERNEL_AUTO,
+  DEC_KERNEL_STRICT,
+  DEC_KERNEL_FIXED,
+  DEC_KERNEL_SSE2,
+  DEC_KERNEL_AVX2,
+  DEC_KERNEL_NEON,
+} DecKernel;
+
+/**
+ * @brief 8x8ブロック1つをRGBに復元する関数の型
+ * @param header ヘッダ面のブロック (BLOCK_HEADER_SIZEバイト)
+ * @param corners 四隅の面のブロック (BLOCK_CORNERS_SIZEバイト)
+ * @param codes 画素の面のブロック (BLOCK_CODES_SIZEバイト)
+ * @param dst ブロック左上のRGBピクセルへのポインタ
+ * @param stride 1行あたりのバイト数
+ */
+typedef void (*decode_block_fn)(const uint8_t *header, const uint8_t *corners,
+                                const uint8_t *codes, uint8_t *dst,
+                                size_t stride);
+
+/**
+ * @brief double演算による基準実装。--strictで使われる
+ */
+void decode_block_strict(const uint8_t *header, const uint8_t *corners,
+                         const uint8_t *codes, uint8_t *dst, size_t stride);
+
+/**
+ * @brief 8x8ブロック1つを四隅の平均の1画素に復元する
+ * @param dst RGB1画素の出力先
+ * @note 画素の面は読まない
+ */
+void decode_block_thumbnail(const uint8_t *header, const uint8_t *corners,
+                            uint8_t *dst);
+
+/**
+ * @brief ヘッダと四隅の面だけから1/8に縮小した画像を復元する
+ * @param dst (width/8)x(height/8)のRGB画像の出力先
+ * @param stride 1行あたりのバイト数
+ * @note メモリマップしたファイルでは画素の面のページを読まずに済む
+ */
+void decode_view_thumbnail(const ImgView *view, uint8_t *dst, size_t stride);
+
+/**
+ * @brief 矩形に掛かるブロックだけを復元する
+ * @param x,y,w,h 復元する矩形。画像の範囲内であること
+ * @param dst wxhのRGB画像の出力先
+ * @param stride 1行あたりのバイト数
+ * @return 成功時0、矩形が画像からはみ出している場合-1
+ * @note 各ブロックの位置は面の中の添字から計算するので、他のブロックは読まない
+ */
+int decode_view_region(const ImgView *view, decode_block_fn decode_block,
+                       int x, int y, int w, int h, uint8_t *dst,
+                       size_t stride);
+
+/**
+ * @brief カーネルを選択する
+ * @param kernel DEC_KERNEL_AUTOの場合はCPUに応じて最速のものを選ぶ
+ * @return カーネル関数、CPUが対応していない場合はNULL
+ * @note STRICT以外は固定小数点演算のため、基準実装と±1の差が出ることがある
+ */
+decode_block_fn decode_kernel_select(DecKernel kernel);
+
+#endif
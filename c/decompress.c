@@ -1,5 +1,13 @@
+#include "batch.h"
 #include "binfmt.h"
-#include <math.h>
+#include "deckernel.h"
+#include "parallel.h"
+#include "progressive.h"
+#include "pyramid.h"
+#include "rawio.h"
+#include "stats.h"
+#include "temporal.h"
+#include "tiled.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,219 +17,908 @@
 #include <winsock2.h>
 #else
 #include <arpa/inet.h>
+#include <errno.h>
+#include <unistd.h>
 #endif
 
 typedef struct {
-  double r, g, b;
-} RGB_Pixel;
+  const ImgView *view;
+  decode_block_fn decode_block;
+  uint8_t *pixels;
+} DecodeJob;
 
-RGB_Pixel yuv_to_rgb_norm(double Y, double U, double V);
-int pix_delta_rev(int prev, int delta, int max);
-double interpolate(double tl, double tr, double bl, double br, double u,
-                   double v);
+static void decode_block_row(void *ctx, int row) {
+  DecodeJob *job = (DecodeJob *)ctx;
+  int blocks_per_row = job->view->width / 8;
+  size_t stride = (size_t)job->view->width * 3;
+  for (int bx = 0; bx < blocks_per_row; bx++) {
+    size_t i = (size_t)row * blocks_per_row + bx;
+    if (i >= (size_t)job->view->block_count) {
+      return;
+    }
+    job->decode_block(img_view_header(job->view, i),
+                      img_view_corners(job->view, i),
+                      img_view_codes(job->view, i),
+                      job->pixels + (size_t)row * 8 * stride + bx * 8 * 3,
+                      stride);
+  }
+}
 
-int main(int argc, char *argv[]) {
-  if (VIPS_INIT(argv[0])) {
-    vips_error_exit(NULL);
+typedef struct {
+  const ImgView *view;
+  decode_block_fn decode_block;
+  int x, y, w, h;
+  uint8_t *pixels;
+} CropJob;
+
+/**
+ * @brief 矩形のうちrow番目のブロック行に掛かる部分を復元する
+ */
+static void decode_crop_row(void *ctx, int row) {
+  CropJob *job = (CropJob *)ctx;
+  int top = (job->y / 8 + row) * 8;
+  int bottom = top + 8;
+  if (top < job->y) {
+    top = job->y;
+  }
+  if (bottom > job->y + job->h) {
+    bottom = job->y + job->h;
   }
+  size_t stride = (size_t)job->w * 3;
+  decode_view_region(job->view, job->decode_block, job->x, top, job->w,
+                     bottom - top,
+                     job->pixels + (size_t)(top - job->y) * stride, stride);
+}
 
-#ifdef _WIN32
-  WSADATA wsaData;
-  if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
-    fprintf(stderr, "WSAStartup failed.\n");
-    return 1;
+/**
+ * @brief 矩形のうち画像からはみ出した部分を切り詰める
+ * @return 矩形が画像に掛かっている場合0、掛かっていない場合-1
+ */
+static int clip_crop(int width, int height, int *x, int *y, int *w, int *h) {
+  if (*x < 0) {
+    *w += *x;
+    *x = 0;
   }
-#endif
+  if (*y < 0) {
+    *h += *y;
+    *y = 0;
+  }
+  if (*w > width - *x) {
+    *w = width - *x;
+  }
+  if (*h > height - *y) {
+    *h = height - *y;
+  }
+  if (*w <= 0 || *h <= 0) {
+    fprintf(stderr, "Crop rectangle is outside the image.\n");
+    return -1;
+  }
+  return 0;
+}
 
-  if (argc < 3) {
-    fprintf(stderr, "Usage: %s <input_file> <output_file>\n", argv[0]);
-    return 1;
+typedef struct {
+  const TiledImage *tiled;
+  decode_block_fn decode_block;
+  bool thumbnail;
+  /* 出力する矩形 (縮小画像の場合は画像全体) */
+  int x, y, w, h;
+  uint8_t *pixels;
+  int *results;
+  Stats *stats;
+} TiledJob;
+
+/**
+ * @brief index番目のタイルのうち出力する矩形に掛かる部分を復元する
+ */
+static void decode_tile(void *ctx, int index) {
+  TiledJob *job = (TiledJob *)ctx;
+  uint32_t utx, uty, utw, uth;
+  tiled_tile_rect(job->tiled, index, &utx, &uty, &utw, &uth);
+  int tx = utx, ty = uty, tw = utw, th = uth;
+  int left = tx > job->x ? tx : job->x;
+  int top = ty > job->y ? ty : job->y;
+  int right = tx + tw < job->x + job->w ? tx + tw : job->x + job->w;
+  int bottom = ty + th < job->y + job->h ? ty + th : job->y + job->h;
+  job->results[index] = 0;
+  if (left >= right || top >= bottom) {
+    return;
   }
 
-  const char *input_file = argv[1];
-  const char *output_file = argv[2];
+  /* タイル同士を並列に処理するので、展開はタイルごとに1スレッドで行う */
+  ImgView *view = tiled_image_tile(job->tiled, index, 1);
+  if (!view) {
+    job->results[index] = -1;
+    return;
+  }
+  stats_add_blocks(job->stats, view->headers, view->block_count);
+  if (job->thumbnail) {
+    size_t stride = (size_t)(job->w / 8) * 3;
+    decode_view_thumbnail(view,
+                          job->pixels + (size_t)(ty / 8) * stride +
+                              (size_t)(tx / 8) * 3,
+                          stride);
+  } else {
+    size_t stride = (size_t)job->w * 3;
+    job->results[index] = decode_view_region(
+        view, job->decode_block, left - tx, top - ty, right - left,
+        bottom - top,
+        job->pixels + (size_t)(top - job->y) * stride +
+            (size_t)(left - job->x) * 3,
+        stride);
+  }
+  img_view_close(view);
+}
 
-  char *data = NULL;
-  size_t data_size = 0;
+typedef struct {
+  decode_block_fn decode_block;
+  int nthreads;
+  bool thumbnail;
+  bool crop;
+  int crop_x, crop_y, crop_w, crop_h;
+  Stats *stats; /* --statsの計測値。NULLの場合は計測しない */
+  bool progressive; /* --progressive */
+  int level;        /* --level。段の形式のファイルで復元する段 */
+  /* --output-format。falseの場合は出力ファイルの拡張子で決める */
+  bool has_output_format;
+  RawFormat output_format;
+} DecodeOptions;
 
-  if (strcmp(input_file, "-") == 0) {
-    fprintf(stderr, "Reading from stdin is not supported in this C version.\n");
+/**
+ * @brief 復元した画素を置く領域。バッチでは複数のファイルで使い回す
+ */
+typedef struct {
+  uint8_t *data;
+  size_t capacity;
+} PixelBuffer;
+
+/**
+ * @brief sizeバイト以上の領域を用意する
+ * @return 領域の先頭、確保できなかった場合はNULL
+ */
+static uint8_t *pixel_buffer_reserve(PixelBuffer *buffer, size_t size) {
+  if (buffer->capacity < size) {
+    g_free(buffer->data);
+    buffer->data = (uint8_t *)g_malloc(size);
+    buffer->capacity = buffer->data ? size : 0;
+  }
+  if (!buffer->data) {
+    fprintf(stderr, "Failed to allocate memory for pixel data.\n");
+  }
+  return buffer->data;
+}
+
+/**
+ * @brief タイル形式のファイルから、必要なタイルだけを読んで復元する
+ * @param buffer 復元したwidthxheightのRGB画像を置く領域
+ * @return 成功時0、失敗時1
+ */
+static int decode_tiled(const char *input_file, const DecodeOptions *opts,
+                        PixelBuffer *buffer, int *width, int *height) {
+  StatsTimer timer = stats_timer_start(opts->stats);
+  TiledImage *tiled = tiled_image_open(input_file);
+  if (!tiled) {
     return 1;
-  } else {
-    FILE *in_file = fopen(input_file, "rb");
-    if (!in_file) {
-      fprintf(stderr, "Could not open input file: %s\n", input_file);
+  }
+  stats_timer_stop(opts->stats, "open", &timer);
+  if (tiled->width > INT32_MAX / 3 || tiled->height > INT32_MAX / 3) {
+    fprintf(stderr, "Image is too large: %ux%u\n", tiled->width,
+            tiled->height);
+    tiled_image_close(tiled);
+    return 1;
+  }
+  TiledJob job = {tiled, opts->decode_block, opts->thumbnail, 0, 0,
+                  (int)tiled->width, (int)tiled->height, NULL, NULL,
+                  opts->stats};
+  if (opts->crop) {
+    int crop_x = opts->crop_x, crop_y = opts->crop_y;
+    int crop_w = opts->crop_w, crop_h = opts->crop_h;
+    if (clip_crop(job.w, job.h, &crop_x, &crop_y, &crop_w, &crop_h) != 0) {
+      tiled_image_close(tiled);
       return 1;
     }
-    fseek(in_file, 0, SEEK_END);
-    data_size = ftell(in_file);
-    fseek(in_file, 0, SEEK_SET);
-    data = (char *)malloc(data_size);
-    if (!data) {
-      fprintf(stderr, "Memory allocation failed for input buffer.\n");
-      fclose(in_file);
+    job.x = crop_x;
+    job.y = crop_y;
+    job.w = crop_w;
+    job.h = crop_h;
+  }
+  *width = opts->thumbnail ? job.w / 8 : job.w;
+  *height = opts->thumbnail ? job.h / 8 : job.h;
+
+  int tile_count = tiled->tiles_x * tiled->tiles_y;
+  job.pixels = pixel_buffer_reserve(buffer, (size_t)*width * *height * 3);
+  job.results = (int *)calloc(tile_count ? tile_count : 1, sizeof(int));
+  if (!job.pixels || !job.results) {
+    free(job.results);
+    tiled_image_close(tiled);
+    return 1;
+  }
+
+  /* タイルごとの展開と復元は並列に重なるので、まとめて計る */
+  timer = stats_timer_start(opts->stats);
+  parallel_for_rows(tile_count, opts->nthreads, decode_tile, &job);
+  stats_timer_stop(opts->stats, "decode", &timer);
+  int result = 0;
+  for (int i = 0; i < tile_count; i++) {
+    if (job.results[i] != 0) {
+      result = 1;
+    }
+  }
+  free(job.results);
+  tiled_image_close(tiled);
+  return result;
+}
+
+/**
+ * @brief 開いたビューを復元する
+ * @param image_width,image_height 画像の寸法。8の倍数に広げたビューの寸法より
+ *                                 小さい場合は、広げた部分を切り詰めて復元する
+ * @param buffer 復元したwidthxheightのRGB画像を置く領域
+ * @return 成功時0、失敗時1
+ */
+static int decode_opened_view(const ImgView *view, const DecodeOptions *opts,
+                              int image_width, int image_height,
+                              PixelBuffer *buffer, int *width, int *height) {
+  stats_add_blocks(opts->stats, view->headers, view->block_count);
+
+  /* 縮小画像はブロック1つを1画素にする */
+  *width = opts->thumbnail ? view->width / 8 : view->width;
+  *height = opts->thumbnail ? view->height / 8 : view->height;
+  int crop_x = opts->crop_x, crop_y = opts->crop_y;
+  int crop_w = opts->crop_w, crop_h = opts->crop_h;
+  bool padded = image_width != view->width || image_height != view->height;
+  bool crop = opts->crop || (padded && !opts->thumbnail);
+  if (!opts->crop) {
+    crop_x = 0;
+    crop_y = 0;
+    crop_w = image_width;
+    crop_h = image_height;
+  }
+  if (crop) {
+    if (clip_crop(image_width, image_height, &crop_x, &crop_y, &crop_w,
+                  &crop_h) != 0) {
       return 1;
     }
-    fread(data, 1, data_size, in_file);
-    fclose(in_file);
+    *width = crop_w;
+    *height = crop_h;
   }
 
-  ImgData *imgdata = buf_to_img(data, data_size);
-  if (!imgdata) {
-    fprintf(stderr, "Failed to decode image data.\n");
+  uint8_t *pixels =
+      pixel_buffer_reserve(buffer, (size_t)*width * *height * 3);
+  if (!pixels) {
+    return 1;
+  }
+
+  StatsTimer timer = stats_timer_start(opts->stats);
+  if (opts->thumbnail) {
+    decode_view_thumbnail(view, pixels, (size_t)*width * 3);
+  } else if (crop) {
+    CropJob job = {view,   opts->decode_block, crop_x, crop_y,
+                   crop_w, crop_h,             pixels};
+    int rows = (crop_y + crop_h + 7) / 8 - crop_y / 8;
+    parallel_for_rows(rows, opts->nthreads, decode_crop_row, &job);
+  } else {
+    DecodeJob job = {view, opts->decode_block, pixels};
+    parallel_for_rows(*height / 8, opts->nthreads, decode_block_row, &job);
+  }
+  stats_timer_stop(opts->stats, "decode", &timer);
+  return 0;
+}
+
+/**
+ * @brief ビューで読めるファイルを復元する
+ * @param buffer 復元したwidthxheightのRGB画像を置く領域
+ * @return 成功時0、失敗時1
+ */
+static int decode_view(const char *input_file, const DecodeOptions *opts,
+                       PixelBuffer *buffer, int *width, int *height) {
+  StatsTimer timer = stats_timer_start(opts->stats);
+  /* 標準入力はマップできないので、全体を読んでからビューを作る */
+  uint8_t *data = NULL;
+  ImgView *view;
+  if (strcmp(input_file, "-") == 0) {
+    size_t size;
+    data = rawio_read_all(stdin, &size);
+    view = data ? img_view_open_mem(data, size, opts->nthreads) : NULL;
+  } else {
+    view = img_view_open(input_file, opts->nthreads);
+  }
+  if (!view) {
     free(data);
     return 1;
   }
+  stats_timer_stop(opts->stats, "open", &timer);
+  int result = decode_opened_view(view, opts, view->width, view->height,
+                                  buffer, width, height);
+  img_view_close(view);
   free(data);
+  return result;
+}
 
-  int width = imgdata->width;
-  int height = imgdata->height;
+/**
+ * @brief 段の形式のファイルから、--levelで選んだ段だけを読んで復元する
+ * @param buffer 復元したwidthxheightのRGB画像を置く領域
+ * @return 成功時0、失敗時1
+ */
+static int decode_pyramid(const char *input_file, const DecodeOptions *opts,
+                          PixelBuffer *buffer, int *width, int *height) {
+  StatsTimer timer = stats_timer_start(opts->stats);
+  PyramidImage *pyramid = pyramid_image_open(input_file);
+  if (!pyramid) {
+    return 1;
+  }
+  if ((uint32_t)opts->level >= pyramid->level_count) {
+    fprintf(stderr, "Level %d is out of range, %s has %u levels.\n",
+            opts->level, input_file, pyramid->level_count);
+    pyramid_image_close(pyramid);
+    return 1;
+  }
+  ImgView *view =
+      pyramid_image_level(pyramid, (uint32_t)opts->level, opts->nthreads);
+  if (!view) {
+    pyramid_image_close(pyramid);
+    return 1;
+  }
+  stats_timer_stop(opts->stats, "open", &timer);
+  uint32_t level_width, level_height;
+  pyramid_level_size(pyramid, (uint32_t)opts->level, &level_width,
+                     &level_height);
+  fprintf(stderr, "Level %d of %u: %ux%u\n", opts->level,
+          pyramid->level_count, level_width, level_height);
+  /* 表は広げる前の寸法を持つので、広げた部分を書き出さない */
+  int result = decode_opened_view(view, opts, (int)level_width,
+                                  (int)level_height, buffer, width, height);
+  img_view_close(view);
+  pyramid_image_close(pyramid);
+  return result;
+}
 
-  void *pixel_data_ptr;
-  size_t pixel_data_size = width * height * 3;
-  if (!(pixel_data_ptr = g_malloc(pixel_data_size))) {
-    fprintf(stderr, "Failed to allocate memory for pixel data.\n");
-    free_imgdata(imgdata);
-    return 1;
-  }
-
-  fprintf(stderr, "Decoding...\n");
-  int current_x = -8;
-  int current_y = 0;
-
-  for (int i = 0; i < imgdata->block_count; ++i) {
-    BlockData *block = &imgdata->blocks[i];
-
-    current_x += 8;
-    if (current_x >= width) {
-      current_y += 8;
-      current_x = 0;
-    }
-
-    double corners_orig[4][3];
-    for (int j = 0; j < 4; ++j) {
-      uint8_t corner = block->corners[j];
-      double oy = (floor(corner / 16.0) / 15.0) *
-                      (block->blockmaxy - block->blockminy) +
-                  block->blockminy;
-      double ou = (floor((corner % 16) / 4.0) / 3.0) *
-                      (block->blockmaxu - block->blockminu) +
-                  block->blockminu;
-      double ov =
-          (floor(corner % 4) / 3.0) * (block->blockmaxv - block->blockminv) +
-          block->blockminv;
-      corners_orig[j][0] = oy;
-      corners_orig[j][1] = ou;
-      corners_orig[j][2] = ov;
-    }
-
-    double prevpix[3] = {0, 0, 0};
-    for (int blockY = 0; blockY < 8; ++blockY) {
-      for (int blockX = 0; blockX < 8; ++blockX) {
-        uint8_t nblock_val = block->nblock4bn[blockY][blockX];
-        int oy_val = floor(nblock_val / 16.0);
-        int ou_val = floor((nblock_val % 16) / 4.0);
-        int ov_val = floor(nblock_val % 4);
-
-        double dy = pix_delta_rev((int)prevpix[0], oy_val, 16);
-        double du = pix_delta_rev((int)prevpix[1], ou_val, 4);
-        double dv = pix_delta_rev((int)prevpix[2], ov_val, 4);
-        prevpix[0] = dy;
-        prevpix[1] = du;
-        prevpix[2] = dv;
-
-        double u_interp = (double)blockX / 7.0;
-        double v_interp = (double)blockY / 7.0;
-
-        double cy, cu, cv;
-        if (block->interpolatey) {
-          cy = interpolate(corners_orig[0][0], corners_orig[1][0],
-                           corners_orig[2][0], corners_orig[3][0], u_interp,
-                           v_interp);
-        } else {
-          cy = (dy / 15.0) * (block->blockmaxy - block->blockminy) +
-               block->blockminy;
-        }
-
-        if (block->interpolateu) {
-          cu = interpolate(corners_orig[0][1], corners_orig[1][1],
-                           corners_orig[2][1], corners_orig[3][1], u_interp,
-                           v_interp);
-        } else {
-          cu = (du / 3.0) * (block->blockmaxu - block->blockminu) +
-               block->blockminu;
-        }
-
-        if (block->interpolatev) {
-          cv = interpolate(corners_orig[0][2], corners_orig[1][2],
-                           corners_orig[2][2], corners_orig[3][2], u_interp,
-                           v_interp);
-        } else {
-          cv = (dv / 3.0) * (block->blockmaxv - block->blockminv) +
-               block->blockminv;
-        }
-
-        RGB_Pixel rgb = yuv_to_rgb_norm(cy, cu, cv);
-
-        uint8_t *pixels = (uint8_t *)pixel_data_ptr;
-        size_t linear_byte_offset =
-            ((current_y + blockY) * width + (current_x + blockX)) * 3;
-        pixels[linear_byte_offset] = (uint8_t)fmax(0, fmin(255, round(rgb.r)));
-        pixels[linear_byte_offset + 1] =
-            (uint8_t)fmax(0, fmin(255, round(rgb.g)));
-        pixels[linear_byte_offset + 2] =
-            (uint8_t)fmax(0, fmin(255, round(rgb.b)));
-      }
+/**
+ * @brief 入れ物の形式に合わせて1つのファイルを復元する
+ * @note 差分の形式は前の画像が要るので扱わない
+ * @return 成功時0、失敗時1
+ */
+static int decode_image(const char *input_file, const DecodeOptions *opts,
+                        PixelBuffer *buffer, int *width, int *height) {
+  if (tiled_is_file(input_file)) {
+    return decode_tiled(input_file, opts, buffer, width, height);
+  }
+  if (pyramid_is_file(input_file)) {
+    return decode_pyramid(input_file, opts, buffer, width, height);
+  }
+  if (opts->level > 0) {
+    fprintf(stderr, "%s has only one level.\n", input_file);
+    return 1;
+  }
+  return decode_view(input_file, opts, buffer, width, height);
+}
+
+/**
+ * @brief 復元したRGB画像をoutput_fileに書き出す
+ * @param written 書き出したバイト数を返す
+ * @return 成功時0、失敗時1
+ */
+static int write_image(const char *output_file, const DecodeOptions *opts,
+                       const uint8_t *pixels, int width, int height,
+                       uint64_t *written) {
+  bool is_stdout = strcmp(output_file, "-") == 0;
+  RawFormat format = opts->output_format;
+  *written = 0;
+  if (opts->has_output_format ||
+      (!is_stdout && rawio_format_from_name(output_file, &format))) {
+    /* PPM/PAMとヘッダなしのRGBは画素をそのまま書くのでlibvipsを通さない */
+    FILE *out_file = stdout;
+    if (!is_stdout && !(out_file = fopen(output_file, "wb"))) {
+      fprintf(stderr, "Could not open output file: %s\n", output_file);
+      return 1;
     }
+    int result = rawio_write(out_file, format, pixels, width, height,
+                             (size_t)width * 3) == 0
+                     ? 0
+                     : 1;
+    if (!is_stdout && fclose(out_file) != 0) {
+      result = 1;
+    }
+    *written = is_stdout ? (uint64_t)width * height * 3
+                         : stats_file_size(output_file);
+    return result;
   }
 
-  VipsImage *out_image;
-  out_image = vips_image_new_from_memory(pixel_data_ptr, pixel_data_size, width,
-                                         height, 3, VIPS_FORMAT_UCHAR);
+  VipsImage *out_image =
+      vips_image_new_from_memory(pixels, (size_t)width * height * 3, width,
+                                 height, 3, VIPS_FORMAT_UCHAR);
   if (!out_image) {
-    vips_error_exit(NULL);
+    fprintf(stderr, "Could not create image: %s\n", vips_error_buffer());
+    vips_error_clear();
+    return 1;
   }
-  if (strcmp(output_file, "-") == 0) {
-
+  int result = 0;
+  if (is_stdout) {
     void *output_buffer;
     size_t output_size;
     if (vips_image_write_to_buffer(out_image, ".png", &output_buffer,
                                    &output_size, NULL) != 0) {
-      vips_error_exit(NULL);
+      result = 1;
+    } else {
+      if (fwrite(output_buffer, 1, output_size, stdout) != output_size ||
+          fflush(stdout) != 0) {
+        result = 1;
+      }
+      *written = output_size;
+      g_free(output_buffer);
     }
-    fwrite(output_buffer, 1, output_size, stdout);
-    g_free(output_buffer);
+  } else if (vips_image_write_to_file(out_image, output_file, NULL) != 0) {
+    result = 1;
   } else {
-    if (vips_image_write_to_file(out_image, output_file, NULL) != 0) {
-      vips_error_exit(NULL);
-    }
+    *written = stats_file_size(output_file);
+  }
+  if (result != 0) {
+    fprintf(stderr, "Could not write %s: %s\n", output_file,
+            vips_error_buffer());
+    vips_error_clear();
   }
-
-  g_free(pixel_data_ptr);
   g_object_unref(out_image);
-  free_imgdata(imgdata);
-  vips_shutdown();
+  return result;
+}
+
+/**
+ * @brief 1つのファイルを復元して画像として書き出す
+ * @return 成功時0、失敗時1
+ */
+static int decode_file(const char *input_file, const char *output_file,
+                       const DecodeOptions *opts, PixelBuffer *buffer) {
+  if (temporal_is_file(input_file)) {
+    fprintf(stderr, "%s holds only the blocks changed since the previous "
+                    "frame; decode it with --sequence.\n",
+            input_file);
+    return 1;
+  }
+  int width, height;
+  int result = decode_image(input_file, opts, buffer, &width, &height);
+  if (result != 0) {
+    fprintf(stderr, "Failed to decode image data.\n");
+    return 1;
+  }
+
+  StatsTimer timer = stats_timer_start(opts->stats);
+  uint64_t written;
+  result = write_image(output_file, opts, buffer->data, width, height,
+                       &written);
+  stats_timer_stop(opts->stats, "write", &timer);
+  stats_add_bytes(opts->stats, stats_file_size(input_file), written);
+  return result;
+}
 
+/**
+ * @brief 届いている分だけを読む
+ * @return 読んだバイト数、入力の終わりの場合0、失敗した場合-1
+ * @note freadは要求した量が揃うまで待つので、パイプではreadを使う
+ */
+static long read_some(FILE *in, char *buf, size_t size) {
 #ifdef _WIN32
-  WSACleanup();
+  size_t n = fread(buf, 1, size, in);
+  return (n == 0 && ferror(in)) ? -1 : (long)n;
+#else
+  ssize_t n;
+  do {
+    n = read(fileno(in), buf, size);
+  } while (n < 0 && errno == EINTR);
+  return (long)n;
 #endif
-  fprintf(stderr, "Done.\n");
+}
+
+/**
+ * @brief 入力を届いた分から復元し、下見の画像と最終的な画像を順に書き出す
+ * @return 成功時0、失敗時1
+ * @note 標準出力に書く場合は2枚の画像が続けて出力される
+ */
+static int decode_progressive(const char *input_file, const char *output_file,
+                              const DecodeOptions *opts) {
+  FILE *in_file = stdin;
+  if (strcmp(input_file, "-") != 0 && !(in_file = fopen(input_file, "rb"))) {
+    fprintf(stderr, "Could not open input file: %s\n", input_file);
+    return 1;
+  }
+  ProgressiveDecoder *decoder =
+      progressive_decoder_new(opts->decode_block, opts->nthreads);
+  if (!decoder) {
+    if (in_file != stdin) {
+      fclose(in_file);
+    }
+    return 1;
+  }
+
+  static char chunk[65536];
+  uint64_t read_total = 0, written_total = 0, written;
+  int result = 0;
+  bool previewed = false;
+  for (;;) {
+    long n = read_some(in_file, chunk, sizeof(chunk));
+    if (n < 0) {
+      fprintf(stderr, "Failed to read input data.\n");
+      result = 1;
+      break;
+    }
+    StatsTimer timer = stats_timer_start(opts->stats);
+    int pushed = n > 0 ? progressive_decoder_push(decoder, chunk, n)
+                       : progressive_decoder_finish(decoder);
+    stats_timer_stop(opts->stats, "decode", &timer);
+    if (pushed != 0) {
+      result = 1;
+      break;
+    }
+    read_total += n;
+    ProgressiveStage stage = progressive_decoder_stage(decoder);
+    /* 最後まで一度に届いた場合は、下見を出さずに最終的な画像だけを書く */
+    if (stage == PROGRESSIVE_DONE ||
+        (stage == PROGRESSIVE_CODES && !previewed)) {
+      int width, height;
+      const uint8_t *pixels =
+          progressive_decoder_pixels(decoder, &width, &height);
+      bool done = stage == PROGRESSIVE_DONE;
+      fprintf(stderr, done ? "Writing image.\n" : "Writing preview.\n");
+      timer = stats_timer_start(opts->stats);
+      result = write_image(output_file, opts, pixels, width, height, &written);
+      stats_timer_stop(opts->stats, "write", &timer);
+      written_total += written;
+      previewed = true;
+      if (result != 0 || done) {
+        break;
+      }
+    }
+  }
+  if (result != 0) {
+    fprintf(stderr, "Failed to decode image data.\n");
+  }
+  progressive_decoder_free(decoder);
+  if (in_file != stdin) {
+    fclose(in_file);
+  }
+  stats_add_bytes(opts->stats, read_total, written_total);
+  return result;
+}
+
+typedef struct {
+  const BatchManifest *manifest;
+  const DecodeOptions *opts;
+  BatchPool *buffer_pool;
+  int *results;
+} BatchJob;
+
+static void free_pixel_buffer(void *buffer) {
+  g_free(((PixelBuffer *)buffer)->data);
+  free(buffer);
+}
+
+static void decode_batch_entry(void *ctx, int index) {
+  BatchJob *job = (BatchJob *)ctx;
+  const BatchEntry *entry = &job->manifest->entries[index];
+  PixelBuffer *buffer = (PixelBuffer *)batch_pool_take(job->buffer_pool);
+  if (!buffer && !(buffer = (PixelBuffer *)calloc(1, sizeof(PixelBuffer)))) {
+    fprintf(stderr, "Memory allocation failed for PixelBuffer.\n");
+    job->results[index] = 1;
+    return;
+  }
+  job->results[index] =
+      decode_file(entry->input, entry->output, job->opts, buffer);
+  batch_pool_give(job->buffer_pool, buffer);
+  if (job->results[index] != 0) {
+    fprintf(stderr, "Failed to decode %s\n", entry->input);
+  }
+}
+
+/**
+ * @brief リストにあるファイルをまとめて復元する
+ * @note ファイル単位でnthreads個を並列に処理し、各ファイルは1スレッドで復元する
+ * @return すべて成功した場合0、一つでも失敗した場合1
+ */
+static int decode_batch(const char *list_file, const DecodeOptions *opts) {
+  BatchManifest *manifest = batch_manifest_read(list_file);
+  if (!manifest) {
+    return 1;
+  }
+  BatchPool *pool = batch_pool_new(free_pixel_buffer);
+  int *results = (int *)calloc(manifest->count ? manifest->count : 1,
+                               sizeof(int));
+  if (!pool || !results) {
+    fprintf(stderr, "Memory allocation failed for batch.\n");
+    batch_pool_free(pool);
+    free(results);
+    batch_manifest_free(manifest);
+    return 1;
+  }
+
+  DecodeOptions file_opts = *opts;
+  file_opts.nthreads = 1;
+  BatchJob job = {manifest, &file_opts, pool, results};
+  double start = batch_now();
+  parallel_for_rows(manifest->count, opts->nthreads, decode_batch_entry, &job);
+  double elapsed = batch_now() - start;
+
+  int failed = 0;
+  for (int i = 0; i < manifest->count; i++) {
+    failed += results[i] != 0;
+  }
+  fprintf(stderr, "Decoded %d of %d images in %.2f s (%.1f images/s).\n",
+          manifest->count - failed, manifest->count, elapsed,
+          elapsed > 0 ? (manifest->count - failed) / elapsed : 0.0);
+  free(results);
+  batch_pool_free(pool);
+  batch_manifest_free(manifest);
+  return failed ? 1 : 0;
+}
+
+typedef struct {
+  const TemporalFrame *frame;
+  const int32_t *positions; /* 変わったブロックの、画像全体での番号 */
+  decode_block_fn decode_block;
+  uint8_t *pixels;
+} FrameJob;
+
+/**
+ * @brief 変わったブロックのうちk番目を、前の画像の画素の上に復元する
+ */
+static void decode_frame_block(void *ctx, int k) {
+  FrameJob *job = (FrameJob *)ctx;
+  const TemporalFrame *frame = job->frame;
+  int blocks_per_row = frame->width / 8;
+  size_t stride = (size_t)frame->width * 3;
+  int32_t i = job->positions[k];
+  job->decode_block(frame->headers + (size_t)k * BLOCK_HEADER_SIZE,
+                    frame->corners + (size_t)k * BLOCK_CORNERS_SIZE,
+                    frame->codes + (size_t)k * BLOCK_CODES_SIZE,
+                    job->pixels + (size_t)(i / blocks_per_row) * 8 * stride +
+                        (size_t)(i % blocks_per_row) * 8 * 3,
+                    stride);
+}
+
+/**
+ * @brief 前の画像の上に差分のファイルを復元する
+ * @param positions 変わったブロックの番号を置く領域。足りない場合は確保し直す
+ * @return 成功時0、失敗時1
+ */
+static int decode_frame(const TemporalFrame *frame, const DecodeOptions *opts,
+                        uint8_t *pixels, int32_t **positions,
+                        int32_t *capacity) {
+  if (*capacity < frame->changed_count) {
+    free(*positions);
+    *positions = (int32_t *)malloc(sizeof(int32_t) * frame->changed_count);
+    *capacity = *positions ? frame->changed_count : 0;
+    if (!*positions) {
+      fprintf(stderr, "Memory allocation failed for changed blocks.\n");
+      return 1;
+    }
+  }
+  int32_t k = 0;
+  for (int32_t i = 0; i < frame->block_count; i++) {
+    /* 変わらなかったブロックが8個続く部分はまとめて飛ばす */
+    if (i % 8 == 0 && frame->skip[i / 8] == 0xff) {
+      i += 7;
+    } else if (!temporal_is_skipped(frame->skip, i)) {
+      (*positions)[k++] = i;
+    }
+  }
+  StatsTimer timer = stats_timer_start(opts->stats);
+  FrameJob job = {frame, *positions, opts->decode_block, pixels};
+  parallel_for_rows(frame->changed_count, opts->nthreads, decode_frame_block,
+                    &job);
+  stats_timer_stop(opts->stats, "decode", &timer);
+  stats_add_blocks(opts->stats, frame->headers, frame->changed_count);
   return 0;
 }
 
-RGB_Pixel yuv_to_rgb_norm(double Y, double U, double V) {
-  RGB_Pixel rgb;
-  rgb.r = Y + 1.402 * (V - 128);
-  rgb.g = Y - 0.344 * (U - 128) - 0.714 * (V - 128);
-  rgb.b = Y + 1.772 * (U - 128);
-  return rgb;
+/**
+ * @brief リストにあるファイルを順に連続した画像として復元する
+ * @note 差分のファイルは前の画像の画素を残し、変わったブロックだけを描き直す
+ * @return すべて成功した場合0、失敗した場合1
+ */
+static int decode_sequence(const char *list_file, const DecodeOptions *opts) {
+  BatchManifest *manifest = batch_manifest_read(list_file);
+  if (!manifest) {
+    return 1;
+  }
+  PixelBuffer buffer = {NULL, 0};
+  int32_t *positions = NULL;
+  int32_t capacity = 0;
+  int width = 0, height = 0;
+  bool have_frame = false;
+  int64_t total_blocks = 0, redrawn_blocks = 0;
+  int decoded = 0;
+  int result = 0;
+  double start = batch_now();
+
+  for (int f = 0; f < manifest->count && result == 0; f++) {
+    const BatchEntry *entry = &manifest->entries[f];
+    StatsTimer timer = stats_timer_start(opts->stats);
+    bool is_frame;
+    TemporalFrame *frame =
+        temporal_frame_open(entry->input, opts->nthreads, &is_frame);
+    if (frame) {
+      stats_timer_stop(opts->stats, "open", &timer);
+      if (!have_frame || frame->width != width || frame->height != height) {
+        fprintf(stderr, "%s needs the previous frame at the same size.\n",
+                entry->input);
+        result = 1;
+      } else {
+        result = decode_frame(frame, opts, buffer.data, &positions,
+                              &capacity);
+        total_blocks += frame->block_count;
+        redrawn_blocks += frame->changed_count;
+      }
+      temporal_frame_close(frame);
+    } else if (is_frame) {
+      result = 1;
+    } else {
+      /* 差分でないファイルは画像全体を描き直し、次の差分の基準にする */
+      result = decode_image(entry->input, opts, &buffer, &width, &height);
+      have_frame = result == 0;
+      total_blocks += (int64_t)(width / 8) * (height / 8);
+      redrawn_blocks += (int64_t)(width / 8) * (height / 8);
+    }
+
+    if (result == 0) {
+      timer = stats_timer_start(opts->stats);
+      uint64_t written;
+      result = write_image(entry->output, opts, buffer.data, width, height,
+                           &written);
+      stats_timer_stop(opts->stats, "write", &timer);
+      stats_add_bytes(opts->stats, stats_file_size(entry->input), written);
+    }
+    if (result != 0) {
+      fprintf(stderr, "Failed to decode %s\n", entry->input);
+    } else {
+      decoded++;
+    }
+  }
+
+  double elapsed = batch_now() - start;
+  fprintf(stderr,
+          "Decoded %d of %d frames in %.2f s, %lld of %lld blocks redrawn "
+          "(%.1f%%).\n",
+          decoded, manifest->count, elapsed, (long long)redrawn_blocks,
+          (long long)total_blocks,
+          total_blocks ? 100.0 * redrawn_blocks / total_blocks : 0.0);
+  free(positions);
+  g_free(buffer.data);
+  batch_manifest_free(manifest);
+  return result;
 }
 
-int pix_delta_rev(int prev, int delta, int max) { return (prev + delta) % max; }
+int main(int argc, char *argv[]) {
+  if (VIPS_INIT(argv[0])) {
+    vips_error_exit(NULL);
+  }
+
+#ifdef _WIN32
+  WSADATA wsaData;
+  if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+    fprintf(stderr, "WSAStartup failed.\n");
+    return 1;
+  }
+#endif
+
+  const char *positional[2];
+  int npositional = 0;
+  bool strict = false;
+  const char *batch_list = NULL;
+  const char *sequence_list = NULL;
+  bool stats = false, stats_json = false;
+  DecodeOptions opts = {NULL, 1, false, false, 0, 0, 0, 0, NULL, false, 0,
+                        false, RAWIO_PPM};
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      opts.nthreads = atoi(argv[++i]);
+    } else if (strncmp(argv[i], "-j", 2) == 0 && argv[i][2] != '\0') {
+      opts.nthreads = atoi(argv[i] + 2);
+    } else if (strcmp(argv[i], "--strict") == 0) {
+      strict = true;
+    } else if (strcmp(argv[i], "--thumbnail") == 0) {
+      opts.thumbnail = true;
+    } else if (strcmp(argv[i], "--crop") == 0 && i + 1 < argc) {
+      if (sscanf(argv[++i], "%d,%d,%d,%d", &opts.crop_x, &opts.crop_y,
+                 &opts.crop_w, &opts.crop_h) != 4) {
+        fprintf(stderr, "Invalid crop rectangle: %s\n", argv[i]);
+        return 1;
+      }
+      opts.crop = true;
+    } else if (strcmp(argv[i], "--progressive") == 0) {
+      opts.progressive = true;
+    } else if (strcmp(argv[i], "--level") == 0 && i + 1 < argc) {
+      opts.level = atoi(argv[++i]);
+      if (opts.level < 0) {
+        fprintf(stderr, "--level expects a non-negative level.\n");
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--output-format") == 0 && i + 1 < argc) {
+      if (rawio_format_parse(argv[++i], &opts.output_format) != 0) {
+        fprintf(stderr, "Unknown output format: %s\n", argv[i]);
+        return 1;
+      }
+      opts.has_output_format = true;
+    } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+      batch_list = argv[++i];
+    } else if (strcmp(argv[i], "--sequence") == 0 && i + 1 < argc) {
+      sequence_list = argv[++i];
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      stats = true;
+    } else if (strcmp(argv[i], "--stats=json") == 0) {
+      stats = stats_json = true;
+    } else if (npositional < 2) {
+      positional[npositional++] = argv[i];
+    } else {
+      npositional = 0;
+      break;
+    }
+  }
+
+  const char *list = batch_list ? batch_list : sequence_list;
+  if (list ? npositional != 0 : npositional < 2) {
+    fprintf(stderr,
+            "Usage: %s [-j threads] [--strict] [--thumbnail] "
+            "[--crop x,y,w,h] [--progressive] [--level n] "
+            "[--output-format ppm|pam|raw] "
+            "[--stats[=json]] <input_file> <output_file>\n"
+            "       %s [options] --batch <list_file>\n"
+            "       %s [options] --sequence <list_file>\n",
+            argv[0], argv[0], argv[0]);
+    return 1;
+  }
+  if (opts.nthreads <= 0) {
+    opts.nthreads = parallel_cpu_count();
+  }
+  if (opts.crop && opts.thumbnail) {
+    fprintf(stderr, "--crop cannot be combined with --thumbnail.\n");
+    return 1;
+  }
+  if (opts.progressive && (opts.crop || opts.thumbnail || batch_list)) {
+    fprintf(stderr, "--progressive cannot be combined with --crop, "
+                    "--thumbnail or --batch.\n");
+    return 1;
+  }
+  if (opts.progressive && !list &&
+      (opts.level > 0 || pyramid_is_file(positional[0]))) {
+    /* 届いた順に描く復元器は、一つの画像だけを持つ形式を前提にしている */
+    fprintf(stderr, "--progressive cannot read pyramid files.\n");
+    return 1;
+  }
+  if (sequence_list &&
+      (opts.crop || opts.thumbnail || opts.progressive || batch_list)) {
+    /* 差分は前の画像全体の画素の上に描くので、縮小や切り出しとは合わない */
+    fprintf(stderr, "--sequence cannot be combined with --crop, "
+                    "--thumbnail, --progressive or --batch.\n");
+    return 1;
+  }
 
-double interpolate(double tl, double tr, double bl, double br, double u,
-                   double v) {
-  double top = tl * (1 - u) + tr * u;
-  double bottom = bl * (1 - u) + br * u;
-  return top * (1 - v) + bottom * v;
-}
\ No newline at end of file
+  opts.decode_block =
+      decode_kernel_select(strict ? DEC_KERNEL_STRICT : DEC_KERNEL_AUTO);
+  /* バッチでは各ファイルを1スレッドで処理するので、CPU時間はスレッドごとに計る */
+  if (stats && !(opts.stats = stats_new(batch_list != NULL))) {
+    return 1;
+  }
+
+  int result;
+  if (batch_list) {
+    result = decode_batch(batch_list, &opts);
+  } else if (sequence_list) {
+    result = decode_sequence(sequence_list, &opts);
+  } else {
+    PixelBuffer buffer = {NULL, 0};
+    fprintf(stderr, "Decoding...\n");
+    result = opts.progressive
+                 ? decode_progressive(positional[0], positional[1], &opts)
+                 : decode_file(positional[0], positional[1], &opts, &buffer);
+    g_free(buffer.data);
+  }
+  if (opts.stats) {
+    stats_print(opts.stats, stderr, stats_json);
+    stats_free(opts.stats);
+  }
+  vips_shutdown();
+
+#ifdef _WIN32
+  WSACleanup();
+#endif
+  if (result == 0 && !list) {
+    fprintf(stderr, "Done.\n");
+  }
+  return result;
+}
@@ -0,0 +1,895 @@
+#include "enckernel.h"
+#include <math.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ENCKERNEL_X86 1
+#endif
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#define ENCKERNEL_NEON 1
+#endif
+
+/*
+ * SIMDカーネルはYUVを1000倍した整数で扱う。
+ *   Y * 1000 = 299r + 587g + 114b
+ *   U * 1000 = -169r - 331g + 500b + 128000
+ *   V * 1000 = 500r - 419g - 81b + 128000
+ * 量子化値 floor((c - min) / drange * 15.9) は
+ * floor(N * 159 / (10000 * drange)) (N = c * 1000 - min * 1000) と等しいので、
+ * ブロックごとに段の境界値を求めて比較回数を数えれば除算が不要になる。
+ * 真の値がちょうど整数になる場合だけdouble演算の丸めで結果が変わりうるので、
+ * その画素だけ基準実装と同じdouble演算で求め直す。
+ */
+
+static const int quant_levels[3] = {15, 3, 3};
+static const int32_t quant_scale10[3] = {159, 39, 39};
+static const double quant_scale[3] = {15.9, 3.9, 3.9};
+
+typedef void (*quantize_fn)(const int32_t *val, int32_t base,
+                            const int32_t *thresholds, int nthresholds,
+                            uint8_t *q);
+
+void rgb_to_yuv_norm(uint8_t r, uint8_t g, uint8_t b, YUV_Pixel *yuv) {
+  yuv->y = 0.299 * r + 0.587 * g + 0.114 * b;
+  yuv->u = -0.169 * r - 0.331 * g + 0.5 * b + 128;
+  yuv->v = 0.5 * r - 0.419 * g - 0.081 * b + 128;
+}
+
+static int pix_delta(int prev, int now, int max) {
+  if (now >= prev) {
+    return now - prev;
+  } else {
+    return max + now - prev;
+  }
+}
+
+static void get_channel_stats(YUV_Pixel block[8][8], float channel,
+                              uint8_t *min_val, uint8_t *max_val,
+                              int *drange) {
+  double min_d = 256.0, max_d = -1.0;
+  for (int by = 0; by < 8; by++) {
+    for (int bx = 0; bx < 8; bx++) {
+      double val;
+      if (channel == 0)
+        val = block[by][bx].y;
+      else if (channel == 1)
+        val = block[by][bx].u;
+      else
+        val = block[by][bx].v;
+      min_d = fmin(min_d, val);
+      max_d = fmax(max_d, val);
+    }
+  }
+  *max_val = ceil(max_d);
+  *min_val = floor(min_d);
+  *drange = *max_val - *min_val;
+}
+
+static double pixel_channel(const uint8_t *src, size_t stride, int i,
+                            int channel) {
+  const uint8_t *p = src + (i / 8) * stride + (i % 8) * 3;
+  YUV_Pixel yuv;
+  rgb_to_yuv_norm(p[0], p[1], p[2], &yuv);
+  if (channel == 0)
+    return yuv.y;
+  else if (channel == 1)
+    return yuv.u;
+  else
+    return yuv.v;
+}
+
+static int quantize_ref(double c, uint8_t min_val, int drange, double scale) {
+  return floor((c - min_val) / drange * scale);
+}
+
+/**
+ * @param flags ヘッダのBLOCK_FLAGS。特殊化したカーネルからは定数で渡される
+ */
+__attribute__((always_inline)) static inline void
+encode_corners(const uint8_t *src, size_t stride, const uint8_t *header,
+               int drangey, int drangeu, int drangev, int flags,
+               uint8_t *corners) {
+  const bool interpolatey = flags & BLOCK_FLAG_Y;
+  const bool interpolateu = flags & BLOCK_FLAG_U;
+  const bool interpolatev = flags & BLOCK_FLAG_V;
+  int corners_indices[4][2] = {{0, 0}, {0, 7}, {7, 0}, {7, 7}};
+  for (int i = 0; i < 4; i++) {
+    int yi = corners_indices[i][0];
+    int xi = corners_indices[i][1];
+    const uint8_t *p = src + yi * stride + xi * 3;
+    YUV_Pixel yuv;
+    rgb_to_yuv_norm(p[0], p[1], p[2], &yuv);
+    double cy = yuv.y;
+    double cu = yuv.u;
+    double cv = yuv.v;
+
+    int qy, qu, qv;
+    if (interpolatey) {
+      qy = floor(cy / 255.0 * 15.9);
+    } else {
+      qy = (drangey > 0)
+               ? floor((cy - header[BLOCK_MINY]) / drangey * 15.9)
+               : 0;
+    }
+    if (interpolateu) {
+      qu = floor(cu / 255.0 * 3.9);
+    } else {
+      qu = (drangeu > 0)
+               ? floor((cu - header[BLOCK_MINU]) / drangeu * 3.9)
+               : 0;
+    }
+    if (interpolatev) {
+      qv = floor(cv / 255.0 * 3.9);
+    } else {
+      qv = (drangev > 0)
+               ? floor((cv - header[BLOCK_MINV]) / drangev * 3.9)
+               : 0;
+    }
+    corners[i] = (qy * 4 + qu) * 4 + qv;
+  }
+}
+
+/**
+ * @brief 基準実装の量子化と四隅。flagsを定数として展開し、組み合わせごとに
+ *        特殊化する
+ * @note 補間するチャンネルの段は常に0なので、差分も0のまま計算しない
+ */
+__attribute__((always_inline)) static inline void
+encode_codes_scalar_with(const uint8_t *src, size_t stride,
+                         YUV_Pixel block_yuv[8][8], const uint8_t *header,
+                         const int drange[3], uint8_t *corners,
+                         uint8_t *codes, int flags) {
+  const bool interpolatey = flags & BLOCK_FLAG_Y;
+  const bool interpolateu = flags & BLOCK_FLAG_U;
+  const bool interpolatev = flags & BLOCK_FLAG_V;
+  int prevy = 0, prevu = 0, prevv = 0;
+
+  for (int yi = 0; yi < 8; yi++) {
+    for (int xi = 0; xi < 8; xi++) {
+      int y_delta = 0, u_delta = 0, v_delta = 0;
+      if (!interpolatey) {
+        int qy = floor((block_yuv[yi][xi].y - header[BLOCK_MINY]) /
+                       drange[0] * 15.9);
+        y_delta = pix_delta(prevy, qy, 16);
+        prevy = qy;
+      }
+      if (!interpolateu) {
+        int qu = floor((block_yuv[yi][xi].u - header[BLOCK_MINU]) /
+                       drange[1] * 3.9);
+        u_delta = pix_delta(prevu, qu, 4);
+        prevu = qu;
+      }
+      if (!interpolatev) {
+        int qv = floor((block_yuv[yi][xi].v - header[BLOCK_MINV]) /
+                       drange[2] * 3.9);
+        v_delta = pix_delta(prevv, qv, 4);
+        prevv = qv;
+      }
+      codes[yi * 8 + xi] = (y_delta * 4 + u_delta) * 4 + v_delta;
+    }
+  }
+
+  encode_corners(src, stride, header, drange[0], drange[1], drange[2], flags,
+                 corners);
+}
+
+typedef void (*encode_codes_scalar_fn)(const uint8_t *src, size_t stride,
+                                       YUV_Pixel block_yuv[8][8],
+                                       const uint8_t *header,
+                                       const int drange[3], uint8_t *corners,
+                                       uint8_t *codes);
+
+#define ENCODE_SCALAR_FLAGS(name, flags)                                       \
+  static void name##_##flags(const uint8_t *src, size_t stride,                \
+                             YUV_Pixel block_yuv[8][8], const uint8_t *header, \
+                             const int drange[3], uint8_t *corners,            \
+                             uint8_t *codes) {                                 \
+    encode_codes_scalar_with(src, stride, block_yuv, header, drange, corners,  \
+                             codes, flags);                                    \
+  }
+BLOCK_FLAGS_EACH(ENCODE_SCALAR_FLAGS, encode_codes_scalar)
+
+void encode_block_scalar(const uint8_t *src, size_t stride, int compress_level,
+                         uint8_t *header, uint8_t *corners, uint8_t *codes) {
+  static const encode_codes_scalar_fn by_flags[8] =
+      BLOCK_FLAGS_TABLE(encode_codes_scalar);
+  YUV_Pixel block_yuv[8][8];
+  for (int by = 0; by < 8; by++) {
+    for (int bx = 0; bx < 8; bx++) {
+      const uint8_t *p = src + by * stride + bx * 3;
+      rgb_to_yuv_norm(p[0], p[1], p[2], &block_yuv[by][bx]);
+    }
+  }
+
+  int drange[3];
+
+  get_channel_stats(block_yuv, 0, &header[BLOCK_MINY], &header[BLOCK_MAXY],
+                    &drange[0]);
+  get_channel_stats(block_yuv, 1, &header[BLOCK_MINU], &header[BLOCK_MAXU],
+                    &drange[1]);
+  get_channel_stats(block_yuv, 2, &header[BLOCK_MINV], &header[BLOCK_MAXV],
+                    &drange[2]);
+
+  bool interpolatey = (drange[0] < compress_level / 2);
+  bool interpolateu = (drange[1] < compress_level);
+  bool interpolatev = (drange[2] < compress_level);
+  header[BLOCK_FLAGS] = block_flags(interpolatey, interpolateu, interpolatev);
+
+  by_flags[header[BLOCK_FLAGS]](src, stride, block_yuv, header, drange,
+                                corners, codes);
+}
+
+/**
+ * @brief 1000倍値の最小・最大から基準実装と同じfloor/ceilを求める
+ */
+static int fixed_channel_stats(const uint8_t *src, size_t stride,
+                               const int32_t *val, int channel, int32_t vmin,
+                               int32_t vmax, uint8_t *min_val,
+                               uint8_t *max_val) {
+  int lo = vmin / 1000;
+  if (vmin % 1000 == 0) {
+    for (int i = 0; i < 64; i++) {
+      if (val[i] == vmin && pixel_channel(src, stride, i, channel) < lo) {
+        lo--;
+        break;
+      }
+    }
+  }
+  int hi = vmax / 1000;
+  if (vmax % 1000 != 0) {
+    hi++;
+  } else {
+    for (int i = 0; i < 64; i++) {
+      if (val[i] == vmax && pixel_channel(src, stride, i, channel) > hi) {
+        hi++;
+        break;
+      }
+    }
+  }
+  *min_val = (uint8_t)lo;
+  *max_val = (uint8_t)hi;
+  return *max_val - *min_val;
+}
+
+__attribute__((always_inline)) static inline void
+quantize_channel(const uint8_t *src, size_t stride, const int32_t *val,
+                 int channel, uint8_t min_val, int drange,
+                 quantize_fn quantize, uint8_t *q) {
+  int levels = quant_levels[channel];
+  int32_t scale10 = quant_scale10[channel];
+  int32_t base = 1000 * min_val;
+  int32_t thresholds[15];
+  bool exact[15];
+  bool any_exact = false;
+  for (int m = 1; m <= levels; m++) {
+    int32_t num = m * 10000 * drange;
+    thresholds[m - 1] = (num + scale10 - 1) / scale10 - 1;
+    exact[m - 1] = (num % scale10 == 0);
+    any_exact |= exact[m - 1];
+  }
+
+  quantize(val, base, thresholds, levels, q);
+
+  if (!any_exact) {
+    return;
+  }
+  for (int m = 1; m <= levels; m++) {
+    if (!exact[m - 1]) {
+      continue;
+    }
+    for (int i = 0; i < 64; i++) {
+      if (val[i] - base == thresholds[m - 1] + 1) {
+        q[i] = quantize_ref(pixel_channel(src, stride, i, channel), min_val,
+                            drange, quant_scale[channel]);
+      }
+    }
+  }
+}
+
+/**
+ * @brief 段の差分を詰める。補間するチャンネルの差分は常に0なので読まない
+ */
+__attribute__((always_inline)) static inline void
+pack_codes(const uint8_t q[3][64], int flags, uint8_t *out) {
+  for (int i = 0; i < 64; i++) {
+    int dy = (flags & BLOCK_FLAG_Y)
+                 ? 0
+                 : (q[0][i] - (i ? q[0][i - 1] : 0)) & 15;
+    int du = (flags & BLOCK_FLAG_U)
+                 ? 0
+                 : (q[1][i] - (i ? q[1][i - 1] : 0)) & 3;
+    int dv = (flags & BLOCK_FLAG_V)
+                 ? 0
+                 : (q[2][i] - (i ? q[2][i - 1] : 0)) & 3;
+    out[i] = (dy * 4 + du) * 4 + dv;
+  }
+}
+
+/**
+ * @brief 補間しないチャンネルを量子化し、画素と四隅の面を書く
+ * @param flags ヘッダのBLOCK_FLAGS。ENCODE_KERNELが定数を渡して展開する
+ */
+__attribute__((always_inline)) static inline void
+encode_codes_fixed_with(const uint8_t *src, size_t stride,
+                        const uint8_t *header, const int32_t val[3][64],
+                        const int drange[3], uint8_t *corners, uint8_t *codes,
+                        int flags, quantize_fn quantize) {
+  static const int channel_flags[3] = {BLOCK_FLAG_Y, BLOCK_FLAG_U,
+                                       BLOCK_FLAG_V};
+  uint8_t q[3][64];
+  for (int c = 0; c < 3; c++) {
+    if (!(flags & channel_flags[c])) {
+      quantize_channel(src, stride, val[c], c, header[BLOCK_MINY + c * 2],
+                       drange[c], quantize, q[c]);
+    }
+  }
+  pack_codes(q, flags, codes);
+  encode_corners(src, stride, header, drange[0], drange[1], drange[2], flags,
+                 corners);
+}
+
+typedef void (*encode_codes_fn)(const uint8_t *src, size_t stride,
+                                const uint8_t *header,
+                                const int32_t val[3][64], const int drange[3],
+                                uint8_t *corners, uint8_t *codes);
+
+/**
+ * @brief 変換済みの1000倍YUVからブロックを仕上げる。SIMDカーネル共通部分
+ * @param by_flags 補間の組み合わせごとに特殊化した残りの処理の表
+ */
+static void encode_block_fixed(const uint8_t *src, size_t stride,
+                               int compress_level, uint8_t *header,
+                               uint8_t *corners, uint8_t *codes,
+                               const int32_t val[3][64], const int32_t vmin[3],
+                               const int32_t vmax[3],
+                               const encode_codes_fn by_flags[8]) {
+  uint8_t *mins[3] = {&header[BLOCK_MINY], &header[BLOCK_MINU],
+                      &header[BLOCK_MINV]};
+  uint8_t *maxs[3] = {&header[BLOCK_MAXY], &header[BLOCK_MAXU],
+                      &header[BLOCK_MAXV]};
+  int drange[3];
+  for (int c = 0; c < 3; c++) {
+    drange[c] = fixed_channel_stats(src, stride, val[c], c, vmin[c], vmax[c],
+                                    mins[c], maxs[c]);
+  }
+
+  bool interp[3] = {drange[0] < compress_level / 2,
+                    drange[1] < compress_level, drange[2] < compress_level};
+  header[BLOCK_FLAGS] = block_flags(interp[0], interp[1], interp[2]);
+
+  for (int c = 0; c < 3; c++) {
+    if (!interp[c] && drange[c] <= 0) {
+      /* 0除算になるブロックは基準実装の挙動をそのまま使う */
+      encode_block_scalar(src, stride, compress_level, header, corners, codes);
+      return;
+    }
+  }
+
+  by_flags[header[BLOCK_FLAGS]](src, stride, header, val, drange, corners,
+                                codes);
+}
+
+#define ENCODE_CODES_FLAGS(name, attr, quantize, flags)                        \
+  attr static void name##_codes_##flags(                                       \
+      const uint8_t *src, size_t stride, const uint8_t *header,                \
+      const int32_t val[3][64], const int drange[3], uint8_t *corners,         \
+      uint8_t *codes) {                                                        \
+    encode_codes_fixed_with(src, stride, header, val, drange, corners, codes,  \
+                            flags, quantize);                                  \
+  }
+
+/*
+ * 量子化を補間の組み合わせごとに特殊化したname_codes_0からname_codes_7と、
+ * convertで変換してからそれらを表で引いて呼ぶnameを定義する
+ */
+#define ENCODE_KERNEL(name, attr, convert, quantize)                           \
+  BLOCK_FLAGS_EACH(ENCODE_CODES_FLAGS, name, attr, quantize)                   \
+  attr static void name(const uint8_t *src, size_t stride, int compress_level, \
+                        uint8_t *header, uint8_t *corners, uint8_t *codes) {   \
+    static const encode_codes_fn by_flags[8] =                                 \
+        BLOCK_FLAGS_TABLE(name##_codes);                                       \
+    int32_t val[3][64], vmin[3], vmax[3];                                      \
+    convert(src, stride, val, vmin, vmax);                                     \
+    encode_block_fixed(src, stride, compress_level, header, corners, codes,    \
+                       val, vmin, vmax, by_flags);                             \
+  }
+
+/*
+ * chroma-420のカーネル。輝度は他のカーネルと同じく画素ごとに量子化し、
+ * 色差は4x4の区画ごとに2x2画素の平均を求めてから量子化する。
+ * 1000倍したU, Vは整数なので、区画の4画素の和 (平均の4000倍) も整数で
+ * 正確に求まる。色差の範囲と段はこの和から整数演算だけで決めるので、
+ * どのカーネルでも同じになる。
+ */
+
+#define CHROMA420_SCALE 4000
+
+static void chroma420_sums_rgb(const uint8_t *src, size_t stride,
+                               int32_t sum[2][16]) {
+  memset(sum, 0, sizeof(int32_t) * 2 * 16);
+  for (int i = 0; i < 64; i++) {
+    const uint8_t *p = src + (i / 8) * stride + (i % 8) * 3;
+    int cell = CHROMA420_CELL(i);
+    sum[0][cell] += -169 * p[0] - 331 * p[1] + 500 * p[2] + 128000;
+    sum[1][cell] += 500 * p[0] - 419 * p[1] - 81 * p[2] + 128000;
+  }
+}
+
+__attribute__((always_inline)) static inline void
+chroma420_sums_fixed(const int32_t val[3][64], int32_t sum[2][16]) {
+  for (int c = 0; c < 2; c++) {
+    const int32_t *v = val[c + 1];
+    for (int k = 0; k < 16; k++) {
+      int i = (k / 4) * 16 + (k % 4) * 2;
+      sum[c][k] = v[i] + v[i + 1] + v[i + 8] + v[i + 9];
+    }
+  }
+}
+
+/**
+ * @brief 区画の和から色差の範囲を求める
+ * @note Uは最大255.5になるので、最大値は255で打ち切る
+ */
+static int chroma420_stats(const int32_t *sum, uint8_t *min_val,
+                           uint8_t *max_val) {
+  int32_t lo = sum[0], hi = sum[0];
+  for (int k = 1; k < 16; k++) {
+    lo = sum[k] < lo ? sum[k] : lo;
+    hi = sum[k] > hi ? sum[k] : hi;
+  }
+  /* 和は常に正なので、除算の切り捨てがfloorになる */
+  int min = lo / CHROMA420_SCALE;
+  int max = (hi + CHROMA420_SCALE - 1) / CHROMA420_SCALE;
+  max = max < 255 ? max : 255;
+  *min_val = (uint8_t)min;
+  *max_val = (uint8_t)max;
+  return max - min;
+}
+
+/**
+ * @brief floor((sum / 4000 - min) / drange * 3.9) を3で打ち切った段を求める
+ * @note (sum - 4000 * min) * 39 を 40000 * drange の倍数と比べて数えるので、
+ *       区画ごとの除算は要らない
+ */
+static void chroma420_levels(const int32_t *sum, int min_val, int drange,
+                             uint8_t *q) {
+  if (drange <= 0) {
+    memset(q, 0, 16);
+    return;
+  }
+  int32_t step = CHROMA420_SCALE * 10 * drange;
+  for (int k = 0; k < 16; k++) {
+    int32_t n = (sum[k] - CHROMA420_SCALE * min_val) * 39;
+    q[k] = (n >= step) + (n >= step * 2) + (n >= step * 3);
+  }
+}
+
+/**
+ * @brief 輝度の段が決まったブロックの色差を量子化し、面を書く
+ * @param qy 輝度の段。補間する場合とdrangeyが0の場合は読まない
+ * @param sum 区画ごとのU, Vの和
+ */
+__attribute__((always_inline)) static inline void
+encode_chroma420_finish(const uint8_t *src, size_t stride, int compress_level,
+                        uint8_t *header, int drangey, const uint8_t *qy,
+                        const int32_t sum[2][16], uint8_t *corners,
+                        uint8_t *codes) {
+  bool interpy = drangey < compress_level / 2;
+  int drange[2];
+  bool interp[2];
+  uint8_t q[2][16];
+  for (int c = 0; c < 2; c++) {
+    drange[c] = chroma420_stats(sum[c], &header[BLOCK_MINU + c * 2],
+                                &header[BLOCK_MAXU + c * 2]);
+    interp[c] = drange[c] < compress_level;
+    if (interp[c]) {
+      memset(q[c], 0, 16);
+    } else {
+      chroma420_levels(sum[c], header[BLOCK_MINU + c * 2], drange[c], q[c]);
+    }
+  }
+  header[BLOCK_FLAGS] = block_flags(interpy, interp[0], interp[1]) |
+                        BLOCK_FLAG_CHROMA420;
+
+  memset(codes, 0, BLOCK_CODES_SIZE);
+  if (!interpy && drangey > 0) {
+    for (int i = 0; i < 64; i++) {
+      int dy = (qy[i] - (i ? qy[i - 1] : 0)) & 15;
+      codes[i / 2] |= dy << (i % 2 ? 0 : 4);
+    }
+  }
+  for (int k = 0; k < 16; k++) {
+    int du = (q[0][k] - (k ? q[0][k - 1] : 0)) & 3;
+    int dv = (q[1][k] - (k ? q[1][k - 1] : 0)) & 3;
+    codes[CHROMA420_Y_SIZE + k / 2] |= ((du << 2) | dv) << (k % 2 ? 0 : 4);
+  }
+
+  /* 色差の四隅は、四隅の区画の平均から求める */
+  static const int corner_pixels[4] = {0, 7, 56, 63};
+  static const int corner_cells[4] = {0, 3, 12, 15};
+  for (int j = 0; j < 4; j++) {
+    int i = corner_pixels[j];
+    int cy;
+    if (interpy) {
+      YUV_Pixel yuv;
+      const uint8_t *p = src + (i / 8) * stride + (i % 8) * 3;
+      rgb_to_yuv_norm(p[0], p[1], p[2], &yuv);
+      cy = floor(yuv.y / 255.0 * 15.9);
+    } else {
+      cy = drangey > 0 ? qy[i] : 0;
+    }
+    int cq[2];
+    for (int c = 0; c < 2; c++) {
+      int32_t s = sum[c][corner_cells[j]];
+      cq[c] = interp[c] ? s * 39 / (CHROMA420_SCALE * 10 * 255)
+                        : q[c][corner_cells[j]];
+    }
+    corners[j] = (cy * 4 + cq[0]) * 4 + cq[1];
+  }
+}
+
+void encode_chroma420_scalar(const uint8_t *src, size_t stride,
+                             int compress_level, uint8_t *header,
+                             uint8_t *corners, uint8_t *codes) {
+  YUV_Pixel block_yuv[8][8];
+  for (int by = 0; by < 8; by++) {
+    for (int bx = 0; bx < 8; bx++) {
+      const uint8_t *p = src + by * stride + bx * 3;
+      rgb_to_yuv_norm(p[0], p[1], p[2], &block_yuv[by][bx]);
+    }
+  }
+  int drangey;
+  get_channel_stats(block_yuv, 0, &header[BLOCK_MINY], &header[BLOCK_MAXY],
+                    &drangey);
+  uint8_t qy[64];
+  if (!(drangey < compress_level / 2) && drangey > 0) {
+    for (int i = 0; i < 64; i++) {
+      qy[i] = quantize_ref(block_yuv[i / 8][i % 8].y, header[BLOCK_MINY],
+                           drangey, 15.9);
+    }
+  }
+  int32_t sum[2][16];
+  chroma420_sums_rgb(src, stride, sum);
+  encode_chroma420_finish(src, stride, compress_level, header, drangey, qy,
+                          sum, corners, codes);
+}
+
+__attribute__((always_inline)) static inline void
+encode_chroma420_fixed(const uint8_t *src, size_t stride, int compress_level,
+                       uint8_t *header, uint8_t *corners, uint8_t *codes,
+                       const int32_t val[3][64], const int32_t vmin[3],
+                       const int32_t vmax[3], quantize_fn quantize) {
+  int drangey =
+      fixed_channel_stats(src, stride, val[0], 0, vmin[0], vmax[0],
+                          &header[BLOCK_MINY], &header[BLOCK_MAXY]);
+  uint8_t qy[64];
+  if (!(drangey < compress_level / 2) && drangey > 0) {
+    quantize_channel(src, stride, val[0], 0, header[BLOCK_MINY], drangey,
+                     quantize, qy);
+  }
+  int32_t sum[2][16];
+  chroma420_sums_fixed(val, sum);
+  encode_chroma420_finish(src, stride, compress_level, header, drangey, qy,
+                          sum, corners, codes);
+}
+
+/*
+ * convertで変換し、輝度をquantizeで量子化するchroma-420のカーネルnameを定義する
+ */
+#define ENCODE_CHROMA420_KERNEL(name, attr, convert, quantize)                 \
+  attr static void name(const uint8_t *src, size_t stride, int compress_level, \
+                        uint8_t *header, uint8_t *corners, uint8_t *codes) {   \
+    int32_t val[3][64], vmin[3], vmax[3];                                      \
+    convert(src, stride, val, vmin, vmax);                                     \
+    encode_chroma420_fixed(src, stride, compress_level, header, corners,       \
+                           codes, val, vmin, vmax, quantize);                  \
+  }
+
+#ifdef ENCKERNEL_X86
+
+static void deinterleave_block(const uint8_t *src, size_t stride,
+                               uint8_t rgb[3][64]) {
+  for (int by = 0; by < 8; by++) {
+    const uint8_t *row = src + by * stride;
+    for (int bx = 0; bx < 8; bx++) {
+      rgb[0][by * 8 + bx] = row[bx * 3];
+      rgb[1][by * 8 + bx] = row[bx * 3 + 1];
+      rgb[2][by * 8 + bx] = row[bx * 3 + 2];
+    }
+  }
+}
+
+__attribute__((target("sse2"))) static __m128i pair_epi16(int16_t lo,
+                                                          int16_t hi) {
+  return _mm_set1_epi32((int32_t)((uint16_t)lo | ((uint32_t)(uint16_t)hi << 16)));
+}
+
+__attribute__((target("sse2"))) static __m128i min_epi32_sse2(__m128i a,
+                                                              __m128i b) {
+  __m128i gt = _mm_cmpgt_epi32(a, b);
+  return _mm_or_si128(_mm_and_si128(gt, b), _mm_andnot_si128(gt, a));
+}
+
+__attribute__((target("sse2"))) static __m128i max_epi32_sse2(__m128i a,
+                                                              __m128i b) {
+  __m128i gt = _mm_cmpgt_epi32(a, b);
+  return _mm_or_si128(_mm_and_si128(gt, a), _mm_andnot_si128(gt, b));
+}
+
+__attribute__((target("sse2"))) static int32_t hmin_epi32_sse2(__m128i v) {
+  v = min_epi32_sse2(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+  v = min_epi32_sse2(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(v);
+}
+
+__attribute__((target("sse2"))) static int32_t hmax_epi32_sse2(__m128i v) {
+  v = max_epi32_sse2(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+  v = max_epi32_sse2(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(v);
+}
+
+__attribute__((target("sse2"))) static void
+convert_sse2(const uint8_t *src, size_t stride, int32_t val[3][64],
+             int32_t vmin[3], int32_t vmax[3]) {
+  uint8_t rgb[3][64];
+  deinterleave_block(src, stride, rgb);
+
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i offset = _mm_set1_epi32(128000);
+  const __m128i k_rg[3] = {pair_epi16(299, 587), pair_epi16(-169, -331),
+                           pair_epi16(500, -419)};
+  const __m128i k_b[3] = {pair_epi16(114, 0), pair_epi16(500, 0),
+                          pair_epi16(-81, 0)};
+  __m128i mn[3], mx[3];
+  for (int c = 0; c < 3; c++) {
+    mn[c] = _mm_set1_epi32(INT32_MAX);
+    mx[c] = _mm_set1_epi32(INT32_MIN);
+  }
+
+  for (int i = 0; i < 64; i += 8) {
+    __m128i r = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(rgb[0] + i)), zero);
+    __m128i g = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(rgb[1] + i)), zero);
+    __m128i b = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(rgb[2] + i)), zero);
+    __m128i rg[2] = {_mm_unpacklo_epi16(r, g), _mm_unpackhi_epi16(r, g)};
+    __m128i b0[2] = {_mm_unpacklo_epi16(b, zero), _mm_unpackhi_epi16(b, zero)};
+    for (int h = 0; h < 2; h++) {
+      for (int c = 0; c < 3; c++) {
+        __m128i v = _mm_add_epi32(_mm_madd_epi16(rg[h], k_rg[c]),
+                                  _mm_madd_epi16(b0[h], k_b[c]));
+        if (c != 0) {
+          v = _mm_add_epi32(v, offset);
+        }
+        _mm_storeu_si128((__m128i *)(val[c] + i + h * 4), v);
+        mn[c] = min_epi32_sse2(mn[c], v);
+        mx[c] = max_epi32_sse2(mx[c], v);
+      }
+    }
+  }
+  for (int c = 0; c < 3; c++) {
+    vmin[c] = hmin_epi32_sse2(mn[c]);
+    vmax[c] = hmax_epi32_sse2(mx[c]);
+  }
+}
+
+__attribute__((target("sse2"))) static void
+quantize_sse2(const int32_t *val, int32_t base, const int32_t *thresholds,
+              int nthresholds, uint8_t *q) {
+  const __m128i vbase = _mm_set1_epi32(base);
+  for (int i = 0; i < 64; i += 8) {
+    __m128i n0 = _mm_sub_epi32(_mm_loadu_si128((const __m128i *)(val + i)), vbase);
+    __m128i n1 = _mm_sub_epi32(_mm_loadu_si128((const __m128i *)(val + i + 4)), vbase);
+    __m128i c0 = _mm_setzero_si128();
+    __m128i c1 = _mm_setzero_si128();
+    for (int m = 0; m < nthresholds; m++) {
+      __m128i t = _mm_set1_epi32(thresholds[m]);
+      c0 = _mm_sub_epi32(c0, _mm_cmpgt_epi32(n0, t));
+      c1 = _mm_sub_epi32(c1, _mm_cmpgt_epi32(n1, t));
+    }
+    __m128i c16 = _mm_packs_epi32(c0, c1);
+    _mm_storel_epi64((__m128i *)(q + i), _mm_packus_epi16(c16, c16));
+  }
+}
+
+ENCODE_KERNEL(encode_block_sse2, __attribute__((target("sse2"))), convert_sse2,
+              quantize_sse2)
+ENCODE_CHROMA420_KERNEL(encode_chroma420_sse2, __attribute__((target("sse2"))),
+                        convert_sse2, quantize_sse2)
+
+__attribute__((target("avx2"))) static void
+convert_avx2(const uint8_t *src, size_t stride, int32_t val[3][64],
+             int32_t vmin[3], int32_t vmax[3]) {
+  uint8_t rgb[3][64];
+  deinterleave_block(src, stride, rgb);
+
+  static const int32_t k[3][3] = {
+      {299, 587, 114}, {-169, -331, 500}, {500, -419, -81}};
+  static const int32_t offset[3] = {0, 128000, 128000};
+  __m256i mn[3], mx[3];
+  for (int c = 0; c < 3; c++) {
+    mn[c] = _mm256_set1_epi32(INT32_MAX);
+    mx[c] = _mm256_set1_epi32(INT32_MIN);
+  }
+
+  for (int i = 0; i < 64; i += 8) {
+    __m256i r = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(rgb[0] + i)));
+    __m256i g = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(rgb[1] + i)));
+    __m256i b = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(rgb[2] + i)));
+    for (int c = 0; c < 3; c++) {
+      __m256i v = _mm256_add_epi32(
+          _mm256_add_epi32(_mm256_mullo_epi32(r, _mm256_set1_epi32(k[c][0])),
+                           _mm256_mullo_epi32(g, _mm256_set1_epi32(k[c][1]))),
+          _mm256_add_epi32(_mm256_mullo_epi32(b, _mm256_set1_epi32(k[c][2])),
+                           _mm256_set1_epi32(offset[c])));
+      _mm256_storeu_si256((__m256i *)(val[c] + i), v);
+      mn[c] = _mm256_min_epi32(mn[c], v);
+      mx[c] = _mm256_max_epi32(mx[c], v);
+    }
+  }
+  for (int c = 0; c < 3; c++) {
+    __m128i lo = _mm_min_epi32(_mm256_castsi256_si128(mn[c]),
+                               _mm256_extracti128_si256(mn[c], 1));
+    lo = _mm_min_epi32(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(1, 0, 3, 2)));
+    lo = _mm_min_epi32(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(2, 3, 0, 1)));
+    vmin[c] = _mm_cvtsi128_si32(lo);
+    __m128i hi = _mm_max_epi32(_mm256_castsi256_si128(mx[c]),
+                               _mm256_extracti128_si256(mx[c], 1));
+    hi = _mm_max_epi32(hi, _mm_shuffle_epi32(hi, _MM_SHUFFLE(1, 0, 3, 2)));
+    hi = _mm_max_epi32(hi, _mm_shuffle_epi32(hi, _MM_SHUFFLE(2, 3, 0, 1)));
+    vmax[c] = _mm_cvtsi128_si32(hi);
+  }
+}
+
+__attribute__((target("avx2"))) static void
+quantize_avx2(const int32_t *val, int32_t base, const int32_t *thresholds,
+              int nthresholds, uint8_t *q) {
+  const __m256i vbase = _mm256_set1_epi32(base);
+  for (int i = 0; i < 64; i += 16) {
+    __m256i n0 = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)(val + i)), vbase);
+    __m256i n1 = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)(val + i + 8)), vbase);
+    __m256i c0 = _mm256_setzero_si256();
+    __m256i c1 = _mm256_setzero_si256();
+    for (int m = 0; m < nthresholds; m++) {
+      __m256i t = _mm256_set1_epi32(thresholds[m]);
+      c0 = _mm256_sub_epi32(c0, _mm256_cmpgt_epi32(n0, t));
+      c1 = _mm256_sub_epi32(c1, _mm256_cmpgt_epi32(n1, t));
+    }
+    /* packsはレーン内で詰めるので、最後に64bit単位で並べ直す */
+    __m256i c16 = _mm256_packs_epi32(c0, c1);
+    __m256i c8 = _mm256_packus_epi16(c16, c16);
+    c8 = _mm256_permutevar8x32_epi32(c8, _mm256_setr_epi32(0, 4, 1, 5, 0, 0, 0, 0));
+    _mm_storeu_si128((__m128i *)(q + i), _mm256_castsi256_si128(c8));
+  }
+}
+
+ENCODE_KERNEL(encode_block_avx2, __attribute__((target("avx2"))), convert_avx2,
+              quantize_avx2)
+ENCODE_CHROMA420_KERNEL(encode_chroma420_avx2, __attribute__((target("avx2"))),
+                        convert_avx2, quantize_avx2)
+
+#endif
+
+#ifdef ENCKERNEL_NEON
+
+static void convert_neon(const uint8_t *src, size_t stride, int32_t val[3][64],
+                         int32_t vmin[3], int32_t vmax[3]) {
+  int32x4_t mn[3], mx[3];
+  for (int c = 0; c < 3; c++) {
+    mn[c] = vdupq_n_s32(INT32_MAX);
+    mx[c] = vdupq_n_s32(INT32_MIN);
+  }
+  const int32x4_t offset = vdupq_n_s32(128000);
+
+  for (int by = 0; by < 8; by++) {
+    uint8x8x3_t px = vld3_u8(src + by * stride);
+    int16x8_t r = vreinterpretq_s16_u16(vmovl_u8(px.val[0]));
+    int16x8_t g = vreinterpretq_s16_u16(vmovl_u8(px.val[1]));
+    int16x8_t b = vreinterpretq_s16_u16(vmovl_u8(px.val[2]));
+    for (int h = 0; h < 2; h++) {
+      int16x4_t rh = h ? vget_high_s16(r) : vget_low_s16(r);
+      int16x4_t gh = h ? vget_high_s16(g) : vget_low_s16(g);
+      int16x4_t bh = h ? vget_high_s16(b) : vget_low_s16(b);
+      int32x4_t v[3];
+      v[0] = vmlal_n_s16(vmlal_n_s16(vmull_n_s16(rh, 299), gh, 587), bh, 114);
+      v[1] = vaddq_s32(
+          vmlal_n_s16(vmlal_n_s16(vmull_n_s16(rh, -169), gh, -331), bh, 500),
+          offset);
+      v[2] = vaddq_s32(
+          vmlal_n_s16(vmlal_n_s16(vmull_n_s16(rh, 500), gh, -419), bh, -81),
+          offset);
+      for (int c = 0; c < 3; c++) {
+        vst1q_s32(val[c] + by * 8 + h * 4, v[c]);
+        mn[c] = vminq_s32(mn[c], v[c]);
+        mx[c] = vmaxq_s32(mx[c], v[c]);
+      }
+    }
+  }
+  for (int c = 0; c < 3; c++) {
+    vmin[c] = vminvq_s32(mn[c]);
+    vmax[c] = vmaxvq_s32(mx[c]);
+  }
+}
+
+static void quantize_neon(const int32_t *val, int32_t base,
+                          const int32_t *thresholds, int nthresholds,
+                          uint8_t *q) {
+  const int32x4_t vbase = vdupq_n_s32(base);
+  for (int i = 0; i < 64; i += 8) {
+    int32x4_t n0 = vsubq_s32(vld1q_s32(val + i), vbase);
+    int32x4_t n1 = vsubq_s32(vld1q_s32(val + i + 4), vbase);
+    int32x4_t c0 = vdupq_n_s32(0);
+    int32x4_t c1 = vdupq_n_s32(0);
+    for (int m = 0; m < nthresholds; m++) {
+      int32x4_t t = vdupq_n_s32(thresholds[m]);
+      c0 = vsubq_s32(c0, vreinterpretq_s32_u32(vcgtq_s32(n0, t)));
+      c1 = vsubq_s32(c1, vreinterpretq_s32_u32(vcgtq_s32(n1, t)));
+    }
+    int16x8_t c16 = vcombine_s16(vqmovn_s32(c0), vqmovn_s32(c1));
+    vst1_u8(q + i, vqmovun_s16(c16));
+  }
+}
+
+ENCODE_KERNEL(encode_block_neon, , convert_neon, quantize_neon)
+ENCODE_CHROMA420_KERNEL(encode_chroma420_neon, , convert_neon, quantize_neon)
+
+#endif
+
+encode_block_fn encode_kernel_select(EncKernel kernel, bool chroma420) {
+  switch (kernel) {
+  case ENC_KERNEL_SCALAR:
+    return chroma420 ? encode_chroma420_scalar : encode_block_scalar;
+  case ENC_KERNEL_SSE2:
+#ifdef ENCKERNEL_X86
+    if (__builtin_cpu_supports("sse2")) {
+      return chroma420 ? encode_chroma420_sse2 : encode_block_sse2;
+    }
+#endif
+    return NULL;
+  case ENC_KERNEL_AVX2:
+#ifdef ENCKERNEL_X86
+    if (__builtin_cpu_supports("avx2")) {
+      return chroma420 ? encode_chroma420_avx2 : encode_block_avx2;
+    }
+#endif
+    return NULL;
+  case ENC_KERNEL_NEON:
+#ifdef ENCKERNEL_NEON
+    return chroma420 ? encode_chroma420_neon : encode_block_neon;
+#else
+    return NULL;
+#endif
+  case ENC_KERNEL_AUTO:
+  default:
+    break;
+  }
+
+  static const EncKernel preferred[] = {ENC_KERNEL_AVX2, ENC_KERNEL_SSE2,
+                                        ENC_KERNEL_NEON};
+  for (size_t i = 0; i < sizeof(preferred) / sizeof(preferred[0]); i++) {
+    encode_block_fn fn = encode_kernel_select(preferred[i], chroma420);
+    if (fn) {
+      return fn;
+    }
+  }
+  return chroma420 ? encode_chroma420_scalar : encode_block_scalar;
+}
+
+int encode_kernel_parse(const char *name, EncKernel *kernel) {
+  static const struct {
+    const char *name;
+    EncKernel kernel;
+  } names[] = {
+      {"auto", ENC_KERNEL_AUTO}, {"scalar", ENC_KERNEL_SCALAR},
+      {"sse2", ENC_KERNEL_SSE2}, {"avx2", ENC_KERNEL_AVX2},
+      {"neon", ENC_KERNEL_NEON},
+  };
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    if (strcmp(name, names[i].name) == 0) {
+      *kernel = names[i].kernel;
+      return 0;
+    }
+  }
+  return -1;
+}
@@ -0,0 +1,65 @@
+#ifndef ENCKERNEL_H
+#define ENCKERNEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "binfmt.h"
+
+typedef struct {
+  double y, u, v;
+} YUV_Pixel;
+
+typedef enum {
+  ENC_KERNEL_AUTO,
+  ENC_KERNEL_SCALAR,
+  ENC_KERNEL_SSE2,
+  ENC_KERNEL_AVX2,
+  ENC_KERNEL_NEON,
+} EncKernel;
+
+/**
+ * @brief 8x8ブロック1つを符号化する関数の型
+ * @param src ブロック左上のRGBピクセルへのポインタ
+ * @param stride 1行あたりのバイト数
+ * @param compress_level 圧縮レベル
+ * @param header ヘッダ面の出力先 (BLOCK_HEADER_SIZEバイト)
+ * @param corners 四隅の面の出力先 (BLOCK_CORNERS_SIZEバイト)
+ * @param codes 画素の面の出力先 (BLOCK_CODES_SIZEバイト)
+ */
+typedef void (*encode_block_fn)(const uint8_t *src, size_t stride,
+                                int compress_level, uint8_t *header,
+                                uint8_t *corners, uint8_t *codes);
+
+void rgb_to_yuv_norm(uint8_t r, uint8_t g, uint8_t b, YUV_Pixel *yuv);
+
+/**
+ * @brief double演算による基準実装。他のカーネルはこれとバイト単位で一致する
+ */
+void encode_block_scalar(const uint8_t *src, size_t stride, int compress_level,
+                         uint8_t *header, uint8_t *corners, uint8_t *codes);
+
+/**
+ * @brief 色差を2x2画素で平均してから量子化する、BINFMT_CHROMA420用の基準実装
+ * @note 画素の面にはCHROMA420_Y_SIZEバイトの輝度とCHROMA420_UV_SIZEバイトの
+ *       色差を続けて書き、ヘッダにBLOCK_FLAG_CHROMA420を立てる
+ */
+void encode_chroma420_scalar(const uint8_t *src, size_t stride,
+                             int compress_level, uint8_t *header,
+                             uint8_t *corners, uint8_t *codes);
+
+/**
+ * @brief カーネルを選択する
+ * @param kernel ENC_KERNEL_AUTOの場合はCPUに応じて最速のものを選ぶ
+ * @param chroma420 BINFMT_CHROMA420用のカーネルを選ぶ
+ * @return カーネル関数、CPUが対応していない場合はNULL
+ */
+encode_block_fn encode_kernel_select(EncKernel kernel, bool chroma420);
+
+/**
+ * @brief "scalar" / "sse2" / "avx2" / "neon" / "auto" を解釈する
+ * @return 成功時0、不明な名前の場合-1
+ */
+int encode_kernel_parse(const char *name, EncKernel *kernel);
+
+#endif
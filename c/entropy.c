@@ -0,0 +1,511 @@
+#include "entropy.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RC_PROB_BITS 11
+#define RC_PROB_ONE (1 << RC_PROB_BITS)
+#define RC_MOVE_BITS 4
+#define RC_TOP (1u << 24)
+#define RC_BUFFER_SIZE 65536
+
+typedef uint16_t Prob;
+
+static const int field_bits[3] = {4, 2, 2};
+static const int field_shift[3] = {4, 2, 0};
+static const uint8_t flag_bits[3] = {BLOCK_FLAG_Y, BLOCK_FLAG_U, BLOCK_FLAG_V};
+static const int min_field[3] = {BLOCK_MINY, BLOCK_MINU, BLOCK_MINV};
+static const int max_field[3] = {BLOCK_MAXY, BLOCK_MAXU, BLOCK_MAXV};
+static const int corner_pos[4] = {0, 7, 56, 63};
+/* 補間するチャンネルの四隅は floor(c / 255 * 15.9) なので、minから予測できる */
+static const int corner_scale10[3] = {159, 39, 39};
+
+/* 前のブロックの繰り返し。上と同じ、左と同じ、どちらでもない */
+enum { REPEAT_ABOVE, REPEAT_LEFT, REPEAT_NONE };
+
+/*
+ * 文脈ごとの確率。
+ * 画素の差分は、ブロックの1行目では直前の差分を、2行目以降では
+ * 上の画素と直前の画素の量子化値の差を文脈にする。
+ * 補間しないチャンネルの四隅はその位置の画素の量子化値と同じになるので、
+ * それを文脈にすればほとんど符号量がかからない。
+ */
+typedef struct {
+  Prob repeat[3][2];
+  Prob min[3][256];
+  Prob range[3][16][256];
+  Prob flag[3][64];
+  Prob code[3][32][16];
+  Prob corner[3][2][16][16];
+  int prev_repeat;
+} Model;
+
+static void model_init(Model *model) {
+  Prob *probs = (Prob *)model;
+  for (size_t i = 0; i < offsetof(Model, prev_repeat) / sizeof(Prob); i++) {
+    probs[i] = RC_PROB_ONE / 2;
+  }
+  model->prev_repeat = REPEAT_NONE;
+}
+
+/* 上、左、左上のブロックのヘッダ。画像の端にあって無い場合はNULL */
+typedef struct {
+  const uint8_t *above, *left, *above_left;
+} Neighbors;
+
+/**
+ * @brief 周りのブロックからヘッダの値を予測する (JPEG-LSと同じMED予測)
+ */
+static int predict_field(const Neighbors *n, int field) {
+  if (n->above && n->left) {
+    int a = n->above[field], l = n->left[field], al = n->above_left[field];
+    int lo = a < l ? a : l, hi = a < l ? l : a;
+    if (al >= hi) {
+      return lo;
+    }
+    if (al <= lo) {
+      return hi;
+    }
+    return a + l - al;
+  }
+  if (n->left) {
+    return n->left[field];
+  }
+  if (n->above) {
+    return n->above[field];
+  }
+  return 0;
+}
+
+static int range_context(const Neighbors *n, int c) {
+  int left = n->left ? n->left[max_field[c]] - n->left[min_field[c]] : 0;
+  int above = n->above ? n->above[max_field[c]] - n->above[min_field[c]] : 0;
+  int ctx = ((left & 0xFF) + (above & 0xFF) + 1) / 2;
+  return ctx < 15 ? ctx : 15;
+}
+
+#define PACKED_BLOCK_SIZE                                                      \
+  (BLOCK_HEADER_SIZE + BLOCK_CORNERS_SIZE + BLOCK_CODES_SIZE)
+
+static void pack_block(const uint8_t *header, const uint8_t *corners,
+                       const uint8_t *codes, uint8_t *packed) {
+  memcpy(packed, header, BLOCK_HEADER_SIZE);
+  memcpy(packed + BLOCK_HEADER_SIZE, corners, BLOCK_CORNERS_SIZE);
+  memcpy(packed + BLOCK_HEADER_SIZE + BLOCK_CORNERS_SIZE, codes,
+         BLOCK_CODES_SIZE);
+}
+
+static int code_context(const uint8_t *q, int i, int levels, int prev_delta) {
+  if (i < 8) {
+    return levels + prev_delta;
+  }
+  return (q[i - 8] - q[i - 1]) & (levels - 1);
+}
+
+static int corner_context(const uint8_t *header, const uint8_t *q, int c,
+                          bool interpolate, int j) {
+  if (interpolate) {
+    return header[min_field[c]] * corner_scale10[c] / 2550;
+  }
+  return q[corner_pos[j]];
+}
+
+struct EntropyEncoder {
+  binfmt_sink_fn sink;
+  void *ctx;
+  uint64_t low;
+  uint32_t range;
+  uint8_t cache;
+  uint64_t cache_size;
+  int error;
+  size_t nbuf;
+  Model model;
+  /* 上と左上のブロックを参照するため、直前の1行と1ブロック分を持っておく */
+  int blocks_per_row;
+  int64_t index;
+  uint8_t *history;
+  uint8_t buf[RC_BUFFER_SIZE];
+};
+
+EntropyEncoder *entropy_encoder_new(binfmt_sink_fn sink, void *ctx,
+                                    int blocks_per_row) {
+  if (blocks_per_row < 1) {
+    blocks_per_row = 1;
+  }
+  EntropyEncoder *encoder = (EntropyEncoder *)malloc(sizeof(EntropyEncoder));
+  uint8_t *history =
+      (uint8_t *)malloc((size_t)(blocks_per_row + 1) * PACKED_BLOCK_SIZE);
+  if (!encoder || !history) {
+    fprintf(stderr, "Memory allocation failed for EntropyEncoder.\n");
+    free(encoder);
+    free(history);
+    return NULL;
+  }
+  encoder->blocks_per_row = blocks_per_row;
+  encoder->index = 0;
+  encoder->history = history;
+  encoder->sink = sink;
+  encoder->ctx = ctx;
+  encoder->low = 0;
+  encoder->range = 0xFFFFFFFF;
+  encoder->cache = 0;
+  encoder->cache_size = 1;
+  encoder->error = 0;
+  encoder->nbuf = 0;
+  model_init(&encoder->model);
+  return encoder;
+}
+
+static int enc_flush(EntropyEncoder *e) {
+  if (e->nbuf > 0 && e->sink(e->ctx, e->buf, e->nbuf) != 0) {
+    e->error = -1;
+  }
+  e->nbuf = 0;
+  return e->error;
+}
+
+static void enc_shift_low(EntropyEncoder *e) {
+  if ((uint32_t)e->low < 0xFF000000u || (e->low >> 32) != 0) {
+    uint8_t carry = (uint8_t)(e->low >> 32);
+    uint8_t temp = e->cache;
+    do {
+      e->buf[e->nbuf++] = (uint8_t)(temp + carry);
+      if (e->nbuf == RC_BUFFER_SIZE) {
+        enc_flush(e);
+      }
+      temp = 0xFF;
+    } while (--e->cache_size != 0);
+    e->cache = (uint8_t)(e->low >> 24);
+  }
+  e->cache_size++;
+  e->low = (e->low & 0x00FFFFFF) << 8;
+}
+
+static inline void enc_bit(EntropyEncoder *e, Prob *p, int bit) {
+  uint32_t bound = (e->range >> RC_PROB_BITS) * *p;
+  if (!bit) {
+    e->range = bound;
+    *p += (RC_PROB_ONE - *p) >> RC_MOVE_BITS;
+  } else {
+    e->low += bound;
+    e->range -= bound;
+    *p -= *p >> RC_MOVE_BITS;
+  }
+  while (e->range < RC_TOP) {
+    e->range <<= 8;
+    enc_shift_low(e);
+  }
+}
+
+static inline void enc_tree(EntropyEncoder *e, Prob *probs, int nbits,
+                            int symbol) {
+  int m = 1;
+  for (int i = nbits - 1; i >= 0; i--) {
+    int bit = (symbol >> i) & 1;
+    enc_bit(e, &probs[m], bit);
+    m = (m << 1) | bit;
+  }
+}
+
+static uint8_t *history_slot(const EntropyEncoder *e, int64_t index) {
+  return e->history +
+         (size_t)(index % (e->blocks_per_row + 1)) * PACKED_BLOCK_SIZE;
+}
+
+static Neighbors encoder_neighbors(const EntropyEncoder *e) {
+  int64_t bpr = e->blocks_per_row;
+  bool has_above = e->index >= bpr;
+  bool has_left = e->index % bpr > 0;
+  Neighbors n;
+  n.above = has_above ? history_slot(e, e->index - bpr) : NULL;
+  n.left = has_left ? history_slot(e, e->index - 1) : NULL;
+  n.above_left =
+      has_above && has_left ? history_slot(e, e->index - bpr - 1) : NULL;
+  return n;
+}
+
+/**
+ * @brief 上または左のブロックと同じかどうかを符号化する
+ * @return REPEAT_ABOVE、REPEAT_LEFT、REPEAT_NONEのいずれか
+ */
+static int encode_repeat(EntropyEncoder *e, const Neighbors *n,
+                         const uint8_t *packed) {
+  int repeat = REPEAT_NONE;
+  if (n->above && memcmp(packed, n->above, PACKED_BLOCK_SIZE) == 0) {
+    repeat = REPEAT_ABOVE;
+  } else if (n->left && memcmp(packed, n->left, PACKED_BLOCK_SIZE) == 0) {
+    repeat = REPEAT_LEFT;
+  }
+  Prob *probs = e->model.repeat[e->model.prev_repeat];
+  if (n->above) {
+    enc_bit(e, &probs[0], repeat == REPEAT_ABOVE);
+  }
+  if (n->left && repeat != REPEAT_ABOVE) {
+    enc_bit(e, &probs[1], repeat == REPEAT_LEFT);
+  }
+  e->model.prev_repeat = repeat;
+  return repeat;
+}
+
+static void encode_body(EntropyEncoder *e, uint8_t flags,
+                        const uint8_t *header, const uint8_t *corners,
+                        const uint8_t *codes);
+
+static void encode_block(EntropyEncoder *e, const uint8_t *header,
+                         const uint8_t *corners, const uint8_t *codes) {
+  Model *model = &e->model;
+  uint8_t flags = header[BLOCK_FLAGS];
+  uint8_t packed[PACKED_BLOCK_SIZE];
+  pack_block(header, corners, codes, packed);
+  Neighbors n = encoder_neighbors(e);
+  int repeat = encode_repeat(e, &n, packed);
+  if (repeat == REPEAT_NONE) {
+    for (int c = 0; c < 3; c++) {
+      uint8_t min = header[min_field[c]];
+      uint8_t range = header[max_field[c]] - min;
+      enc_tree(e, model->min[c], 8,
+               (uint8_t)(min - predict_field(&n, min_field[c])));
+      enc_tree(e, model->range[c][range_context(&n, c)], 8, range);
+      enc_bit(e, &model->flag[c][range < 63 ? range : 63],
+              (flags & flag_bits[c]) != 0);
+    }
+    encode_body(e, flags, header, corners, codes);
+  }
+  /* 左上のブロックはもう使わないので、その場所に今のブロックを入れる */
+  memcpy(history_slot(e, e->index), packed, PACKED_BLOCK_SIZE);
+  e->index++;
+}
+
+/**
+ * @brief 画素と四隅を符号化する
+ */
+static void encode_body(EntropyEncoder *e, uint8_t flags,
+                        const uint8_t *header, const uint8_t *corners,
+                        const uint8_t *codes) {
+  Model *model = &e->model;
+
+  uint8_t q[3][64];
+  for (int c = 0; c < 3; c++) {
+    if (flags & flag_bits[c]) {
+      continue;
+    }
+    int levels = 1 << field_bits[c];
+    int value = 0, delta = 0;
+    for (int i = 0; i < 64; i++) {
+      int ctx = code_context(q[c], i, levels, delta);
+      delta = (codes[i] >> field_shift[c]) & (levels - 1);
+      enc_tree(e, model->code[c][ctx], field_bits[c], delta);
+      value = (value + delta) & (levels - 1);
+      q[c][i] = value;
+    }
+  }
+
+  for (int j = 0; j < 4; j++) {
+    for (int c = 0; c < 3; c++) {
+      bool interpolate = flags & flag_bits[c];
+      int ctx = corner_context(header, q[c], c, interpolate, j);
+      int field = (corners[j] >> field_shift[c]) & ((1 << field_bits[c]) - 1);
+      enc_tree(e, model->corner[c][interpolate][ctx], field_bits[c], field);
+    }
+  }
+}
+
+int entropy_encode_planes(EntropyEncoder *encoder, const ImgPlanes *strip) {
+  for (int32_t i = 0; i < strip->block_count; i++) {
+    encode_block(encoder, planes_header(strip, i), planes_corners(strip, i),
+                  planes_codes(strip, i));
+  }
+  return encoder->error;
+}
+
+int entropy_encoder_finish(EntropyEncoder *encoder) {
+  for (int i = 0; i < 5; i++) {
+    enc_shift_low(encoder);
+  }
+  int result = enc_flush(encoder);
+  entropy_encoder_free(encoder);
+  return result;
+}
+
+void entropy_encoder_free(EntropyEncoder *encoder) {
+  if (encoder) {
+    free(encoder->history);
+    free(encoder);
+  }
+}
+
+struct EntropyDecoder {
+  const uint8_t *in, *end;
+  uint32_t range, code;
+  bool overrun;
+  Model model;
+};
+
+EntropyDecoder *entropy_decoder_new(void) {
+  EntropyDecoder *d = (EntropyDecoder *)malloc(sizeof(EntropyDecoder));
+  if (!d) {
+    fprintf(stderr, "Memory allocation failed for EntropyDecoder.\n");
+  }
+  return d;
+}
+
+void entropy_decoder_free(EntropyDecoder *decoder) { free(decoder); }
+
+static inline uint8_t dec_next(EntropyDecoder *d) {
+  if (d->in < d->end) {
+    return *d->in++;
+  }
+  d->overrun = true;
+  return 0;
+}
+
+static inline int dec_bit(EntropyDecoder *d, Prob *p) {
+  uint32_t bound = (d->range >> RC_PROB_BITS) * *p;
+  int bit;
+  if (d->code < bound) {
+    d->range = bound;
+    *p += (RC_PROB_ONE - *p) >> RC_MOVE_BITS;
+    bit = 0;
+  } else {
+    d->code -= bound;
+    d->range -= bound;
+    *p -= *p >> RC_MOVE_BITS;
+    bit = 1;
+  }
+  while (d->range < RC_TOP) {
+    d->range <<= 8;
+    d->code = (d->code << 8) | dec_next(d);
+  }
+  return bit;
+}
+
+static inline int dec_tree(EntropyDecoder *d, Prob *probs, int nbits) {
+  int m = 1;
+  for (int i = 0; i < nbits; i++) {
+    m = (m << 1) | dec_bit(d, &probs[m]);
+  }
+  return m - (1 << nbits);
+}
+
+static Neighbors decoder_neighbors(const ImgPlanes *planes, int bpr,
+                                   int32_t i) {
+  bool has_above = i >= bpr;
+  bool has_left = i % bpr > 0;
+  Neighbors n;
+  n.above = has_above ? planes_header(planes, i - bpr) : NULL;
+  n.left = has_left ? planes_header(planes, i - 1) : NULL;
+  n.above_left =
+      has_above && has_left ? planes_header(planes, i - bpr - 1) : NULL;
+  return n;
+}
+
+/**
+ * @brief 上または左のブロックと同じなら、そのブロックをコピーする
+ * @return コピーした場合true
+ */
+static bool decode_repeat(EntropyDecoder *d, const Neighbors *n,
+                          ImgPlanes *planes, int bpr, int32_t i) {
+  Prob *probs = d->model.repeat[d->model.prev_repeat];
+  int repeat = REPEAT_NONE;
+  if (n->above && dec_bit(d, &probs[0])) {
+    repeat = REPEAT_ABOVE;
+  } else if (n->left && dec_bit(d, &probs[1])) {
+    repeat = REPEAT_LEFT;
+  }
+  d->model.prev_repeat = repeat;
+  if (repeat == REPEAT_NONE) {
+    return false;
+  }
+
+  int32_t src = repeat == REPEAT_ABOVE ? i - bpr : i - 1;
+  memcpy(planes_header(planes, i), planes_header(planes, src),
+         BLOCK_HEADER_SIZE);
+  memcpy(planes_corners(planes, i), planes_corners(planes, src),
+         BLOCK_CORNERS_SIZE);
+  memcpy(planes_codes(planes, i), planes_codes(planes, src),
+         BLOCK_CODES_SIZE);
+  return true;
+}
+
+static void decode_block(EntropyDecoder *d, const Neighbors *n,
+                         uint8_t *header, uint8_t *corners, uint8_t *codes) {
+  Model *model = &d->model;
+  uint8_t flags = 0;
+  for (int c = 0; c < 3; c++) {
+    uint8_t min =
+        predict_field(n, min_field[c]) + dec_tree(d, model->min[c], 8);
+    uint8_t range = dec_tree(d, model->range[c][range_context(n, c)], 8);
+    if (dec_bit(d, &model->flag[c][range < 63 ? range : 63])) {
+      flags |= flag_bits[c];
+    }
+    header[min_field[c]] = min;
+    header[max_field[c]] = min + range;
+  }
+  header[BLOCK_FLAGS] = flags;
+
+  uint8_t q[3][64];
+  memset(codes, 0, BLOCK_CODES_SIZE);
+  for (int c = 0; c < 3; c++) {
+    if (flags & flag_bits[c]) {
+      continue;
+    }
+    int levels = 1 << field_bits[c];
+    int value = 0, delta = 0;
+    for (int i = 0; i < 64; i++) {
+      int ctx = code_context(q[c], i, levels, delta);
+      delta = dec_tree(d, model->code[c][ctx], field_bits[c]);
+      codes[i] |= delta << field_shift[c];
+      value = (value + delta) & (levels - 1);
+      q[c][i] = value;
+    }
+  }
+
+  for (int j = 0; j < 4; j++) {
+    uint8_t corner = 0;
+    for (int c = 0; c < 3; c++) {
+      bool interpolate = flags & flag_bits[c];
+      int ctx = corner_context(header, q[c], c, interpolate, j);
+      corner |= dec_tree(d, model->corner[c][interpolate][ctx], field_bits[c])
+                << field_shift[c];
+    }
+    corners[j] = corner;
+  }
+}
+
+int entropy_decode_planes(EntropyDecoder *decoder, const uint8_t *in,
+                          size_t size, ImgPlanes *planes) {
+  EntropyDecoder *d = decoder ? decoder : entropy_decoder_new();
+  if (!d) {
+    return -1;
+  }
+  d->in = in;
+  d->end = in + size;
+  d->range = 0xFFFFFFFF;
+  d->code = 0;
+  d->overrun = false;
+  model_init(&d->model);
+  for (int i = 0; i < 5; i++) {
+    d->code = (d->code << 8) | dec_next(d);
+  }
+
+  int bpr = planes->width / 8 > 0 ? planes->width / 8 : 1;
+  for (int32_t i = 0; i < planes->block_count && !d->overrun; i++) {
+    Neighbors n = decoder_neighbors(planes, bpr, i);
+    if (decode_repeat(d, &n, planes, bpr, i)) {
+      continue;
+    }
+    decode_block(d, &n, planes_header(planes, i), planes_corners(planes, i),
+                 planes_codes(planes, i));
+  }
+
+  int result = d->overrun ? -1 : 0;
+  if (result != 0) {
+    fprintf(stderr, "Entropy-coded data is truncated.\n");
+  }
+  if (d != decoder) {
+    entropy_decoder_free(d);
+  }
+  return result;
+}
@@ -0,0 +1,62 @@
+#ifndef ENTROPY_H
+#define ENTROPY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "binfmt.h"
+
+/*
+ * ブロックの面をまとめて符号化する適応型の算術符号 (LZMAと同じ2値のレンジコーダ)。
+ * ブロックごとにヘッダ、画素、四隅の順に符号化するので、先頭から順に書き出せる。
+ * 上または左のブロックと全く同じブロックは1ビット程度で済ませる。
+ * 補間するチャンネルの画素の差分は常に0なので符号化しない。
+ */
+
+typedef struct EntropyEncoder EntropyEncoder;
+
+/**
+ * @brief 符号化器を作る
+ * @param sink 符号化したバイト列の出力先
+ * @param blocks_per_row 1行あたりのブロック数。上のブロックとの比較に使う
+ * @return 符号化器、失敗した場合はNULL
+ */
+EntropyEncoder *entropy_encoder_new(binfmt_sink_fn sink, void *ctx,
+                                    int blocks_per_row);
+
+/**
+ * @brief stripのblock_count個のブロックを続けて符号化する
+ * @return 成功時0、出力に失敗した場合-1
+ */
+int entropy_encode_planes(EntropyEncoder *encoder, const ImgPlanes *strip);
+
+/**
+ * @brief 残りを書き出して符号化器を解放する
+ * @return 成功時0、出力に失敗した場合-1
+ */
+int entropy_encoder_finish(EntropyEncoder *encoder);
+
+/**
+ * @brief 書き出さずに符号化器を解放する
+ */
+void entropy_encoder_free(EntropyEncoder *encoder);
+
+typedef struct EntropyDecoder EntropyDecoder;
+
+/**
+ * @brief 復元器を作る。確率のモデルを持つので大きく、使い回すためにある
+ * @return 復元器、失敗した場合はNULL
+ */
+EntropyDecoder *entropy_decoder_new(void);
+
+void entropy_decoder_free(EntropyDecoder *decoder);
+
+/**
+ * @brief 符号化されたバイト列からplanesのblock_count個のブロックを復元する
+ * @param decoder 使い回す復元器。NULLの場合は呼び出しの間だけ確保する
+ * @return 成功時0、データが足りない場合-1
+ */
+int entropy_decode_planes(EntropyDecoder *decoder, const uint8_t *in,
+                          size_t size, ImgPlanes *planes);
+
+#endif
@@ -0,0 +1,222 @@
+#include "imgcompress.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "binfmt.h"
+#include "deckernel.h"
+#include "enckernel.h"
+#include "entropy.h"
+#include "xzio.h"
+
+struct ImgcompressEncoder {
+  encode_block_fn encode_block;
+  ImgPlanes *planes;
+  uint8_t *out;
+  size_t out_capacity;
+};
+
+struct ImgcompressDecoder {
+  decode_block_fn decode_block;
+  /* 面をそのまま並べていない形式を展開する面 */
+  ImgPlanes *planes;
+  EntropyDecoder *entropy; /* BINFMT_ENTROPY形式の復元器 */
+  uint8_t *pixels;
+  size_t pixels_capacity;
+};
+
+/**
+ * @brief 作業用の領域をsizeバイト以上にする。足りている場合は何もしない
+ * @return 成功時0、失敗時-1
+ */
+static int reserve(uint8_t **buf, size_t *capacity, size_t size) {
+  if (*capacity >= size) {
+    return 0;
+  }
+  /* 中身は書き直すので、reallocでコピーする必要はない */
+  free(*buf);
+  *buf = (uint8_t *)malloc(size);
+  *capacity = *buf ? size : 0;
+  if (!*buf) {
+    fprintf(stderr, "Memory allocation failed for imgcompress buffer.\n");
+    return -1;
+  }
+  return 0;
+}
+
+ImgcompressEncoder *imgcompress_encoder_new(void) {
+  ImgcompressEncoder *ctx =
+      (ImgcompressEncoder *)calloc(1, sizeof(ImgcompressEncoder));
+  if (!ctx) {
+    fprintf(stderr, "Memory allocation failed for ImgcompressEncoder.\n");
+    return NULL;
+  }
+  ctx->encode_block = encode_kernel_select(ENC_KERNEL_AUTO, false);
+  return ctx;
+}
+
+void imgcompress_encoder_free(ImgcompressEncoder *ctx) {
+  if (ctx) {
+    free_imgplanes(ctx->planes);
+    free(ctx->out);
+    free(ctx);
+  }
+}
+
+typedef struct {
+  uint8_t *dst;
+  size_t pos;
+} MemorySink;
+
+static int memory_sink(void *ctx, const void *data, size_t len) {
+  MemorySink *sink = (MemorySink *)ctx;
+  memcpy(sink->dst + sink->pos, data, len);
+  sink->pos += len;
+  return 0;
+}
+
+int imgcompress_encode_rgb(ImgcompressEncoder *ctx, const uint8_t *pixels,
+                           int width, int height, size_t stride, int level,
+                           ImgcompressBuffer *out) {
+  /* 8の倍数に広げた寸法がファイルの寸法になる */
+  int padded_width = (width + 7) / 8 * 8;
+  int padded_height = (height + 7) / 8 * 8;
+  if (width <= 0 || height <= 0 || padded_width > INT16_MAX ||
+      padded_height > INT16_MAX || stride < (size_t)width * 3) {
+    fprintf(stderr, "Invalid image size: %dx%d\n", width, height);
+    return -1;
+  }
+  int blocks_per_row = padded_width / 8;
+  int block_rows = padded_height / 8;
+  int32_t block_count = blocks_per_row * block_rows;
+
+  ctx->planes = reuse_imgplanes(ctx->planes, (int16_t)padded_width,
+                                (int16_t)padded_height, block_count);
+  size_t size = binfmt_file_size(block_count);
+  if (!ctx->planes || reserve(&ctx->out, &ctx->out_capacity, size) != 0) {
+    return -1;
+  }
+
+  for (int by = 0; by < block_rows; by++) {
+    for (int bx = 0; bx < blocks_per_row; bx++) {
+      int32_t index = by * blocks_per_row + bx;
+      const uint8_t *src = pixels + (size_t)by * 8 * stride + bx * 8 * 3;
+      const uint8_t *block = src;
+      size_t block_stride = stride;
+      uint8_t edge[8 * 8 * 3];
+      int w = width - bx * 8 < 8 ? width - bx * 8 : 8;
+      int h = height - by * 8 < 8 ? height - by * 8 : 8;
+      if (w < 8 || h < 8) {
+        /* 画像の外側は黒として符号化する */
+        memset(edge, 0, sizeof(edge));
+        for (int y = 0; y < h; y++) {
+          memcpy(edge + y * 8 * 3, src + (size_t)y * stride, w * 3);
+        }
+        block = edge;
+        block_stride = 8 * 3;
+      }
+      ctx->encode_block(block, block_stride, level,
+                        planes_header(ctx->planes, index),
+                        planes_corners(ctx->planes, index),
+                        planes_codes(ctx->planes, index));
+    }
+  }
+
+  MemorySink sink = {ctx->out, 0};
+  planes_write_sink(ctx->planes, memory_sink, &sink);
+  out->data = ctx->out;
+  out->size = sink.pos;
+  return 0;
+}
+
+ImgcompressDecoder *imgcompress_decoder_new(bool strict) {
+  ImgcompressDecoder *ctx =
+      (ImgcompressDecoder *)calloc(1, sizeof(ImgcompressDecoder));
+  if (!ctx) {
+    fprintf(stderr, "Memory allocation failed for ImgcompressDecoder.\n");
+    return NULL;
+  }
+  ctx->decode_block =
+      decode_kernel_select(strict ? DEC_KERNEL_STRICT : DEC_KERNEL_AUTO);
+  ctx->entropy = entropy_decoder_new();
+  if (!ctx->entropy) {
+    free(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+void imgcompress_decoder_free(ImgcompressDecoder *ctx) {
+  if (ctx) {
+    free_imgplanes(ctx->planes);
+    entropy_decoder_free(ctx->entropy);
+    free(ctx->pixels);
+    free(ctx);
+  }
+}
+
+/**
+ * @brief dataに対するビューを作る。面を並べていない形式はctxの面に展開する
+ * @return 成功時0、失敗時-1
+ */
+static int decoder_view(ImgcompressDecoder *ctx, const char *data,
+                        size_t size, ImgView *view) {
+  if (binfmt_is_planar(data, size)) {
+    return img_view_from_buf(data, size, view);
+  }
+  if (buf_unpack_planes_with(data, size, &ctx->planes, ctx->entropy) != 0) {
+    return -1;
+  }
+  memset(view, 0, sizeof(ImgView));
+  view->width = ctx->planes->width;
+  view->height = ctx->planes->height;
+  view->block_count = ctx->planes->block_count;
+  view->headers = ctx->planes->headers;
+  view->corners = ctx->planes->corners;
+  view->codes = ctx->planes->codes;
+  return 0;
+}
+
+int imgcompress_decode(ImgcompressDecoder *ctx, const void *buf, size_t len,
+                       ImgcompressImage *out) {
+  const char *data = (const char *)buf;
+  uint8_t *unpacked = NULL;
+  if (xz_is_stream(buf, len)) {
+    if (xz_decode_buffer((const uint8_t *)buf, len, 1, &unpacked, &len) !=
+        0) {
+      return -1;
+    }
+    data = (const char *)unpacked;
+  }
+
+  ImgView view;
+  int result = decoder_view(ctx, data, len, &view);
+  if (result == 0 && (view.width <= 0 || view.height <= 0 ||
+                      view.width % 8 != 0 || view.height % 8 != 0 ||
+                      view.block_count !=
+                          (view.width / 8) * (view.height / 8))) {
+    fprintf(stderr, "Invalid image size: %dx%d\n", view.width, view.height);
+    result = -1;
+  }
+  size_t stride = (size_t)view.width * 3;
+  if (result == 0) {
+    result = reserve(&ctx->pixels, &ctx->pixels_capacity,
+                     stride * view.height);
+  }
+
+  if (result == 0) {
+    int blocks_per_row = view.width / 8;
+    for (int32_t i = 0; i < view.block_count; i++) {
+      uint8_t *dst = ctx->pixels + (size_t)(i / blocks_per_row) * 8 * stride +
+                     (size_t)(i % blocks_per_row) * 8 * 3;
+      ctx->decode_block(img_view_header(&view, i), img_view_corners(&view, i),
+                        img_view_codes(&view, i), dst, stride);
+    }
+    out->pixels = ctx->pixels;
+    out->width = view.width;
+    out->height = view.height;
+    out->stride = stride;
+  }
+  free(unpacked);
+  return result;
+}
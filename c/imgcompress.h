@@ -0,0 +1,84 @@
+#ifndef IMGCOMPRESS_H
+#define IMGCOMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * プロセス内から呼び出すための符号化・復元のAPI (libimgcompress)。
+ * libvipsには依存せず、メモリ上のRGB画素とバイナリ形式を相互に変換する。
+ * コンテキストは作業用の領域を持ち続けるので、同じ寸法以下の画像を
+ * 繰り返し変換する場合、2回目以降はヒープを確保しない。
+ * 一つのコンテキストを複数のスレッドから同時に使ってはならない。
+ */
+
+typedef struct ImgcompressEncoder ImgcompressEncoder;
+typedef struct ImgcompressDecoder ImgcompressDecoder;
+
+/**
+ * @brief 符号化したバイナリ形式。dataはコンテキストが持ち、次の呼び出しまで有効
+ */
+typedef struct {
+  const uint8_t *data;
+  size_t size;
+} ImgcompressBuffer;
+
+/**
+ * @brief 復元したRGB画像。pixelsはコンテキストが持ち、次の呼び出しまで有効
+ */
+typedef struct {
+  const uint8_t *pixels;
+  int width, height;
+  size_t stride;
+} ImgcompressImage;
+
+/**
+ * @brief 符号化のコンテキストを作る
+ * @return コンテキスト、失敗した場合はNULL
+ */
+ImgcompressEncoder *imgcompress_encoder_new(void);
+
+/**
+ * @brief 符号化のコンテキストと作業用の領域を解放する
+ */
+void imgcompress_encoder_free(ImgcompressEncoder *ctx);
+
+/**
+ * @brief RGB画像をバイナリ形式 (BINFMT_PLANAR) に符号化する
+ * @param pixels 左上から並んだ8ビットRGBの画素
+ * @param stride 1行あたりのバイト数
+ * @param level 圧縮レベル
+ * @param out 符号化したバイナリ形式を返す
+ * @return 成功時0、失敗時-1
+ * @note 幅と高さが8の倍数でない場合は、enc_imgと同じく黒で埋めて広げる
+ */
+int imgcompress_encode_rgb(ImgcompressEncoder *ctx, const uint8_t *pixels,
+                           int width, int height, size_t stride, int level,
+                           ImgcompressBuffer *out);
+
+/**
+ * @brief 復元のコンテキストを作る
+ * @param strict trueの場合は基準実装と一致する浮動小数点演算で復元する
+ * @return コンテキスト、失敗した場合はNULL
+ */
+ImgcompressDecoder *imgcompress_decoder_new(bool strict);
+
+/**
+ * @brief 復元のコンテキストと作業用の領域を解放する
+ */
+void imgcompress_decoder_free(ImgcompressDecoder *ctx);
+
+/**
+ * @brief バイナリ形式をRGB画像に復元する
+ * @param buf 一つの画像を持つバイナリ形式。算術符号や画素を省いた形式、
+ *            色差を間引いた形式、xz形式も読める。タイル、段、差分の入れ物は
+ *            読めない
+ * @param out 復元した画像を返す
+ * @return 成功時0、失敗時-1
+ * @note 面をそのまま並べた形式は入力を直接読む。xz形式は展開のたびに確保する
+ */
+int imgcompress_decode(ImgcompressDecoder *ctx, const void *buf, size_t len,
+                       ImgcompressImage *out);
+
+#endif
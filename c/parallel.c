@@ -0,0 +1,136 @@
+#include "parallel.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef struct {
+  pthread_mutex_t lock;
+  int begin, end;
+} RowRange;
+
+typedef struct {
+  RowRange *ranges;
+  int nthreads;
+  parallel_row_fn fn;
+  void *ctx;
+} RowPool;
+
+typedef struct {
+  RowPool *pool;
+  int index;
+} RowWorker;
+
+static int take_own(RowRange *range) {
+  int row = -1;
+  pthread_mutex_lock(&range->lock);
+  if (range->begin < range->end) {
+    row = range->begin++;
+  }
+  pthread_mutex_unlock(&range->lock);
+  return row;
+}
+
+static int steal(RowPool *pool, int self) {
+  for (int k = 1; k < pool->nthreads; k++) {
+    RowRange *victim = &pool->ranges[(self + k) % pool->nthreads];
+    int begin = 0, end = 0;
+    pthread_mutex_lock(&victim->lock);
+    int remaining = victim->end - victim->begin;
+    if (remaining > 0) {
+      end = victim->end;
+      begin = victim->end - (remaining + 1) / 2;
+      victim->end = begin;
+    }
+    pthread_mutex_unlock(&victim->lock);
+    if (begin < end) {
+      RowRange *own = &pool->ranges[self];
+      pthread_mutex_lock(&own->lock);
+      own->begin = begin;
+      own->end = end;
+      pthread_mutex_unlock(&own->lock);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static void *row_worker(void *arg) {
+  RowWorker *worker = (RowWorker *)arg;
+  RowPool *pool = worker->pool;
+  for (;;) {
+    int row = take_own(&pool->ranges[worker->index]);
+    if (row >= 0) {
+      pool->fn(pool->ctx, row);
+      continue;
+    }
+    if (steal(pool, worker->index) != 0) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+static void serial_for_rows(int nrows, parallel_row_fn fn, void *ctx) {
+  for (int row = 0; row < nrows; row++) {
+    fn(ctx, row);
+  }
+}
+
+void parallel_for_rows(int nrows, int nthreads, parallel_row_fn fn,
+                       void *ctx) {
+  if (nthreads > nrows) {
+    nthreads = nrows;
+  }
+  if (nthreads <= 1) {
+    serial_for_rows(nrows, fn, ctx);
+    return;
+  }
+
+  RowRange *ranges = (RowRange *)malloc(sizeof(RowRange) * nthreads);
+  RowWorker *workers = (RowWorker *)malloc(sizeof(RowWorker) * nthreads);
+  pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * nthreads);
+  if (!ranges || !workers || !threads) {
+    fprintf(stderr, "Memory allocation failed for thread pool.\n");
+    free(ranges);
+    free(workers);
+    free(threads);
+    serial_for_rows(nrows, fn, ctx);
+    return;
+  }
+
+  RowPool pool = {ranges, nthreads, fn, ctx};
+  for (int i = 0; i < nthreads; i++) {
+    pthread_mutex_init(&ranges[i].lock, NULL);
+    ranges[i].begin = (int)((long long)nrows * i / nthreads);
+    ranges[i].end = (int)((long long)nrows * (i + 1) / nthreads);
+    workers[i].pool = &pool;
+    workers[i].index = i;
+  }
+
+  int started = 1;
+  for (int i = 1; i < nthreads; i++) {
+    if (pthread_create(&threads[i], NULL, row_worker, &workers[i]) != 0) {
+      fprintf(stderr, "Failed to create worker thread.\n");
+      break;
+    }
+    started++;
+  }
+  /* 作成できなかったスレッドの範囲は呼び出し元のスレッドが奪って処理する */
+  row_worker(&workers[0]);
+  for (int i = 1; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  for (int i = 0; i < nthreads; i++) {
+    pthread_mutex_destroy(&ranges[i].lock);
+  }
+  free(ranges);
+  free(workers);
+  free(threads);
+}
+
+int parallel_cpu_count(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int)n : 1;
+}
@@ -0,0 +1,27 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+/**
+ * @brief 行ごとの処理関数の型
+ * @param ctx parallel_for_rowsに渡したポインタ
+ * @param row 処理する行番号
+ */
+typedef void (*parallel_row_fn)(void *ctx, int row);
+
+/**
+ * @brief 0..nrows-1の各行に対してfnを並列に呼び出す
+ * @param nrows 行数
+ * @param nthreads スレッド数。1以下の場合は呼び出し元のスレッドだけで処理する
+ * @note スレッドを作成できなかった場合も、残りは呼び出し元のスレッドで処理する
+ * @note 各スレッドは連続した行の範囲を受け持ち、自分の範囲が空になったら
+ *       他のスレッドの残りの後半を奪って処理する
+ */
+void parallel_for_rows(int nrows, int nthreads, parallel_row_fn fn,
+                       void *ctx);
+
+/**
+ * @brief -j 0 などで使うためのCPU数を返す
+ */
+int parallel_cpu_count(void);
+
+#endif
@@ -0,0 +1,355 @@
+#include "progressive.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "binfmt.h"
+
+struct ProgressiveDecoder {
+  decode_block_fn decode_block;
+  int nthreads;
+  ProgressiveStage stage;
+  bool failed;
+  /* 面を並べていない形式。全体をdataに溜めてからfinishで復元する */
+  bool buffered;
+  /* 先頭のヘッダ、bufferedの場合は全体、最後はフッタを溜める */
+  uint8_t *data;
+  size_t size, capacity;
+  int16_t width, height;
+  int32_t block_count;
+  int blocks_per_row;
+  uint8_t *planes; /* ヘッダと四隅の面 */
+  uint8_t *codes;  /* 受け取り途中のブロック行の画素の面 */
+  size_t received; /* ヘッダの後に受け取った面のバイト数 */
+  int rows;        /* 描き直したブロック行の数 */
+  uint8_t *pixels;
+};
+
+ProgressiveDecoder *progressive_decoder_new(decode_block_fn decode_block,
+                                            int nthreads) {
+  ProgressiveDecoder *decoder =
+      (ProgressiveDecoder *)calloc(1, sizeof(ProgressiveDecoder));
+  if (!decoder) {
+    fprintf(stderr, "Memory allocation failed for ProgressiveDecoder.\n");
+    return NULL;
+  }
+  decoder->decode_block = decode_block;
+  decoder->nthreads = nthreads;
+  decoder->stage = PROGRESSIVE_HEADER;
+  return decoder;
+}
+
+void progressive_decoder_free(ProgressiveDecoder *decoder) {
+  if (decoder) {
+    free(decoder->data);
+    free(decoder->planes);
+    free(decoder->codes);
+    free(decoder->pixels);
+    free(decoder);
+  }
+}
+
+static int append_data(ProgressiveDecoder *decoder, const uint8_t *data,
+                       size_t size) {
+  if (decoder->size + size > decoder->capacity) {
+    size_t capacity = decoder->capacity ? decoder->capacity : 4096;
+    while (capacity < decoder->size + size) {
+      capacity *= 2;
+    }
+    uint8_t *grown = (uint8_t *)realloc(decoder->data, capacity);
+    if (!grown) {
+      fprintf(stderr, "Memory allocation failed for input data.\n");
+      return -1;
+    }
+    decoder->data = grown;
+    decoder->capacity = capacity;
+  }
+  memcpy(decoder->data + decoder->size, data, size);
+  decoder->size += size;
+  return 0;
+}
+
+static size_t planes_size(const ProgressiveDecoder *decoder) {
+  return (size_t)decoder->block_count *
+         (BLOCK_HEADER_SIZE + BLOCK_CORNERS_SIZE);
+}
+
+static size_t codes_size(const ProgressiveDecoder *decoder) {
+  return (size_t)decoder->block_count * BLOCK_CODES_SIZE;
+}
+
+/**
+ * @brief 画素の面のrow番目のブロック行に含まれるブロック数
+ */
+static int row_blocks(const ProgressiveDecoder *decoder, int row) {
+  int per_row = decoder->blocks_per_row > 0 ? decoder->blocks_per_row : 1;
+  int32_t left = decoder->block_count - (int32_t)row * per_row;
+  return left < per_row ? left : per_row;
+}
+
+/**
+ * @brief 寸法から面と画素の領域を確保する
+ * @return 成功時0、失敗時-1
+ */
+static int start_planes(ProgressiveDecoder *decoder) {
+  decoder->blocks_per_row = decoder->width / 8;
+  size_t per_row = decoder->blocks_per_row > 0 ? decoder->blocks_per_row : 1;
+  decoder->planes = (uint8_t *)malloc(planes_size(decoder) + 1);
+  decoder->codes = (uint8_t *)malloc(per_row * BLOCK_CODES_SIZE);
+  decoder->pixels =
+      (uint8_t *)calloc((size_t)decoder->width * decoder->height * 3 + 1, 1);
+  if (!decoder->planes || !decoder->codes || !decoder->pixels) {
+    fprintf(stderr, "Memory allocation failed for progressive decoding.\n");
+    return -1;
+  }
+  decoder->size = 0;
+  decoder->stage = PROGRESSIVE_CORNERS;
+  return 0;
+}
+
+static uint8_t *block_dst(const ProgressiveDecoder *decoder, int row, int bx) {
+  size_t stride = (size_t)decoder->width * 3;
+  return decoder->pixels + (size_t)row * 8 * stride + (size_t)bx * 8 * 3;
+}
+
+/**
+ * @brief 全ブロックを四隅の補間だけで描く
+ * @note 三つのチャンネルをすべて補間するブロックとして復元すると、
+ *       画素の面は読まれない
+ */
+static void render_preview(ProgressiveDecoder *decoder) {
+  static const uint8_t zero_codes[BLOCK_CODES_SIZE];
+  const uint8_t *headers = decoder->planes;
+  const uint8_t *corners =
+      decoder->planes + (size_t)decoder->block_count * BLOCK_HEADER_SIZE;
+  size_t stride = (size_t)decoder->width * 3;
+  for (int row = 0; row < decoder->height / 8; row++) {
+    for (int bx = 0; bx < decoder->blocks_per_row; bx++) {
+      int32_t i = row * decoder->blocks_per_row + bx;
+      if (i >= decoder->block_count) {
+        return;
+      }
+      uint8_t header[BLOCK_HEADER_SIZE];
+      memcpy(header, headers + (size_t)i * BLOCK_HEADER_SIZE,
+             BLOCK_HEADER_SIZE);
+      header[BLOCK_FLAGS] |= BLOCK_FLAGS_ALL;
+      decoder->decode_block(header, corners + (size_t)i * BLOCK_CORNERS_SIZE,
+                            zero_codes, block_dst(decoder, row, bx), stride);
+    }
+  }
+}
+
+/**
+ * @brief 画素の面が揃ったブロック行を本来の画素で描き直す
+ */
+static void render_row(ProgressiveDecoder *decoder, int row) {
+  if (row >= decoder->height / 8) {
+    return;
+  }
+  const uint8_t *headers = decoder->planes;
+  const uint8_t *corners =
+      decoder->planes + (size_t)decoder->block_count * BLOCK_HEADER_SIZE;
+  size_t stride = (size_t)decoder->width * 3;
+  int count = row_blocks(decoder, row);
+  for (int bx = 0; bx < count && bx < decoder->blocks_per_row; bx++) {
+    int32_t i = row * decoder->blocks_per_row + bx;
+    decoder->decode_block(headers + (size_t)i * BLOCK_HEADER_SIZE,
+                          corners + (size_t)i * BLOCK_CORNERS_SIZE,
+                          decoder->codes + (size_t)bx * BLOCK_CODES_SIZE,
+                          block_dst(decoder, row, bx), stride);
+  }
+}
+
+/**
+ * @brief 先頭のヘッダを溜め、揃ったら形式を判定する
+ * @return 使ったバイト数、失敗した場合は(size_t)-1
+ */
+static size_t push_header(ProgressiveDecoder *decoder, const uint8_t *data,
+                          size_t size) {
+  size_t header_size = binfmt_header_size();
+  size_t take = header_size - decoder->size;
+  take = take < size ? take : size;
+  if (append_data(decoder, data, take) != 0) {
+    return (size_t)-1;
+  }
+  if (decoder->size < header_size) {
+    return take;
+  }
+  if (!binfmt_is_planar((const char *)decoder->data, decoder->size)) {
+    decoder->buffered = true;
+    return take;
+  }
+  if (binfmt_parse_header((const char *)decoder->data, decoder->size,
+                          &decoder->width, &decoder->height,
+                          &decoder->block_count) != 0) {
+    fprintf(stderr, "Invalid header.\n");
+    return (size_t)-1;
+  }
+  return start_planes(decoder) == 0 ? take : (size_t)-1;
+}
+
+/**
+ * @brief ヘッダと四隅の面を溜め、揃ったら下見の画像を描く
+ * @return 使ったバイト数
+ */
+static size_t push_corners(ProgressiveDecoder *decoder, const uint8_t *data,
+                           size_t size) {
+  size_t take = planes_size(decoder) - decoder->received;
+  take = take < size ? take : size;
+  memcpy(decoder->planes + decoder->received, data, take);
+  decoder->received += take;
+  if (decoder->received == planes_size(decoder)) {
+    render_preview(decoder);
+    decoder->stage = PROGRESSIVE_CODES;
+  }
+  return take;
+}
+
+/**
+ * @brief 画素の面をブロック行ごとに溜めて描き直し、最後にフッタを確かめる
+ * @return 使ったバイト数、フッタが不正な場合は(size_t)-1
+ */
+static size_t push_codes(ProgressiveDecoder *decoder, const uint8_t *data,
+                         size_t size) {
+  size_t offset = decoder->received - planes_size(decoder);
+  if (offset < codes_size(decoder)) {
+    size_t row_size = (size_t)(decoder->blocks_per_row > 0
+                                   ? decoder->blocks_per_row
+                                   : 1) *
+                      BLOCK_CODES_SIZE;
+    size_t in_row = offset - (size_t)decoder->rows * row_size;
+    size_t row_end = (size_t)row_blocks(decoder, decoder->rows) *
+                     BLOCK_CODES_SIZE;
+    size_t take = row_end - in_row;
+    take = take < size ? take : size;
+    memcpy(decoder->codes + in_row, data, take);
+    decoder->received += take;
+    if (in_row + take == row_end) {
+      render_row(decoder, decoder->rows);
+      decoder->rows++;
+    }
+    return take;
+  }
+
+  size_t footer_size = binfmt_footer_size();
+  size_t take = footer_size - decoder->size;
+  take = take < size ? take : size;
+  if (append_data(decoder, data, take) != 0) {
+    return (size_t)-1;
+  }
+  if (decoder->size == footer_size) {
+    if (!binfmt_is_footer((const char *)decoder->data)) {
+      fprintf(stderr, "Invalid footer.\n");
+      return (size_t)-1;
+    }
+    decoder->stage = PROGRESSIVE_DONE;
+  }
+  return take;
+}
+
+int progressive_decoder_push(ProgressiveDecoder *decoder, const void *data,
+                             size_t size) {
+  const uint8_t *ptr = (const uint8_t *)data;
+  while (!decoder->failed && size > 0) {
+    size_t used;
+    if (decoder->buffered) {
+      used = append_data(decoder, ptr, size) == 0 ? size : (size_t)-1;
+    } else if (decoder->stage == PROGRESSIVE_HEADER) {
+      used = push_header(decoder, ptr, size);
+    } else if (decoder->stage == PROGRESSIVE_CORNERS) {
+      used = push_corners(decoder, ptr, size);
+    } else if (decoder->stage == PROGRESSIVE_CODES) {
+      used = push_codes(decoder, ptr, size);
+    } else {
+      /* フッタより後ろは、ファイル全体を読む場合と同じく無視する */
+      used = size;
+    }
+    if (used == (size_t)-1) {
+      decoder->failed = true;
+      break;
+    }
+    ptr += used;
+    size -= used;
+  }
+  return decoder->failed ? -1 : 0;
+}
+
+/**
+ * @brief 溜めた全体をビューとして読み、すべてのブロックを復元する
+ * @return 成功時0、失敗時-1
+ */
+static int decode_buffered(ProgressiveDecoder *decoder) {
+  ImgView *view =
+      img_view_open_mem(decoder->data, decoder->size, decoder->nthreads);
+  if (!view) {
+    return -1;
+  }
+  decoder->width = view->width;
+  decoder->height = view->height;
+  decoder->block_count = view->block_count;
+  decoder->blocks_per_row = view->width / 8;
+  decoder->pixels =
+      (uint8_t *)malloc((size_t)view->width * view->height * 3 + 1);
+  if (!decoder->pixels) {
+    fprintf(stderr, "Memory allocation failed for pixel data.\n");
+    img_view_close(view);
+    return -1;
+  }
+  size_t stride = (size_t)view->width * 3;
+  for (int row = 0; row < view->height / 8; row++) {
+    for (int bx = 0; bx < decoder->blocks_per_row; bx++) {
+      int32_t i = row * decoder->blocks_per_row + bx;
+      if (i >= view->block_count) {
+        break;
+      }
+      decoder->decode_block(img_view_header(view, i),
+                            img_view_corners(view, i),
+                            img_view_codes(view, i),
+                            block_dst(decoder, row, bx), stride);
+    }
+  }
+  decoder->rows = view->height / 8;
+  img_view_close(view);
+  return 0;
+}
+
+int progressive_decoder_finish(ProgressiveDecoder *decoder) {
+  if (decoder->failed) {
+    return -1;
+  }
+  if (decoder->stage == PROGRESSIVE_DONE) {
+    return 0;
+  }
+  /* ヘッダより短い入力も、ビューに読ませて理由を表示させる */
+  if (decoder->buffered || decoder->stage == PROGRESSIVE_HEADER) {
+    if (decode_buffered(decoder) != 0) {
+      decoder->failed = true;
+      return -1;
+    }
+    decoder->stage = PROGRESSIVE_DONE;
+    return 0;
+  }
+  fprintf(stderr, "Input ended before the image was complete.\n");
+  decoder->failed = true;
+  return -1;
+}
+
+ProgressiveStage progressive_decoder_stage(const ProgressiveDecoder *decoder) {
+  return decoder->stage;
+}
+
+const uint8_t *progressive_decoder_pixels(const ProgressiveDecoder *decoder,
+                                          int *width, int *height) {
+  if (!decoder->pixels) {
+    return NULL;
+  }
+  *width = decoder->width;
+  *height = decoder->height;
+  return decoder->pixels;
+}
+
+int progressive_decoder_rows(const ProgressiveDecoder *decoder) {
+  int rows = decoder->rows < decoder->height / 8 ? decoder->rows
+                                                 : decoder->height / 8;
+  return rows * 8;
+}
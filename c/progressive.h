@@ -0,0 +1,66 @@
+#ifndef PROGRESSIVE_H
+#define PROGRESSIVE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "deckernel.h"
+
+/*
+ * 届いた分から少しずつ復元するデコーダ。
+ * BINFMT_PLANAR形式はヘッダ、四隅、画素の順に面が並ぶので、四隅の面が
+ * 届いた時点で全ブロックを四隅の補間だけで描いた下見の画像を作り、
+ * 画素の面が届くにつれてブロック行ごとに本来の画素で描き直す。
+ * 面を並べていない形式 (xz、BINFMT_ENTROPY、BINFMT_SPARSE、
+ * BINFMT_CHROMA420) は全体を受け取ってから復元する。
+ */
+
+typedef struct ProgressiveDecoder ProgressiveDecoder;
+
+typedef enum {
+  PROGRESSIVE_HEADER,  /* 寸法が分かるのを待っている */
+  PROGRESSIVE_CORNERS, /* 寸法は分かったが、下見の画像はまだない */
+  PROGRESSIVE_CODES,   /* 下見の画像があり、ブロック行ごとに描き直している */
+  PROGRESSIVE_DONE,    /* 画像全体を復元した */
+} ProgressiveStage;
+
+/**
+ * @brief デコーダを作る
+ * @param nthreads xz形式を展開する場合のスレッド数
+ * @return デコーダ、失敗した場合はNULL
+ */
+ProgressiveDecoder *progressive_decoder_new(decode_block_fn decode_block,
+                                            int nthreads);
+
+void progressive_decoder_free(ProgressiveDecoder *decoder);
+
+/**
+ * @brief 続きのバイト列を渡す。区切りはどこでもよい
+ * @return 成功時0、形式が不正な場合や前の呼び出しで失敗していた場合-1
+ */
+int progressive_decoder_push(ProgressiveDecoder *decoder, const void *data,
+                             size_t size);
+
+/**
+ * @brief 入力の終わりを伝える。全体を受け取ってから復元する形式はここで復元する
+ * @return 画像全体を復元できた場合0、入力が途中で終わっていた場合などは-1
+ */
+int progressive_decoder_finish(ProgressiveDecoder *decoder);
+
+ProgressiveStage progressive_decoder_stage(const ProgressiveDecoder *decoder);
+
+/**
+ * @brief 復元中の画像を返す。1行あたりwidth*3バイトのRGB
+ * @return 画素、PROGRESSIVE_CORNERSより前の場合はNULL
+ * @note 下見の前は黒で、次にpushやfinishを呼ぶまでは書き換わらない
+ */
+const uint8_t *progressive_decoder_pixels(const ProgressiveDecoder *decoder,
+                                          int *width, int *height);
+
+/**
+ * @brief 本来の画素で描き終えた、上から数えた画素の行数を返す
+ */
+int progressive_decoder_rows(const ProgressiveDecoder *decoder);
+
+#endif
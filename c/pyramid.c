@@ -0,0 +1,136 @@
+#include "pyramid.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const char *pyramid_msg =
+    "this is binary image of https://github.com/bsahd/image-compress "
+    "format.\nversion:pyramid-1\n\n\n\n\n\n\n\n\n";
+
+/* 段数 */
+#define PYRAMID_FIELDS_SIZE sizeof(uint32_t)
+/* 段ごとの幅、高さ、位置、長さ */
+#define PYRAMID_ENTRY_SIZE (sizeof(uint32_t) * 2 + sizeof(uint64_t) * 2)
+
+static size_t pyramid_header_size(void) {
+  return strlen(pyramid_msg) + PYRAMID_FIELDS_SIZE;
+}
+
+int pyramid_write(FILE *out, uint32_t level_count,
+                  const PyramidLevel *levels) {
+  size_t index_size = (size_t)level_count * PYRAMID_ENTRY_SIZE;
+  uint8_t *head = (uint8_t *)malloc(pyramid_header_size() + index_size);
+  if (!head) {
+    fprintf(stderr, "Memory allocation failed for pyramid index.\n");
+    return -1;
+  }
+  memcpy(head, pyramid_msg, strlen(pyramid_msg));
+  binfmt_put_be32(head + strlen(pyramid_msg), level_count);
+  /* 段の中身は全て手元にあるので、表を先に埋めてから順に書ける */
+  uint64_t offset = pyramid_header_size() + index_size;
+  for (uint32_t i = 0; i < level_count; i++) {
+    uint8_t *entry = head + pyramid_header_size() + i * PYRAMID_ENTRY_SIZE;
+    binfmt_put_be32(entry, levels[i].width);
+    binfmt_put_be32(entry + 4, levels[i].height);
+    binfmt_put_be64(entry + 8, offset);
+    binfmt_put_be64(entry + 16, levels[i].len);
+    offset += levels[i].len;
+  }
+
+  int result = fwrite(head, 1, pyramid_header_size() + index_size, out) ==
+                       pyramid_header_size() + index_size
+                   ? 0
+                   : -1;
+  for (uint32_t i = 0; i < level_count && result == 0; i++) {
+    if (fwrite(levels[i].data, 1, levels[i].len, out) != levels[i].len) {
+      result = -1;
+    }
+  }
+  if (result == 0 && fwrite(binfmt_footer(), 1, binfmt_footer_size(), out) !=
+                         binfmt_footer_size()) {
+    result = -1;
+  }
+  if (result != 0) {
+    fprintf(stderr, "Failed to write pyramid data.\n");
+  }
+  free(head);
+  return result;
+}
+
+bool pyramid_is_file(const char *path) {
+  return binfmt_file_has_version(path, pyramid_msg);
+}
+
+PyramidImage *pyramid_image_open(const char *path) {
+  PyramidImage *pyramid = (PyramidImage *)malloc(sizeof(PyramidImage));
+  if (!pyramid) {
+    fprintf(stderr, "Memory allocation failed for PyramidImage.\n");
+    return NULL;
+  }
+  pyramid->map = binfmt_map_file(path, &pyramid->map_size);
+  if (!pyramid->map) {
+    free(pyramid);
+    return NULL;
+  }
+
+  const uint8_t *data = (const uint8_t *)pyramid->map;
+  size_t size = pyramid->map_size;
+  if (size < pyramid_header_size() ||
+      memcmp(data, pyramid_msg, strlen(pyramid_msg)) != 0) {
+    fprintf(stderr, "Invalid header.\n");
+    pyramid_image_close(pyramid);
+    return NULL;
+  }
+  pyramid->level_count = binfmt_get_be32(data + strlen(pyramid_msg));
+  if (pyramid->level_count == 0 ||
+      (size - pyramid_header_size()) / PYRAMID_ENTRY_SIZE <
+          pyramid->level_count) {
+    fprintf(stderr, "Invalid level count.\n");
+    pyramid_image_close(pyramid);
+    return NULL;
+  }
+  pyramid->index = data + pyramid_header_size();
+
+  if (binfmt_check_index(data, size, pyramid->index, pyramid->level_count,
+                         PYRAMID_ENTRY_SIZE, 8, "Level") != 0) {
+    pyramid_image_close(pyramid);
+    return NULL;
+  }
+  return pyramid;
+}
+
+void pyramid_image_close(PyramidImage *pyramid) {
+  if (pyramid) {
+    binfmt_unmap_file(pyramid->map, pyramid->map_size);
+    free(pyramid);
+  }
+}
+
+void pyramid_level_size(const PyramidImage *pyramid, uint32_t level,
+                        uint32_t *width, uint32_t *height) {
+  const uint8_t *entry = pyramid->index + (size_t)level * PYRAMID_ENTRY_SIZE;
+  *width = binfmt_get_be32(entry);
+  *height = binfmt_get_be32(entry + 4);
+}
+
+ImgView *pyramid_image_level(const PyramidImage *pyramid, uint32_t level,
+                             int nthreads) {
+  const uint8_t *entry = pyramid->index + (size_t)level * PYRAMID_ENTRY_SIZE;
+  uint64_t offset = binfmt_get_be64(entry + 8);
+  uint64_t len = binfmt_get_be64(entry + 16);
+  ImgView *view = img_view_open_mem((const uint8_t *)pyramid->map + offset,
+                                    (size_t)len, nthreads);
+  if (!view) {
+    fprintf(stderr, "Could not read level %u.\n", level);
+    return NULL;
+  }
+  uint32_t width, height;
+  pyramid_level_size(pyramid, level, &width, &height);
+  if ((uint32_t)view->width != (width + 7) / 8 * 8 ||
+      (uint32_t)view->height != (height + 7) / 8 * 8) {
+    fprintf(stderr, "Level %u has unexpected size %dx%d.\n", level,
+            view->width, view->height);
+    img_view_close(view);
+    return NULL;
+  }
+  return view;
+}
@@ -0,0 +1,72 @@
+#ifndef PYRAMID_H
+#define PYRAMID_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "binfmt.h"
+
+/*
+ * 同じ画像を1/2ずつ縮小した段を並べる入れ物。0段目が元の寸法になる。
+ * ヘッダの直後に各段の寸法と位置と長さの表があり、段は個別に読み出せる。
+ * 各段の中身は独立したバイナリ形式で、どの形式でもよく、xzで圧縮されて
+ * いてもよい。
+ */
+
+/**
+ * @brief 書き出す1段分
+ */
+typedef struct {
+  uint32_t width, height; /* 8の倍数に広げる前の寸法 */
+  const void *data;       /* 段の中身のバイナリ形式 */
+  size_t len;
+} PyramidLevel;
+
+/**
+ * @brief 表と全ての段を書き出す
+ * @param levels 0段目から順に並べた段
+ * @return 成功時0、失敗時-1
+ */
+int pyramid_write(FILE *out, uint32_t level_count, const PyramidLevel *levels);
+
+/**
+ * @brief メモリマップした段の形式のファイル
+ */
+typedef struct {
+  uint32_t level_count;
+  const uint8_t *index; /* 24バイト (幅, 高さ, 位置, 長さ) x 段数 */
+  void *map;
+  size_t map_size;
+} PyramidImage;
+
+/**
+ * @brief ファイルが段の形式かどうかを先頭のメッセージで判定する
+ */
+bool pyramid_is_file(const char *path);
+
+/**
+ * @brief 段の形式のファイルを開く
+ * @return 開いたファイル、失敗した場合はNULL。pyramid_image_closeで解放する
+ */
+PyramidImage *pyramid_image_open(const char *path);
+
+void pyramid_image_close(PyramidImage *pyramid);
+
+/**
+ * @brief level段目の、8の倍数に広げる前の寸法を返す
+ */
+void pyramid_level_size(const PyramidImage *pyramid, uint32_t level,
+                        uint32_t *width, uint32_t *height);
+
+/**
+ * @brief level段目だけを読んでビューを作る
+ * @param nthreads 段がxz形式の場合の展開スレッド数
+ * @return ビュー、失敗した場合はNULL。img_view_closeで解放する
+ * @note 他の段のページは読まない
+ */
+ImgView *pyramid_image_level(const PyramidImage *pyramid, uint32_t level,
+                             int nthreads);
+
+#endif
@@ -0,0 +1,231 @@
+#include "ratectl.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "deckernel.h"
+
+/* λを探す範囲 (log2) と二分探索の回数 */
+#define LAMBDA_LOG2_MIN -24.0
+#define LAMBDA_LOG2_MAX 40.0
+#define LAMBDA_STEPS 48
+
+typedef struct {
+  int level;
+  float sse;   /* 有効な画素についてのRGBの二乗誤差の和 */
+  float bytes; /* 画素の面の符号量の見積もり */
+} RateCandidate;
+
+typedef struct {
+  RateCandidate candidates[RATECTL_MAX_CANDIDATES];
+  uint8_t count;
+  uint8_t pixels; /* 誤差を数えた画素数 */
+} RateBlock;
+
+struct RateControl {
+  int32_t block_count;
+  encode_block_fn encode_block;
+  decode_block_fn decode_block;
+  bool sparse;
+  RateBlock *blocks;
+};
+
+RateControl *ratectl_new(int32_t block_count, encode_block_fn encode_block,
+                         bool sparse) {
+  RateControl *rc = (RateControl *)calloc(1, sizeof(RateControl));
+  if (rc) {
+    rc->blocks = (RateBlock *)calloc(block_count ? block_count : 1,
+                                     sizeof(RateBlock));
+  }
+  if (!rc || !rc->blocks) {
+    fprintf(stderr, "Memory allocation failed for rate control.\n");
+    ratectl_free(rc);
+    return NULL;
+  }
+  rc->block_count = block_count;
+  rc->encode_block = encode_block;
+  /* 誤差は見積もりに使うだけなので、基準実装と±1の差がある速いカーネルでよい */
+  rc->decode_block = decode_kernel_select(DEC_KERNEL_AUTO);
+  rc->sparse = sparse;
+  return rc;
+}
+
+void ratectl_free(RateControl *rc) {
+  if (rc) {
+    free(rc->blocks);
+    free(rc);
+  }
+}
+
+/**
+ * @brief 画素の面の1ブロックのバイト数を見積もる
+ * @note 圧縮後の大きさの目安として、ブロック内の符号の0次エントロピーを使う。
+ *       BLOCK_FLAG_CHROMA420のブロックはファイルに書く先頭の符号だけを数える
+ */
+static double codes_bytes(const uint8_t *header, const uint8_t *codes) {
+  int size = header[BLOCK_FLAGS] & BLOCK_FLAG_CHROMA420
+                 ? CHROMA420_Y_SIZE + CHROMA420_UV_SIZE
+                 : BLOCK_CODES_SIZE;
+  uint8_t counts[256] = {0};
+  for (int i = 0; i < size; i++) {
+    counts[codes[i]]++;
+  }
+  double bits = 0;
+  for (int i = 0; i < size; i++) {
+    int c = counts[codes[i]];
+    if (c > 0) {
+      bits += c * log2((double)size / c);
+      counts[codes[i]] = 0;
+    }
+  }
+  return bits / 8;
+}
+
+static void add_level(int *levels, int *count, int level) {
+  for (int i = 0; i < *count; i++) {
+    if (levels[i] == level) {
+      return;
+    }
+  }
+  int i = (*count)++;
+  while (i > 0 && levels[i - 1] > level) {
+    levels[i] = levels[i - 1];
+    i--;
+  }
+  levels[i] = level;
+}
+
+void ratectl_analyze_block(RateControl *rc, int32_t index, const uint8_t *src,
+                           size_t stride, int w, int h) {
+  RateBlock *block = &rc->blocks[index];
+  uint8_t header[BLOCK_HEADER_SIZE], corners[BLOCK_CORNERS_SIZE];
+  uint8_t codes[BLOCK_CODES_SIZE], rgb[8 * 8 * 3];
+
+  /* ヘッダの範囲は補間するかどうかによらないので、最初の候補から各チャンネルの
+   * drangeが分かる。yはdrange < level / 2、uとvはdrange < levelで補間に
+   * 切り替わる。レベル0ではdrangeが0のチャンネルも量子化して0で割るので、
+   * レベル1から始める。レベル1で補間するのはdrangeが0のuとvだけで、
+   * 復元した画素はレベル0と変わらない */
+  rc->encode_block(src, stride, 1, header, corners, codes);
+  int levels[RATECTL_MAX_CANDIDATES] = {1};
+  int count = 1;
+  add_level(levels, &count, (header[BLOCK_MAXY] - header[BLOCK_MINY]) * 2 + 2);
+  add_level(levels, &count, header[BLOCK_MAXU] - header[BLOCK_MINU] + 1);
+  add_level(levels, &count, header[BLOCK_MAXV] - header[BLOCK_MINV] + 1);
+
+  for (int k = 0; k < count; k++) {
+    if (k > 0) {
+      rc->encode_block(src, stride, levels[k], header, corners, codes);
+    }
+    rc->decode_block(header, corners, codes, rgb, 8 * 3);
+    double sse = 0;
+    for (int y = 0; y < h; y++) {
+      for (int x = 0; x < w * 3; x++) {
+        int d = rgb[y * 8 * 3 + x] - src[(size_t)y * stride + x];
+        sse += d * d;
+      }
+    }
+    RateCandidate *c = &block->candidates[k];
+    c->level = levels[k];
+    c->sse = (float)sse;
+    if (rc->sparse) {
+      c->bytes = block_is_flat(header) ? 0 : BLOCK_CODES_SIZE;
+    } else {
+      c->bytes = (float)codes_bytes(header, codes);
+    }
+  }
+  block->count = (uint8_t)count;
+  block->pixels = (uint8_t)(w * h);
+}
+
+/**
+ * @brief 各ブロックで 誤差 + lambda * バイト数 が最小の候補を選ぶ
+ * @param levels 選んだレベルを返す。NULLの場合は合計だけを求める
+ */
+static void choose(const RateControl *rc, double lambda, int *levels,
+                   double *sse, double *bytes) {
+  *sse = 0;
+  *bytes = 0;
+  for (int32_t i = 0; i < rc->block_count; i++) {
+    const RateBlock *block = &rc->blocks[i];
+    int best = 0;
+    double best_cost = INFINITY;
+    for (int k = 0; k < block->count; k++) {
+      const RateCandidate *c = &block->candidates[k];
+      double cost = c->sse + lambda * c->bytes;
+      if (cost < best_cost) {
+        best = k;
+        best_cost = cost;
+      }
+    }
+    *sse += block->candidates[best].sse;
+    *bytes += block->candidates[best].bytes;
+    if (levels) {
+      levels[i] = block->candidates[best].level;
+    }
+  }
+}
+
+static RateEstimate estimate(const RateControl *rc, double sse,
+                             double code_bytes) {
+  int64_t samples = 0;
+  for (int32_t i = 0; i < rc->block_count; i++) {
+    samples += rc->blocks[i].pixels * 3;
+  }
+  /* ヘッダと四隅の面はレベルによらないので、そのままの大きさで数える */
+  size_t fixed = binfmt_file_size(rc->block_count) -
+                 (size_t)rc->block_count * BLOCK_CODES_SIZE;
+  RateEstimate result = {fixed + code_bytes, INFINITY};
+  if (sse > 0 && samples > 0) {
+    result.psnr = 10 * log10(255.0 * 255.0 * samples / sse);
+  }
+  return result;
+}
+
+/**
+ * @brief 目標を満たすλを二分探索で求め、そのλで選ぶ
+ * @param by_psnr trueの場合はPSNRがlimit以上、falseの場合はバイト数が
+ *                limit以下であることを目標にする
+ */
+static RateEstimate search(const RateControl *rc, double limit, bool by_psnr,
+                           int *levels) {
+  double sse, bytes;
+  /* λを大きくするほど誤差は増え、バイト数は減る */
+  double lo = LAMBDA_LOG2_MIN, hi = LAMBDA_LOG2_MAX;
+  for (int step = 0; step < LAMBDA_STEPS; step++) {
+    double mid = (lo + hi) / 2;
+    choose(rc, exp2(mid), NULL, &sse, &bytes);
+    bool ok = by_psnr ? estimate(rc, sse, bytes).psnr >= limit
+                      : estimate(rc, sse, bytes).bytes <= limit;
+    /* PSNRは満たす中で最大のλ、バイト数は満たす中で最小のλを探す */
+    if (ok == by_psnr) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  double lambda;
+  if (by_psnr) {
+    choose(rc, exp2(lo), NULL, &sse, &bytes);
+    lambda = estimate(rc, sse, bytes).psnr >= limit ? exp2(lo) : 0;
+  } else {
+    choose(rc, exp2(hi), NULL, &sse, &bytes);
+    lambda = estimate(rc, sse, bytes).bytes <= limit ? exp2(hi) : INFINITY;
+  }
+  if (isinf(lambda)) {
+    /* 誤差を無視してバイト数が最小の候補を選ぶ */
+    lambda = exp2(LAMBDA_LOG2_MAX * 2);
+  }
+  choose(rc, lambda, levels, &sse, &bytes);
+  return estimate(rc, sse, bytes);
+}
+
+RateEstimate ratectl_choose_psnr(const RateControl *rc, double psnr,
+                                 int *levels) {
+  return search(rc, psnr, true, levels);
+}
+
+RateEstimate ratectl_choose_bytes(const RateControl *rc, double bytes,
+                                  int *levels) {
+  return search(rc, bytes, false, levels);
+}
@@ -0,0 +1,68 @@
+#ifndef RATECTL_H
+#define RATECTL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "enckernel.h"
+
+/*
+ * 目標のバイト数またはPSNRに合わせて、ブロックごとに圧縮レベルを選ぶ。
+ * ブロックの出力は各チャンネルを補間するかどうかだけで決まり、補間に
+ * 切り替わるレベルはdrangeから分かるので、1ブロックの候補は高々4つになる。
+ * 各候補を一度だけ符号化して復元し、誤差と画素の面の符号量の見積もりを
+ * 表にしておくので、目標に合わせた選び直しは表を引くだけで済む。
+ */
+
+#define RATECTL_MAX_CANDIDATES 4
+
+typedef struct RateControl RateControl;
+
+/**
+ * @brief 選んだレベルで見積もった結果
+ */
+typedef struct {
+  double bytes; /* 出力のバイト数 */
+  double psnr;  /* RGBのPSNR (dB)。誤差がない場合はINFINITY */
+} RateEstimate;
+
+/**
+ * @brief 表を作る
+ * @param encode_block 実際の符号化に使うカーネル。BINFMT_CHROMA420用の
+ *                     カーネルであれば、誤差も符号量も色差を間引いた形で数える
+ * @param sparse trueの場合、符号量をBINFMT_SPARSE形式の面のバイト数で数える。
+ *               それ以外はブロック内の符号のエントロピーで見積もる
+ * @return 表、失敗した場合はNULL
+ */
+RateControl *ratectl_new(int32_t block_count, encode_block_fn encode_block,
+                         bool sparse);
+
+void ratectl_free(RateControl *rc);
+
+/**
+ * @brief index番目のブロックの候補を符号化して復元し、表に記録する
+ * @param src ブロック左上のRGBピクセルへのポインタ (8x8)
+ * @param w,h 誤差を数える範囲。画像の端で埋めたブロックでは8より小さい
+ * @note 異なるブロックであれば複数のスレッドから同時に呼んでよい
+ */
+void ratectl_analyze_block(RateControl *rc, int32_t index, const uint8_t *src,
+                           size_t stride, int w, int h);
+
+/**
+ * @brief PSNRがpsnr以上になる中で、見積もったバイト数が最小のレベルを選ぶ
+ * @param levels ブロックごとのレベルを返す
+ * @return 選んだレベルの見積もり。届かない場合は誤差が最小のレベルを選ぶ
+ */
+RateEstimate ratectl_choose_psnr(const RateControl *rc, double psnr,
+                                 int *levels);
+
+/**
+ * @brief 見積もったバイト数がbytes以下になる中で、誤差が最小のレベルを選ぶ
+ * @param levels ブロックごとのレベルを返す
+ * @return 選んだレベルの見積もり。届かない場合はバイト数が最小のレベルを選ぶ
+ */
+RateEstimate ratectl_choose_bytes(const RateControl *rc, double bytes,
+                                  int *levels);
+
+#endif
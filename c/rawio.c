@@ -0,0 +1,414 @@
+#include "rawio.h"
+#include <ctype.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "binfmt.h"
+
+static const struct {
+  const char *ext;
+  RawFormat format;
+} rawio_exts[] = {{".ppm", RAWIO_PPM}, {".pnm", RAWIO_PPM},
+                  {".pam", RAWIO_PAM}, {".rgb", RAWIO_RAW},
+                  {".raw", RAWIO_RAW}};
+
+bool rawio_format_from_name(const char *path, RawFormat *format) {
+  size_t len = strlen(path);
+  for (size_t i = 0; i < sizeof(rawio_exts) / sizeof(rawio_exts[0]); i++) {
+    size_t ext_len = strlen(rawio_exts[i].ext);
+    if (len <= ext_len) {
+      continue;
+    }
+    const char *tail = path + len - ext_len;
+    size_t k = 0;
+    while (k < ext_len &&
+           tolower((unsigned char)tail[k]) == rawio_exts[i].ext[k]) {
+      k++;
+    }
+    if (k == ext_len) {
+      *format = rawio_exts[i].format;
+      return true;
+    }
+  }
+  return false;
+}
+
+int rawio_format_parse(const char *name, RawFormat *format) {
+  if (strcmp(name, "ppm") == 0) {
+    *format = RAWIO_PPM;
+  } else if (strcmp(name, "pam") == 0) {
+    *format = RAWIO_PAM;
+  } else if (strcmp(name, "raw") == 0) {
+    *format = RAWIO_RAW;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+uint8_t *rawio_read_all(FILE *stream, size_t *size) {
+  size_t capacity = 1 << 20, len = 0;
+  uint8_t *data = (uint8_t *)malloc(capacity);
+  size_t n;
+  while (data && (n = fread(data + len, 1, capacity - len, stream)) > 0) {
+    len += n;
+    if (len == capacity) {
+      uint8_t *grown = (uint8_t *)realloc(data, capacity * 2);
+      if (!grown) {
+        free(data);
+        data = NULL;
+        break;
+      }
+      data = grown;
+      capacity *= 2;
+    }
+  }
+  if (!data) {
+    fprintf(stderr, "Memory allocation failed for input data.\n");
+    return NULL;
+  }
+  if (ferror(stream)) {
+    fprintf(stderr, "Failed to read input data.\n");
+    free(data);
+    return NULL;
+  }
+  *size = len;
+  return data;
+}
+
+/**
+ * @brief 空白と#から行末までのコメントを読み飛ばす
+ */
+static const uint8_t *pnm_skip(const uint8_t *p, const uint8_t *end) {
+  while (p < end) {
+    if (*p == '#') {
+      while (p < end && *p != '\n') {
+        p++;
+      }
+    } else if (isspace(*p)) {
+      p++;
+    } else {
+      break;
+    }
+  }
+  return p;
+}
+
+/**
+ * @brief 10進の整数を読む
+ * @return 読んだ直後の位置、読めなかった場合はNULL
+ */
+static const uint8_t *pnm_int(const uint8_t *p, const uint8_t *end,
+                              int *value) {
+  p = pnm_skip(p, end);
+  const uint8_t *start = p;
+  long v = 0;
+  while (p < end && isdigit(*p) && v <= INT_MAX / 10) {
+    v = v * 10 + (*p++ - '0');
+  }
+  if (p == start || v > INT_MAX) {
+    return NULL;
+  }
+  *value = (int)v;
+  return p;
+}
+
+/**
+ * @brief P6のヘッダを読む
+ * @return 画素の先頭、読めなかった場合はNULL
+ */
+static const uint8_t *parse_ppm(const uint8_t *p, const uint8_t *end,
+                                int *width, int *height, int *maxval) {
+  p = pnm_int(p, end, width);
+  p = p ? pnm_int(p, end, height) : NULL;
+  p = p ? pnm_int(p, end, maxval) : NULL;
+  /* MAXVALの直後の空白1文字で画素が始まる */
+  if (!p || p >= end || !isspace(*p)) {
+    return NULL;
+  }
+  return p + 1;
+}
+
+/**
+ * @brief P7のヘッダを読む
+ * @return 画素の先頭、読めなかった場合はNULL
+ */
+static const uint8_t *parse_pam(const uint8_t *p, const uint8_t *end,
+                                int *width, int *height, int *depth,
+                                int *maxval) {
+  *width = *height = *depth = *maxval = 0;
+  while ((p = pnm_skip(p, end)) < end) {
+    const uint8_t *word = p;
+    while (p < end && !isspace(*p)) {
+      p++;
+    }
+    size_t len = p - word;
+    if (len == 6 && memcmp(word, "ENDHDR", 6) == 0) {
+      return (p < end && *p == '\n') ? p + 1 : NULL;
+    } else if (len == 5 && memcmp(word, "WIDTH", 5) == 0) {
+      p = pnm_int(p, end, width);
+    } else if (len == 6 && memcmp(word, "HEIGHT", 6) == 0) {
+      p = pnm_int(p, end, height);
+    } else if (len == 5 && memcmp(word, "DEPTH", 5) == 0) {
+      p = pnm_int(p, end, depth);
+    } else if (len == 6 && memcmp(word, "MAXVAL", 6) == 0) {
+      p = pnm_int(p, end, maxval);
+    } else {
+      /* TUPLTYPEなどは深さから判断するので読み飛ばす */
+      while (p < end && *p != '\n') {
+        p++;
+      }
+    }
+    if (!p) {
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief dataの先頭にあるヘッダを読む。ヘッダなしのRGBでは寸法だけを設定する
+ * @param pixels 画素の先頭を返す
+ * @param depth 1画素あたりのバイト数 (3か4) を返す
+ * @return 成功時0、失敗時-1
+ */
+static int parse_header(const uint8_t *data, size_t size, int raw_width,
+                        int raw_height, int *width, int *height, int *depth,
+                        const uint8_t **pixels, bool *unsupported) {
+  const uint8_t *end = data + size;
+  int maxval = 255;
+  *depth = 3;
+  if (raw_width > 0) {
+    *width = raw_width;
+    *height = raw_height;
+    *pixels = data;
+  } else if (size >= 2 && data[0] == 'P' && data[1] == '6') {
+    *pixels = parse_ppm(data + 2, end, width, height, &maxval);
+  } else if (size >= 2 && data[0] == 'P' && data[1] == '7') {
+    *pixels = parse_pam(data + 2, end, width, height, depth, &maxval);
+  } else {
+    *unsupported = size >= 2 && data[0] == 'P' && isdigit(data[1]);
+    fprintf(stderr, "Input is not a binary PPM or PAM image.\n");
+    return -1;
+  }
+  if (!*pixels || *width <= 0 || *height <= 0) {
+    fprintf(stderr, "Invalid PPM/PAM header.\n");
+    return -1;
+  }
+  if (maxval != 255 || (*depth != 3 && *depth != 4)) {
+    *unsupported = true;
+    fprintf(stderr, "Only 8-bit RGB or RGBA PPM/PAM is read natively.\n");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief dataを画像として解釈し、imageの画素と寸法を設定する
+ * @return 成功時0、失敗時-1
+ */
+static int rawio_parse(RawImage *image, const uint8_t *data, size_t size,
+                       int raw_width, int raw_height, bool *unsupported) {
+  const uint8_t *end = data + size;
+  const uint8_t *pixels;
+  int width, height, depth;
+  if (parse_header(data, size, raw_width, raw_height, &width, &height, &depth,
+                   &pixels, unsupported) != 0) {
+    return -1;
+  }
+  size_t row_size = (size_t)width * depth;
+  if ((size_t)(end - pixels) / row_size < (size_t)height) {
+    fprintf(stderr, "Input is shorter than %dx%d pixels.\n", width, height);
+    return -1;
+  }
+
+  image->width = width;
+  image->height = height;
+  image->pixels = pixels;
+  if (depth == 4) {
+    /* 符号化はRGBの並びを前提にするので、アルファを落として詰め直す */
+    uint8_t *rgb = (uint8_t *)malloc((size_t)width * height * 3);
+    if (!rgb) {
+      fprintf(stderr, "Memory allocation failed for RGB pixels.\n");
+      return -1;
+    }
+    for (size_t i = 0; i < (size_t)width * height; i++) {
+      memcpy(rgb + i * 3, pixels + i * 4, 3);
+    }
+    free(image->owned);
+    image->owned = rgb;
+    image->pixels = rgb;
+  }
+  return 0;
+}
+
+RawImage *rawio_open(const char *path, int raw_width, int raw_height,
+                     bool *unsupported) {
+  *unsupported = false;
+  RawImage *image = (RawImage *)calloc(1, sizeof(RawImage));
+  if (!image) {
+    fprintf(stderr, "Memory allocation failed for RawImage.\n");
+    return NULL;
+  }
+  const uint8_t *data;
+  size_t size;
+  if (strcmp(path, "-") == 0) {
+    data = image->owned = rawio_read_all(stdin, &size);
+  } else {
+    data = (const uint8_t *)(image->map = binfmt_map_file(path, &size));
+    image->map_size = size;
+  }
+  if (!data ||
+      rawio_parse(image, data, size, raw_width, raw_height, unsupported) !=
+          0) {
+    rawio_close(image);
+    return NULL;
+  }
+  /* アルファを落とした場合、元のデータはもう参照しない */
+  if (image->map && image->pixels == image->owned) {
+    binfmt_unmap_file(image->map, image->map_size);
+    image->map = NULL;
+  }
+  return image;
+}
+
+void rawio_close(RawImage *image) {
+  if (image) {
+    binfmt_unmap_file(image->map, image->map_size);
+    free(image->owned);
+    free(image);
+  }
+}
+
+RawStream *rawio_stream_open(const char *path, int raw_width, int raw_height,
+                             bool *unsupported) {
+  *unsupported = false;
+  RawStream *stream = (RawStream *)calloc(1, sizeof(RawStream));
+  if (!stream) {
+    fprintf(stderr, "Memory allocation failed for RawStream.\n");
+    return NULL;
+  }
+  bool is_stdin = strcmp(path, "-") == 0;
+  stream->file = is_stdin ? stdin : fopen(path, "rb");
+  stream->owns_file = !is_stdin;
+  if (!stream->file) {
+    fprintf(stderr, "Could not open input file: %s\n", path);
+    free(stream);
+    return NULL;
+  }
+
+  /* ヘッダは先頭のRAWIO_HEADER_MAXバイトに収まっているものとする。
+   * 読みすぎた画素はheadに残して最初の行として渡す */
+  if (raw_width <= 0) {
+    stream->head = (uint8_t *)malloc(RAWIO_HEADER_MAX);
+    if (!stream->head) {
+      fprintf(stderr, "Memory allocation failed for input header.\n");
+      rawio_stream_close(stream);
+      return NULL;
+    }
+    stream->head_len = fread(stream->head, 1, RAWIO_HEADER_MAX, stream->file);
+  }
+  const uint8_t *pixels;
+  if (parse_header(stream->head, stream->head_len, raw_width, raw_height,
+                   &stream->width, &stream->height, &stream->depth, &pixels,
+                   unsupported) != 0) {
+    rawio_stream_close(stream);
+    return NULL;
+  }
+  stream->head_pos = stream->head ? (size_t)(pixels - stream->head) : 0;
+  if (stream->depth == 4) {
+    stream->row = (uint8_t *)malloc((size_t)stream->width * 4);
+    if (!stream->row) {
+      fprintf(stderr, "Memory allocation failed for RGBA row.\n");
+      rawio_stream_close(stream);
+      return NULL;
+    }
+  }
+  return stream;
+}
+
+/**
+ * @brief headに残ったバイトから先に、sizeバイトを読む
+ * @return 読めた場合0、入力が足りない場合-1
+ */
+static int stream_fill(RawStream *stream, uint8_t *dst, size_t size) {
+  size_t left = stream->head_len - stream->head_pos;
+  size_t n = size < left ? size : left;
+  if (n > 0) {
+    memcpy(dst, stream->head + stream->head_pos, n);
+    stream->head_pos += n;
+  }
+  if (n < size && fread(dst + n, 1, size - n, stream->file) != size - n) {
+    return -1;
+  }
+  return 0;
+}
+
+int rawio_stream_read(RawStream *stream, uint8_t *pixels, int rows) {
+  size_t row_size = (size_t)stream->width * 3;
+  for (int y = 0; y < rows; y++) {
+    uint8_t *dst = pixels + (size_t)y * row_size;
+    int result;
+    if (stream->depth == 4) {
+      /* アルファは1行ずつ落とす */
+      result = stream_fill(stream, stream->row, (size_t)stream->width * 4);
+      for (int x = 0; result == 0 && x < stream->width; x++) {
+        memcpy(dst + x * 3, stream->row + x * 4, 3);
+      }
+    } else {
+      result = stream_fill(stream, dst, row_size);
+    }
+    if (result != 0) {
+      fprintf(stderr, "Input is shorter than %dx%d pixels.\n", stream->width,
+              stream->height);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void rawio_stream_close(RawStream *stream) {
+  if (stream) {
+    if (stream->owns_file && stream->file) {
+      fclose(stream->file);
+    }
+    free(stream->head);
+    free(stream->row);
+    free(stream);
+  }
+}
+
+int rawio_write(FILE *out, RawFormat format, const uint8_t *pixels, int width,
+                int height, size_t stride) {
+  int result = 0;
+  if (format == RAWIO_PPM) {
+    result = fprintf(out, "P6\n%d %d\n255\n", width, height) < 0 ? -1 : 0;
+  } else if (format == RAWIO_PAM) {
+    result = fprintf(out,
+                     "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 3\nMAXVAL 255\n"
+                     "TUPLTYPE RGB\nENDHDR\n",
+                     width, height) < 0
+                 ? -1
+                 : 0;
+  }
+  size_t row_size = (size_t)width * 3;
+  if (result == 0 && stride == row_size) {
+    size_t total = row_size * height;
+    result = fwrite(pixels, 1, total, out) == total ? 0 : -1;
+  } else {
+    for (int y = 0; y < height && result == 0; y++) {
+      result = fwrite(pixels + (size_t)y * stride, 1, row_size, out) ==
+                       row_size
+                   ? 0
+                   : -1;
+    }
+  }
+  if (result == 0 && fflush(out) != 0) {
+    result = -1;
+  }
+  if (result != 0) {
+    fprintf(stderr, "Failed to write image data.\n");
+  }
+  return result;
+}
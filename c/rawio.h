@@ -0,0 +1,107 @@
+#ifndef RAWIO_H
+#define RAWIO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * libvipsを通さずに読み書きする画像形式。
+ * PPM (P6) とPAM (P7)、寸法を別に指定するヘッダなしのRGBを扱う。
+ * ファイルはメモリマップして画素を直接参照するので、読み込みでコピーしない。
+ * "-"は標準入力または標準出力を表す。
+ */
+
+typedef enum {
+  RAWIO_PPM,
+  RAWIO_PAM,
+  RAWIO_RAW, /* ヘッダなしのRGB */
+} RawFormat;
+
+typedef struct {
+  int width, height;
+  const uint8_t *pixels; /* 8ビットRGB、1行あたりwidth*3バイト */
+  /* pixelsが指す領域の持ち主 */
+  void *map;
+  size_t map_size;
+  uint8_t *owned;
+} RawImage;
+
+/**
+ * @brief 拡張子 (.ppm .pnm .pam .rgb .raw) から形式を判定する
+ * @return 判定できた場合true
+ */
+bool rawio_format_from_name(const char *path, RawFormat *format);
+
+/**
+ * @brief "ppm" / "pam" / "raw" を解釈する
+ * @return 成功時0、不明な名前の場合-1
+ */
+int rawio_format_parse(const char *name, RawFormat *format);
+
+/**
+ * @brief 画像を読む
+ * @param path ファイル名。"-"の場合は標準入力から読む
+ * @param raw_width,raw_height 0より大きい場合はヘッダなしのRGBとして読む
+ * @param unsupported PNMだがこの実装が扱わない種類 (P3やMAXVALが255以外など)
+ *                    の場合にtrueを返す。呼び出し元はlibvipsで読み直せる
+ * @return 読んだ画像、失敗した場合はNULL。rawio_closeで解放する
+ */
+RawImage *rawio_open(const char *path, int raw_width, int raw_height,
+                     bool *unsupported);
+
+void rawio_close(RawImage *image);
+
+/* rawio_stream_openでヘッダを探す範囲 */
+#define RAWIO_HEADER_MAX 4096
+
+/**
+ * @brief 画素を上から順に読むリーダ。全体をメモリに置かない
+ */
+typedef struct {
+  int width, height;
+  FILE *file;
+  bool owns_file; /* 標準入力は閉じない */
+  int depth;      /* 入力の1画素あたりのバイト数 */
+  /* ヘッダを読んだときに一緒に読んだ画素 */
+  uint8_t *head;
+  size_t head_len, head_pos;
+  uint8_t *row; /* RGBAの1行 */
+} RawStream;
+
+/**
+ * @brief 画像のヘッダだけを読み、画素を順に読めるようにする
+ * @param path ファイル名。"-"の場合は標準入力から読む
+ * @param raw_width,raw_height 0より大きい場合はヘッダなしのRGBとして読む
+ * @param unsupported rawio_openと同じ
+ * @return 開いたリーダ、失敗した場合はNULL。rawio_stream_closeで解放する
+ * @note ヘッダはRAWIO_HEADER_MAXバイト以内でなければならない
+ */
+RawStream *rawio_stream_open(const char *path, int raw_width, int raw_height,
+                             bool *unsupported);
+
+/**
+ * @brief 次のrows行をRGBで読む
+ * @param pixels width*3*rowsバイトの領域
+ * @return 成功時0、入力が足りない場合などは-1
+ */
+int rawio_stream_read(RawStream *stream, uint8_t *pixels, int rows);
+
+void rawio_stream_close(RawStream *stream);
+
+/**
+ * @brief streamの残りをすべて読む
+ * @return 読んだ内容 (mallocで確保)、失敗した場合はNULL
+ */
+uint8_t *rawio_read_all(FILE *stream, size_t *size);
+
+/**
+ * @brief RGB画像を書き出す
+ * @param stride 1行あたりのバイト数
+ * @return 成功時0、失敗時-1
+ */
+int rawio_write(FILE *out, RawFormat format, const uint8_t *pixels, int width,
+                int height, size_t stride);
+
+#endif
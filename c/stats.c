@@ -0,0 +1,276 @@
+#include "stats.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+#include "batch.h"
+#include "binfmt.h"
+
+struct Stats {
+  pthread_mutex_t lock;
+  bool per_thread;
+  double start_wall;
+  StatsStage stages[STATS_MAX_STAGES];
+  int nstages;
+  uint64_t bytes_read, bytes_written;
+  int64_t blocks;
+  /* BLOCK_FLAGSの値 (y<<2|u<<1|v) ごとのブロック数 */
+  int64_t modes[8];
+  int64_t drange[3][STATS_DRANGE_BUCKETS];
+  int64_t drange_sum[3];
+};
+
+static double cpu_now(bool per_thread) {
+#ifdef _WIN32
+  (void)per_thread;
+  return (double)clock() / CLOCKS_PER_SEC;
+#else
+  struct timespec ts;
+  clock_gettime(
+      per_thread ? CLOCK_THREAD_CPUTIME_ID : CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+Stats *stats_new(bool per_thread) {
+  Stats *stats = (Stats *)calloc(1, sizeof(Stats));
+  if (!stats) {
+    fprintf(stderr, "Memory allocation failed for Stats.\n");
+    return NULL;
+  }
+  pthread_mutex_init(&stats->lock, NULL);
+  stats->per_thread = per_thread;
+  stats->start_wall = batch_now();
+  return stats;
+}
+
+void stats_free(Stats *stats) {
+  if (stats) {
+    pthread_mutex_destroy(&stats->lock);
+    free(stats);
+  }
+}
+
+StatsTimer stats_timer_start(const Stats *stats) {
+  StatsTimer timer = {0, 0};
+  if (stats) {
+    timer.wall = batch_now();
+    timer.cpu = cpu_now(stats->per_thread);
+  }
+  return timer;
+}
+
+void stats_timer_stop(Stats *stats, const char *name, const StatsTimer *timer) {
+  if (!stats) {
+    return;
+  }
+  double wall = batch_now() - timer->wall;
+  double cpu = cpu_now(stats->per_thread) - timer->cpu;
+  pthread_mutex_lock(&stats->lock);
+  int i = 0;
+  while (i < stats->nstages && strcmp(stats->stages[i].name, name) != 0) {
+    i++;
+  }
+  if (i < STATS_MAX_STAGES) {
+    if (i == stats->nstages) {
+      stats->stages[i].name = name;
+      stats->nstages++;
+    }
+    stats->stages[i].wall += wall;
+    stats->stages[i].cpu += cpu;
+  }
+  pthread_mutex_unlock(&stats->lock);
+}
+
+void stats_add_bytes(Stats *stats, uint64_t read, uint64_t written) {
+  if (stats) {
+    pthread_mutex_lock(&stats->lock);
+    stats->bytes_read += read;
+    stats->bytes_written += written;
+    pthread_mutex_unlock(&stats->lock);
+  }
+}
+
+static int drange_bucket(int drange) {
+  int bucket = 0;
+  while (drange > 0 && bucket < STATS_DRANGE_BUCKETS - 1) {
+    drange >>= 1;
+    bucket++;
+  }
+  return bucket;
+}
+
+void stats_add_blocks(Stats *stats, const uint8_t *headers, int32_t count) {
+  if (!stats) {
+    return;
+  }
+  /* ロックを取る回数を減らすため、手元で数えてから加える */
+  int64_t modes[8] = {0};
+  int64_t drange[3][STATS_DRANGE_BUCKETS] = {{0}};
+  int64_t drange_sum[3] = {0};
+  for (int32_t i = 0; i < count; i++) {
+    const uint8_t *header = headers + (size_t)i * BLOCK_HEADER_SIZE;
+    modes[header[BLOCK_FLAGS] & BLOCK_FLAGS_ALL]++;
+    for (int c = 0; c < 3; c++) {
+      /* get_channel_statsのdrangeはヘッダの最大値と最小値の差そのもの */
+      int d = header[BLOCK_MAXY + c * 2] - header[BLOCK_MINY + c * 2];
+      d = d < 0 ? 0 : d;
+      drange[c][drange_bucket(d)]++;
+      drange_sum[c] += d;
+    }
+  }
+  pthread_mutex_lock(&stats->lock);
+  stats->blocks += count;
+  for (int m = 0; m < 8; m++) {
+    stats->modes[m] += modes[m];
+  }
+  for (int c = 0; c < 3; c++) {
+    for (int b = 0; b < STATS_DRANGE_BUCKETS; b++) {
+      stats->drange[c][b] += drange[c][b];
+    }
+    stats->drange_sum[c] += drange_sum[c];
+  }
+  pthread_mutex_unlock(&stats->lock);
+}
+
+uint64_t stats_file_size(const char *path) {
+  struct stat st;
+  if (strcmp(path, "-") == 0 || stat(path, &st) != 0 ||
+      !S_ISREG(st.st_mode)) {
+    return 0;
+  }
+  return (uint64_t)st.st_size;
+}
+
+/**
+ * @brief プロセス全体のCPU時間と最大RSS (KiB) を返す
+ */
+static void process_usage(double *cpu, long *peak_rss_kib) {
+#ifdef _WIN32
+  *cpu = (double)clock() / CLOCKS_PER_SEC;
+  *peak_rss_kib = 0;
+#else
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  *cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+         usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+#ifdef __APPLE__
+  *peak_rss_kib = usage.ru_maxrss / 1024;
+#else
+  *peak_rss_kib = usage.ru_maxrss;
+#endif
+#endif
+}
+
+/**
+ * @brief 補間するチャンネルを文字で、しないチャンネルを'-'で表す
+ */
+static void mode_label(int mode, char *label) {
+  label[0] = (mode & BLOCK_FLAG_Y) ? 'y' : '-';
+  label[1] = (mode & BLOCK_FLAG_U) ? 'u' : '-';
+  label[2] = (mode & BLOCK_FLAG_V) ? 'v' : '-';
+  label[3] = '\0';
+}
+
+static const char *channel_names[3] = {"y", "u", "v"};
+
+static void print_json(const Stats *stats, FILE *out, double wall, double cpu,
+                       long peak_rss_kib) {
+  fprintf(out, "{\"stages\": [");
+  for (int i = 0; i < stats->nstages; i++) {
+    fprintf(out, "%s{\"name\": \"%s\", \"wall_s\": %.6f, \"cpu_s\": %.6f}",
+            i ? ", " : "", stats->stages[i].name, stats->stages[i].wall,
+            stats->stages[i].cpu);
+  }
+  fprintf(out,
+          "], \"wall_s\": %.6f, \"cpu_s\": %.6f, \"bytes_read\": %llu, "
+          "\"bytes_written\": %llu, \"peak_rss_kib\": %ld, \"blocks\": %lld, "
+          "\"modes\": {",
+          wall, cpu, (unsigned long long)stats->bytes_read,
+          (unsigned long long)stats->bytes_written, peak_rss_kib,
+          (long long)stats->blocks);
+  for (int m = 0; m < 8; m++) {
+    char label[4];
+    mode_label(m, label);
+    fprintf(out, "%s\"%s\": %lld", m ? ", " : "", label,
+            (long long)stats->modes[m]);
+  }
+  fprintf(out, "}, \"drange_buckets\": [0");
+  for (int b = 1; b < STATS_DRANGE_BUCKETS; b++) {
+    fprintf(out, ", %d", 1 << (b - 1));
+  }
+  fprintf(out, "], \"drange\": {");
+  for (int c = 0; c < 3; c++) {
+    fprintf(out, "%s\"%s\": {\"mean\": %.3f, \"counts\": [", c ? ", " : "",
+            channel_names[c],
+            stats->blocks ? (double)stats->drange_sum[c] / stats->blocks
+                          : 0.0);
+    for (int b = 0; b < STATS_DRANGE_BUCKETS; b++) {
+      fprintf(out, "%s%lld", b ? ", " : "", (long long)stats->drange[c][b]);
+    }
+    fprintf(out, "]}");
+  }
+  fprintf(out, "}}\n");
+}
+
+static void print_text(const Stats *stats, FILE *out, double wall, double cpu,
+                       long peak_rss_kib) {
+  fprintf(out, "%-12s %10s %10s\n", "stage", "wall ms", "cpu ms");
+  for (int i = 0; i < stats->nstages; i++) {
+    fprintf(out, "%-12s %10.2f %10.2f\n", stats->stages[i].name,
+            stats->stages[i].wall * 1e3, stats->stages[i].cpu * 1e3);
+  }
+  fprintf(out, "%-12s %10.2f %10.2f\n", "total", wall * 1e3, cpu * 1e3);
+  fprintf(out, "bytes read %llu, written %llu, peak RSS %ld KiB\n",
+          (unsigned long long)stats->bytes_read,
+          (unsigned long long)stats->bytes_written, peak_rss_kib);
+  if (stats->blocks == 0) {
+    return;
+  }
+
+  fprintf(out, "blocks %lld, interpolated channels:\n",
+          (long long)stats->blocks);
+  for (int m = 0; m < 8; m++) {
+    char label[4];
+    mode_label(m, label);
+    fprintf(out, "  %s %10lld %6.2f%%\n", label, (long long)stats->modes[m],
+            100.0 * stats->modes[m] / stats->blocks);
+  }
+  fprintf(out, "drange   %8s", "mean");
+  for (int b = 0; b < STATS_DRANGE_BUCKETS; b++) {
+    char range[16];
+    if (b < 2) {
+      snprintf(range, sizeof(range), "%d", b);
+    } else {
+      snprintf(range, sizeof(range), "%d-%d", 1 << (b - 1), (1 << b) - 1);
+    }
+    fprintf(out, " %8s", range);
+  }
+  fprintf(out, "\n");
+  for (int c = 0; c < 3; c++) {
+    fprintf(out, "  %-6s %8.2f", channel_names[c],
+            (double)stats->drange_sum[c] / stats->blocks);
+    for (int b = 0; b < STATS_DRANGE_BUCKETS; b++) {
+      fprintf(out, " %8lld", (long long)stats->drange[c][b]);
+    }
+    fprintf(out, "\n");
+  }
+}
+
+void stats_print(const Stats *stats, FILE *out, bool json) {
+  double cpu;
+  long peak_rss_kib;
+  process_usage(&cpu, &peak_rss_kib);
+  double wall = batch_now() - stats->start_wall;
+  if (json) {
+    print_json(stats, out, wall, cpu, peak_rss_kib);
+  } else {
+    print_text(stats, out, wall, cpu, peak_rss_kib);
+  }
+}
@@ -0,0 +1,72 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * --statsで表示する計測値。段階ごとの時間、入出力のバイト数、最大RSSと、
+ * ヘッダ面から数えたブロックの補間の組み合わせとdrangeの分布を持つ。
+ * 複数のスレッドから同時に加算してよい。
+ */
+
+#define STATS_MAX_STAGES 16
+/* drangeの分布は0, 1, 2-3, 4-7, ... 128-255の9区間で数える */
+#define STATS_DRANGE_BUCKETS 9
+
+typedef struct {
+  const char *name;
+  double wall, cpu;
+} StatsStage;
+
+typedef struct Stats Stats;
+
+/**
+ * @brief 段階の計測を始めた時刻
+ */
+typedef struct {
+  double wall, cpu;
+} StatsTimer;
+
+/**
+ * @brief 計測値を作る
+ * @param per_thread trueの場合、CPU時間を呼び出したスレッドの分だけ数える。
+ *                   ファイルごとに1スレッドで処理するバッチで使う
+ * @return 計測値、失敗した場合はNULL
+ */
+Stats *stats_new(bool per_thread);
+
+void stats_free(Stats *stats);
+
+/**
+ * @brief 段階の計測を始める。statsがNULLの場合も呼べる
+ */
+StatsTimer stats_timer_start(const Stats *stats);
+
+/**
+ * @brief 始めた時刻からの時間をnameの段階に加える。statsがNULLの場合は何もしない
+ * @note 同じ名前の段階は合計する
+ */
+void stats_timer_stop(Stats *stats, const char *name, const StatsTimer *timer);
+
+void stats_add_bytes(Stats *stats, uint64_t read, uint64_t written);
+
+/**
+ * @brief ヘッダ面のcount個のブロックを数える。statsがNULLの場合は何もしない
+ * @param headers BLOCK_HEADER_SIZEバイト x countのヘッダ面
+ */
+void stats_add_blocks(Stats *stats, const uint8_t *headers, int32_t count);
+
+/**
+ * @brief pathのファイルのバイト数を返す。通常のファイルでない場合は0
+ */
+uint64_t stats_file_size(const char *path);
+
+/**
+ * @brief 計測値を表示する
+ * @param json trueの場合はJSONで、それ以外は表で出力する
+ */
+void stats_print(const Stats *stats, FILE *out, bool json);
+
+#endif
@@ -0,0 +1,148 @@
+#include "temporal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xzio.h"
+
+static const char *temporal_msg =
+    "this is binary image of https://github.com/bsahd/image-compress "
+    "format.\nversion:temporal-1\n\n\n\n\n\n\n\n\n";
+
+/* 幅、高さ、ブロック数、変わったブロックの数 */
+#define TEMPORAL_FIELDS_SIZE (sizeof(uint32_t) * 4)
+
+/**
+ * @brief lenが0でなければsinkに渡す。xzのライタは空の書き込みを受け付けない
+ */
+static int emit(binfmt_sink_fn sink, void *ctx, const void *data, size_t len) {
+  return len > 0 ? sink(ctx, data, len) : 0;
+}
+
+int temporal_write(binfmt_sink_fn sink, void *ctx, int32_t block_count,
+                   const uint8_t *skip, const ImgPlanes *changed) {
+  uint8_t fields[TEMPORAL_FIELDS_SIZE];
+  binfmt_put_be32(fields, (uint32_t)changed->width);
+  binfmt_put_be32(fields + 4, (uint32_t)changed->height);
+  binfmt_put_be32(fields + 8, (uint32_t)block_count);
+  binfmt_put_be32(fields + 12, (uint32_t)changed->block_count);
+  size_t count = (size_t)changed->block_count;
+  if (sink(ctx, temporal_msg, strlen(temporal_msg)) != 0 ||
+      sink(ctx, fields, sizeof(fields)) != 0 ||
+      emit(sink, ctx, skip, temporal_bitmap_size(block_count)) != 0 ||
+      emit(sink, ctx, changed->headers, count * BLOCK_HEADER_SIZE) != 0 ||
+      emit(sink, ctx, changed->corners, count * BLOCK_CORNERS_SIZE) != 0 ||
+      emit(sink, ctx, changed->codes, count * BLOCK_CODES_SIZE) != 0 ||
+      sink(ctx, binfmt_footer(), binfmt_footer_size()) != 0) {
+    fprintf(stderr, "Failed to write frame data.\n");
+    return -1;
+  }
+  return 0;
+}
+
+bool temporal_is_file(const char *path) {
+  return binfmt_file_has_version(path, temporal_msg);
+}
+
+/**
+ * @brief dataを差分の形式として解釈し、frameの寸法と面を設定する
+ * @return 成功時0、失敗時-1
+ */
+static int parse_frame(TemporalFrame *frame, const uint8_t *data,
+                       size_t size) {
+  size_t header_size = strlen(temporal_msg) + TEMPORAL_FIELDS_SIZE;
+  if (size < header_size + binfmt_footer_size()) {
+    fprintf(stderr, "Invalid header.\n");
+    return -1;
+  }
+  const uint8_t *fields = data + strlen(temporal_msg);
+  uint32_t width = binfmt_get_be32(fields);
+  uint32_t height = binfmt_get_be32(fields + 4);
+  uint32_t block_count = binfmt_get_be32(fields + 8);
+  uint32_t changed_count = binfmt_get_be32(fields + 12);
+  if (width > INT16_MAX || height > INT16_MAX || width % 8 != 0 ||
+      height % 8 != 0 || block_count != (width / 8) * (height / 8) ||
+      changed_count > block_count) {
+    fprintf(stderr, "Invalid frame dimensions.\n");
+    return -1;
+  }
+
+  size_t bitmap_size = temporal_bitmap_size((int32_t)block_count);
+  size_t planes_size = (size_t)changed_count *
+                       (BLOCK_HEADER_SIZE + BLOCK_CORNERS_SIZE +
+                        BLOCK_CODES_SIZE);
+  size_t body_size = size - header_size - binfmt_footer_size();
+  if (body_size != bitmap_size + planes_size ||
+      !binfmt_is_footer((const char *)data + size - binfmt_footer_size())) {
+    fprintf(stderr, "Invalid footer.\n");
+    return -1;
+  }
+
+  frame->width = (int16_t)width;
+  frame->height = (int16_t)height;
+  frame->block_count = (int32_t)block_count;
+  frame->changed_count = (int32_t)changed_count;
+  frame->skip = data + header_size;
+  frame->headers = frame->skip + bitmap_size;
+  frame->corners =
+      frame->headers + (size_t)changed_count * BLOCK_HEADER_SIZE;
+  frame->codes = frame->corners + (size_t)changed_count * BLOCK_CORNERS_SIZE;
+
+  /* 変わったブロックの数とビット列が食い違っていないことを確かめる */
+  int32_t skipped = 0;
+  for (int32_t i = 0; i < frame->block_count; i++) {
+    skipped += temporal_is_skipped(frame->skip, i);
+  }
+  if (frame->block_count - skipped != frame->changed_count) {
+    fprintf(stderr, "Skip bitmap does not match the changed blocks.\n");
+    return -1;
+  }
+  return 0;
+}
+
+TemporalFrame *temporal_frame_open(const char *path, int nthreads,
+                                   bool *is_frame) {
+  *is_frame = false;
+  TemporalFrame *frame = (TemporalFrame *)calloc(1, sizeof(TemporalFrame));
+  if (!frame) {
+    fprintf(stderr, "Memory allocation failed for TemporalFrame.\n");
+    return NULL;
+  }
+  frame->map = binfmt_map_file(path, &frame->map_size);
+  if (!frame->map) {
+    free(frame);
+    return NULL;
+  }
+  const uint8_t *data = (const uint8_t *)frame->map;
+  size_t size = frame->map_size;
+  if (xz_is_stream(data, size)) {
+    size_t unpacked_size;
+    if (xz_decode_buffer(data, size, nthreads, &frame->unpacked,
+                         &unpacked_size) != 0) {
+      temporal_frame_close(frame);
+      return NULL;
+    }
+    data = frame->unpacked;
+    size = unpacked_size;
+  }
+
+  if (size < strlen(temporal_msg) ||
+      memcmp(data, temporal_msg, strlen(temporal_msg)) != 0) {
+    temporal_frame_close(frame);
+    return NULL;
+  }
+  *is_frame = true;
+  if (parse_frame(frame, data, size) != 0) {
+    temporal_frame_close(frame);
+    return NULL;
+  }
+  return frame;
+}
+
+void temporal_frame_close(TemporalFrame *frame) {
+  if (frame) {
+    binfmt_unmap_file(frame->map, frame->map_size);
+    free(frame->unpacked);
+    free(frame);
+  }
+}
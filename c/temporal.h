@@ -0,0 +1,79 @@
+#ifndef TEMPORAL_H
+#define TEMPORAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "binfmt.h"
+
+/*
+ * 連続した画像の2枚目以降を、前の画像から変わったブロックだけで表す入れ物。
+ * ブロックごとに前の画像と同じかどうかを1ビットで持ち、変わったブロックの
+ * ヘッダ、四隅、画素の面だけをBINFMT_PLANAR形式と同じ順に並べる。
+ * 同じブロックは前の画像の画素をそのまま使うので、復元には前の画像が要る。
+ * 全体をxzで圧縮してもよい。
+ */
+
+/**
+ * @brief block_count個のブロックのビット列のバイト数
+ */
+static inline size_t temporal_bitmap_size(int32_t block_count) {
+  return ((size_t)block_count + 7) / 8;
+}
+
+/**
+ * @brief index番目のブロックが前の画像と同じかどうかを返す
+ * @param skip 先頭のブロックを最上位ビットに置いたビット列
+ */
+static inline bool temporal_is_skipped(const uint8_t *skip, int32_t index) {
+  return (skip[index / 8] >> (7 - index % 8)) & 1;
+}
+
+/**
+ * @brief 前の画像との差分を書き出す
+ * @param block_count 画像全体のブロック数
+ * @param skip ブロックごとに前の画像と同じなら1のビット列
+ * @param changed 変わったブロックだけを先頭から順に持つImgPlanes。
+ *                widthとheightは画像全体の寸法
+ * @return 成功時0、失敗時-1
+ */
+int temporal_write(binfmt_sink_fn sink, void *ctx, int32_t block_count,
+                   const uint8_t *skip, const ImgPlanes *changed);
+
+/**
+ * @brief メモリマップした差分のファイル
+ */
+typedef struct {
+  int16_t width, height;
+  int32_t block_count;
+  const uint8_t *skip;
+  /* 変わったブロックだけの三つの面 */
+  int32_t changed_count;
+  const uint8_t *headers;
+  const uint8_t *corners;
+  const uint8_t *codes;
+  void *map;
+  size_t map_size;
+  uint8_t *unpacked; /* xzを展開した場合の領域 */
+} TemporalFrame;
+
+/**
+ * @brief ファイルが差分の形式かどうかを先頭のメッセージで判定する
+ * @note xzで圧縮したファイルは判定できない
+ */
+bool temporal_is_file(const char *path);
+
+/**
+ * @brief 差分のファイルを開く
+ * @param nthreads xz形式の場合の展開スレッド数
+ * @param is_frame 差分の形式だった場合にtrueを返す。falseの場合は何も
+ *                 表示せずにNULLを返すので、呼び出し元は通常の形式として読める
+ * @return 開いたファイル、失敗した場合はNULL。temporal_frame_closeで解放する
+ */
+TemporalFrame *temporal_frame_open(const char *path, int nthreads,
+                                   bool *is_frame);
+
+void temporal_frame_close(TemporalFrame *frame);
+
+#endif
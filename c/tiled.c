@@ -0,0 +1,253 @@
+#include "tiled.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const char *tiled_msg =
+    "this is binary image of https://github.com/bsahd/image-compress "
+    "format.\nversion:tiled-1\n\n\n\n\n\n\n\n\n";
+
+/* 幅、高さ、タイルの一辺、タイル数 */
+#define TILED_FIELDS_SIZE (sizeof(uint32_t) * 4)
+/* タイルごとの位置と長さ */
+#define TILED_ENTRY_SIZE (sizeof(uint64_t) * 2)
+
+static size_t tiled_header_size(void) {
+  return strlen(tiled_msg) + TILED_FIELDS_SIZE;
+}
+
+struct TiledWriter {
+  FILE *out;
+  uint32_t width, height, tile_size;
+  uint32_t tile_count;
+  uint32_t added;
+  /* 次のタイルを置く、入れ物の先頭からの位置 */
+  uint64_t offset;
+  uint8_t *index;
+  /* 出力がシークできる場合は表の分を空けて書き、最後に表を埋める */
+  bool seekable;
+  long base;
+  /* シークできない場合はタイルを一時ファイルに退避する */
+  FILE *spill;
+};
+
+static int write_header(TiledWriter *writer) {
+  uint8_t fields[TILED_FIELDS_SIZE];
+  binfmt_put_be32(fields, writer->width);
+  binfmt_put_be32(fields + 4, writer->height);
+  binfmt_put_be32(fields + 8, writer->tile_size);
+  binfmt_put_be32(fields + 12, writer->tile_count);
+  size_t index_size = (size_t)writer->tile_count * TILED_ENTRY_SIZE;
+  if (fwrite(tiled_msg, 1, strlen(tiled_msg), writer->out) !=
+          strlen(tiled_msg) ||
+      fwrite(fields, 1, sizeof(fields), writer->out) != sizeof(fields) ||
+      fwrite(writer->index, 1, index_size, writer->out) != index_size) {
+    return -1;
+  }
+  return 0;
+}
+
+TiledWriter *tiled_writer_open(FILE *out, uint32_t width, uint32_t height,
+                               uint32_t tile_size) {
+  if (tile_size == 0 || tile_size % 8 != 0 ||
+      tile_size > TILED_MAX_TILE_SIZE) {
+    fprintf(stderr, "Invalid tile size: %u\n", tile_size);
+    return NULL;
+  }
+  TiledWriter *writer = (TiledWriter *)calloc(1, sizeof(TiledWriter));
+  if (!writer) {
+    fprintf(stderr, "Memory allocation failed for TiledWriter.\n");
+    return NULL;
+  }
+  writer->out = out;
+  writer->width = width;
+  writer->height = height;
+  writer->tile_size = tile_size;
+  writer->tile_count = tiled_tiles_across(width, tile_size) *
+                       tiled_tiles_across(height, tile_size);
+  writer->index =
+      (uint8_t *)calloc(writer->tile_count ? writer->tile_count : 1,
+                        TILED_ENTRY_SIZE);
+  if (!writer->index) {
+    fprintf(stderr, "Memory allocation failed for tile index.\n");
+    free(writer);
+    return NULL;
+  }
+  writer->offset = tiled_header_size() +
+                   (uint64_t)writer->tile_count * TILED_ENTRY_SIZE;
+
+  writer->base = ftell(out);
+  writer->seekable =
+      writer->base >= 0 && fseek(out, writer->base, SEEK_SET) == 0;
+  if (writer->seekable) {
+    if (write_header(writer) != 0) {
+      fprintf(stderr, "Failed to write tiled header.\n");
+      tiled_writer_abort(writer);
+      return NULL;
+    }
+  } else if (!(writer->spill = tmpfile())) {
+    fprintf(stderr, "Could not create spill files.\n");
+    tiled_writer_abort(writer);
+    return NULL;
+  }
+  return writer;
+}
+
+int tiled_writer_add(TiledWriter *writer, const void *data, size_t len) {
+  if (writer->added == writer->tile_count) {
+    fprintf(stderr, "Too many tiles written.\n");
+    return -1;
+  }
+  FILE *dst = writer->seekable ? writer->out : writer->spill;
+  if (fwrite(data, 1, len, dst) != len) {
+    fprintf(stderr, "Failed to write tile %u.\n", writer->added);
+    return -1;
+  }
+  uint8_t *entry = writer->index + (size_t)writer->added * TILED_ENTRY_SIZE;
+  binfmt_put_be64(entry, writer->offset);
+  binfmt_put_be64(entry + 8, len);
+  writer->offset += len;
+  writer->added++;
+  return 0;
+}
+
+static int copy_spill(FILE *spill, FILE *out) {
+  char buf[65536];
+  size_t n;
+  rewind(spill);
+  while ((n = fread(buf, 1, sizeof(buf), spill)) > 0) {
+    if (fwrite(buf, 1, n, out) != n) {
+      return -1;
+    }
+  }
+  return ferror(spill) ? -1 : 0;
+}
+
+int tiled_writer_close(TiledWriter *writer) {
+  int result = 0;
+  if (writer->added != writer->tile_count) {
+    fprintf(stderr, "Expected %u tiles but %u were written.\n",
+            writer->tile_count, writer->added);
+    result = -1;
+  } else if (writer->seekable) {
+    long end = writer->base + (long)writer->offset;
+    if (fseek(writer->out, writer->base, SEEK_SET) != 0 ||
+        write_header(writer) != 0 ||
+        fseek(writer->out, end, SEEK_SET) != 0) {
+      result = -1;
+    }
+  } else if (write_header(writer) != 0 ||
+             copy_spill(writer->spill, writer->out) != 0) {
+    result = -1;
+  }
+  if (result == 0 && fwrite(binfmt_footer(), 1, binfmt_footer_size(),
+                            writer->out) != binfmt_footer_size()) {
+    result = -1;
+  }
+  if (result != 0) {
+    fprintf(stderr, "Failed to finish tiled output.\n");
+  }
+  tiled_writer_abort(writer);
+  return result;
+}
+
+void tiled_writer_abort(TiledWriter *writer) {
+  if (writer) {
+    if (writer->spill) {
+      fclose(writer->spill);
+    }
+    free(writer->index);
+    free(writer);
+  }
+}
+
+bool tiled_is_file(const char *path) {
+  return binfmt_file_has_version(path, tiled_msg);
+}
+
+TiledImage *tiled_image_open(const char *path) {
+  TiledImage *tiled = (TiledImage *)malloc(sizeof(TiledImage));
+  if (!tiled) {
+    fprintf(stderr, "Memory allocation failed for TiledImage.\n");
+    return NULL;
+  }
+  tiled->map = binfmt_map_file(path, &tiled->map_size);
+  if (!tiled->map) {
+    free(tiled);
+    return NULL;
+  }
+
+  const uint8_t *data = (const uint8_t *)tiled->map;
+  size_t size = tiled->map_size;
+  if (size < tiled_header_size() ||
+      memcmp(data, tiled_msg, strlen(tiled_msg)) != 0) {
+    fprintf(stderr, "Invalid header.\n");
+    tiled_image_close(tiled);
+    return NULL;
+  }
+  const uint8_t *fields = data + strlen(tiled_msg);
+  tiled->width = binfmt_get_be32(fields);
+  tiled->height = binfmt_get_be32(fields + 4);
+  tiled->tile_size = binfmt_get_be32(fields + 8);
+  uint32_t tile_count = binfmt_get_be32(fields + 12);
+  if (tiled->tile_size == 0 || tiled->tile_size % 8 != 0 ||
+      tiled->tile_size > TILED_MAX_TILE_SIZE) {
+    fprintf(stderr, "Invalid tile size.\n");
+    tiled_image_close(tiled);
+    return NULL;
+  }
+  tiled->tiles_x = tiled_tiles_across(tiled->width, tiled->tile_size);
+  tiled->tiles_y = tiled_tiles_across(tiled->height, tiled->tile_size);
+  if ((uint64_t)tiled->tiles_x * tiled->tiles_y != tile_count ||
+      (size - tiled_header_size()) / TILED_ENTRY_SIZE < tile_count) {
+    fprintf(stderr, "Invalid tile count.\n");
+    tiled_image_close(tiled);
+    return NULL;
+  }
+  tiled->index = fields + TILED_FIELDS_SIZE;
+
+  if (binfmt_check_index(data, size, tiled->index, tile_count,
+                         TILED_ENTRY_SIZE, 0, "Tile") != 0) {
+    tiled_image_close(tiled);
+    return NULL;
+  }
+  return tiled;
+}
+
+void tiled_image_close(TiledImage *tiled) {
+  if (tiled) {
+    binfmt_unmap_file(tiled->map, tiled->map_size);
+    free(tiled);
+  }
+}
+
+void tiled_tile_rect(const TiledImage *tiled, uint32_t index, uint32_t *x,
+                     uint32_t *y, uint32_t *w, uint32_t *h) {
+  *x = index % tiled->tiles_x * tiled->tile_size;
+  *y = index / tiled->tiles_x * tiled->tile_size;
+  *w = tiled->width - *x < tiled->tile_size ? tiled->width - *x
+                                            : tiled->tile_size;
+  *h = tiled->height - *y < tiled->tile_size ? tiled->height - *y
+                                             : tiled->tile_size;
+}
+
+ImgView *tiled_image_tile(const TiledImage *tiled, uint32_t index,
+                          int nthreads) {
+  const uint8_t *entry = tiled->index + (size_t)index * TILED_ENTRY_SIZE;
+  uint64_t offset = binfmt_get_be64(entry);
+  uint64_t len = binfmt_get_be64(entry + 8);
+  ImgView *view = img_view_open_mem((const uint8_t *)tiled->map + offset,
+                                    (size_t)len, nthreads);
+  if (!view) {
+    fprintf(stderr, "Could not read tile %u.\n", index);
+    return NULL;
+  }
+  uint32_t x, y, w, h;
+  tiled_tile_rect(tiled, index, &x, &y, &w, &h);
+  if ((uint32_t)view->width != w || (uint32_t)view->height != h) {
+    fprintf(stderr, "Tile %u has unexpected size %dx%d.\n", index,
+            view->width, view->height);
+    img_view_close(view);
+    return NULL;
+  }
+  return view;
+}
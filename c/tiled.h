@@ -0,0 +1,95 @@
+#ifndef TILED_H
+#define TILED_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "binfmt.h"
+
+/*
+ * 画像をタイルに分けて、タイルごとに独立したバイナリ形式を並べる入れ物。
+ * 寸法は32ビットで持つので、一辺が32767pxを超える画像も扱える。
+ * ヘッダの直後に各タイルの位置と長さの表があり、タイルは個別に読み出せる。
+ * 各タイルの中身はどの形式でもよく、xzで圧縮されていてもよい。
+ */
+
+/* タイルの一辺の上限。タイルの中身の寸法はint16_tに収める */
+#define TILED_MAX_TILE_SIZE 32760
+
+static inline uint32_t tiled_tiles_across(uint32_t size, uint32_t tile_size) {
+  return (size + tile_size - 1) / tile_size;
+}
+
+typedef struct TiledWriter TiledWriter;
+
+/**
+ * @brief タイルを先頭から順に書き出すライタを開く
+ * @param out 出力先。シークできない場合はタイルを一時ファイルに退避する
+ * @param tile_size タイルの一辺。8の倍数であること
+ * @return ライタ、失敗した場合はNULL
+ */
+TiledWriter *tiled_writer_open(FILE *out, uint32_t width, uint32_t height,
+                               uint32_t tile_size);
+
+/**
+ * @brief 次のタイルの中身を書き出す。タイルは左上から行ごとの順に渡す
+ * @return 成功時0、失敗時-1
+ */
+int tiled_writer_add(TiledWriter *writer, const void *data, size_t len);
+
+/**
+ * @brief 位置の表とフッタを書き出してライタを解放する
+ * @return 成功時0、タイルが足りない場合や書き込みに失敗した場合-1
+ */
+int tiled_writer_close(TiledWriter *writer);
+
+/**
+ * @brief 出力を完了せずにライタを解放する
+ */
+void tiled_writer_abort(TiledWriter *writer);
+
+/**
+ * @brief メモリマップしたタイル形式のファイル
+ */
+typedef struct {
+  uint32_t width, height;
+  uint32_t tile_size;
+  uint32_t tiles_x, tiles_y;
+  const uint8_t *index; /* 16バイト (位置, 長さ) x タイル数 */
+  void *map;
+  size_t map_size;
+} TiledImage;
+
+/**
+ * @brief ファイルがタイル形式かどうかを先頭のメッセージで判定する
+ */
+bool tiled_is_file(const char *path);
+
+/**
+ * @brief タイル形式のファイルを開く
+ * @return 開いたファイル、失敗した場合はNULL。tiled_image_closeで解放する
+ */
+TiledImage *tiled_image_open(const char *path);
+
+/**
+ * @brief tiled_image_openで開いたファイルを解放する
+ */
+void tiled_image_close(TiledImage *tiled);
+
+/**
+ * @brief index番目のタイルが覆う画像上の矩形を返す
+ */
+void tiled_tile_rect(const TiledImage *tiled, uint32_t index, uint32_t *x,
+                     uint32_t *y, uint32_t *w, uint32_t *h);
+
+/**
+ * @brief index番目のタイルだけを読んでビューを作る
+ * @param nthreads タイルがxz形式の場合の展開スレッド数
+ * @return ビュー、失敗した場合はNULL。img_view_closeで解放する
+ */
+ImgView *tiled_image_tile(const TiledImage *tiled, uint32_t index,
+                          int nthreads);
+
+#endif
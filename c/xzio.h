@@ -0,0 +1,53 @@
+#ifndef XZIO_H
+#define XZIO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct XzWriter XzWriter;
+
+/**
+ * @brief `xz -9e`相当の設定でxz形式に圧縮しながら書き出すライタを開く
+ * @param out 出力先
+ * @param nthreads 圧縮スレッド数。メモリが足りない場合は減らされる
+ * @param expected_size 書き込む予定のバイト数。スレッドごとのブロックの大きさに使う
+ * @return ライタ、失敗した場合はNULL
+ */
+XzWriter *xz_writer_open(FILE *out, int nthreads, size_t expected_size);
+
+/**
+ * @brief データを圧縮して書き出す。binfmt_sink_fnとして渡せる
+ * @param ctx xz_writer_openで開いたライタ
+ * @return 成功時0、失敗時-1
+ */
+int xz_writer_write(void *ctx, const void *data, size_t len);
+
+/**
+ * @brief 残りを書き出してストリームを終え、ライタを解放する
+ * @return 成功時0、失敗時-1
+ * @note outは閉じない
+ */
+int xz_writer_close(XzWriter *writer);
+
+/**
+ * @brief ストリームを終えずにライタを解放する
+ */
+void xz_writer_abort(XzWriter *writer);
+
+/**
+ * @brief データがxz形式かどうかをマジックナンバーで判定する
+ */
+bool xz_is_stream(const void *data, size_t size);
+
+/**
+ * @brief xz形式のデータをメモリ上に展開する
+ * @param nthreads 展開スレッド数
+ * @param out 展開結果。freeで解放する
+ * @return 成功時0、失敗時-1
+ */
+int xz_decode_buffer(const uint8_t *in, size_t in_size, int nthreads,
+                     uint8_t **out, size_t *out_size);
+
+#endif